@@ -0,0 +1,84 @@
+#!/bin/sh
+# Runs bin/bench through bin/impair with a set of Wi-Fi link profiles, and
+# reports the tunnel goodput and the time needed to recover from losses.
+#
+# Usage: scripts/impair-scenarios.sh [scenario...]
+#
+# Exits with a non-zero status if any scenario did not complete.
+
+BINDIR=${BINDIR:-bin}
+PORT_BASE=${PORT_BASE:-41000}
+PROXY_PORT=$((PORT_BASE + 10))
+PROXY_UPSTREAM_PORT=$((PORT_BASE + 11))
+BENCH_ARGS=${BENCH_ARGS:---size 1000 --rate 2000 --count 10000 --time-limit 15}
+
+# Each scenario is "<name>|<impair options>|<blackout duration in ms>"
+SCENARIOS='
+clean||0
+hotspot|--delay 20 --jitter 5 --loss 1|0
+congested|--delay 40 --jitter 20 --loss 3 --rate 20000 --queue-limit 200|0
+bursty|--delay 20 --jitter 5 --gilbert 1,30,50|0
+reorder|--delay 10 --jitter 2 --reorder 5 --duplicate 1|0
+blackout|--delay 20 --jitter 5 --blackout 1000,2000|2000
+'
+
+runScenario() {
+    name=$1
+    options=$2
+    blackout=$3
+
+    "$BINDIR/impair" --listen $PROXY_PORT --upstream-port $PROXY_UPSTREAM_PORT \
+        --target 127.0.0.1:$((PORT_BASE + 1)) --seed 1 $options > /dev/null &
+    proxy=$!
+
+    # Give the proxy some time to bind its sockets
+    sleep 0.2
+
+    report=$("$BINDIR/bench" --port $PORT_BASE --via $PROXY_PORT:$PROXY_UPSTREAM_PORT $BENCH_ARGS)
+    status=$?
+
+    kill $proxy
+    wait $proxy 2> /dev/null
+
+    value() {
+        echo "$report" | sed -n "s/^$1: //p"
+    }
+
+    # A run that did not complete must not pass as an empty row
+    if [ $status -ne 0 ] || [ -z "$(value delivered_packets)" ]; then
+        reason=$(echo "$report" | grep -v '^[a-z0-9_]*: ' | head -n 1)
+        echo "$name: bin/bench failed with status $status${reason:+: $reason}" >&2
+        return 1
+    fi
+
+    gap=$(value max_delivery_gap_ms)
+    recovery=$(echo "$gap $blackout" | awk '{ r = $1 - $2; if(r < 0) r = 0; printf "%.1f", r }')
+
+    printf "%-10s %10s %10s %8s %8s %10s %10s\n" "$name" \
+        "$(value delivered_packets)" "$(value goodput_mbit_s)" \
+        "$(value retransmissions)" "$(value repaired_frames)" \
+        "$(value latency_p99_us)" "$recovery"
+}
+
+printf "%-10s %10s %10s %8s %8s %10s %10s\n" scenario delivered mbit/s retx repaired p99_us recovery_ms
+
+failed=0
+
+while IFS='|' read -r name options blackout; do
+    if [ -z "$name" ]; then
+        continue
+    fi
+
+    if [ $# -gt 0 ]; then
+        case " $* " in
+            *" $name "*) ;;
+            *) continue ;;
+        esac
+    fi
+
+    runScenario "$name" "$options" "$blackout" || failed=1
+done <<EOF
+$SCENARIOS
+EOF
+
+exit $failed
@@ -10,31 +10,107 @@
 #include <threads.h>
 #include <string.h>
 #include <libswtp/swtp.h>
+#include <libcapture/capture.h>
+#include <libsched/sched.h>
+#include <libcpu/cpu.h>
 #include <net/if.h>
 #include <sys/select.h>
 #include <signal.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sys/time.h>
 
 #define MAX_HOSTNAME_LENGTH 256
 
+// Delays between two SABM attempts, in milliseconds
+#define CLIENT_RECONNECT_MIN_DELAY 100
+#define CLIENT_RECONNECT_MAX_DELAY 1000
+
+#define CLIENT_RECEIVE_TIMEOUT 500
+
+// Contains the maximum time the egress thread sleeps while the send window is
+// full, in milliseconds.
+#define EGRESS_WAIT_TIMEOUT 100
+
+// Contains the fraction of the send window kept for interactive packets.
+#define INTERACTIVE_WINDOW_FRACTION 8
+
 char serverHostname[MAX_HOSTNAME_LENGTH + 1];
 int serverPort = SWTP_PORT;
 
 int tunDevice;
 char tunDeviceName[16];
 int clientSocket;
+struct sockaddr_in serverAddress;
+
+// Contains the extra paths to the server, each with its own socket and server
+// port, which are added to the session with JOIN frames.
+uint16_t pathPorts[SWTP_MAX_PATHS - 1];
+int pathSockets[SWTP_MAX_PATHS - 1];
+struct sockaddr_in pathAddresses[SWTP_MAX_PATHS - 1];
+int pathCount = 0;
 int receiveWindowSize;
 int maxSendWindowSize = 0;
+
+// If true, the client asks the server for extended sequence numbers. Receive
+// windows larger than SWTP_MAX_WINDOW_SIZE require them.
+bool extendedSequenceNumbers = false;
+unsigned int fecBlockSize = 0;
+bool fecAdaptive = false;
+swtp_time_t keepaliveIdleTime = SWTP_DEFAULT_KEEPALIVE_IDLE_TIME;
+swtp_time_t keepaliveInterval = SWTP_DEFAULT_KEEPALIVE_INTERVAL;
+unsigned int keepaliveProbes = SWTP_DEFAULT_KEEPALIVE_PROBES;
+bool keepaliveAdaptive = false;
+const char *capturePath = NULL;
+uint64_t captureRecordCount = CAPTURE_DEFAULT_RECORD_COUNT;
+uint32_t captureSnapLength = 0;
+
+// The data frames are encrypted if the server answers the key of the SABM
+// frame, which is generated again for each connection. With a pre-shared key,
+// the server must answer it.
+bool encryption = true;
+bool hasPreSharedKey = false;
+uint8_t preSharedKey[SWTP_PRE_SHARED_KEY_SIZE];
+uint8_t secretKey[SWTP_KEY_SIZE];
+uint8_t publicKey[SWTP_KEY_SIZE];
+capture_t capture;
 swtp_t swtp;
 mtx_t swtp_mutex;
+
+// Contains the queue of the packets read from the TUN device, sorted by
+// priority. It has a single flow.
+sched_t scheduler;
+
 thrd_t tunDeviceReaderThread;
 thrd_t timerThread;
+thrd_t egressThread;
+
+// Contains the CPUs the threads of the client run on. The receiver is the main
+// thread.
+#define THREAD_RECEIVER 0
+#define THREAD_READER 1
+#define THREAD_TIMER 2
+#define THREAD_EGRESS 3
 
+const char *const threadNames[] = {"receiver", "reader", "timer", "egress"};
+cpu_affinity_t affinity;
+
+// Contains the time the kernel busy polls the sockets, and the time the main
+// thread spins before it blocks, in microseconds. 0 disables both.
+uint32_t busyPollTime = 0;
+
+int openClientSocket();
 int connectToServer();
 int tunReaderMainLoop(void *arg);
 int timerThreadMainLoop(void *arg);
+int egressThreadMainLoop(void *arg);
 int mainLoop();
 int parseCommandLineParameters(int argc, const char **argv);
+int parseFecParameter(const char *value);
+int parseKeepaliveParameter(const char *value);
+int parsePortList(const char *value, uint16_t *ports, int *portCount);
+int readPreSharedKey(const char *path, uint8_t *key);
+void joinPaths();
 
 int main(int argc, const char **argv) {
     if(parseCommandLineParameters(argc, argv)) {
@@ -42,8 +118,45 @@ int main(int argc, const char **argv) {
         return EXIT_FAILURE;
     }
 
+    // The main thread is pinned before it allocates the send window, so that
+    // it is local to it
+    if(cpu_pinThread(&affinity, THREAD_RECEIVER)) {
+        perror("Failed to pin the receiver thread");
+        return EXIT_FAILURE;
+    }
+
     tunDevice = libtun_open(tunDeviceName);
 
+    // Until the path MTU is known, the TUN device only accepts packets that
+    // fit in the default frame size
+    if(libtun_setMtu(tunDeviceName, SWTP_DEFAULT_MTU)) {
+        perror("Failed to set the MTU of the TUN device");
+    }
+
+    if(capturePath) {
+        if(capture_create(&capture, capturePath, captureRecordCount, captureSnapLength)) {
+            perror("Failed to create the capture file");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(mtx_init(&swtp_mutex, mtx_plain)) {
+        perror("Failed to create mutex");
+        return EXIT_FAILURE;
+    }
+
+    if(sched_init(&scheduler, 1, SCHED_DEFAULT_QUANTUM, SCHED_DEFAULT_QUEUE_SIZE) || sched_addFlow(&scheduler, 0, SCHED_DEFAULT_QUEUE_SIZE, 1)) {
+        perror("Failed to create the egress queue");
+        return EXIT_FAILURE;
+    }
+
+    if(openClientSocket()) {
+        perror("Failed to open the client socket");
+        return EXIT_FAILURE;
+    }
+
+    srandom(time(NULL) ^ getpid());
+
     // Connect to the server
     if(connectToServer()) {
         perror("Server connection failed");
@@ -55,11 +168,6 @@ int main(int argc, const char **argv) {
         return EXIT_FAILURE;
     }
 
-    if(mtx_init(&swtp_mutex, mtx_plain)) {
-        perror("Failed to create mutex");
-        return EXIT_FAILURE;
-    }
-
     if(thrd_create(&tunDeviceReaderThread, tunReaderMainLoop, NULL)) {
         perror("Failed to create tun device reader thread");
         return EXIT_FAILURE;
@@ -70,6 +178,11 @@ int main(int argc, const char **argv) {
         return EXIT_FAILURE;
     }
 
+    if(thrd_create(&egressThread, egressThreadMainLoop, NULL)) {
+        perror("Failed to create egress thread");
+        return EXIT_FAILURE;
+    }
+
     return mainLoop();
 }
 
@@ -78,6 +191,15 @@ int parseCommandLineParameters(int argc, const char **argv) {
     bool flag_serverHostname = false;
     bool flag_serverPort = false;
     bool flag_maxSendWindowSize = false;
+    bool flag_fec = false;
+    bool flag_keepalive = false;
+    bool flag_capture = false;
+    bool flag_captureRecords = false;
+    bool flag_capturePayload = false;
+    bool flag_paths = false;
+    bool flag_psk = false;
+    bool flag_affinity = false;
+    bool flag_busyPoll = false;
     
     bool flag_windowSize_set = false;
     bool flag_serverHostname_set = false;
@@ -91,11 +213,15 @@ int parseCommandLineParameters(int argc, const char **argv) {
                 return 1;
             }
 
-            if(receiveWindowSize <= 0 || receiveWindowSize > SWTP_MAX_WINDOW_SIZE) {
-                printf("Invalid value for --max-recv-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_WINDOW_SIZE);
+            if(receiveWindowSize <= 0 || receiveWindowSize > SWTP_MAX_EXTENDED_WINDOW_SIZE) {
+                printf("Invalid value for --max-recv-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_EXTENDED_WINDOW_SIZE);
                 return 1;
             }
 
+            if(receiveWindowSize > SWTP_MAX_WINDOW_SIZE) {
+                extendedSequenceNumbers = true;
+            }
+
             flag_windowSize_set = true;
         } else if(flag_maxSendWindowSize) {
             flag_maxSendWindowSize = false;
@@ -105,8 +231,8 @@ int parseCommandLineParameters(int argc, const char **argv) {
                 return 1;
             }
 
-            if(maxSendWindowSize <= 0 || maxSendWindowSize > SWTP_MAX_WINDOW_SIZE) {
-                printf("Invalid value for --max-send-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_WINDOW_SIZE);
+            if(maxSendWindowSize <= 0 || maxSendWindowSize > SWTP_MAX_EXTENDED_WINDOW_SIZE) {
+                printf("Invalid value for --max-send-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_EXTENDED_WINDOW_SIZE);
                 return 1;
             }
         } else if(flag_serverHostname) {
@@ -122,6 +248,65 @@ int parseCommandLineParameters(int argc, const char **argv) {
                 printf("Invalid value for --server-port. Expected an integer between 0 and 65535 included.\n");
                 return 1;
             }
+        } else if(flag_fec) {
+            flag_fec = false;
+
+            if(parseFecParameter(argv[i])) {
+                return 1;
+            }
+        } else if(flag_keepalive) {
+            flag_keepalive = false;
+
+            if(parseKeepaliveParameter(argv[i])) {
+                return 1;
+            }
+        } else if(flag_paths) {
+            flag_paths = false;
+
+            if(parsePortList(argv[i], pathPorts, &pathCount)) {
+                printf("Invalid value for --paths. Expected up to %d comma-separated ports.\n", SWTP_MAX_PATHS - 1);
+                return 1;
+            }
+        } else if(flag_affinity) {
+            flag_affinity = false;
+
+            if(cpu_parseAffinity(&affinity, threadNames, sizeof(threadNames) / sizeof(threadNames[0]), argv[i])) {
+                printf("Invalid value for --affinity. Expected <thread>=<cpus> pairs separated by commas, the threads being receiver, reader, timer and egress.\n");
+                return 1;
+            }
+        } else if(flag_busyPoll) {
+            flag_busyPoll = false;
+
+            if(sscanf(argv[i], "%u", &busyPollTime) != 1 || busyPollTime > CPU_MAX_BUSY_POLL_TIME) {
+                printf("Invalid value for --busy-poll. Expected an integer between 0 and %d included.\n", CPU_MAX_BUSY_POLL_TIME);
+                return 1;
+            }
+        } else if(flag_psk) {
+            flag_psk = false;
+
+            if(readPreSharedKey(argv[i], preSharedKey)) {
+                printf("Invalid value for --psk. Expected a file containing %d hexadecimal bytes.\n", SWTP_PRE_SHARED_KEY_SIZE);
+                return 1;
+            }
+
+            hasPreSharedKey = true;
+        } else if(flag_capture) {
+            flag_capture = false;
+            capturePath = argv[i];
+        } else if(flag_captureRecords) {
+            flag_captureRecords = false;
+
+            if(sscanf(argv[i], "%lu", &captureRecordCount) != 1 || captureRecordCount == 0) {
+                printf("Invalid value for --capture-records. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_capturePayload) {
+            flag_capturePayload = false;
+
+            if(sscanf(argv[i], "%u", &captureSnapLength) != 1 || captureSnapLength > SWTP_MAX_PAYLOAD_SIZE) {
+                printf("Invalid value for --capture-payload. Expected an integer between 0 and %d included.\n", SWTP_MAX_PAYLOAD_SIZE);
+                return 1;
+            }
         } else if(strcmp(argv[i], "--max-recv-window-size") == 0) {
             flag_windowSize = true;
         } else if(strcmp(argv[i], "--hostname") == 0) {
@@ -130,6 +315,28 @@ int parseCommandLineParameters(int argc, const char **argv) {
             flag_serverPort = true;
         } else if(strcmp(argv[i], "--max-send-window-size") == 0) {
             flag_maxSendWindowSize = true;
+        } else if(strcmp(argv[i], "--fec") == 0) {
+            flag_fec = true;
+        } else if(strcmp(argv[i], "--keepalive") == 0) {
+            flag_keepalive = true;
+        } else if(strcmp(argv[i], "--paths") == 0) {
+            flag_paths = true;
+        } else if(strcmp(argv[i], "--extended") == 0) {
+            extendedSequenceNumbers = true;
+        } else if(strcmp(argv[i], "--no-encryption") == 0) {
+            encryption = false;
+        } else if(strcmp(argv[i], "--psk") == 0) {
+            flag_psk = true;
+        } else if(strcmp(argv[i], "--affinity") == 0) {
+            flag_affinity = true;
+        } else if(strcmp(argv[i], "--busy-poll") == 0) {
+            flag_busyPoll = true;
+        } else if(strcmp(argv[i], "--capture") == 0) {
+            flag_capture = true;
+        } else if(strcmp(argv[i], "--capture-records") == 0) {
+            flag_captureRecords = true;
+        } else if(strcmp(argv[i], "--capture-payload") == 0) {
+            flag_capturePayload = true;
         } else {
             printf("Unknown argument \"%s\".", argv[i]);
             return 1;
@@ -148,51 +355,292 @@ int parseCommandLineParameters(int argc, const char **argv) {
     } else if(flag_maxSendWindowSize) {
         printf("--max-send-window-size expected an integer value.\n");
         return 1;
+    } else if(flag_fec) {
+        printf("--fec expected a block size or \"auto\".\n");
+        return 1;
+    } else if(flag_keepalive) {
+        printf("--keepalive expected an idle time, and optionally an interval and a number of probes.\n");
+        return 1;
+    } else if(flag_paths) {
+        printf("--paths expected a list of ports.\n");
+        return 1;
+    } else if(flag_psk) {
+        printf("--psk expected a file path.\n");
+        return 1;
+    } else if(flag_affinity) {
+        printf("--affinity expected a list of threads and CPUs.\n");
+        return 1;
+    } else if(flag_busyPoll) {
+        printf("--busy-poll expected an integer value.\n");
+        return 1;
+    } else if(flag_capture) {
+        printf("--capture expected a file path.\n");
+        return 1;
+    } else if(flag_captureRecords) {
+        printf("--capture-records expected an integer value.\n");
+        return 1;
+    } else if(flag_capturePayload) {
+        printf("--capture-payload expected an integer value.\n");
+        return 1;
     } else if(!flag_windowSize_set) {
         printf("--max-recv-window-size was not set.\n");
         return 1;
     } else if(!flag_serverHostname_set) {
         printf("--hostname was not set.\n");
         return 1;
+    } else if(hasPreSharedKey && !encryption) {
+        printf("--psk cannot be used with --no-encryption.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Parses a comma-separated list of UDP ports, such as "4500,10000".
+*/
+int parsePortList(const char *value, uint16_t *ports, int *portCount) {
+    int count = 0;
+
+    while(*value) {
+        char *end;
+        unsigned long port = strtoul(value, &end, 10);
+
+        if(end == value || port == 0 || port > UINT16_MAX || count >= SWTP_MAX_PATHS - 1 || (*end != ',' && *end != '\0')) {
+            return 1;
+        }
+
+        ports[count++] = port;
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    if(count == 0) {
+        return 1;
+    }
+
+    *portCount = count;
+
+    return 0;
+}
+
+/*
+    Reads a pre-shared key, written in hexadecimal in a file.
+*/
+int readPreSharedKey(const char *path, uint8_t *key) {
+    FILE *file = fopen(path, "r");
+
+    if(!file) {
+        perror("Failed to open the pre-shared key file");
+        return 1;
+    }
+
+    int result = 0;
+
+    for(int i = 0; i < SWTP_PRE_SHARED_KEY_SIZE && !result; i++) {
+        if(fscanf(file, " %2hhx", &key[i]) != 1) {
+            result = 1;
+        }
     }
 
+    fclose(file);
+
+    return result;
+}
+
+int parseFecParameter(const char *value) {
+    if(strcmp(value, "auto") == 0) {
+        fecBlockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+        fecAdaptive = true;
+        return 0;
+    }
+
+    if(sscanf(value, "%u", &fecBlockSize) != 1) {
+        printf("Failed to parse argument value to --fec.\n");
+        return 1;
+    }
+
+    if(fecBlockSize < SWTP_FEC_MIN_BLOCK_SIZE || fecBlockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        printf("Invalid value for --fec. Expected \"auto\" or an integer between %d and %d included.\n", SWTP_FEC_MIN_BLOCK_SIZE, SWTP_FEC_MAX_BLOCK_SIZE);
+        return 1;
+    }
+
+    fecAdaptive = false;
+
+    return 0;
+}
+
+/*
+    Parses the keepalive schedule, such as "5000,1000,3": the idle time and the
+    maximum interval between two TEST frames in milliseconds, and the number of
+    unanswered TEST frames after which the peer is considered dead. The last
+    two values are optional. A schedule given on the command line is adaptive,
+    so that dead peers are detected within a few RTTs.
+*/
+int parseKeepaliveParameter(const char *value) {
+    int64_t idleTime;
+    int64_t interval = keepaliveInterval;
+    unsigned int probes = keepaliveProbes;
+
+    if(sscanf(value, "%ld,%ld,%u", &idleTime, &interval, &probes) < 1) {
+        printf("Failed to parse argument value to --keepalive.\n");
+        return 1;
+    }
+
+    if(idleTime < SWTP_MIN_KEEPALIVE_INTERVAL || interval < SWTP_MIN_KEEPALIVE_INTERVAL || probes == 0) {
+        printf("Invalid value for --keepalive. Expected times of at least %d milliseconds and a strictly positive number of probes.\n", SWTP_MIN_KEEPALIVE_INTERVAL);
+        return 1;
+    }
+
+    keepaliveIdleTime = idleTime;
+    keepaliveInterval = interval;
+    keepaliveProbes = probes;
+    keepaliveAdaptive = true;
+
     return 0;
 }
 
 int timerThreadMainLoop(void *arg) {
     UNUSED_PARAMETER(arg);
 
-    while(swtp.connected) {
-        if(swtp_onTimerTick(&swtp) != SWTP_SUCCESS) {
-            break;
+    if(cpu_pinThread(&affinity, THREAD_TIMER)) {
+        perror("Failed to pin the timer thread");
+    }
+
+    while(true) {
+        mtx_lock(&swtp_mutex);
+
+        // The main loop reconnects when the connection is lost
+        if(swtp.connected) {
+            swtp_onTimerTick(&swtp);
+
+            // The server forgets the paths when it rebinds the session
+            joinPaths();
         }
 
-        sleep(1);
+        mtx_unlock(&swtp_mutex);
+
+        thrd_sleep(&(struct timespec){.tv_nsec = SWTP_TIMER_INTERVAL * 1000000}, NULL);
     }
 
     return 0;
 }
 
-int mainLoop() {
-    struct sockaddr_in serverAddress;
+/*
+    Sends a JOIN frame on each extra path that is not part of the session yet.
+    The server answers on the same path, and the path is added to the session
+    when the answer is received. Must be called with swtp_mutex locked.
+*/
+void joinPaths() {
+    if(!swtp.hasSession) {
+        return;
+    }
 
+    for(int i = 0; i < pathCount; i++) {
+        if(swtp_findPath(&swtp, (const struct sockaddr *)&pathAddresses[i]) < 0) {
+            swtp_frame_t joinFrame;
+
+            swtp_buildJoin(&joinFrame, &swtp, false);
+
+            printf("< JOIN (port %d)\n", pathPorts[i]);
+
+            sendto(pathSockets[i], &joinFrame.frame, joinFrame.size, 0, (const struct sockaddr *)&pathAddresses[i], sizeof(struct sockaddr_in));
+        }
+    }
+}
+
+/*
+    Receives a frame from one of the sockets, and passes it to SWTP. The frames
+    of the extra paths are handled like those of the primary path, except the
+    JOIN confirmations.
+*/
+int receiveFrame(int socket) {
+    struct sockaddr_in sourceAddress;
+    socklen_t sourceAddressLength = sizeof(sourceAddress);
     swtp_frame_t buffer;
-    socklen_t serverAddressLength;
+
+    ssize_t size = recvfrom(socket, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0, (struct sockaddr *)&sourceAddress, &sourceAddressLength);
+
+    if(size < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+
+        perror("Failed to read from client socket");
+        return 1;
+    }
+
+    buffer.size = size;
+
+    uint32_t sessionId;
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+    bool accepted;
+
+    if(socket != clientSocket && swtp_parseJoin(&buffer, &sessionId, sessionToken, &accepted) == SWTP_SUCCESS) {
+        mtx_lock(&swtp_mutex);
+
+        if(accepted && swtp.connected && swtp.hasSession && sessionId == swtp.sessionId && swtp_findPath(&swtp, (const struct sockaddr *)&sourceAddress) < 0) {
+            if(swtp_addPath(&swtp, socket, (const struct sockaddr *)&sourceAddress) >= 0) {
+                printf("Added the path to port %d.\n", ntohs(sourceAddress.sin_port));
+            }
+        }
+
+        mtx_unlock(&swtp_mutex);
+
+        return 0;
+    }
+
+    // Errors are usually temporary, for example when the network is down
+    if(swtp_onFrameReceived(&swtp, &buffer) != SWTP_SUCCESS) {
+        perror("SWTP failed to handle received frame");
+    }
+
+    // The frame may have acknowledged frames, which frees slots in the
+    // send window
+    sched_kick(&scheduler);
+
+    return 0;
+}
+
+int mainLoop() {
+    struct pollfd pollFds[SWTP_MAX_PATHS];
+    cpu_spinner_t spinner;
+
+    cpu_initSpinner(&spinner, busyPollTime);
+
+    pollFds[0].fd = clientSocket;
+    pollFds[0].events = POLLIN;
+
+    for(int i = 0; i < pathCount; i++) {
+        pollFds[i + 1].fd = pathSockets[i];
+        pollFds[i + 1].events = POLLIN;
+    }
     
     while(true) {
-        ssize_t size = recvfrom(clientSocket, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0, (struct sockaddr *)&serverAddress, &serverAddressLength);
-
-        if(size < 0) {
-            perror("Failed to read from client socket");
-            return 1;
+        if(!swtp.connected) {
+            if(connectToServer()) {
+                return 1;
+            }
         }
 
-        buffer.size = size;
+        // The timeout lets the loop notice a connection loss
+        int readySocketCount = cpu_poll(&spinner, pollFds, pathCount + 1, CLIENT_RECEIVE_TIMEOUT);
+
+        if(readySocketCount < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
 
-        if(swtp_onFrameReceived(&swtp, &buffer) != SWTP_SUCCESS) {
-            perror("SWTP failed to handle received frame");
+            perror("Failed to wait for frames");
             return 1;
         }
+
+        for(int i = 0; i < pathCount + 1 && readySocketCount > 0; i++) {
+            if(pollFds[i].revents & POLLIN) {
+                if(receiveFrame(pollFds[i].fd)) {
+                    return 1;
+                }
+            }
+        }
     }
 
     return 0;
@@ -200,6 +648,10 @@ int mainLoop() {
 
 int tunReaderMainLoop(void *arg) {
     UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_READER)) {
+        perror("Failed to pin the tun reader thread");
+    }
     
     uint8_t buffer[SWTP_MAX_PAYLOAD_SIZE];
 
@@ -209,15 +661,63 @@ int tunReaderMainLoop(void *arg) {
         if(packetSize < 0) {
             return 1;
         }
-        
-        if(swtp_sendDataFrame(&swtp, buffer, packetSize) != SWTP_SUCCESS) {
-            return 1;
-        }
+
+        // The packets stay queued while the client reconnects, until the
+        // queue is full
+        sched_enqueue(&scheduler, 0, buffer, packetSize);
     }
 
     return 0;
 }
 
+/*
+    Sends a queued packet, if the send window has a free slot. The last slots
+    are kept for the interactive packets, so that they do not wait for the bulk
+    frames to be acknowledged.
+*/
+int sendQueuedPacket(void *context, int flow, int band, const void *packet, size_t size, pktbuf_t *buffer) {
+    UNUSED_PARAMETER(context);
+    UNUSED_PARAMETER(flow);
+    UNUSED_PARAMETER(buffer);
+
+    unsigned int reservedSlots = band == SCHED_BAND_INTERACTIVE ? 0 : swtp.sendWindowLimit / INTERACTIVE_WINDOW_FRACTION;
+
+    if(!swtp.connected || swtp_getSendWindowAvailableSlots(&swtp) <= reservedSlots) {
+        return SCHED_BLOCKED;
+    }
+
+    swtp_sendDataFrame(&swtp, packet, size);
+
+    return SCHED_SENT;
+}
+
+/*
+    Sends the queued packets, the interactive ones first. The thread is woken
+    up when packets are queued and when the server acknowledges frames.
+*/
+int egressThreadMainLoop(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_EGRESS)) {
+        perror("Failed to pin the egress thread");
+    }
+
+    while(true) {
+        mtx_lock(&swtp_mutex);
+        sched_run(&scheduler, sendQueuedPacket, NULL);
+        mtx_unlock(&swtp_mutex);
+
+        sched_wait(&scheduler, EGRESS_WAIT_TIMEOUT);
+    }
+
+    return 0;
+}
+
+void onFrameCaptured(swtp_t *swtp, int direction, const void *frame, size_t size) {
+    UNUSED_PARAMETER(swtp);
+    capture_recordFrame(&capture, 0, direction, frame, size);
+}
+
 void onFrameReceived(swtp_t *swtp, const void *buffer, size_t size) {
     UNUSED_PARAMETER(swtp);
     write(tunDevice, buffer, size);
@@ -237,22 +737,60 @@ int resolveHostname(const char *hostname, in_addr_t *address) {
 
 void onDisconnect(swtp_t *swtp, int reason) {
     UNUSED_PARAMETER(swtp);
-    UNUSED_PARAMETER(reason);
 
-    printf("Connection lost.\n");
+    // The main loop reconnects, and keeps the TUN device open meanwhile
+    printf("Connection lost (reason=%d).\n", reason);
+}
+
+/*
+    Follows the receive window that the server announced with a WINDOW frame,
+    up to the maximum send window.
+*/
+void onWindowChanged(swtp_t *swtp, uint32_t windowSize, uint32_t byteWindowSize) {
+    UNUSED_PARAMETER(byteWindowSize);
 
-    exit(0);
+    uint32_t size = windowSize;
+
+    if(maxSendWindowSize > 0 && size > (uint32_t)maxSendWindowSize) {
+        size = maxSendWindowSize;
+    }
+
+    if(size == swtp->sendWindowSize) {
+        return;
+    }
+
+    printf("Resizing the send window from %u to %u.\n", swtp->sendWindowSize, size);
+
+    if(swtp_setSendWindowSize(swtp, size) != SWTP_SUCCESS) {
+        perror("Failed to resize the send window");
+    }
 }
 
-int connectToServer() {
-    // Open the socket
+void onMtuChanged(swtp_t *swtp, unsigned int mtu) {
+    UNUSED_PARAMETER(swtp);
+
+    if(libtun_setMtu(tunDeviceName, mtu)) {
+        perror("Failed to set the MTU of the TUN device");
+        return;
+    }
+
+    printf("TUN device MTU set to %u.\n", mtu);
+}
+
+int openClientSocket() {
     clientSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
     if(clientSocket < 0) {
         return -1;
     }
 
-    struct sockaddr_in serverAddress;
+    // Wake the main loop up regularly, so that it notices a connection loss
+    struct timeval receiveTimeout = {0, CLIENT_RECEIVE_TIMEOUT * 1000};
+
+    if(setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout))) {
+        return -1;
+    }
+
     memset(&serverAddress, 0, sizeof(struct sockaddr_in));
 
     if(resolveHostname(serverHostname, &serverAddress.sin_addr.s_addr)) {
@@ -262,56 +800,254 @@ int connectToServer() {
     printf("Resolved %s to %s\n", serverHostname, inet_ntoa(serverAddress.sin_addr));
 
     serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(5228);
+    serverAddress.sin_port = htons(serverPort);
 
-    // Initialize the SWTP structure
-    swtp_init(&swtp, clientSocket, (const struct sockaddr *)&serverAddress);
-
-    // Send a SABM packet with the desired window size
-    uint32_t sabmBuffer = htonl(0x80000000 | receiveWindowSize);
+    // Each extra path has its own socket, and thus its own local port, so that
+    // the hotspot sees several UDP flows
+    for(int i = 0; i < pathCount; i++) {
+        pathSockets[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
-    printf("Connecting to %s:%d...\n", inet_ntoa(*(struct in_addr *)&serverAddress.sin_addr), serverPort);
+        if(pathSockets[i] < 0) {
+            return -1;
+        }
 
-    if(sendto(clientSocket, &sabmBuffer, 4, 0, &swtp.socketAddress, sizeof(struct sockaddr_in)) < 0) {
-        return -1;
+        pathAddresses[i] = serverAddress;
+        pathAddresses[i].sin_port = htons(pathPorts[i]);
     }
 
-    swtp_frame_t buffer;
-    socklen_t serverAddressLength;
-    buffer.size = recvfrom(clientSocket, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0, (struct sockaddr *)&serverAddress, &serverAddressLength);
-    
-    // Expect a SABM packet
-    if(buffer.size != 4) {
-        printf("was not SABM (bad length %d)\n", (int)buffer.size);
-        return -1;
+    for(int i = -1; i < pathCount && busyPollTime > 0; i++) {
+        if(cpu_enableBusyPoll(i < 0 ? clientSocket : pathSockets[i], busyPollTime)) {
+            return -1;
+        }
     }
 
-    sabmBuffer = ntohl(*(uint32_t *)buffer.frame.header);
+    return 0;
+}
+
+/*
+    Sets the SWTP structure up for the connection accepted by the given SABM
+    response. If the server resumed the session, the sequence numbers and the
+    frames of the send window are kept.
+*/
+int onConnected(const swtp_sabm_t *sabm) {
+    if(sabm->resume && swtp.hasSession && sabm->sessionId == swtp.sessionId && sabm->extended == swtp.extended) {
+        swtp_setPeerWindow(&swtp, sabm->windowSize, sabm->overheadSize, sabm->byteWindowSize);
 
-    if((sabmBuffer & 0xffff8000) != 0x80000000) {
-        printf("was not SABM (bad contents 0x%08x)\n", sabmBuffer);
-        return -1;
+        if(swtp_resume(&swtp, (const struct sockaddr *)&serverAddress, sabm->expectedFrameNumber) != SWTP_SUCCESS) {
+            perror("Failed to retransmit frames after resuming the session");
+        }
+
+        printf("Session %u resumed.\n", sabm->sessionId);
+
+        // The server forgot the extra paths
+        mtx_lock(&swtp_mutex);
+        joinPaths();
+        mtx_unlock(&swtp_mutex);
+
+        sched_kick(&scheduler);
+
+        return 0;
     }
 
-    int sendWindowSize = sabmBuffer & 0x00007fff;
+    uint32_t sendWindowSize = sabm->windowSize;
 
     if(maxSendWindowSize > 0) {
-        if(sendWindowSize > maxSendWindowSize) {
-            printf("Reducing send window size from %d to %d.\n", sendWindowSize, maxSendWindowSize);
+        if(sendWindowSize > (uint32_t)maxSendWindowSize) {
+            printf("Reducing send window size from %u to %d.\n", sendWindowSize, maxSendWindowSize);
             sendWindowSize = maxSendWindowSize;
         }
     }
 
+    // The frames of the previous session are lost
+    mtx_lock(&swtp_mutex);
+
+    swtp_destroy(&swtp);
+    swtp_init(&swtp, clientSocket, (const struct sockaddr *)&serverAddress);
+    swtp_setKeepalive(&swtp, keepaliveIdleTime, keepaliveInterval, keepaliveProbes, keepaliveAdaptive);
+    swtp_setReceiveWindow(&swtp, receiveWindowSize, receiveWindowSize * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU));
+
+    // The server only confirms extended sequence numbers if it supports them
+    swtp.extended = sabm->extended;
+
+    if(swtp.extended) {
+        printf("Using extended sequence numbers.\n");
+    }
+
     if(swtp_initSendWindow(&swtp, sendWindowSize) != SWTP_SUCCESS) {
+        mtx_unlock(&swtp_mutex);
         perror("SWTP send window initialization failed");
         return -1;
     }
 
+    // The server announced its receive window and overhead in its response
+    swtp_setPeerWindow(&swtp, sabm->windowSize, sabm->overheadSize, sabm->byteWindowSize);
+
+    if(fecBlockSize > 0) {
+        if(swtp_enableFec(&swtp, fecBlockSize, fecAdaptive) != SWTP_SUCCESS) {
+            mtx_unlock(&swtp_mutex);
+            perror("Failed to enable FEC");
+            return -1;
+        }
+    }
+
+    // Servers that understand SACK frames get them instead of REJ frames
+    if(sabm->sack && swtp_enableSack(&swtp) != SWTP_SUCCESS) {
+        mtx_unlock(&swtp_mutex);
+        perror("Failed to enable SACK");
+        return -1;
+    }
+
+    // An attacker who can remove the key from the response could as well
+    // answer with its own, so a server that does not encrypt is only refused
+    // when the pre-shared key would have authenticated it
+    if(sabm->hasKey) {
+        if(swtp_enableEncryption(&swtp, secretKey, sabm->publicKey, hasPreSharedKey ? preSharedKey : NULL, true) != SWTP_SUCCESS) {
+            mtx_unlock(&swtp_mutex);
+            printf("Key exchange failed.\n");
+            return -1;
+        }
+
+        printf("Tunnel encrypted.\n");
+    } else if(hasPreSharedKey) {
+        mtx_unlock(&swtp_mutex);
+        printf("The server does not support encryption.\n");
+        return -1;
+    } else if(encryption) {
+        printf("Warning: the server does not support encryption, the tunnel is not encrypted.\n");
+    }
+
+    // Servers that answer probe frames let the client search the path MTU
+    if(sabm->pmtu) {
+        swtp_enablePmtuDiscovery(&swtp);
+        swtp.mtuCallback = onMtuChanged;
+
+        // A new connection searches again from the default frame size
+        onMtuChanged(&swtp, swtp_getMtu(&swtp));
+    }
+
+    // Servers that do not support sessions do not send one
+    if(sabm->hasSession) {
+        swtp.hasSession = true;
+        swtp.sessionId = sabm->sessionId;
+        memcpy(swtp.sessionToken, sabm->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+        swtp.roaming = true;
+
+        printf("Session %u\n", sabm->sessionId);
+    }
+
     // Set callbacks
     swtp.recvCallback = onFrameReceived;
     swtp.disconnectCallback = onDisconnect;
+    swtp.windowCallback = onWindowChanged;
+
+    if(capturePath) {
+        swtp.frameCallback = onFrameCaptured;
+        capture_recordSession(&capture, 0, swtp.sendWindowSize, swtp.extended);
+    }
+
+    joinPaths();
+
+    mtx_unlock(&swtp_mutex);
+
+    // Send the packets queued while the client was connecting
+    sched_kick(&scheduler);
 
     printf("Connection established.\n");
 
     return 0;
 }
+
+/*
+    Sends SABM frames until the server answers, with an exponential and
+    jittered delay between the attempts. If the client already had a session,
+    it asks the server to resume it.
+*/
+int connectToServer() {
+    swtp_frame_t request;
+    swtp_sabm_t sabm = {
+        .windowSize = receiveWindowSize,
+        .overheadSize = SWTP_OVERHEAD_SIZE,
+        .byteWindowSize = receiveWindowSize * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU),
+        .hasSession = true,
+        .resume = swtp.hasSession,
+        .extended = swtp.hasSession ? swtp.extended : extendedSequenceNumbers,
+        .sack = true,
+        .pmtu = true
+    };
+
+    // The empty session asks the server for a session, so that the tunnel
+    // survives address changes
+    if(swtp.hasSession) {
+        sabm.sessionId = swtp.sessionId;
+        memcpy(sabm.sessionToken, swtp.sessionToken, SWTP_SESSION_TOKEN_SIZE);
+        sabm.expectedFrameNumber = swtp.expectedFrameNumber;
+    }
+
+    // A resumed session keeps its keys, but the server may have forgotten it
+    if(encryption) {
+        if(swtp_generateKeyPair(secretKey, publicKey) != SWTP_SUCCESS) {
+            perror("Failed to generate a key pair");
+            return -1;
+        }
+
+        sabm.hasKey = true;
+        memcpy(sabm.publicKey, publicKey, SWTP_KEY_SIZE);
+    }
+
+    swtp_buildSABM(&request, &sabm);
+
+    unsigned int delay = CLIENT_RECONNECT_MIN_DELAY;
+
+    while(true) {
+        printf("Connecting to %s:%d...\n", inet_ntoa(serverAddress.sin_addr), serverPort);
+
+        if(sendto(clientSocket, &request.frame, request.size, 0, (const struct sockaddr *)&serverAddress, sizeof(struct sockaddr_in)) < 0) {
+            perror("Failed to send SABM");
+        }
+
+        // Clients that lost the connection at the same time must not all
+        // retry at the same time
+        swtp_time_t deadline = swtp_getTime(&swtp) + delay / 2 + random() % (delay / 2 + 1);
+        swtp_time_t remainingTime;
+
+        while((remainingTime = deadline - swtp_getTime(&swtp)) > 0) {
+            struct pollfd pollFd = {clientSocket, POLLIN, 0};
+
+            if(poll(&pollFd, 1, remainingTime) <= 0) {
+                continue;
+            }
+
+            swtp_frame_t response;
+            ssize_t size = recv(clientSocket, &response.frame, SWTP_MAX_FRAME_SIZE, 0);
+
+            if(size < 0) {
+                continue;
+            }
+
+            response.size = size;
+
+            swtp_sabm_t responseSabm;
+
+            // The server asks for a proof that we receive frames at our
+            // address before accepting the connection
+            if(swtp_parseCookie(&response, sabm.cookie) == SWTP_SUCCESS) {
+                sabm.hasCookie = true;
+                swtp_buildSABM(&request, &sabm);
+
+                if(sendto(clientSocket, &request.frame, request.size, 0, (const struct sockaddr *)&serverAddress, sizeof(struct sockaddr_in)) < 0) {
+                    perror("Failed to send SABM");
+                }
+            } else if(swtp_parseSABM(&response, &responseSabm) == SWTP_SUCCESS) {
+                return onConnected(&responseSabm);
+            }
+
+            // Other frames of the previous connection may still arrive
+        }
+
+        delay *= 2;
+
+        if(delay > CLIENT_RECONNECT_MAX_DELAY) {
+            delay = CLIENT_RECONNECT_MAX_DELAY;
+        }
+    }
+}
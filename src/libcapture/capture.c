@@ -0,0 +1,166 @@
+#include <libcapture/capture.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int capture_map(capture_t *capture, int protection) {
+    capture->header = mmap(NULL, capture->mappingSize, protection, MAP_SHARED, capture->fd, 0);
+
+    if(capture->header == MAP_FAILED) {
+        close(capture->fd);
+        return -1;
+    }
+
+    capture->records = (uint8_t *)capture->header + sizeof(capture_header_t);
+
+    return 0;
+}
+
+int capture_create(capture_t *capture, const char *path, uint64_t recordCount, uint32_t snapLength) {
+    if(recordCount == 0 || snapLength > UINT16_MAX) {
+        return -1;
+    }
+
+    // Keep the records aligned on 8 bytes
+    uint32_t recordSize = (sizeof(capture_record_t) + snapLength + 7) & ~7u;
+
+    capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(capture->fd < 0) {
+        return -1;
+    }
+
+    capture->mappingSize = sizeof(capture_header_t) + recordCount * recordSize;
+
+    // The file is sparse, so that only the written records use disk space
+    if(ftruncate(capture->fd, capture->mappingSize)) {
+        close(capture->fd);
+        return -1;
+    }
+
+    if(capture_map(capture, PROT_READ | PROT_WRITE)) {
+        return -1;
+    }
+
+    memcpy(capture->header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    capture->header->version = CAPTURE_VERSION;
+    capture->header->snapLength = snapLength;
+    capture->header->recordSize = recordSize;
+    capture->header->recordCount = recordCount;
+    atomic_init(&capture->header->writeCount, 0);
+
+    return 0;
+}
+
+int capture_open(capture_t *capture, const char *path) {
+    struct stat fileStatus;
+
+    capture->fd = open(path, O_RDONLY);
+
+    if(capture->fd < 0) {
+        return -1;
+    }
+
+    if(fstat(capture->fd, &fileStatus) || (size_t)fileStatus.st_size < sizeof(capture_header_t)) {
+        close(capture->fd);
+        return -1;
+    }
+
+    capture->mappingSize = fileStatus.st_size;
+
+    if(capture_map(capture, PROT_READ)) {
+        return -1;
+    }
+
+    const capture_header_t *header = capture->header;
+
+    if(
+        memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+        || header->version != CAPTURE_VERSION
+        || header->recordSize < sizeof(capture_record_t) + header->snapLength
+        || header->recordCount > (capture->mappingSize - sizeof(capture_header_t)) / header->recordSize
+    ) {
+        printf("%s is not a valid capture file.\n", path);
+        capture_close(capture);
+        return -1;
+    }
+
+    return 0;
+}
+
+void capture_close(capture_t *capture) {
+    munmap(capture->header, capture->mappingSize);
+    close(capture->fd);
+}
+
+static inline capture_record_t *capture_allocateRecord(capture_t *capture) {
+    uint64_t index = atomic_fetch_add_explicit(&capture->header->writeCount, 1, memory_order_relaxed);
+
+    return (capture_record_t *)(capture->records + (index % capture->header->recordCount) * capture->header->recordSize);
+}
+
+static inline uint64_t capture_getTimestamp() {
+    struct timespec now;
+
+    // Served by the vDSO, so no system call is made
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void capture_recordFrame(capture_t *capture, uint32_t session, int direction, const void *frame, size_t size) {
+    capture_record_t *record = capture_allocateRecord(capture);
+    size_t payloadLength = 0;
+
+    if(size > CAPTURE_FRAME_HEADER_SIZE) {
+        payloadLength = size - CAPTURE_FRAME_HEADER_SIZE;
+
+        if(payloadLength > capture->header->snapLength) {
+            payloadLength = capture->header->snapLength;
+        }
+    }
+
+    record->timestamp = capture_getTimestamp();
+    record->session = session;
+    record->size = size;
+    record->payloadLength = payloadLength;
+    record->direction = direction;
+    record->flags = 0;
+    memset(record->header, 0, CAPTURE_FRAME_HEADER_SIZE);
+    memcpy(record->header, frame, size < CAPTURE_FRAME_HEADER_SIZE ? size : CAPTURE_FRAME_HEADER_SIZE);
+    memcpy(record->payload, (const uint8_t *)frame + CAPTURE_FRAME_HEADER_SIZE, payloadLength);
+}
+
+void capture_recordSession(capture_t *capture, uint32_t session, uint32_t sendWindowSize, bool extended) {
+    capture_record_t *record = capture_allocateRecord(capture);
+
+    record->timestamp = capture_getTimestamp();
+    record->session = session;
+    record->size = sendWindowSize < UINT16_MAX ? sendWindowSize : UINT16_MAX;
+    record->payloadLength = 0;
+    record->direction = CAPTURE_DIRECTION_SESSION;
+    record->flags = extended ? CAPTURE_FLAG_EXTENDED : 0;
+    memcpy(record->header, &sendWindowSize, CAPTURE_FRAME_HEADER_SIZE);
+}
+
+uint64_t capture_getRecordCount(const capture_t *capture, uint64_t *firstIndex) {
+    uint64_t writeCount = atomic_load(&capture->header->writeCount);
+
+    if(writeCount > capture->header->recordCount) {
+        *firstIndex = writeCount % capture->header->recordCount;
+        return capture->header->recordCount;
+    }
+
+    *firstIndex = 0;
+
+    return writeCount;
+}
+
+const capture_record_t *capture_getRecord(const capture_t *capture, uint64_t index) {
+    return (const capture_record_t *)(capture->records + (index % capture->header->recordCount) * capture->header->recordSize);
+}
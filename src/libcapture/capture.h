@@ -0,0 +1,110 @@
+#ifndef __LIBCAPTURE_CAPTURE_H_INCLUDED__
+#define __LIBCAPTURE_CAPTURE_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "SWTPCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FRAME_HEADER_SIZE 4
+#define CAPTURE_DEFAULT_RECORD_COUNT 1048576
+
+#define CAPTURE_DIRECTION_RECEIVED 0
+#define CAPTURE_DIRECTION_SENT 1
+#define CAPTURE_DIRECTION_SESSION 2
+
+// The session uses extended sequence numbers
+#define CAPTURE_FLAG_EXTENDED 0x01
+
+// The capture file starts with this header, followed by the record ring. All
+// values are stored in host byte order.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+
+    // Contains the number of payload bytes stored in each record.
+    uint32_t snapLength;
+
+    // Contains the size of each record, in bytes.
+    uint32_t recordSize;
+    uint32_t reserved;
+
+    // Contains the number of records in the ring.
+    uint64_t recordCount;
+
+    // Contains the total number of records written since the file was
+    // created. Once it exceeds recordCount, the oldest records have been
+    // overwritten.
+    _Atomic uint64_t writeCount;
+} capture_header_t;
+
+typedef struct {
+    // Contains the CLOCK_MONOTONIC time of the frame, in nanoseconds.
+    uint64_t timestamp;
+
+    // Identifies the session the frame belongs to.
+    uint32_t session;
+
+    // Contains the size of the frame, including its header. For session
+    // records, contains the size of the send window, capped to 65535 frames.
+    uint16_t size;
+
+    // Contains the number of payload bytes that follow the record.
+    uint16_t payloadLength;
+
+    // Contains the first bytes of the frame. For session records, contains
+    // the size of the send window.
+    uint8_t header[CAPTURE_FRAME_HEADER_SIZE];
+
+    // One of CAPTURE_DIRECTION_*.
+    uint8_t direction;
+
+    // CAPTURE_FLAG_* values, for session records.
+    uint8_t flags;
+    uint8_t reserved[2];
+
+    uint8_t payload[];
+} capture_record_t;
+
+typedef struct {
+    int fd;
+    size_t mappingSize;
+    capture_header_t *header;
+    uint8_t *records;
+} capture_t;
+
+/*
+Creates the capture file at the given path, holding recordCount records. If
+snapLength is not zero, up to snapLength bytes of the payload of each frame are
+stored as well.
+*/
+int capture_create(capture_t *capture, const char *path, uint64_t recordCount, uint32_t snapLength);
+
+/*
+Opens an existing capture file for reading.
+*/
+int capture_open(capture_t *capture, const char *path);
+void capture_close(capture_t *capture);
+
+/*
+Stores a frame in the ring. This function may be called from several threads
+at once, and does not make any system call.
+*/
+void capture_recordFrame(capture_t *capture, uint32_t session, int direction, const void *frame, size_t size);
+
+/*
+Stores the beginning of a session, with the size of its send window and whether
+it uses extended sequence numbers.
+*/
+void capture_recordSession(capture_t *capture, uint32_t session, uint32_t sendWindowSize, bool extended);
+
+/*
+Returns the number of records that can be read, and the index of the oldest one
+in firstIndex.
+*/
+uint64_t capture_getRecordCount(const capture_t *capture, uint64_t *firstIndex);
+const capture_record_t *capture_getRecord(const capture_t *capture, uint64_t index);
+
+#endif
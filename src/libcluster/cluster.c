@@ -0,0 +1,381 @@
+#include <libcluster/cluster.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+static uint64_t cluster_getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t cluster_hash(const cluster_t *cluster, uint64_t key) {
+    // splitmix64 finalizer
+    key ^= cluster->hashKey;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+
+    return key ^ (key >> 31);
+}
+
+static uint64_t cluster_getAddressKey(const struct sockaddr_in *clientAddress) {
+    return (uint64_t)clientAddress->sin_addr.s_addr << 16 | clientAddress->sin_port;
+}
+
+static int cluster_findOwner(const cluster_t *cluster, cluster_owner_t *table, uint64_t key, bool *stale) {
+    uint64_t now = cluster_getTime();
+    uint64_t hash = cluster_hash(cluster, key);
+
+    for(int i = 0; i < CLUSTER_MAX_PROBES; i++) {
+        cluster_owner_t *entry = &table[(hash + i) % CLUSTER_OWNER_TABLE_SIZE];
+
+        if(entry->owner == CLUSTER_UNKNOWN || entry->key != key) {
+            continue;
+        }
+
+        uint64_t age = now - entry->time;
+
+        if(entry->owner == CLUSTER_PENDING) {
+            if(age < CLUSTER_CLAIM_TIMEOUT) {
+                return CLUSTER_PENDING;
+            } else if(age < CLUSTER_CLAIM_TIMEOUT + CLUSTER_UNCLAIMED_LIFETIME) {
+                return CLUSTER_UNCLAIMED;
+            }
+        } else if(age < CLUSTER_OWNER_LIFETIME) {
+            // An owner is kept as long as it claims it again. It is replaced
+            // by the claims of the other nodes, and forgotten when it
+            // releases it.
+            if(stale) {
+                *stale = age >= CLUSTER_REFRESH_INTERVAL;
+            }
+
+            return entry->owner;
+        }
+
+        entry->owner = CLUSTER_UNKNOWN;
+        break;
+    }
+
+    return CLUSTER_UNKNOWN;
+}
+
+static void cluster_setOwner(const cluster_t *cluster, cluster_owner_t *table, uint64_t key, int owner) {
+    uint64_t now = cluster_getTime();
+    uint64_t hash = cluster_hash(cluster, key);
+    cluster_owner_t *slot = NULL;
+
+    for(int i = 0; i < CLUSTER_MAX_PROBES; i++) {
+        cluster_owner_t *entry = &table[(hash + i) % CLUSTER_OWNER_TABLE_SIZE];
+
+        if(entry->owner != CLUSTER_UNKNOWN && entry->key == key) {
+            slot = entry;
+            break;
+        } else if(!slot || (slot->owner != CLUSTER_UNKNOWN && (entry->owner == CLUSTER_UNKNOWN || entry->time < slot->time))) {
+            // Else, take the first free entry, or the least recently used one
+            slot = entry;
+        }
+    }
+
+    if(owner == CLUSTER_UNKNOWN && slot->key != key) {
+        return;
+    }
+
+    slot->key = key;
+    slot->owner = owner;
+    slot->time = now;
+}
+
+int cluster_init(cluster_t *cluster, uint16_t port, const struct sockaddr_in *peers, int peerCount) {
+    struct sockaddr_in socketAddress;
+    int enable = 1;
+
+    if(peerCount > CLUSTER_MAX_PEERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(cluster, 0, sizeof(cluster_t));
+    memcpy(cluster->peers, peers, peerCount * sizeof(struct sockaddr_in));
+    cluster->peerCount = peerCount;
+
+    for(int i = 0; i < CLUSTER_OWNER_TABLE_SIZE; i++) {
+        cluster->addressOwners[i].owner = CLUSTER_UNKNOWN;
+        cluster->sessionOwners[i].owner = CLUSTER_UNKNOWN;
+    }
+
+    if(getrandom(&cluster->hashKey, sizeof(cluster->hashKey), 0) != sizeof(cluster->hashKey)) {
+        return -1;
+    }
+
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    socketAddress.sin_port = htons(port);
+
+    cluster->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    cluster->listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if(
+        cluster->socket < 0 || cluster->listenSocket < 0
+        || setsockopt(cluster->listenSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable))
+        // A server that takes the node over binds them before the other exits
+        || setsockopt(cluster->socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable))
+        || setsockopt(cluster->listenSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable))
+        || bind(cluster->socket, (const struct sockaddr *)&socketAddress, sizeof(socketAddress))
+        || bind(cluster->listenSocket, (const struct sockaddr *)&socketAddress, sizeof(socketAddress))
+        || listen(cluster->listenSocket, CLUSTER_MAX_PEERS)
+    ) {
+        int error = errno;
+
+        cluster_destroy(cluster);
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cluster_destroy(cluster_t *cluster) {
+    if(cluster->socket >= 0) {
+        close(cluster->socket);
+    }
+
+    if(cluster->listenSocket >= 0) {
+        close(cluster->listenSocket);
+    }
+
+    cluster->socket = -1;
+    cluster->listenSocket = -1;
+}
+
+int cluster_parsePeers(const char *value, struct sockaddr_in *peers, int *peerCount) {
+    int count = 0;
+
+    while(*value) {
+        char host[INET_ADDRSTRLEN];
+        const char *separator = strchr(value, ':');
+        char *end;
+
+        if(!separator || separator == value || (size_t)(separator - value) >= sizeof(host) || count >= CLUSTER_MAX_PEERS) {
+            return -1;
+        }
+
+        memcpy(host, value, separator - value);
+        host[separator - value] = '\0';
+
+        unsigned long port = strtoul(separator + 1, &end, 10);
+
+        if(end == separator + 1 || port == 0 || port > UINT16_MAX || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        memset(&peers[count], 0, sizeof(struct sockaddr_in));
+        peers[count].sin_family = AF_INET;
+        peers[count].sin_port = htons(port);
+
+        if(inet_pton(AF_INET, host, &peers[count].sin_addr) != 1) {
+            return -1;
+        }
+
+        count++;
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    if(count == 0) {
+        return -1;
+    }
+
+    *peerCount = count;
+
+    return 0;
+}
+
+static int cluster_send(cluster_t *cluster, int peer, const cluster_message_t *message, size_t payloadSize) {
+    size_t size = sizeof(cluster_header_t) + payloadSize;
+    int result = 0;
+
+    for(int i = 0; i < cluster->peerCount; i++) {
+        if(peer != CLUSTER_ALL_PEERS && peer != i) {
+            continue;
+        }
+
+        if(sendto(cluster->socket, message, size, 0, (const struct sockaddr *)&cluster->peers[i], sizeof(struct sockaddr_in)) < 0) {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+static void cluster_initHeader(cluster_header_t *header, uint8_t type, const struct sockaddr_in *clientAddress, bool hasSession, uint32_t sessionId) {
+    memset(header, 0, sizeof(cluster_header_t));
+    header->version = CLUSTER_VERSION;
+    header->type = type;
+    header->flags = hasSession ? CLUSTER_FLAG_SESSION : 0;
+    header->clientAddress = clientAddress->sin_addr.s_addr;
+    header->clientPort = clientAddress->sin_port;
+    header->sessionId = htonl(sessionId);
+}
+
+int cluster_forward(cluster_t *cluster, int peer, uint16_t port, const struct sockaddr_in *clientAddress, const void *datagram, size_t size, uint8_t flags) {
+    cluster_message_t message;
+
+    if(size > CLUSTER_MAX_PAYLOAD_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    cluster_initHeader(&message.header, CLUSTER_MESSAGE_FORWARD, clientAddress, false, 0);
+    message.header.port = htons(port);
+    message.header.flags = flags;
+    memcpy(message.payload, datagram, size);
+
+    return cluster_send(cluster, flags & CLUSTER_FLAG_FLOOD ? CLUSTER_ALL_PEERS : peer, &message, size);
+}
+
+int cluster_claim(cluster_t *cluster, int peer, const struct sockaddr_in *clientAddress, bool hasSession, uint32_t sessionId) {
+    cluster_message_t message;
+
+    cluster_initHeader(&message.header, CLUSTER_MESSAGE_CLAIM, clientAddress, hasSession, sessionId);
+
+    return cluster_send(cluster, peer, &message, 0);
+}
+
+int cluster_release(cluster_t *cluster, int peer, const struct sockaddr_in *clientAddress, bool hasSession, uint32_t sessionId) {
+    cluster_message_t message;
+
+    cluster_initHeader(&message.header, CLUSTER_MESSAGE_RELEASE, clientAddress, hasSession, sessionId);
+
+    return cluster_send(cluster, peer, &message, 0);
+}
+
+ssize_t cluster_receive(cluster_t *cluster, cluster_message_t *message, int *peer) {
+    struct sockaddr_in socketAddress;
+    socklen_t socketAddressLength = sizeof(socketAddress);
+    ssize_t size = recvfrom(cluster->socket, message, sizeof(cluster_message_t), 0, (struct sockaddr *)&socketAddress, &socketAddressLength);
+
+    if(size < (ssize_t)sizeof(cluster_header_t) || message->header.version != CLUSTER_VERSION) {
+        return -1;
+    }
+
+    // Only the peers are trusted
+    *peer = -1;
+
+    for(int i = 0; i < cluster->peerCount; i++) {
+        if(cluster->peers[i].sin_addr.s_addr == socketAddress.sin_addr.s_addr && cluster->peers[i].sin_port == socketAddress.sin_port) {
+            *peer = i;
+            break;
+        }
+    }
+
+    if(*peer < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in clientAddress;
+    bool hasSession = message->header.flags & CLUSTER_FLAG_SESSION;
+    uint32_t sessionId = ntohl(message->header.sessionId);
+
+    memset(&clientAddress, 0, sizeof(clientAddress));
+    clientAddress.sin_family = AF_INET;
+    clientAddress.sin_addr.s_addr = message->header.clientAddress;
+    clientAddress.sin_port = message->header.clientPort;
+
+    switch(message->header.type) {
+        case CLUSTER_MESSAGE_FORWARD:
+            break;
+
+        case CLUSTER_MESSAGE_CLAIM:
+            cluster_setAddressOwner(cluster, &clientAddress, *peer);
+
+            if(hasSession) {
+                cluster_setSessionOwner(cluster, sessionId, *peer);
+            }
+
+            break;
+
+        case CLUSTER_MESSAGE_RELEASE:
+            // The owner may have changed since the datagram was forwarded
+            if(cluster_findAddressOwner(cluster, &clientAddress, NULL) == *peer) {
+                cluster_setAddressOwner(cluster, &clientAddress, CLUSTER_UNKNOWN);
+            }
+
+            if(hasSession && cluster_findSessionOwner(cluster, sessionId, NULL) == *peer) {
+                cluster_setSessionOwner(cluster, sessionId, CLUSTER_UNKNOWN);
+            }
+
+            break;
+
+        default:
+            return -1;
+    }
+
+    return size - sizeof(cluster_header_t);
+}
+
+int cluster_findAddressOwner(cluster_t *cluster, const struct sockaddr_in *clientAddress, bool *stale) {
+    return cluster_findOwner(cluster, cluster->addressOwners, cluster_getAddressKey(clientAddress), stale);
+}
+
+int cluster_findSessionOwner(cluster_t *cluster, uint32_t sessionId, bool *stale) {
+    return cluster_findOwner(cluster, cluster->sessionOwners, sessionId, stale);
+}
+
+void cluster_setAddressOwner(cluster_t *cluster, const struct sockaddr_in *clientAddress, int owner) {
+    cluster_setOwner(cluster, cluster->addressOwners, cluster_getAddressKey(clientAddress), owner);
+}
+
+void cluster_setSessionOwner(cluster_t *cluster, uint32_t sessionId, int owner) {
+    cluster_setOwner(cluster, cluster->sessionOwners, sessionId, owner);
+}
+
+int cluster_selectPeer(const cluster_t *cluster, const struct sockaddr_in *clientAddress) {
+    return cluster_hash(cluster, cluster_getAddressKey(clientAddress)) % cluster->peerCount;
+}
+
+int cluster_connect(const cluster_t *cluster, int peer) {
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(connect(fd, (const struct sockaddr *)&cluster->peers[peer], sizeof(struct sockaddr_in))) {
+        int error = errno;
+
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+int cluster_accept(const cluster_t *cluster) {
+    struct sockaddr_in socketAddress;
+    socklen_t socketAddressLength = sizeof(socketAddress);
+    int fd = accept(cluster->listenSocket, (struct sockaddr *)&socketAddress, &socketAddressLength);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    // The connection comes from an ephemeral port of the peer
+    for(int i = 0; i < cluster->peerCount; i++) {
+        if(cluster->peers[i].sin_addr.s_addr == socketAddress.sin_addr.s_addr) {
+            return fd;
+        }
+    }
+
+    close(fd);
+
+    return -1;
+}
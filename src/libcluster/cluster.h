@@ -0,0 +1,184 @@
+#ifndef __LIBCLUSTER_CLUSTER_H_INCLUDED__
+#define __LIBCLUSTER_CLUSTER_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#define CLUSTER_VERSION 1
+#define CLUSTER_MAX_PEERS 16
+#define CLUSTER_MAX_PAYLOAD_SIZE 2048
+
+// Types of the messages exchanged on the UDP socket of the cluster.
+// A datagram received by a node that does not own its session
+#define CLUSTER_MESSAGE_FORWARD 1
+// Tells the other nodes that the sender owns an address and a session
+#define CLUSTER_MESSAGE_CLAIM 2
+// Tells a node that the sender does not own an address it forwarded to it
+#define CLUSTER_MESSAGE_RELEASE 3
+
+// The forwarded datagram was sent to every node, as its owner is unknown
+#define CLUSTER_FLAG_FLOOD 0x01
+// The owner of the forwarded datagram must claim it again
+#define CLUSTER_FLAG_REFRESH 0x04
+// The message designates a session, not only an address
+#define CLUSTER_FLAG_SESSION 0x02
+
+// Sends a message to every peer
+#define CLUSTER_ALL_PEERS -1
+
+// Owners returned by cluster_findAddressOwner() and cluster_findSessionOwner()
+// instead of the index of a peer.
+// No node was asked for the owner
+#define CLUSTER_UNKNOWN -1
+// The other nodes were asked for the owner, and did not answer yet
+#define CLUSTER_PENDING -2
+// No other node claimed it, so the local node may handle it
+#define CLUSTER_UNCLAIMED -3
+
+// Contains the number of entries of the owner tables, and the number of
+// entries searched for a key.
+#define CLUSTER_OWNER_TABLE_SIZE 4096
+#define CLUSTER_MAX_PROBES 8
+
+// Contains the time after which an owner that did not claim an address or a
+// session again is forgotten, as it may have stopped, the time after which it
+// is asked to claim it again, the time the other nodes have to claim an
+// address or a session, and the time after which an unclaimed one is asked
+// for again, in milliseconds.
+#define CLUSTER_OWNER_LIFETIME 15000
+#define CLUSTER_REFRESH_INTERVAL 5000
+#define CLUSTER_CLAIM_TIMEOUT 500
+#define CLUSTER_UNCLAIMED_LIFETIME 10000
+
+/*
+Header of the messages. The addresses and ports are in network byte order.
+*/
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved;
+
+    // Contains the server port the datagram was received on.
+    uint16_t port;
+
+    // Contains the address of the client.
+    uint16_t clientPort;
+    uint32_t clientAddress;
+
+    uint32_t sessionId;
+} cluster_header_t;
+
+typedef struct {
+    cluster_header_t header;
+    uint8_t payload[CLUSTER_MAX_PAYLOAD_SIZE];
+} cluster_message_t;
+
+typedef struct {
+    uint64_t key;
+
+    // Contains the index of the peer, CLUSTER_PENDING, or CLUSTER_UNKNOWN if
+    // the entry is empty.
+    int owner;
+
+    // Contains the time the owner last claimed the entry, or when the other
+    // nodes were asked for the owner if it is pending.
+    uint64_t time;
+} cluster_owner_t;
+
+/*
+Steering layer shared by the server nodes of a cluster. Each node knows the
+sessions it owns; the datagrams it receives for the others are forwarded to
+their owner, which is looked up in the owner tables, or else asked to every
+node. The owner then claims the address and the session. The structure is not
+thread-safe.
+*/
+typedef struct {
+    // Contains the UDP socket of the forwarded datagrams and of the claims,
+    // and the TCP socket the sessions migrate through.
+    int socket;
+    int listenSocket;
+
+    struct sockaddr_in peers[CLUSTER_MAX_PEERS];
+    int peerCount;
+
+    // Contains the random key of the hash tables.
+    uint64_t hashKey;
+
+    cluster_owner_t addressOwners[CLUSTER_OWNER_TABLE_SIZE];
+    cluster_owner_t sessionOwners[CLUSTER_OWNER_TABLE_SIZE];
+} cluster_t;
+
+/*
+Binds the UDP and TCP sockets of the node to the given port, on every
+interface. The peers are the other nodes, whose sockets use the same port
+numbers.
+*/
+int cluster_init(cluster_t *cluster, uint16_t port, const struct sockaddr_in *peers, int peerCount);
+void cluster_destroy(cluster_t *cluster);
+
+/*
+Parses a comma-separated list of peers, such as "10.0.0.2:5300,10.0.0.3:5300".
+*/
+int cluster_parsePeers(const char *value, struct sockaddr_in *peers, int *peerCount);
+
+/*
+Forwards a datagram received from a client on the given server port to a peer,
+or to every peer with CLUSTER_FLAG_FLOOD if the owner is unknown.
+*/
+int cluster_forward(cluster_t *cluster, int peer, uint16_t port, const struct sockaddr_in *clientAddress, const void *datagram, size_t size, uint8_t flags);
+
+/*
+Tells a peer, or every peer, that this node owns the given address, and the
+given session if hasSession is true.
+*/
+int cluster_claim(cluster_t *cluster, int peer, const struct sockaddr_in *clientAddress, bool hasSession, uint32_t sessionId);
+
+/*
+Tells a peer that this node does not own the given address and session.
+*/
+int cluster_release(cluster_t *cluster, int peer, const struct sockaddr_in *clientAddress, bool hasSession, uint32_t sessionId);
+
+/*
+Receives a message from a peer, and returns the size of its payload. Claims and
+releases are applied to the owner tables before returning. Returns -1 if the
+message is invalid or does not come from a peer.
+*/
+ssize_t cluster_receive(cluster_t *cluster, cluster_message_t *message, int *peer);
+
+/*
+Returns the owner of an address or of a session: the index of a peer, or one of
+CLUSTER_UNKNOWN, CLUSTER_PENDING and CLUSTER_UNCLAIMED. If stale is not NULL,
+it is set if the owner must be asked to claim it again.
+*/
+int cluster_findAddressOwner(cluster_t *cluster, const struct sockaddr_in *clientAddress, bool *stale);
+int cluster_findSessionOwner(cluster_t *cluster, uint32_t sessionId, bool *stale);
+
+/*
+Sets the owner of an address or of a session. CLUSTER_PENDING means that the
+other nodes were just asked for it, and CLUSTER_UNKNOWN forgets it.
+*/
+void cluster_setAddressOwner(cluster_t *cluster, const struct sockaddr_in *clientAddress, int owner);
+void cluster_setSessionOwner(cluster_t *cluster, uint32_t sessionId, int owner);
+
+/*
+Returns the peer an address is given to when this node does not take it, so
+that the datagrams of a client always go to the same peer.
+*/
+int cluster_selectPeer(const cluster_t *cluster, const struct sockaddr_in *clientAddress);
+
+/*
+Opens a TCP connection to a peer, to migrate sessions to it.
+*/
+int cluster_connect(const cluster_t *cluster, int peer);
+
+/*
+Accepts a TCP connection from a peer. Connections from other addresses are
+closed. Returns -1 if no peer connected.
+*/
+int cluster_accept(const cluster_t *cluster);
+
+#endif
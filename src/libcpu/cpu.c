@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <libcpu/cpu.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static uint64_t cpu_getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void cpu_setBit(cpu_mask_t *mask, int cpu) {
+    mask->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+}
+
+static bool cpu_getBit(const cpu_mask_t *mask, int cpu) {
+    return mask->bits[cpu / 64] >> (cpu % 64) & 1;
+}
+
+static int cpu_parseCpu(const char *value, char **end) {
+    if(*value < '0' || *value > '9') {
+        return -1;
+    }
+
+    unsigned long cpu = strtoul(value, end, 10);
+
+    return cpu < CPU_MAX_CPUS ? (int)cpu : -1;
+}
+
+/*
+Parses the CPUs of a thread, up to the next ',' or the end of the value.
+*/
+static const char *cpu_parseMask(const char *value, cpu_mask_t *mask) {
+    memset(mask, 0, sizeof(cpu_mask_t));
+
+    while(true) {
+        char *end;
+        int first = cpu_parseCpu(value, &end);
+        int last = first;
+
+        if(first < 0) {
+            return NULL;
+        }
+
+        if(*end == '-') {
+            last = cpu_parseCpu(end + 1, &end);
+
+            if(last < first) {
+                return NULL;
+            }
+        }
+
+        for(int cpu = first; cpu <= last; cpu++) {
+            cpu_setBit(mask, cpu);
+        }
+
+        if(*end != '+') {
+            return end;
+        }
+
+        value = end + 1;
+    }
+}
+
+int cpu_parseAffinity(cpu_affinity_t *affinity, const char *const *names, int threadCount, const char *value) {
+    cpu_set_t initialSet;
+
+    if(threadCount > CPU_MAX_THREADS || sched_getaffinity(0, sizeof(initialSet), &initialSet) < 0) {
+        return -1;
+    }
+
+    // The threads that are not named keep the CPUs of the program
+    memset(&affinity->masks[0], 0, sizeof(cpu_mask_t));
+
+    for(int cpu = 0; cpu < CPU_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &initialSet)) {
+            cpu_setBit(&affinity->masks[0], cpu);
+        }
+    }
+
+    for(int i = 1; i < threadCount; i++) {
+        affinity->masks[i] = affinity->masks[0];
+    }
+
+    affinity->names = names;
+    affinity->threadCount = threadCount;
+
+    while(*value) {
+        const char *separator = strchr(value, '=');
+        int thread = -1;
+
+        for(int i = 0; separator && i < threadCount && thread < 0; i++) {
+            if((size_t)(separator - value) == strlen(names[i]) && !strncmp(value, names[i], separator - value)) {
+                thread = i;
+            }
+        }
+
+        if(thread < 0) {
+            return -1;
+        }
+
+        const char *end = cpu_parseMask(separator + 1, &affinity->masks[thread]);
+
+        if(!end || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    affinity->configured = true;
+
+    return 0;
+}
+
+int cpu_getNode(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *directory = opendir(path);
+    int node = -1;
+
+    if(!directory) {
+        return -1;
+    }
+
+    // The directory of a CPU links to its node as nodeN
+    for(struct dirent *entry = readdir(directory); entry && node < 0; entry = readdir(directory)) {
+        if(!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+        }
+    }
+
+    closedir(directory);
+
+    return node;
+}
+
+int cpu_pinThread(const cpu_affinity_t *affinity, int thread) {
+    if(!affinity->configured) {
+        return 0;
+    }
+
+    const cpu_mask_t *mask = &affinity->masks[thread];
+    cpu_set_t set;
+    int node = -1;
+    bool singleNode = true;
+
+    CPU_ZERO(&set);
+
+    for(int cpu = 0; cpu < CPU_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if(!cpu_getBit(mask, cpu)) {
+            continue;
+        }
+
+        CPU_SET(cpu, &set);
+
+        int cpuNode = cpu_getNode(cpu);
+
+        if(node < 0) {
+            node = cpuNode;
+        } else if(cpuNode != node) {
+            singleNode = false;
+        }
+    }
+
+    if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+        return -1;
+    }
+
+    // The placement of the memory is only a preference, which a kernel
+    // without NUMA support does not have
+    if(singleNode && node >= 0 && node < 64) {
+        unsigned long nodeMask = 1UL << node;
+
+        if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8) < 0 && errno != ENOSYS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void cpu_initSpinner(cpu_spinner_t *spinner, uint32_t maxSpinTime) {
+    spinner->maxSpinTime = (uint64_t)maxSpinTime * 1000;
+    spinner->spinTime = spinner->maxSpinTime;
+}
+
+int cpu_poll(cpu_spinner_t *spinner, struct pollfd *fds, nfds_t count, int timeout) {
+    if(spinner->maxSpinTime > 0) {
+        uint64_t startTime = cpu_getTime();
+
+        do {
+            int result = poll(fds, count, 0);
+
+            if(result != 0) {
+                if(result > 0) {
+                    spinner->spinTime = spinner->spinTime * 2 < spinner->maxSpinTime ? spinner->spinTime * 2 : spinner->maxSpinTime;
+                }
+
+                return result;
+            }
+        } while(cpu_getTime() - startTime < spinner->spinTime);
+
+        spinner->spinTime = spinner->spinTime / 2 > CPU_MIN_SPIN_TIME ? spinner->spinTime / 2 : CPU_MIN_SPIN_TIME;
+    }
+
+    return poll(fds, count, timeout);
+}
+
+int cpu_enableBusyPoll(int socket, uint32_t time) {
+    int value = time;
+
+    return setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+}
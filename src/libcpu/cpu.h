@@ -0,0 +1,82 @@
+#ifndef __LIBCPU_CPU_H_INCLUDED__
+#define __LIBCPU_CPU_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+
+// Contains the number of CPUs a mask can designate, and the number of threads
+// an affinity can name.
+#define CPU_MAX_CPUS 1024
+#define CPU_MAX_THREADS 16
+
+// Contains the longest busy polling time the programs accept, in microseconds.
+#define CPU_MAX_BUSY_POLL_TIME 10000
+
+// Contains the shortest time a spinner keeps spinning before it blocks, in
+// nanoseconds, so that it can find out again that spinning pays off.
+#define CPU_MIN_SPIN_TIME 1000
+
+typedef struct {
+    uint64_t bits[CPU_MAX_CPUS / 64];
+} cpu_mask_t;
+
+/*
+CPUs the threads of a program run on. The threads are designated by the index
+of their name in the table given to cpu_parseAffinity(). The threads that were
+not given CPUs run on the CPUs the program was started on.
+*/
+typedef struct {
+    // False if no affinity was given, in which case the threads are not
+    // pinned.
+    bool configured;
+
+    const char *const *names;
+    int threadCount;
+    cpu_mask_t masks[CPU_MAX_THREADS];
+} cpu_affinity_t;
+
+/*
+Waits for file descriptors like poll(), but first polls them without blocking
+for up to the spin time, so that a datagram that arrives soon is handled
+without the thread going to sleep and being woken up again. The spin time
+adapts: it doubles, up to the maximum, when spinning found a descriptor ready,
+and halves when the thread had to block, so that an idle thread stops burning
+its CPU. The structure must only be used by one thread.
+*/
+typedef struct {
+    // In nanoseconds. A maximum of 0 disables spinning.
+    uint64_t maxSpinTime;
+    uint64_t spinTime;
+} cpu_spinner_t;
+
+/*
+Parses an affinity such as "receiver=2,egress=3,timer=4-5+7": the threads are
+given a CPU, a range of CPUs, or several of them joined with '+'. The names
+are those of the table, which must outlive the affinity.
+*/
+int cpu_parseAffinity(cpu_affinity_t *affinity, const char *const *names, int threadCount, const char *value);
+
+/*
+Pins the calling thread to its CPUs, and makes it allocate its memory on their
+NUMA node when they all belong to the same one. The pages that the thread
+touches first afterwards are then local to it. Does nothing if the affinity was
+not configured.
+*/
+int cpu_pinThread(const cpu_affinity_t *affinity, int thread);
+
+/*
+Returns the NUMA node of a CPU, or -1 if it is unknown.
+*/
+int cpu_getNode(int cpu);
+
+void cpu_initSpinner(cpu_spinner_t *spinner, uint32_t maxSpinTime);
+int cpu_poll(cpu_spinner_t *spinner, struct pollfd *fds, nfds_t count, int timeout);
+
+/*
+Makes the kernel busy poll the device queue of a socket for up to the given
+time, in microseconds, when a receive call finds it empty (SO_BUSY_POLL).
+*/
+int cpu_enableBusyPoll(int socket, uint32_t time);
+
+#endif
@@ -0,0 +1,35 @@
+#include <libpktbuf/pktbuf.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+pktbuf_t *pktbuf_create(const void *packet, size_t size) {
+    if(size > UINT16_MAX) {
+        return NULL;
+    }
+
+    pktbuf_t *buffer = malloc(sizeof(pktbuf_t) + size);
+
+    if(!buffer) {
+        return NULL;
+    }
+
+    atomic_init(&buffer->references, 1);
+    buffer->size = size;
+    memcpy(buffer->data, packet, size);
+
+    return buffer;
+}
+
+pktbuf_t *pktbuf_acquire(pktbuf_t *buffer) {
+    atomic_fetch_add_explicit(&buffer->references, 1, memory_order_relaxed);
+
+    return buffer;
+}
+
+void pktbuf_release(pktbuf_t *buffer) {
+    // The last owner must see the writes of the others before freeing it
+    if(buffer && atomic_fetch_sub_explicit(&buffer->references, 1, memory_order_acq_rel) == 1) {
+        free(buffer);
+    }
+}
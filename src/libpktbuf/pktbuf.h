@@ -0,0 +1,37 @@
+#ifndef __LIBPKTBUF_PKTBUF_H_INCLUDED__
+#define __LIBPKTBUF_PKTBUF_H_INCLUDED__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Packet read from a TUN device, TUN header included, shared by the queues and
+the send windows of several sessions, so that a packet sent to many clients is
+only copied once. The buffer is freed when its last reference is released. Its
+data must not be modified once it is shared.
+*/
+typedef struct {
+    atomic_uint references;
+    uint16_t size;
+    uint8_t data[];
+} pktbuf_t;
+
+/*
+Creates a buffer that contains a copy of the given packet, with one reference.
+Returns NULL if there is not enough memory.
+*/
+pktbuf_t *pktbuf_create(const void *packet, size_t size);
+
+/*
+Adds a reference to a buffer, and returns it.
+*/
+pktbuf_t *pktbuf_acquire(pktbuf_t *buffer);
+
+/*
+Releases a reference to a buffer, and frees it if it was the last one. Does
+nothing if the buffer is NULL.
+*/
+void pktbuf_release(pktbuf_t *buffer);
+
+#endif
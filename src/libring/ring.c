@@ -0,0 +1,286 @@
+#include <libring/ring.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int ring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned int submitCount, unsigned int waitCount, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submitCount, waitCount, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned int opcode, const void *argument, unsigned int count) {
+    return syscall(__NR_io_uring_register, fd, opcode, argument, count);
+}
+
+int ring_init(ring_t *ring, unsigned int entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(ring_t));
+    memset(&params, 0, sizeof(params));
+
+    // Only one thread submits, which lets the kernel skip some locking. Older
+    // kernels do not know this flag.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = entries * 4;
+    ring->fd = ring_setup(entries, &params);
+
+    if(ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = ring_setup(entries, &params);
+    }
+
+    if(ring->fd < 0) {
+        return -1;
+    }
+
+    ring->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both rings may share the same mapping
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->completionRingSize > ring->submissionRingSize) {
+            ring->submissionRingSize = ring->completionRingSize;
+        }
+
+        ring->completionRingSize = ring->submissionRingSize;
+    }
+
+    ring->submissionRing = mmap(NULL, ring->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ring->submissionRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->completionRing = ring->submissionRing;
+    } else {
+        ring->completionRing = mmap(NULL, ring->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if(ring->completionRing == MAP_FAILED) {
+            munmap(ring->submissionRing, ring->submissionRingSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->submissionEntryArraySize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->submissionEntryArray = mmap(NULL, ring->submissionEntryArraySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->submissionEntryArray == MAP_FAILED) {
+        if(ring->completionRing != ring->submissionRing) {
+            munmap(ring->completionRing, ring->completionRingSize);
+        }
+
+        munmap(ring->submissionRing, ring->submissionRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *submissionRing = ring->submissionRing;
+    uint8_t *completionRing = ring->completionRing;
+
+    ring->submissionHead = (unsigned int *)(submissionRing + params.sq_off.head);
+    ring->submissionTail = (unsigned int *)(submissionRing + params.sq_off.tail);
+    ring->submissionArray = (unsigned int *)(submissionRing + params.sq_off.array);
+    ring->submissionMask = *(unsigned int *)(submissionRing + params.sq_off.ring_mask);
+    ring->submissionEntries = params.sq_entries;
+    ring->pendingTail = *ring->submissionTail;
+
+    ring->completionHead = (unsigned int *)(completionRing + params.cq_off.head);
+    ring->completionTail = (unsigned int *)(completionRing + params.cq_off.tail);
+    ring->completionMask = *(unsigned int *)(completionRing + params.cq_off.ring_mask);
+    ring->completionEntries = (struct io_uring_cqe *)(completionRing + params.cq_off.cqes);
+
+    return 0;
+}
+
+void ring_destroy(ring_t *ring) {
+    munmap(ring->submissionEntryArray, ring->submissionEntryArraySize);
+
+    if(ring->completionRing != ring->submissionRing) {
+        munmap(ring->completionRing, ring->completionRingSize);
+    }
+
+    munmap(ring->submissionRing, ring->submissionRingSize);
+
+    // Closing the ring cancels its pending requests
+    close(ring->fd);
+}
+
+int ring_registerFiles(ring_t *ring, const int *fds, unsigned int count) {
+    return ring_register(ring->fd, IORING_REGISTER_FILES, fds, count) < 0 ? -1 : 0;
+}
+
+int ring_registerBuffers(ring_t *ring, const struct iovec *iovecs, unsigned int count) {
+    return ring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, count) < 0 ? -1 : 0;
+}
+
+int ring_createBufferGroup(ring_t *ring, ring_bufferGroup_t *group, uint16_t groupId, unsigned int count, size_t size) {
+    if(count == 0 || count > 32768 || (count & (count - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    group->groupId = groupId;
+    group->count = count;
+    group->size = size;
+    group->tail = 0;
+
+    // The kernel requires a page-aligned ring
+    group->bufferRingSize = count * sizeof(struct io_uring_buf);
+    group->bufferRing = mmap(NULL, group->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(group->bufferRing == MAP_FAILED) {
+        return -1;
+    }
+
+    group->buffers = malloc(count * size);
+
+    if(!group->buffers) {
+        munmap(group->bufferRing, group->bufferRingSize);
+        return -1;
+    }
+
+    struct io_uring_buf_reg registration;
+
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uintptr_t)group->bufferRing;
+    registration.ring_entries = count;
+    registration.bgid = groupId;
+
+    if(ring_register(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        free(group->buffers);
+        munmap(group->bufferRing, group->bufferRingSize);
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < count; i++) {
+        ring_recycleBuffer(group, i);
+    }
+
+    return 0;
+}
+
+void ring_destroyBufferGroup(ring_t *ring, ring_bufferGroup_t *group) {
+    struct io_uring_buf_reg registration;
+
+    memset(&registration, 0, sizeof(registration));
+    registration.bgid = group->groupId;
+
+    ring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+    free(group->buffers);
+    munmap(group->bufferRing, group->bufferRingSize);
+}
+
+void *ring_getBuffer(const ring_bufferGroup_t *group, uint16_t bufferId) {
+    return group->buffers + (size_t)bufferId * group->size;
+}
+
+void ring_recycleBuffer(ring_bufferGroup_t *group, uint16_t bufferId) {
+    struct io_uring_buf *buffer = &group->bufferRing->bufs[group->tail & (group->count - 1)];
+
+    buffer->addr = (uintptr_t)ring_getBuffer(group, bufferId);
+    buffer->len = group->size;
+    buffer->bid = bufferId;
+    group->tail++;
+
+    // The kernel must see the buffer before the new tail
+    __atomic_store_n(&group->bufferRing->tail, group->tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *ring_getSqe(ring_t *ring) {
+    unsigned int head = __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE);
+
+    if(ring->pendingTail - head >= ring->submissionEntries) {
+        if(ring_submit(ring, 0) < 0) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE);
+
+        if(ring->pendingTail - head >= ring->submissionEntries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned int index = ring->pendingTail & ring->submissionMask;
+    struct io_uring_sqe *sqe = &ring->submissionEntryArray[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->submissionArray[index] = index;
+    ring->pendingTail++;
+
+    return sqe;
+}
+
+void ring_prepareRecvMsg(struct io_uring_sqe *sqe, int fileIndex, struct msghdr *message, uint16_t groupId, bool multishot, uint64_t userData) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->fd = fileIndex;
+    sqe->addr = (uintptr_t)message;
+    sqe->len = 1;
+    sqe->buf_group = groupId;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = userData;
+}
+
+void ring_prepareRead(struct io_uring_sqe *sqe, int fileIndex, uint16_t groupId, size_t size, bool multishot, uint64_t userData) {
+    sqe->opcode = multishot ? RING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->fd = fileIndex;
+
+    // A multishot read fills whole buffers
+    sqe->len = multishot ? 0 : size;
+    sqe->buf_group = groupId;
+    sqe->user_data = userData;
+}
+
+void ring_prepareWriteFixed(struct io_uring_sqe *sqe, int fileIndex, const void *buffer, size_t size, uint16_t bufferIndex, uint64_t userData) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = fileIndex;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = size;
+    sqe->buf_index = bufferIndex;
+    sqe->user_data = userData;
+}
+
+int ring_submit(ring_t *ring, unsigned int waitCount) {
+    unsigned int submitCount = ring->pendingTail - *ring->submissionTail;
+
+    // The kernel must see the entries before the new tail
+    __atomic_store_n(ring->submissionTail, ring->pendingTail, __ATOMIC_RELEASE);
+
+    int result;
+
+    do {
+        result = ring_enter(ring->fd, submitCount, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while(result < 0 && errno == EINTR);
+
+    return result;
+}
+
+struct io_uring_cqe *ring_peekCqe(ring_t *ring) {
+    unsigned int head = *ring->completionHead;
+
+    if(head == __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->completionEntries[head & ring->completionMask];
+}
+
+void ring_consumeCqe(ring_t *ring) {
+    __atomic_store_n(ring->completionHead, *ring->completionHead + 1, __ATOMIC_RELEASE);
+}
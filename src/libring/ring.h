@@ -0,0 +1,135 @@
+#ifndef __LIBRING_RING_H_INCLUDED__
+#define __LIBRING_RING_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// The multishot read was added in Linux 6.7, after the io_uring header of
+// older distributions. A kernel that does not know it fails the request with
+// EINVAL.
+#define RING_OP_READ_MULTISHOT 49
+
+/*
+Contains a group of buffers provided to the kernel, in which it writes the data
+of the requests that select their buffer themselves, such as multishot
+receptions. A buffer is given back to the kernel with ring_recycleBuffer() once
+its data was handled.
+*/
+typedef struct {
+    uint16_t groupId;
+
+    // Contains the number of buffers, a power of 2, and their size.
+    unsigned int count;
+    size_t size;
+
+    struct io_uring_buf_ring *bufferRing;
+    size_t bufferRingSize;
+    uint8_t *buffers;
+    uint16_t tail;
+} ring_bufferGroup_t;
+
+/*
+Minimal io_uring instance, used through its system calls directly. It must only
+be used by one thread.
+*/
+typedef struct {
+    int fd;
+
+    void *submissionRing;
+    size_t submissionRingSize;
+    unsigned int *submissionHead;
+    unsigned int *submissionTail;
+    unsigned int *submissionArray;
+    unsigned int submissionMask;
+    unsigned int submissionEntries;
+    struct io_uring_sqe *submissionEntryArray;
+    size_t submissionEntryArraySize;
+
+    // Contains the tail of the submission queue, including the entries that
+    // were not submitted yet.
+    unsigned int pendingTail;
+
+    void *completionRing;
+    size_t completionRingSize;
+    unsigned int *completionHead;
+    unsigned int *completionTail;
+    unsigned int completionMask;
+    struct io_uring_cqe *completionEntries;
+} ring_t;
+
+/*
+Creates a ring with the given number of submission entries, and 4 times more
+completion entries, as multishot requests post many completions each. Returns
+-1 and sets errno if io_uring is not available.
+*/
+int ring_init(ring_t *ring, unsigned int entries);
+void ring_destroy(ring_t *ring);
+
+/*
+Registers file descriptors, which the requests then designate by their index,
+so that the kernel does not look them up for each request.
+*/
+int ring_registerFiles(ring_t *ring, const int *fds, unsigned int count);
+
+/*
+Registers buffers, which the kernel maps once instead of for each request that
+uses them.
+*/
+int ring_registerBuffers(ring_t *ring, const struct iovec *iovecs, unsigned int count);
+
+/*
+Allocates a group of count buffers of the given size, and provides them to the
+kernel. The count must be a power of 2.
+*/
+int ring_createBufferGroup(ring_t *ring, ring_bufferGroup_t *group, uint16_t groupId, unsigned int count, size_t size);
+void ring_destroyBufferGroup(ring_t *ring, ring_bufferGroup_t *group);
+
+void *ring_getBuffer(const ring_bufferGroup_t *group, uint16_t bufferId);
+
+/*
+Gives a buffer back to the kernel.
+*/
+void ring_recycleBuffer(ring_bufferGroup_t *group, uint16_t bufferId);
+
+/*
+Returns a cleared submission entry. If the submission queue is full, the
+pending entries are submitted first.
+*/
+struct io_uring_sqe *ring_getSqe(ring_t *ring);
+
+/*
+Prepares the reception of datagrams on a registered socket, in buffers of the
+given group. A multishot request posts a completion per datagram, whose buffer
+starts with a struct io_uring_recvmsg_out, followed by the address, the control
+data and the payload, as described by the msghdr, which must stay valid.
+*/
+void ring_prepareRecvMsg(struct io_uring_sqe *sqe, int fileIndex, struct msghdr *message, uint16_t groupId, bool multishot, uint64_t userData);
+
+/*
+Prepares a read from a registered file, in a buffer of the given group.
+*/
+void ring_prepareRead(struct io_uring_sqe *sqe, int fileIndex, uint16_t groupId, size_t size, bool multishot, uint64_t userData);
+
+/*
+Prepares a write to a registered file, from a registered buffer.
+*/
+void ring_prepareWriteFixed(struct io_uring_sqe *sqe, int fileIndex, const void *buffer, size_t size, uint16_t bufferIndex, uint64_t userData);
+
+/*
+Submits the pending entries, and waits until at least waitCount completions
+are available. Returns the number of entries submitted, or -1.
+*/
+int ring_submit(ring_t *ring, unsigned int waitCount);
+
+/*
+Returns the next completion, or NULL if there is none. It must be consumed
+with ring_consumeCqe() once handled.
+*/
+struct io_uring_cqe *ring_peekCqe(ring_t *ring);
+void ring_consumeCqe(ring_t *ring);
+
+#endif
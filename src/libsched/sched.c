@@ -0,0 +1,628 @@
+#include <libsched/sched.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t sched_getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int sched_init(sched_t *sched, int flowCount, unsigned int quantum, unsigned int packetCount) {
+    // The pool is not initialized, so that its pages are only touched once
+    // packets are queued in them
+    sched->flows = calloc(flowCount, sizeof(sched_flow_t));
+    sched->activeFlows = malloc(flowCount * sizeof(int));
+    sched->packets = malloc(packetCount * sizeof(sched_packet_t));
+
+    if(!sched->flows || !sched->activeFlows || !sched->packets) {
+        free(sched->flows);
+        free(sched->activeFlows);
+        free(sched->packets);
+        return -1;
+    }
+
+    sched->flowCount = flowCount;
+    sched->quantum = quantum;
+    sched->packetCount = packetCount;
+    sched->usedPacketCount = 0;
+    sched->freePacket = -1;
+    sched->activeFlowStartIndex = 0;
+    sched->activeFlowCount = 0;
+    sched->pending = false;
+    sched->wakeupTime = 0;
+
+    if(mtx_init(&sched->mutex, mtx_plain) != thrd_success) {
+        free(sched->flows);
+        free(sched->activeFlows);
+        free(sched->packets);
+        return -1;
+    }
+
+    if(cnd_init(&sched->condition) != thrd_success) {
+        mtx_destroy(&sched->mutex);
+        free(sched->flows);
+        free(sched->activeFlows);
+        free(sched->packets);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+Returns a packet to the pool, and releases its shared buffer.
+*/
+static void sched_freePacket(sched_t *sched, int index) {
+    pktbuf_release(sched->packets[index].buffer);
+    sched->packets[index].buffer = NULL;
+    sched->packets[index].next = sched->freePacket;
+    sched->freePacket = index;
+}
+
+/*
+Takes a packet from the pool. Returns -1 if the pool is empty.
+*/
+static int sched_allocatePacket(sched_t *sched) {
+    int index = sched->freePacket;
+
+    if(index >= 0) {
+        sched->freePacket = sched->packets[index].next;
+    } else if(sched->usedPacketCount < sched->packetCount) {
+        index = sched->usedPacketCount++;
+    }
+
+    return index;
+}
+
+/*
+Returns the packets queued for a flow to the pool.
+*/
+static void sched_freeQueue(sched_t *sched, sched_flow_t *schedFlow) {
+    if(!schedFlow->exists) {
+        return;
+    }
+
+    for(int band = 0; band < SCHED_BAND_COUNT; band++) {
+        int index = schedFlow->bands[band].first;
+
+        while(index >= 0) {
+            int next = sched->packets[index].next;
+
+            sched_freePacket(sched, index);
+            index = next;
+        }
+
+        schedFlow->bands[band].first = -1;
+        schedFlow->bands[band].last = -1;
+        schedFlow->bands[band].length = 0;
+    }
+
+    schedFlow->queueLength = 0;
+}
+
+void sched_destroy(sched_t *sched) {
+    for(int i = 0; i < sched->flowCount; i++) {
+        sched_freeQueue(sched, &sched->flows[i]);
+    }
+
+    cnd_destroy(&sched->condition);
+    mtx_destroy(&sched->mutex);
+    free(sched->flows);
+    free(sched->activeFlows);
+    free(sched->packets);
+}
+
+int sched_addFlow(sched_t *sched, int flow, unsigned int queueSize, unsigned int weight) {
+    if(weight == 0) {
+        return -1;
+    }
+
+    mtx_lock(&sched->mutex);
+
+    sched_flow_t *schedFlow = &sched->flows[flow];
+
+    // The flow may still be in the active list if it was removed during the
+    // current round, in which case it stays there
+    bool active = schedFlow->active;
+
+    sched_freeQueue(sched, schedFlow);
+    memset(schedFlow, 0, sizeof(sched_flow_t));
+
+    schedFlow->exists = true;
+    schedFlow->queueSize = queueSize;
+    schedFlow->weight = weight;
+    schedFlow->active = active;
+
+    for(int i = 0; i < SCHED_BAND_COUNT; i++) {
+        schedFlow->bands[i].first = -1;
+        schedFlow->bands[i].last = -1;
+    }
+
+    mtx_unlock(&sched->mutex);
+
+    return 0;
+}
+
+void sched_removeFlow(sched_t *sched, int flow) {
+    mtx_lock(&sched->mutex);
+
+    sched_flow_t *schedFlow = &sched->flows[flow];
+
+    sched_freeQueue(sched, schedFlow);
+    schedFlow->exists = false;
+
+    // The flow leaves the active list on its next turn
+    mtx_unlock(&sched->mutex);
+}
+
+void sched_setWeight(sched_t *sched, int flow, unsigned int weight) {
+    if(weight == 0) {
+        return;
+    }
+
+    mtx_lock(&sched->mutex);
+    sched->flows[flow].weight = weight;
+    mtx_unlock(&sched->mutex);
+}
+
+void sched_setRate(sched_t *sched, int flow, uint64_t rate, uint64_t burst) {
+    mtx_lock(&sched->mutex);
+
+    sched_flow_t *schedFlow = &sched->flows[flow];
+
+    schedFlow->rate = rate;
+    schedFlow->burst = burst < SCHED_MAX_PACKET_SIZE ? SCHED_MAX_PACKET_SIZE : burst;
+    schedFlow->tokens = schedFlow->burst;
+    schedFlow->lastRefillTime = sched_getTime();
+
+    // The flow may be able to send now
+    sched->pending = true;
+    cnd_signal(&sched->condition);
+
+    mtx_unlock(&sched->mutex);
+}
+
+int sched_classify(const void *packet, size_t size) {
+    const uint8_t *bytes = packet;
+    unsigned int dscp;
+    unsigned int protocol;
+    size_t headerSize;
+    size_t ipSize;
+
+    if(size < 4) {
+        return SCHED_BAND_DEFAULT;
+    }
+
+    // The TUN header contains the protocol of the packet
+    uint16_t etherType = (bytes[2] << 8) | bytes[3];
+
+    bytes += 4;
+    size -= 4;
+
+    if(etherType == 0x0800 && size >= 20) {
+        dscp = bytes[1] >> 2;
+        protocol = bytes[9];
+        headerSize = (bytes[0] & 0x0f) * 4;
+        ipSize = (bytes[2] << 8) | bytes[3];
+
+        // The fragments after the first one do not have the ports
+        if((((bytes[6] & 0x1f) << 8) | bytes[7]) != 0) {
+            headerSize = size;
+        }
+    } else if(etherType == 0x86dd && size >= 40) {
+        dscp = ((bytes[0] & 0x0f) << 2) | (bytes[1] >> 6);
+        protocol = bytes[6];
+        headerSize = 40;
+        ipSize = 40 + ((bytes[4] << 8) | bytes[5]);
+    } else {
+        return SCHED_BAND_DEFAULT;
+    }
+
+    switch(dscp) {
+        case 46: // EF
+        case 44: // VOICE-ADMIT
+        case 34: // AF41
+        case 36: // AF42
+        case 38: // AF43
+        case 40: // CS5
+        case 48: // CS6
+        case 56: // CS7
+            return SCHED_BAND_INTERACTIVE;
+        case 1: // LE
+        case 8: // CS1
+            return SCHED_BAND_BULK;
+    }
+
+    // ICMP and ICMPv6
+    if(protocol == 1 || protocol == 58) {
+        return SCHED_BAND_INTERACTIVE;
+    }
+
+    if((protocol != 6 && protocol != 17) || size < headerSize + 8) {
+        return SCHED_BAND_DEFAULT;
+    }
+
+    const uint8_t *transportHeader = bytes + headerSize;
+    uint16_t ports[2] = {
+        (transportHeader[0] << 8) | transportHeader[1],
+        (transportHeader[2] << 8) | transportHeader[3]
+    };
+
+    for(int i = 0; i < 2; i++) {
+        switch(ports[i]) {
+            case 22: // SSH
+            case 53: // DNS
+            case 123: // NTP
+            case 3478: // STUN
+            case 5060: // SIP
+                return SCHED_BAND_INTERACTIVE;
+        }
+    }
+
+    // TCP segments without payload
+    if(protocol == 6 && size >= headerSize + 20 && ipSize == headerSize + (transportHeader[12] >> 4) * 4) {
+        return SCHED_BAND_INTERACTIVE;
+    }
+
+    return SCHED_BAND_DEFAULT;
+}
+
+/*
+Removes the first packet of a band, and returns its index.
+*/
+static int sched_popPacket(sched_t *sched, sched_flow_t *schedFlow, int band) {
+    sched_band_t *schedBand = &schedFlow->bands[band];
+    int index = schedBand->first;
+
+    schedBand->first = sched->packets[index].next;
+    schedBand->length--;
+
+    if(schedBand->first < 0) {
+        schedBand->last = -1;
+    }
+
+    schedFlow->queueLength--;
+
+    return index;
+}
+
+/*
+Drops the oldest packet of the lowest band of a flow, if that band is lower
+than the given one. Returns false if the flow has no such packet.
+*/
+static bool sched_dropLowerPacket(sched_t *sched, sched_flow_t *schedFlow, int band) {
+    int lowerBand = SCHED_BAND_COUNT - 1;
+
+    while(lowerBand > band && schedFlow->bands[lowerBand].length == 0) {
+        lowerBand--;
+    }
+
+    schedFlow->droppedPackets++;
+
+    if(lowerBand == band) {
+        return false;
+    }
+
+    // The oldest packet of the lowest band has waited the longest anyway
+    sched_freePacket(sched, sched_popPacket(sched, schedFlow, lowerBand));
+
+    return true;
+}
+
+/*
+Returns the active flow with the most packets queued.
+*/
+static int sched_findLongestFlow(const sched_t *sched) {
+    int longestFlow = -1;
+
+    for(int i = 0; i < sched->activeFlowCount; i++) {
+        int flow = sched->activeFlows[(sched->activeFlowStartIndex + i) % sched->flowCount];
+
+        if(longestFlow < 0 || sched->flows[flow].queueLength > sched->flows[longestFlow].queueLength) {
+            longestFlow = flow;
+        }
+    }
+
+    return longestFlow;
+}
+
+/*
+Queues a packet, which is copied in the queue unless it has a shared buffer.
+*/
+static int sched_enqueuePacket(sched_t *sched, int flow, const void *packet, size_t size, pktbuf_t *buffer) {
+    if(size > SCHED_MAX_PACKET_SIZE) {
+        return -1;
+    }
+
+    int band = sched_classify(packet, size);
+
+    mtx_lock(&sched->mutex);
+
+    sched_flow_t *schedFlow = &sched->flows[flow];
+
+    if(!schedFlow->exists) {
+        mtx_unlock(&sched->mutex);
+        return -1;
+    }
+
+    if(schedFlow->queueLength >= schedFlow->queueSize && !sched_dropLowerPacket(sched, schedFlow, band)) {
+        mtx_unlock(&sched->mutex);
+        return -1;
+    }
+
+    int index = sched_allocatePacket(sched);
+
+    // When the pool is empty, the flow with the longest queue makes room, so
+    // that a few flows cannot take the packets of all the others
+    if(index < 0) {
+        int longestFlow = sched_findLongestFlow(sched);
+
+        if(longestFlow < 0 || longestFlow == flow || sched->flows[longestFlow].queueLength <= schedFlow->queueLength) {
+            if(!sched_dropLowerPacket(sched, schedFlow, band)) {
+                mtx_unlock(&sched->mutex);
+                return -1;
+            }
+        } else {
+            sched_dropLowerPacket(sched, &sched->flows[longestFlow], -1);
+        }
+
+        index = sched_allocatePacket(sched);
+    }
+
+    sched_packet_t *queuedPacket = &sched->packets[index];
+    sched_band_t *schedBand = &schedFlow->bands[band];
+
+    if(buffer) {
+        queuedPacket->buffer = pktbuf_acquire(buffer);
+    } else {
+        queuedPacket->buffer = NULL;
+        memcpy(queuedPacket->data, packet, size);
+    }
+
+    queuedPacket->size = size;
+    queuedPacket->next = -1;
+
+    if(schedBand->last < 0) {
+        schedBand->first = index;
+    } else {
+        sched->packets[schedBand->last].next = index;
+    }
+
+    schedBand->last = index;
+    schedBand->length++;
+    schedFlow->queueLength++;
+    schedFlow->queuedPackets++;
+
+    if(!schedFlow->active) {
+        schedFlow->active = true;
+        schedFlow->blocked = false;
+        schedFlow->deficit = 0;
+        sched->activeFlows[(sched->activeFlowStartIndex + sched->activeFlowCount) % sched->flowCount] = flow;
+        sched->activeFlowCount++;
+    }
+
+    sched->pending = true;
+    cnd_signal(&sched->condition);
+
+    mtx_unlock(&sched->mutex);
+
+    return 0;
+}
+
+int sched_enqueue(sched_t *sched, int flow, const void *packet, size_t size) {
+    return sched_enqueuePacket(sched, flow, packet, size, NULL);
+}
+
+int sched_enqueueBuffer(sched_t *sched, int flow, pktbuf_t *buffer) {
+    return sched_enqueuePacket(sched, flow, buffer->data, buffer->size, buffer);
+}
+
+/*
+Returns the band of the next packet of a flow, which is the first non-empty
+band, unless it was served too many times in a row while a lower band waited.
+*/
+static int sched_getNextBand(const sched_flow_t *schedFlow) {
+    int band = 0;
+
+    while(schedFlow->bands[band].length == 0) {
+        band++;
+    }
+
+    if(schedFlow->priorityBurst >= SCHED_PRIORITY_BURST) {
+        for(int lowerBand = band + 1; lowerBand < SCHED_BAND_COUNT; lowerBand++) {
+            if(schedFlow->bands[lowerBand].length > 0) {
+                return lowerBand;
+            }
+        }
+    }
+
+    return band;
+}
+
+/*
+Adds the tokens earned since the last refill to the bucket of a flow.
+*/
+static void sched_refill(sched_flow_t *schedFlow, uint64_t currentTime) {
+    schedFlow->tokens += (double)(currentTime - schedFlow->lastRefillTime) * schedFlow->rate / 1e9;
+    schedFlow->lastRefillTime = currentTime;
+
+    if(schedFlow->tokens > schedFlow->burst) {
+        schedFlow->tokens = schedFlow->burst;
+    }
+}
+
+/*
+Gives its turn to the flow at the head of the active list. Returns the number
+of packets the flow sent, and sets progress to true unless the flow is blocked.
+*/
+static unsigned int sched_serveFlow(sched_t *sched, sched_sendCallback_t sendCallback, void *context, bool *progress) {
+    int flow = sched->activeFlows[sched->activeFlowStartIndex];
+    sched_flow_t *schedFlow = &sched->flows[flow];
+    unsigned int sentPackets = 0;
+
+    sched->activeFlowStartIndex = (sched->activeFlowStartIndex + 1) % sched->flowCount;
+    sched->activeFlowCount--;
+
+    // A flow that could not send during its last turn did not use its quantum,
+    // so it does not get another one, or its deficit would grow without bound
+    if(!schedFlow->blocked) {
+        schedFlow->deficit += (int64_t)sched->quantum * schedFlow->weight;
+    }
+
+    schedFlow->blocked = false;
+
+    while(schedFlow->queueLength > 0) {
+        int band = sched_getNextBand(schedFlow);
+        sched_packet_t *packet = &sched->packets[schedFlow->bands[band].first];
+
+        if(packet->size > schedFlow->deficit) {
+            break;
+        }
+
+        if(schedFlow->rate > 0) {
+            sched_refill(schedFlow, sched_getTime());
+
+            if(schedFlow->tokens < packet->size) {
+                // Wake up the scheduler when the flow has enough tokens
+                uint64_t wakeupTime = schedFlow->lastRefillTime + (uint64_t)((packet->size - schedFlow->tokens) * 1e9 / schedFlow->rate) + 1;
+
+                if(sched->wakeupTime == 0 || wakeupTime < sched->wakeupTime) {
+                    sched->wakeupTime = wakeupTime;
+                }
+
+                schedFlow->blocked = true;
+                break;
+            }
+        }
+
+        if(sendCallback(context, flow, band, packet->buffer ? packet->buffer->data : packet->data, packet->size, packet->buffer) == SCHED_BLOCKED) {
+            schedFlow->blocked = true;
+            break;
+        }
+
+        if(schedFlow->rate > 0) {
+            schedFlow->tokens -= packet->size;
+        }
+
+        schedFlow->deficit -= packet->size;
+        schedFlow->sentPackets++;
+        schedFlow->sentBytes += packet->size;
+        schedFlow->bandSentPackets[band]++;
+        sentPackets++;
+
+        sched_freePacket(sched, sched_popPacket(sched, schedFlow, band));
+
+        // Count the packets sent ahead of a waiting lower band. The count
+        // restarts once a lower band was served.
+        bool lowerBandWaiting = false;
+
+        for(int lowerBand = band + 1; lowerBand < SCHED_BAND_COUNT; lowerBand++) {
+            lowerBandWaiting |= schedFlow->bands[lowerBand].length > 0;
+        }
+
+        if(lowerBandWaiting && schedFlow->priorityBurst < SCHED_PRIORITY_BURST) {
+            schedFlow->priorityBurst++;
+        } else {
+            schedFlow->priorityBurst = 0;
+        }
+    }
+
+    if(schedFlow->queueLength == 0) {
+        // An idle flow must not save its deficit for later
+        schedFlow->active = false;
+        schedFlow->deficit = 0;
+    } else {
+        sched->activeFlows[(sched->activeFlowStartIndex + sched->activeFlowCount) % sched->flowCount] = flow;
+        sched->activeFlowCount++;
+    }
+
+    if(sentPackets > 0 || (schedFlow->active && !schedFlow->blocked)) {
+        *progress = true;
+    }
+
+    return sentPackets;
+}
+
+unsigned int sched_run(sched_t *sched, sched_sendCallback_t sendCallback, void *context) {
+    unsigned int sentPackets = 0;
+    bool progress;
+
+    mtx_lock(&sched->mutex);
+
+    sched->wakeupTime = 0;
+
+    // Serve rounds until every active flow is blocked. A flow whose deficit is
+    // too small for its next packet is not blocked: it sends on a later round.
+    do {
+        progress = false;
+
+        for(int i = sched->activeFlowCount; i > 0; i--) {
+            sentPackets += sched_serveFlow(sched, sendCallback, context, &progress);
+        }
+    } while(progress && sched->activeFlowCount > 0);
+
+    mtx_unlock(&sched->mutex);
+
+    return sentPackets;
+}
+
+void sched_kick(sched_t *sched) {
+    mtx_lock(&sched->mutex);
+    sched->pending = true;
+    cnd_signal(&sched->condition);
+    mtx_unlock(&sched->mutex);
+}
+
+void sched_wait(sched_t *sched, unsigned int timeout) {
+    struct timespec deadline;
+
+    mtx_lock(&sched->mutex);
+
+    // Do not sleep past the time a rate limited flow can send again
+    if(sched->wakeupTime != 0) {
+        uint64_t currentTime = sched_getTime();
+        uint64_t delay = sched->wakeupTime > currentTime ? (sched->wakeupTime - currentTime + 999999) / 1000000 : 0;
+
+        if(delay < timeout) {
+            timeout = delay;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while(!sched->pending) {
+        if(cnd_timedwait(&sched->condition, &sched->mutex, &deadline) != thrd_success) {
+            break;
+        }
+    }
+
+    sched->pending = false;
+
+    mtx_unlock(&sched->mutex);
+}
+
+void sched_getFlow(sched_t *sched, int flow, sched_flow_t *flowCopy) {
+    mtx_lock(&sched->mutex);
+    *flowCopy = sched->flows[flow];
+    mtx_unlock(&sched->mutex);
+}
+
+size_t sched_getQueueMemory(sched_t *sched) {
+    mtx_lock(&sched->mutex);
+    size_t memory = (size_t)sched->usedPacketCount * sizeof(sched_packet_t);
+    mtx_unlock(&sched->mutex);
+
+    return memory;
+}
@@ -0,0 +1,211 @@
+#ifndef __LIBSCHED_SCHED_H_INCLUDED__
+#define __LIBSCHED_SCHED_H_INCLUDED__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+#include <libpktbuf/pktbuf.h>
+
+#define SCHED_MAX_PACKET_SIZE 1504
+#define SCHED_DEFAULT_QUANTUM 1500
+#define SCHED_DEFAULT_QUEUE_SIZE 256
+
+// Contains the default memory of the packets queued for all the flows, in
+// bytes.
+#define SCHED_DEFAULT_QUEUE_MEMORY (64 * 1024 * 1024)
+
+#define SCHED_SENT 0
+#define SCHED_BLOCKED 1
+
+// Priority bands of the packets of a flow. A band is only served when the
+// bands before it are empty.
+#define SCHED_BAND_INTERACTIVE 0
+#define SCHED_BAND_DEFAULT 1
+#define SCHED_BAND_BULK 2
+#define SCHED_BAND_COUNT 3
+
+// Contains the maximum number of packets sent from the higher bands in a row
+// while a lower band waits, so that the lower bands are never starved.
+#define SCHED_PRIORITY_BURST 32
+
+typedef struct {
+    uint16_t size;
+
+    // Contains the index of the next packet of the same band and flow, or of
+    // the next free packet. -1 means none.
+    int next;
+
+    // Contains the packet if it is shared with other flows, in which case it
+    // is not copied in data. NULL otherwise.
+    pktbuf_t *buffer;
+
+    uint8_t data[SCHED_MAX_PACKET_SIZE];
+} sched_packet_t;
+
+typedef struct {
+    // Contains the indexes of the first and last packets of the band, -1 if
+    // the band is empty.
+    int first;
+    int last;
+    unsigned int length;
+} sched_band_t;
+
+typedef struct {
+    // True if the flow exists.
+    bool exists;
+
+    // Contains the maximum and current number of packets queued for the flow,
+    // in all its bands.
+    unsigned int queueSize;
+    unsigned int queueLength;
+    sched_band_t bands[SCHED_BAND_COUNT];
+
+    // Contains the number of packets sent in a row from the higher bands while
+    // a lower band was waiting.
+    unsigned int priorityBurst;
+
+    // The flow may send weight * quantum bytes per round.
+    unsigned int weight;
+    int64_t deficit;
+
+    // Token bucket. A rate of 0 means that the flow is not rate limited.
+    uint64_t rate;
+    uint64_t burst;
+    double tokens;
+    uint64_t lastRefillTime;
+
+    // True if the flow is in the active list, which contains the flows that
+    // have queued packets.
+    bool active;
+
+    // True if the last turn of the flow ended because it could not send, in
+    // which case it does not get a new quantum on its next turn.
+    bool blocked;
+
+    uint64_t queuedPackets;
+    uint64_t sentPackets;
+    uint64_t sentBytes;
+    uint64_t droppedPackets;
+    uint64_t bandSentPackets[SCHED_BAND_COUNT];
+} sched_flow_t;
+
+// Sends a packet of a flow. The buffer is the shared buffer of the packet, or
+// NULL if the packet was copied in the queue. Returns SCHED_BLOCKED if the
+// packet cannot be sent right now, in which case it stays in the queue.
+typedef int (*sched_sendCallback_t)(void *context, int flow, int band, const void *packet, size_t size, pktbuf_t *buffer);
+
+/*
+Deficit round robin scheduler: each flow has its own queue, and the flows that
+have packets to send are served in turn, each flow sending up to its weight
+times the quantum bytes per round. Light flows therefore do not wait behind a
+bulk flow.
+*/
+typedef struct {
+    sched_flow_t *flows;
+    int flowCount;
+    unsigned int quantum;
+
+    // Contains the packets queued for all the flows. The slots after the used
+    // ones have never been touched, so that the memory of the pool follows the
+    // largest number of packets queued at once rather than its size.
+    sched_packet_t *packets;
+    unsigned int packetCount;
+    unsigned int usedPacketCount;
+    int freePacket;
+
+    // Contains the indexes of the active flows, in the order they are served.
+    int *activeFlows;
+    int activeFlowStartIndex;
+    int activeFlowCount;
+
+    mtx_t mutex;
+    cnd_t condition;
+
+    // True if packets were queued or if a flow may be able to send again
+    // since the last call to sched_wait().
+    bool pending;
+
+    // Contains the time at which a flow blocked by its rate limit can send
+    // again, in nanoseconds. 0 means that no flow is blocked by its rate limit.
+    uint64_t wakeupTime;
+} sched_t;
+
+/*
+Creates a scheduler for the given number of flows, whose queues share a pool
+of packetCount packets.
+*/
+int sched_init(sched_t *sched, int flowCount, unsigned int quantum, unsigned int packetCount);
+void sched_destroy(sched_t *sched);
+
+/*
+Creates the queue of a flow, which holds at most queueSize packets. The weight
+must be at least 1.
+*/
+int sched_addFlow(sched_t *sched, int flow, unsigned int queueSize, unsigned int weight);
+
+/*
+Drops the queued packets of a flow and frees its queue.
+*/
+void sched_removeFlow(sched_t *sched, int flow);
+
+void sched_setWeight(sched_t *sched, int flow, unsigned int weight);
+
+/*
+Sets the rate limit of a flow in bytes per second, with a bucket of burst
+bytes. A rate of 0 removes the limit.
+*/
+void sched_setRate(sched_t *sched, int flow, uint64_t rate, uint64_t burst);
+
+/*
+Returns the band of a packet read from a TUN device, from its DSCP, its
+protocol and its ports. The packets marked as expedited forwarding, ICMP,
+SSH, DNS, NTP and SIP packets, and TCP segments without payload such as the
+acknowledgements of a download, are interactive. The packets marked as lower
+effort or CS1 are bulk.
+*/
+int sched_classify(const void *packet, size_t size);
+
+/*
+Queues a packet for a flow, in the band returned by sched_classify(). When the
+queue is full, the oldest packet of a lower band is dropped to make room. When
+the pool is empty, the longest queue drops its oldest packet of its lowest
+band instead. Returns -1 if the packet is dropped, or if the flow does not
+exist.
+*/
+int sched_enqueue(sched_t *sched, int flow, const void *packet, size_t size);
+
+/*
+Queues a shared packet for a flow, like sched_enqueue(), without copying it.
+The queue takes its own reference to the buffer.
+*/
+int sched_enqueueBuffer(sched_t *sched, int flow, pktbuf_t *buffer);
+
+/*
+Sends the queued packets in deficit round robin order, until no flow can send
+anymore. Returns the number of packets sent.
+*/
+unsigned int sched_run(sched_t *sched, sched_sendCallback_t sendCallback, void *context);
+
+/*
+Indicates that a flow that was blocked may be able to send again.
+*/
+void sched_kick(sched_t *sched);
+
+/*
+Waits until packets are queued, a flow is kicked, or the given delay in
+milliseconds expires.
+*/
+void sched_wait(sched_t *sched, unsigned int timeout);
+
+/*
+Returns a copy of a flow, for statistics.
+*/
+void sched_getFlow(sched_t *sched, int flow, sched_flow_t *flowCopy);
+
+/*
+Returns the memory of the pool that was used so far, in bytes.
+*/
+size_t sched_getQueueMemory(sched_t *sched);
+
+#endif
@@ -0,0 +1,482 @@
+#include <libswtp/chacha20poly1305.h>
+
+#include <string.h>
+
+// Contains the number of blocks computed at once with vector instructions, and
+// the number of blocks from which it is worth it. Fewer blocks are computed one
+// by one.
+#define CHACHA20_LANES 8
+#define CHACHA20_MIN_VECTOR_BLOCKS 4
+#define CHACHA20_BLOCK_SIZE 64
+
+// Contains the number of messages whose blocks are computed together.
+#define CHACHA20POLY1305_BATCH_SIZE 16
+
+#define POLY1305_KEY_SIZE 32
+#define POLY1305_BLOCK_SIZE 16
+
+// GCC compiles the operations on this type to the vector instructions of the
+// target (AVX2, SSE2, NEON...), or to scalar instructions if there are none.
+typedef uint32_t chacha20_vector_t __attribute__((vector_size(CHACHA20_LANES * sizeof(uint32_t))));
+
+__extension__ typedef unsigned __int128 poly1305_uint128_t;
+
+#define CHACHA20_ROTATE(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+
+#define CHACHA20_QUARTER_ROUND(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = CHACHA20_ROTATE(d, 16); \
+        c += d; b ^= c; b = CHACHA20_ROTATE(b, 12); \
+        a += b; d ^= a; d = CHACHA20_ROTATE(d, 8); \
+        c += d; b ^= c; b = CHACHA20_ROTATE(b, 7); \
+    } while(0)
+
+#define CHACHA20_DOUBLE_ROUND(x) \
+    do { \
+        CHACHA20_QUARTER_ROUND(x[0], x[4], x[8], x[12]); \
+        CHACHA20_QUARTER_ROUND(x[1], x[5], x[9], x[13]); \
+        CHACHA20_QUARTER_ROUND(x[2], x[6], x[10], x[14]); \
+        CHACHA20_QUARTER_ROUND(x[3], x[7], x[11], x[15]); \
+        CHACHA20_QUARTER_ROUND(x[0], x[5], x[10], x[15]); \
+        CHACHA20_QUARTER_ROUND(x[1], x[6], x[11], x[12]); \
+        CHACHA20_QUARTER_ROUND(x[2], x[7], x[8], x[13]); \
+        CHACHA20_QUARTER_ROUND(x[3], x[4], x[9], x[14]); \
+    } while(0)
+
+static const uint32_t chacha20_constants[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+/*
+A block of keystream to compute, and what to do with it: either XOR it with
+the input, or copy it to the output if there is no input.
+*/
+typedef struct {
+    const uint8_t *input;
+    uint8_t *output;
+    size_t size;
+    uint32_t counter;
+    uint64_t nonce;
+} chacha20_job_t;
+
+typedef struct {
+    uint32_t key[8];
+    chacha20_job_t jobs[CHACHA20_LANES];
+    unsigned int jobCount;
+} chacha20_queue_t;
+
+static inline uint32_t chacha20_readLittleEndian32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline void chacha20_writeLittleEndian32(uint8_t *bytes, uint32_t value) {
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
+
+static inline uint64_t poly1305_readLittleEndian64(const uint8_t *bytes) {
+    return (uint64_t)chacha20_readLittleEndian32(bytes) | (uint64_t)chacha20_readLittleEndian32(bytes + 4) << 32;
+}
+
+static inline void poly1305_writeLittleEndian64(uint8_t *bytes, uint64_t value) {
+    chacha20_writeLittleEndian32(bytes, value);
+    chacha20_writeLittleEndian32(bytes + 4, value >> 32);
+}
+
+/*
+Computes a block of keystream. The nonce takes the last 2 words of the state,
+the word before them is 0.
+*/
+static void chacha20_block(const uint32_t *key, uint32_t counter, uint64_t nonce, uint8_t *keystream) {
+    uint32_t input[16];
+    uint32_t x[16];
+
+    memcpy(input, chacha20_constants, sizeof(chacha20_constants));
+    memcpy(input + 4, key, 8 * sizeof(uint32_t));
+    input[12] = counter;
+    input[13] = 0;
+    input[14] = nonce;
+    input[15] = nonce >> 32;
+    memcpy(x, input, sizeof(x));
+
+    for(int i = 0; i < 10; i++) {
+        CHACHA20_DOUBLE_ROUND(x);
+    }
+
+    for(int i = 0; i < 16; i++) {
+        chacha20_writeLittleEndian32(keystream + 4 * i, x[i] + input[i]);
+    }
+}
+
+/*
+Computes CHACHA20_LANES blocks of keystream at once, each lane of the vectors
+holding the state of a block.
+*/
+static void chacha20_blocks(const uint32_t *key, const uint32_t *counters, const uint64_t *nonces, uint8_t *keystream) {
+    chacha20_vector_t input[16];
+    chacha20_vector_t x[16];
+
+    for(int i = 0; i < CHACHA20_LANES; i++) {
+        for(int j = 0; j < 4; j++) {
+            input[j][i] = chacha20_constants[j];
+        }
+
+        for(int j = 0; j < 8; j++) {
+            input[4 + j][i] = key[j];
+        }
+
+        input[12][i] = counters[i];
+        input[13][i] = 0;
+        input[14][i] = nonces[i];
+        input[15][i] = nonces[i] >> 32;
+    }
+
+    memcpy(x, input, sizeof(x));
+
+    for(int i = 0; i < 10; i++) {
+        CHACHA20_DOUBLE_ROUND(x);
+    }
+
+    for(int i = 0; i < 16; i++) {
+        x[i] += input[i];
+    }
+
+    for(int i = 0; i < CHACHA20_LANES; i++) {
+        for(int j = 0; j < 16; j++) {
+            chacha20_writeLittleEndian32(keystream + CHACHA20_BLOCK_SIZE * i + 4 * j, x[j][i]);
+        }
+    }
+}
+
+static void chacha20_initQueue(chacha20_queue_t *queue, const uint8_t *key) {
+    for(int i = 0; i < 8; i++) {
+        queue->key[i] = chacha20_readLittleEndian32(key + 4 * i);
+    }
+
+    queue->jobCount = 0;
+}
+
+/*
+Computes the blocks of the queued jobs, and applies them.
+*/
+static void chacha20_flush(chacha20_queue_t *queue) {
+    uint8_t keystream[CHACHA20_LANES * CHACHA20_BLOCK_SIZE];
+
+    if(queue->jobCount >= CHACHA20_MIN_VECTOR_BLOCKS) {
+        uint32_t counters[CHACHA20_LANES];
+        uint64_t nonces[CHACHA20_LANES];
+
+        // The unused lanes compute the first block again
+        for(unsigned int i = 0; i < CHACHA20_LANES; i++) {
+            const chacha20_job_t *job = &queue->jobs[i < queue->jobCount ? i : 0];
+
+            counters[i] = job->counter;
+            nonces[i] = job->nonce;
+        }
+
+        chacha20_blocks(queue->key, counters, nonces, keystream);
+    } else {
+        for(unsigned int i = 0; i < queue->jobCount; i++) {
+            chacha20_block(queue->key, queue->jobs[i].counter, queue->jobs[i].nonce, keystream + CHACHA20_BLOCK_SIZE * i);
+        }
+    }
+
+    for(unsigned int i = 0; i < queue->jobCount; i++) {
+        const chacha20_job_t *job = &queue->jobs[i];
+        const uint8_t *block = keystream + CHACHA20_BLOCK_SIZE * i;
+
+        if(job->input) {
+            for(size_t j = 0; j < job->size; j++) {
+                job->output[j] = job->input[j] ^ block[j];
+            }
+        } else {
+            memcpy(job->output, block, job->size);
+        }
+    }
+
+    queue->jobCount = 0;
+}
+
+static inline void chacha20_push(chacha20_queue_t *queue, const uint8_t *input, uint8_t *output, size_t size, uint32_t counter, uint64_t nonce) {
+    chacha20_job_t *job = &queue->jobs[queue->jobCount++];
+
+    job->input = input;
+    job->output = output;
+    job->size = size;
+    job->counter = counter;
+    job->nonce = nonce;
+
+    if(queue->jobCount == CHACHA20_LANES) {
+        chacha20_flush(queue);
+    }
+}
+
+/*
+Queues the encryption or the decryption of a message, from the block 1, as
+the block 0 gives the Poly1305 key.
+*/
+static void chacha20_pushMessage(chacha20_queue_t *queue, const uint8_t *input, uint8_t *output, size_t size, uint64_t nonce) {
+    for(size_t offset = 0; offset < size; offset += CHACHA20_BLOCK_SIZE) {
+        size_t blockSize = size - offset < CHACHA20_BLOCK_SIZE ? size - offset : CHACHA20_BLOCK_SIZE;
+
+        chacha20_push(queue, input + offset, output + offset, blockSize, 1 + offset / CHACHA20_BLOCK_SIZE, nonce);
+    }
+}
+
+/*
+Computes the Poly1305 tag of a ciphertext without additional data: the
+ciphertext padded with zeroes to 16 bytes, followed by the sizes of the
+additional data and of the ciphertext (poly1305-donna, with 44-bit limbs).
+*/
+static void poly1305_computeTag(const uint8_t *key, const uint8_t *data, size_t size, uint8_t *tag) {
+    const uint64_t mask44 = 0xfffffffffff;
+    const uint64_t mask42 = 0x3ffffffffff;
+    uint64_t t0 = poly1305_readLittleEndian64(key);
+    uint64_t t1 = poly1305_readLittleEndian64(key + 8);
+    uint64_t r0 = t0 & 0xffc0fffffff;
+    uint64_t r1 = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    uint64_t r2 = (t1 >> 24) & 0x00ffffffc0f;
+    uint64_t s1 = r1 * (5 << 2);
+    uint64_t s2 = r2 * (5 << 2);
+    uint64_t h0 = 0;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    uint8_t lastBlocks[2 * POLY1305_BLOCK_SIZE] = {0};
+    size_t lastBlocksSize = POLY1305_BLOCK_SIZE;
+    size_t remainingSize = size % POLY1305_BLOCK_SIZE;
+
+    // The last bytes of the ciphertext are padded, and followed by the sizes
+    if(remainingSize > 0) {
+        memcpy(lastBlocks, data + size - remainingSize, remainingSize);
+        lastBlocksSize += POLY1305_BLOCK_SIZE;
+    }
+
+    poly1305_writeLittleEndian64(lastBlocks + lastBlocksSize - 8, size);
+
+    for(int part = 0; part < 2; part++) {
+        const uint8_t *block = part == 0 ? data : lastBlocks;
+        size_t blockCount = part == 0 ? size / POLY1305_BLOCK_SIZE : lastBlocksSize / POLY1305_BLOCK_SIZE;
+
+        for(size_t i = 0; i < blockCount; i++, block += POLY1305_BLOCK_SIZE) {
+            t0 = poly1305_readLittleEndian64(block);
+            t1 = poly1305_readLittleEndian64(block + 8);
+
+            h0 += t0 & mask44;
+            h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+            h2 += ((t1 >> 24) & mask42) | ((uint64_t)1 << 40);
+
+            poly1305_uint128_t d0 = (poly1305_uint128_t)h0 * r0 + (poly1305_uint128_t)h1 * s2 + (poly1305_uint128_t)h2 * s1;
+            poly1305_uint128_t d1 = (poly1305_uint128_t)h0 * r1 + (poly1305_uint128_t)h1 * r0 + (poly1305_uint128_t)h2 * s2;
+            poly1305_uint128_t d2 = (poly1305_uint128_t)h0 * r2 + (poly1305_uint128_t)h1 * r1 + (poly1305_uint128_t)h2 * r0;
+            uint64_t c = d0 >> 44;
+
+            h0 = (uint64_t)d0 & mask44;
+            d1 += c;
+            c = d1 >> 44;
+            h1 = (uint64_t)d1 & mask44;
+            d2 += c;
+            c = d2 >> 42;
+            h2 = (uint64_t)d2 & mask42;
+            h0 += c * 5;
+            c = h0 >> 44;
+            h0 &= mask44;
+            h1 += c;
+        }
+    }
+
+    // Full carry
+    uint64_t c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+
+    // Computes h - p, and keeps it if it is not negative, in constant time
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= mask44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= mask44;
+    uint64_t g2 = h2 + c - ((uint64_t)1 << 42);
+
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    // Adds the second half of the key
+    t0 = poly1305_readLittleEndian64(key + 16);
+    t1 = poly1305_readLittleEndian64(key + 24);
+
+    h0 += t0 & mask44;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += ((t1 >> 24) & mask42) + c;
+    h2 &= mask42;
+
+    poly1305_writeLittleEndian64(tag, h0 | (h1 << 44));
+    poly1305_writeLittleEndian64(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+void chacha20poly1305_seal(const uint8_t *key, uint64_t nonce, uint8_t *data, size_t size) {
+    chacha20poly1305_message_t message = {
+        .data = data,
+        .size = size,
+        .nonce = nonce
+    };
+
+    chacha20poly1305_sealBatch(key, &message, 1);
+}
+
+void chacha20poly1305_sealBatch(const uint8_t *key, chacha20poly1305_message_t *messages, unsigned int count) {
+    chacha20_queue_t queue;
+    uint8_t polyKeys[CHACHA20POLY1305_BATCH_SIZE][POLY1305_KEY_SIZE];
+
+    chacha20_initQueue(&queue, key);
+
+    for(unsigned int first = 0; first < count; first += CHACHA20POLY1305_BATCH_SIZE) {
+        unsigned int batchSize = count - first < CHACHA20POLY1305_BATCH_SIZE ? count - first : CHACHA20POLY1305_BATCH_SIZE;
+
+        for(unsigned int i = 0; i < batchSize; i++) {
+            chacha20poly1305_message_t *message = &messages[first + i];
+
+            chacha20_push(&queue, NULL, polyKeys[i], POLY1305_KEY_SIZE, 0, message->nonce);
+            chacha20_pushMessage(&queue, message->data, message->data, message->size, message->nonce);
+        }
+
+        if(queue.jobCount > 0) {
+            chacha20_flush(&queue);
+        }
+
+        for(unsigned int i = 0; i < batchSize; i++) {
+            chacha20poly1305_message_t *message = &messages[first + i];
+
+            poly1305_computeTag(polyKeys[i], message->data, message->size, message->data + message->size);
+        }
+    }
+}
+
+void chacha20poly1305_sealGather(const uint8_t *key, uint64_t nonce, const uint8_t *prefix, size_t prefixSize, const uint8_t *input, size_t inputSize, uint8_t *output) {
+    chacha20_queue_t queue;
+    uint8_t polyKey[POLY1305_KEY_SIZE];
+    uint8_t firstBlock[CHACHA20_BLOCK_SIZE];
+    size_t size = prefixSize + inputSize;
+    size_t firstBlockSize = size < CHACHA20_BLOCK_SIZE ? size : CHACHA20_BLOCK_SIZE;
+
+    // Only the first block mixes the prefix and the input, the next ones are
+    // read from the input where it is
+    memcpy(firstBlock, prefix, prefixSize);
+    memcpy(firstBlock + prefixSize, input, firstBlockSize - prefixSize);
+
+    chacha20_initQueue(&queue, key);
+    chacha20_push(&queue, NULL, polyKey, POLY1305_KEY_SIZE, 0, nonce);
+    chacha20_push(&queue, firstBlock, output, firstBlockSize, 1, nonce);
+
+    for(size_t offset = CHACHA20_BLOCK_SIZE; offset < size; offset += CHACHA20_BLOCK_SIZE) {
+        size_t blockSize = size - offset < CHACHA20_BLOCK_SIZE ? size - offset : CHACHA20_BLOCK_SIZE;
+
+        chacha20_push(&queue, input + offset - prefixSize, output + offset, blockSize, 1 + offset / CHACHA20_BLOCK_SIZE, nonce);
+    }
+
+    if(queue.jobCount > 0) {
+        chacha20_flush(&queue);
+    }
+
+    poly1305_computeTag(polyKey, output, size, output + size);
+}
+
+void chacha20poly1305_sign(const uint8_t *key, uint64_t nonce, uint8_t *data, size_t size) {
+    chacha20_queue_t queue;
+    uint8_t polyKey[POLY1305_KEY_SIZE];
+
+    chacha20_initQueue(&queue, key);
+    chacha20_push(&queue, NULL, polyKey, POLY1305_KEY_SIZE, 0, nonce);
+    chacha20_flush(&queue);
+
+    poly1305_computeTag(polyKey, data, size, data + size);
+}
+
+int chacha20poly1305_verify(const uint8_t *key, uint64_t nonce, const uint8_t *input, size_t size) {
+    chacha20_queue_t queue;
+    uint8_t polyKey[POLY1305_KEY_SIZE];
+    uint8_t tag[CHACHA20POLY1305_TAG_SIZE];
+    uint8_t difference = 0;
+
+    chacha20_initQueue(&queue, key);
+    chacha20_push(&queue, NULL, polyKey, POLY1305_KEY_SIZE, 0, nonce);
+    chacha20_flush(&queue);
+
+    poly1305_computeTag(polyKey, input, size, tag);
+
+    // The comparison takes the same time wherever the tags differ
+    for(int i = 0; i < CHACHA20POLY1305_TAG_SIZE; i++) {
+        difference |= tag[i] ^ input[size + i];
+    }
+
+    return difference ? -1 : 0;
+}
+
+void chacha20poly1305_decrypt(const uint8_t *key, uint64_t nonce, const uint8_t *input, uint8_t *output, size_t size) {
+    chacha20_queue_t queue;
+
+    chacha20_initQueue(&queue, key);
+    chacha20_pushMessage(&queue, input, output, size, nonce);
+
+    if(queue.jobCount > 0) {
+        chacha20_flush(&queue);
+    }
+}
+
+int chacha20poly1305_open(const uint8_t *key, uint64_t nonce, const uint8_t *input, uint8_t *output, size_t size) {
+    if(chacha20poly1305_verify(key, nonce, input, size) < 0) {
+        return -1;
+    }
+
+    chacha20poly1305_decrypt(key, nonce, input, output, size);
+
+    return 0;
+}
+
+void hchacha20(const uint8_t *key, const uint8_t *input, uint8_t *output) {
+    uint32_t x[16];
+
+    memcpy(x, chacha20_constants, sizeof(chacha20_constants));
+
+    for(int i = 0; i < 8; i++) {
+        x[4 + i] = chacha20_readLittleEndian32(key + 4 * i);
+    }
+
+    for(int i = 0; i < 4; i++) {
+        x[12 + i] = chacha20_readLittleEndian32(input + 4 * i);
+    }
+
+    for(int i = 0; i < 10; i++) {
+        CHACHA20_DOUBLE_ROUND(x);
+    }
+
+    for(int i = 0; i < 4; i++) {
+        chacha20_writeLittleEndian32(output + 4 * i, x[i]);
+        chacha20_writeLittleEndian32(output + 16 + 4 * i, x[12 + i]);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __LIBSWTP_CHACHA20POLY1305_H_INCLUDED__
+#define __LIBSWTP_CHACHA20POLY1305_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20POLY1305_KEY_SIZE 32
+#define CHACHA20POLY1305_TAG_SIZE 16
+#define HCHACHA20_INPUT_SIZE 16
+
+/*
+A message sealed by chacha20poly1305_sealBatch(). The data is encrypted in
+place, and the tag is written after it.
+*/
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uint64_t nonce;
+} chacha20poly1305_message_t;
+
+/*
+Encrypts data in place with ChaCha20-Poly1305 (RFC 8439), without additional
+data, and writes the 16-byte tag after it. The 96-bit nonce is made of 32 zero
+bits followed by the given 64-bit counter in little endian, which must never be
+used twice with the same key. The keystream is computed 8 blocks at a time with
+the vector instructions of the target, and block by block for short messages.
+*/
+void chacha20poly1305_seal(const uint8_t *key, uint64_t nonce, uint8_t *data, size_t size);
+
+/*
+Seals several messages at once. The blocks of the messages are computed
+together, which keeps the vector instructions busy with short messages.
+*/
+void chacha20poly1305_sealBatch(const uint8_t *key, chacha20poly1305_message_t *messages, unsigned int count);
+
+/*
+Seals a short prefix, of at most 64 bytes, followed by a message, to the output,
+like chacha20poly1305_seal(). The message is read where it is, so that a packet
+shared by several sessions is not copied before it is encrypted for each one.
+*/
+void chacha20poly1305_sealGather(const uint8_t *key, uint64_t nonce, const uint8_t *prefix, size_t prefixSize, const uint8_t *input, size_t inputSize, uint8_t *output);
+
+/*
+Writes the tag of a message after it, like chacha20poly1305_seal(), but leaves
+the message in the clear. The tag is checked by chacha20poly1305_verify(). The
+nonces of the signed and of the sealed messages must differ.
+*/
+void chacha20poly1305_sign(const uint8_t *key, uint64_t nonce, uint8_t *data, size_t size);
+
+/*
+Checks the tag that follows a sealed message of the given size, without the
+tag, and decrypts it to the output, which may be the input. Returns -1, and
+leaves the output untouched, if the tag is wrong.
+*/
+int chacha20poly1305_open(const uint8_t *key, uint64_t nonce, const uint8_t *input, uint8_t *output, size_t size);
+
+/*
+Checks the tag that follows a sealed or signed message, without decrypting it.
+Returns -1 if the tag is wrong.
+*/
+int chacha20poly1305_verify(const uint8_t *key, uint64_t nonce, const uint8_t *input, size_t size);
+
+/*
+Decrypts a sealed message whose tag was already checked by
+chacha20poly1305_verify().
+*/
+void chacha20poly1305_decrypt(const uint8_t *key, uint64_t nonce, const uint8_t *input, uint8_t *output, size_t size);
+
+/*
+Derives a 32-byte key from a 32-byte key and a 16-byte input (HChaCha20, as
+used by XChaCha20).
+*/
+void hchacha20(const uint8_t *key, const uint8_t *input, uint8_t *output);
+
+#endif
@@ -0,0 +1,64 @@
+#include <libswtp/siphash.h>
+
+#include <string.h>
+
+#define SIPHASH_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIPHASH_ROTATE(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTATE(v0, 32); \
+        v2 += v3; v3 = SIPHASH_ROTATE(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIPHASH_ROTATE(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIPHASH_ROTATE(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTATE(v2, 32); \
+    } while(0)
+
+static inline uint64_t siphash_readLittleEndian(const uint8_t *bytes) {
+    uint64_t value = 0;
+
+    for(int i = 7; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+
+    return value;
+}
+
+uint64_t siphash24(const uint8_t *key, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    size_t totalSize = size;
+    uint64_t k0 = siphash_readLittleEndian(key);
+    uint64_t k1 = siphash_readLittleEndian(key + 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    // Compression of the complete 8-byte words
+    for(; size >= 8; size -= 8, bytes += 8) {
+        uint64_t m = siphash_readLittleEndian(bytes);
+
+        v3 ^= m;
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // The last word contains the remaining bytes and the total size
+    uint8_t lastBytes[8] = {0};
+    memcpy(lastBytes, bytes, size);
+
+    uint64_t m = siphash_readLittleEndian(lastBytes) | ((uint64_t)totalSize << 56);
+
+    v3 ^= m;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    // Finalization
+    v2 ^= 0xff;
+
+    for(int i = 0; i < 4; i++) {
+        SIPHASH_ROUND(v0, v1, v2, v3);
+    }
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
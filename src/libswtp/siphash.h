@@ -0,0 +1,16 @@
+#ifndef __LIBSWTP_SIPHASH_H_INCLUDED__
+#define __LIBSWTP_SIPHASH_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_SIZE 16
+
+/*
+Computes the SipHash-2-4 of the given data with a 128-bit key. SipHash is a
+keyed hash function designed for short inputs: its output cannot be predicted
+without the key.
+*/
+uint64_t siphash24(const uint8_t *key, const void *data, size_t size);
+
+#endif
@@ -1,219 +1,2749 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <stdio.h>
+#include <sys/random.h>
+#include <sys/uio.h>
 
 #include <libswtp/swtp.h>
 
+swtp_time_t swtp_getTime(const swtp_t *swtp) {
+    if(swtp->clockCallback) {
+        return swtp->clockCallback(swtp);
+    }
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (swtp_time_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+size_t swtp_getHeaderSize(const swtp_t *swtp) {
+    return swtp->extended ? SWTP_EXTENDED_HEADER_SIZE : SWTP_HEADER_SIZE;
+}
+
+static inline uint32_t swtp_getSequenceNumberMask(const swtp_t *swtp) {
+    return swtp->extended ? SWTP_MAX_EXTENDED_SEQUENCE_NUMBER : SWTP_MAX_SEQUENCE_NUMBER;
+}
+
+static inline uint32_t swtp_getMaxWindowSize(const swtp_t *swtp) {
+    return swtp->extended ? SWTP_MAX_EXTENDED_WINDOW_SIZE : SWTP_MAX_WINDOW_SIZE;
+}
+
+/*
+Returns the number of frames from one sequence number to another, with serial
+number arithmetic. A sequence number that is before the first one gives a
+distance larger than any window.
+*/
+static inline uint32_t swtp_getSequenceDistance(const swtp_t *swtp, uint32_t from, uint32_t to) {
+    return (to - from) & swtp_getSequenceNumberMask(swtp);
+}
+
+/*
+Returns the payload of a frame, which follows the header.
+*/
+static inline uint8_t *swtp_getPayload(const swtp_t *swtp, const swtp_frame_t *frame) {
+    return (uint8_t *)&frame->frame + swtp_getHeaderSize(swtp);
+}
+
+uint32_t swtp_getSendSequenceNumber(const swtp_t *swtp, const swtp_frame_t *frame) {
+    if(swtp->extended) {
+        return ntohl(*(const uint32_t *)frame->frame.header) & SWTP_MAX_EXTENDED_SEQUENCE_NUMBER;
+    }
+
+    return ntohs(*(const uint16_t *)frame->frame.header) & SWTP_MAX_SEQUENCE_NUMBER;
+}
+
+uint32_t swtp_getReceiveSequenceNumber(const swtp_t *swtp, const swtp_frame_t *frame) {
+    if(swtp->extended) {
+        return ntohl(*(const uint32_t *)((const uint8_t *)&frame->frame + SWTP_HEADER_SIZE)) & SWTP_MAX_EXTENDED_SEQUENCE_NUMBER;
+    }
+
+    return ntohs(*(const uint16_t *)(frame->frame.header + 2)) & SWTP_MAX_SEQUENCE_NUMBER;
+}
+
+static inline void swtp_setReceiveSequenceNumber(const swtp_t *swtp, swtp_frame_t *frame, uint32_t receiveSequenceNumber) {
+    if(swtp->extended) {
+        uint32_t field = htonl(receiveSequenceNumber);
+
+        memcpy((uint8_t *)&frame->frame + SWTP_HEADER_SIZE, &field, 4);
+    } else {
+        uint16_t field = htons(receiveSequenceNumber);
+
+        memcpy(frame->frame.header + 2, &field, 2);
+    }
+}
+
+static inline void swtp_setSequenceNumbers(const swtp_t *swtp, swtp_frame_t *frame, uint32_t sendSequenceNumber, uint32_t receiveSequenceNumber) {
+    if(swtp->extended) {
+        uint32_t field = htonl(sendSequenceNumber);
+
+        memcpy(frame->frame.header, &field, 4);
+    } else {
+        uint16_t field = htons(sendSequenceNumber);
+
+        memcpy(frame->frame.header, &field, 2);
+    }
+
+    swtp_setReceiveSequenceNumber(swtp, frame, receiveSequenceNumber);
+}
+
+/*
+Builds the header of a control frame that carries a sequence number, and
+returns its size. The command contains the bits of the first word of the
+header, without the sequence number.
+*/
+static inline size_t swtp_buildControlHeader(const swtp_t *swtp, uint8_t *header, uint32_t command, uint32_t sequenceNumber) {
+    if(swtp->extended) {
+        uint32_t fields[2] = {htonl(command), htonl(sequenceNumber)};
+
+        memcpy(header, fields, SWTP_EXTENDED_HEADER_SIZE);
+
+        return SWTP_EXTENDED_HEADER_SIZE;
+    }
+
+    uint32_t field = htonl(command | sequenceNumber);
+
+    memcpy(header, &field, SWTP_HEADER_SIZE);
+
+    return SWTP_HEADER_SIZE;
+}
+
+static inline ssize_t swtp_sendOnPath(swtp_t *swtp, unsigned int path, const void *buffer, size_t size) {
+    if(swtp->frameCallback) {
+        swtp->frameCallback(swtp, SWTP_DIRECTION_SENT, buffer, size);
+    }
+
+    if(swtp->sendCallback) {
+        return swtp->sendCallback(swtp, buffer, size);
+    }
+
+    if(path == 0) {
+        return sendto(swtp->socket, buffer, size, 0, (struct sockaddr *)&swtp->socketAddress, sizeof(struct sockaddr_in));
+    }
+
+    return sendto(swtp->paths[path].socket, buffer, size, 0, (struct sockaddr *)&swtp->paths[path].socketAddress, sizeof(struct sockaddr_in));
+}
+
+/*
+Returns the weight of a path, which is inversely proportional to its RTT, and
+halved for every 10% of loss.
+*/
+static inline int64_t swtp_getPathWeight(const swtp_path_t *path) {
+    swtp_time_t rtt = path->smoothedRtt > 0 ? path->smoothedRtt : SWTP_DEFAULT_PATH_RTT;
+    unsigned int lossPercentage = path->sentFrameCount > 0 ? path->lostFrameCount * 100 / path->sentFrameCount : 0;
+    int64_t weight = 10000000 / ((rtt + 1) * (10 + lossPercentage));
+
+    // A bad path still gets a few frames, so that its RTT and loss rate are
+    // still measured
+    return weight > 0 ? weight : 1;
+}
+
+/*
+Returns the path with the highest weight, on which the control frames and the
+retransmissions are sent.
+*/
+static unsigned int swtp_getBestPath(const swtp_t *swtp) {
+    unsigned int bestPath = 0;
+    int64_t bestWeight = 0;
+
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        int64_t weight = swtp_getPathWeight(&swtp->paths[i]);
+
+        if(weight > bestWeight) {
+            bestPath = i;
+            bestWeight = weight;
+        }
+    }
+
+    return bestPath;
+}
+
+/*
+Returns the path of the next data frame, with smooth weighted round robin, so
+that the frames of each path are evenly spread.
+*/
+static unsigned int swtp_selectPath(swtp_t *swtp) {
+    if(swtp->pathCount <= 1) {
+        return 0;
+    }
+
+    unsigned int selectedPath = 0;
+    int64_t totalWeight = 0;
+
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        int64_t weight = swtp_getPathWeight(&swtp->paths[i]);
+
+        swtp->paths[i].currentWeight += weight;
+        totalWeight += weight;
+
+        if(swtp->paths[i].currentWeight > swtp->paths[selectedPath].currentWeight) {
+            selectedPath = i;
+        }
+    }
+
+    swtp->paths[selectedPath].currentWeight -= totalWeight;
+
+    return selectedPath;
+}
+
+static inline ssize_t swtp_send(swtp_t *swtp, const void *buffer, size_t size) {
+    return swtp_sendOnPath(swtp, swtp->pathCount > 1 ? swtp_getBestPath(swtp) : 0, buffer, size);
+}
+
+/*
+Returns the size of the part of a data frame that is stored in the frame when
+its packet is in a shared buffer: the header and the SWTLLP header.
+*/
+static inline size_t swtp_getSharedHeaderSize(const swtp_t *swtp) {
+    return swtp_getHeaderSize(swtp) + SWTLLP_HEADER_SIZE;
+}
+
+/*
+Copies a frame of the send window whose packet is in a shared buffer to a frame
+that holds all of it.
+*/
+static void swtp_linearizeFrame(const swtp_t *swtp, const swtp_frame_t *frame, swtp_frame_t *outputFrame) {
+    size_t headerSize = swtp_getSharedHeaderSize(swtp);
+
+    *outputFrame = *frame;
+    outputFrame->buffer = NULL;
+    memcpy((uint8_t *)&outputFrame->frame + headerSize, frame->buffer->data + TUN_HEADER_SIZE, frame->size - headerSize);
+}
+
+/*
+Sends a frame of the send window. The headers of a frame whose packet is in a
+shared buffer are sent with the packet in a single datagram, without copying
+it, unless a callback needs the frame in one piece.
+*/
+static ssize_t swtp_sendFrameOnPath(swtp_t *swtp, unsigned int path, const swtp_frame_t *frame) {
+    if(!frame->buffer) {
+        return swtp_sendOnPath(swtp, path, &frame->frame, frame->size);
+    }
+
+    if(swtp->frameCallback || swtp->sendCallback) {
+        swtp_frame_t linearFrame;
+
+        swtp_linearizeFrame(swtp, frame, &linearFrame);
+
+        return swtp_sendOnPath(swtp, path, &linearFrame.frame, linearFrame.size);
+    }
+
+    size_t headerSize = swtp_getSharedHeaderSize(swtp);
+    struct iovec vector[2] = {
+        {.iov_base = (void *)&frame->frame, .iov_len = headerSize},
+        {.iov_base = frame->buffer->data + TUN_HEADER_SIZE, .iov_len = frame->size - headerSize}
+    };
+    struct msghdr message = {
+        .msg_name = path == 0 ? &swtp->socketAddress : &swtp->paths[path].socketAddress,
+        .msg_namelen = sizeof(struct sockaddr_in),
+        .msg_iov = vector,
+        .msg_iovlen = 2
+    };
+
+    return sendmsg(path == 0 ? swtp->socket : swtp->paths[path].socket, &message, 0);
+}
+
+/*
+Prepares the retransmission of a frame, and returns the path to send it on. If
+lost is true, the frame counts as lost on the path it was last sent on.
+*/
+static inline unsigned int swtp_prepareRetransmission(swtp_t *swtp, swtp_frame_t *frame, bool lost) {
+    if(swtp->pathCount <= 1) {
+        frame->retransmitted = true;
+        return 0;
+    }
+
+    if(lost && !frame->retransmitted && frame->path < swtp->pathCount) {
+        swtp->paths[frame->path].lostFrameCount++;
+    }
+
+    frame->retransmitted = true;
+    frame->path = swtp_getBestPath(swtp);
+
+    return frame->path;
+}
+
+/*
+Returns the time after which a frame that was retransmitted and is still not
+acknowledged may be retransmitted again, in milliseconds: the RTT of its path
+plus four times its variation, like the retransmission timeout of TCP.
+*/
+static inline swtp_time_t swtp_getRetransmitDelay(const swtp_t *swtp, const swtp_frame_t *frame) {
+    const swtp_path_t *path = &swtp->paths[frame->path < swtp->pathCount ? frame->path : 0];
+
+    if(path->smoothedRtt == 0) {
+        return SWTP_DEFAULT_PATH_RTT;
+    }
+
+    swtp_time_t retransmitDelay = path->smoothedRtt + 4 * path->rttVariation;
+
+    return retransmitDelay > SWTP_MIN_RETRANSMIT_DELAY ? retransmitDelay : SWTP_MIN_RETRANSMIT_DELAY;
+}
+
+/*
+Returns the time after which a frame that the peer reported missing is
+considered lost, in milliseconds. A frame that was only sent once may still be
+on its way behind the frames that the network reordered, so it is lost once it
+had the time to arrive plus a quarter of the RTT, like the reordering window of
+RACK in TCP. A frame that was already retransmitted is retransmitted again after
+its retransmission delay.
+*/
+static inline swtp_time_t swtp_getLossDelay(const swtp_t *swtp, const swtp_frame_t *frame) {
+    if(frame->retransmitted) {
+        return swtp_getRetransmitDelay(swtp, frame);
+    }
+
+    const swtp_path_t *path = &swtp->paths[frame->path < swtp->pathCount ? frame->path : 0];
+
+    return path->smoothedRtt + path->smoothedRtt / 4;
+}
+
+/*
+Returns the time between two TEST frames, in milliseconds. With an adaptive
+schedule, a peer that stopped answering is probed at the pace of the
+retransmissions of the primary path, so that a dead path is detected within a
+few RTTs, but never faster than the minimum, which absorbs the scheduling
+delays of the timer.
+*/
+static inline swtp_time_t swtp_getKeepaliveInterval(const swtp_t *swtp) {
+    const swtp_path_t *path = &swtp->paths[0];
+
+    if(!swtp->keepaliveAdaptive || path->smoothedRtt == 0) {
+        return swtp->keepaliveInterval;
+    }
+
+    swtp_time_t interval = path->smoothedRtt + 4 * path->rttVariation;
+
+    if(interval < SWTP_MIN_KEEPALIVE_INTERVAL) {
+        interval = SWTP_MIN_KEEPALIVE_INTERVAL;
+    }
+
+    return interval < swtp->keepaliveInterval ? interval : swtp->keepaliveInterval;
+}
+
+static int swtp_allocateReceiveRing(swtp_t *swtp) {
+    if(swtp->receiveRing == NULL) {
+        swtp->receiveRing = calloc(SWTP_RECEIVE_RING_SIZE, sizeof(swtp_receivedFrame_t));
+
+        if(swtp->receiveRing == NULL) {
+            return SWTP_ERROR;
+        }
+    }
+
+    return SWTP_SUCCESS;
+}
+
 void swtp_init(swtp_t *swtp, int socket, const struct sockaddr *socketAddress) {
     memset(swtp, 0, sizeof(swtp_t));
 
-    swtp->socket = socket;
-    memcpy(&swtp->socketAddress, socketAddress, sizeof(struct sockaddr));
-    swtp->lastReceivedFrameTime = time(NULL);
+    swtp->socket = socket;
+    memcpy(&swtp->socketAddress, socketAddress, sizeof(struct sockaddr));
+    swtp->lastReceivedFrameTime = swtp_getTime(swtp);
+    swtp->pathCount = 1;
+
+    swtp->keepaliveIdleTime = SWTP_DEFAULT_KEEPALIVE_IDLE_TIME;
+    swtp->keepaliveInterval = SWTP_DEFAULT_KEEPALIVE_INTERVAL;
+    swtp->keepaliveProbes = SWTP_DEFAULT_KEEPALIVE_PROBES;
+}
+
+void swtp_setKeepalive(swtp_t *swtp, swtp_time_t idleTime, swtp_time_t interval, unsigned int probes, bool adaptive) {
+    swtp->keepaliveIdleTime = idleTime;
+    swtp->keepaliveInterval = interval > SWTP_MIN_KEEPALIVE_INTERVAL ? interval : SWTP_MIN_KEEPALIVE_INTERVAL;
+    swtp->keepaliveProbes = probes;
+    swtp->keepaliveAdaptive = adaptive;
+}
+
+int swtp_initSendWindow(swtp_t *swtp, uint32_t sendWindowSize) {
+    // The slots start without a shared buffer
+    swtp->sendWindow = calloc(sendWindowSize, sizeof(swtp_frame_t));
+
+    if(swtp->sendWindow == NULL) {
+        return SWTP_ERROR;
+    }
+
+    swtp->sendWindowSize = sendWindowSize;
+    swtp->sendWindowLimit = sendWindowSize;
+    swtp->lastReceivedFrameTime = swtp_getTime(swtp);
+
+    if(mtx_init(&swtp->sendWindowMutex, mtx_plain)) {
+        free(swtp->sendWindow);
+        return SWTP_ERROR;
+    }
+
+    swtp->connected = true;
+
+    return SWTP_SUCCESS;
+}
+
+void swtp_destroy(swtp_t *swtp) {
+    if(swtp->sendWindow) {
+        for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+            pktbuf_release(swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize].buffer);
+        }
+
+        mtx_destroy(&swtp->sendWindowMutex);
+        free(swtp->sendWindow);
+    }
+
+    free(swtp->fecEncoder);
+    free(swtp->receiveRing);
+}
+
+static int swtp_writeAll(int fd, const void *buffer, size_t size) {
+    const uint8_t *data = buffer;
+
+    while(size > 0) {
+        ssize_t writtenSize = write(fd, data, size);
+
+        if(writtenSize < 0 && errno == EINTR) {
+            continue;
+        } else if(writtenSize <= 0) {
+            return SWTP_ERROR;
+        }
+
+        data += writtenSize;
+        size -= writtenSize;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+static int swtp_readAll(int fd, void *buffer, size_t size) {
+    uint8_t *data = buffer;
+
+    while(size > 0) {
+        ssize_t readSize = read(fd, data, size);
+
+        if(readSize < 0 && errno == EINTR) {
+            continue;
+        } else if(readSize <= 0) {
+            return SWTP_ERROR;
+        }
+
+        data += readSize;
+        size -= readSize;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_save(const swtp_t *swtp, int fd) {
+    uint32_t header[2] = {SWTP_STATE_VERSION, sizeof(swtp_t)};
+
+    if(swtp_writeAll(fd, header, sizeof(header)) != SWTP_SUCCESS || swtp_writeAll(fd, swtp, sizeof(swtp_t)) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    // Only the frames in flight are written, from the oldest one, with their
+    // packets, as the shared buffers stay in this process
+    for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+        const swtp_frame_t *frame = &swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize];
+        swtp_frame_t linearFrame;
+
+        if(frame->buffer) {
+            swtp_linearizeFrame(swtp, frame, &linearFrame);
+            frame = &linearFrame;
+        }
+
+        if(swtp_writeAll(fd, frame, sizeof(swtp_frame_t)) != SWTP_SUCCESS) {
+            return SWTP_ERROR;
+        }
+    }
+
+    if(swtp->fecEncoder && swtp_writeAll(fd, swtp->fecEncoder, sizeof(swtp_fecEncoder_t)) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    if(swtp->receiveRing && swtp_writeAll(fd, swtp->receiveRing, sizeof(swtp_receivedFrame_t) * SWTP_RECEIVE_RING_SIZE) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Returns true if the sizes and the indexes of a session read by swtp_restore()
+are within the bounds that the other functions rely on, as the state may come
+from another node.
+*/
+static bool swtp_isRestoredStateValid(const swtp_t *swtp) {
+    uint32_t mask = swtp_getSequenceNumberMask(swtp);
+
+    if(swtp->sendWindowSize == 0 || swtp->sendWindowSize > swtp_getMaxWindowSize(swtp) || swtp->sendWindowLength > swtp->sendWindowSize || swtp->sendWindowLimit > swtp->sendWindowSize) {
+        return false;
+    }
+
+    if(swtp->sendWindowStartSequenceNumber > mask || swtp->expectedFrameNumber > mask || swtp->peerFecBlockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        return false;
+    }
+
+    if(swtp->maxFrameSize > SWTP_MAX_FRAME_SIZE || swtp->pathCount == 0 || swtp->pathCount > SWTP_MAX_PATHS) {
+        return false;
+    }
+
+    // The frame sizes stay 0 without path MTU discovery
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        const swtp_path_t *path = &swtp->paths[i];
+
+        if(path->maxFrameSize > SWTP_MAX_FRAME_SIZE || path->probeLimit > SWTP_MAX_FRAME_SIZE || path->probeSize > SWTP_MAX_FRAME_SIZE || (path->probeSize != 0 && path->probeSize <= SWTP_HEADER_SIZE)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+Returns true if a frame read by swtp_restore() fits in its buffer, and clears
+its shared buffer, which only existed in the other process.
+*/
+static bool swtp_isRestoredFrameValid(const swtp_t *swtp, swtp_frame_t *frame) {
+    frame->buffer = NULL;
+
+    return frame->size >= swtp_getHeaderSize(swtp) && frame->size <= SWTP_MAX_FRAME_SIZE && frame->path < swtp->pathCount;
+}
+
+int swtp_restore(swtp_t *swtp, int fd) {
+    uint32_t header[2];
+
+    if(swtp_readAll(fd, header, sizeof(header)) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    if(header[0] != SWTP_STATE_VERSION || header[1] != sizeof(swtp_t)) {
+        printf("Incompatible session state (version %u, size %u).\n", header[0], header[1]);
+        return SWTP_ERROR;
+    }
+
+    if(swtp_readAll(fd, swtp, sizeof(swtp_t)) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    if(!swtp_isRestoredStateValid(swtp)) {
+        printf("Inconsistent session state.\n");
+        return SWTP_ERROR;
+    }
+
+    // The pointers are those of the other process
+    bool hasFecEncoder = swtp->fecEncoder != NULL;
+    bool hasReceiveRing = swtp->receiveRing != NULL;
+    bool connected = swtp->connected;
+    swtp_time_t lastReceivedFrameTime = swtp->lastReceivedFrameTime;
+    uint32_t sendWindowLength = swtp->sendWindowLength;
+    uint32_t sendWindowLimit = swtp->sendWindowLimit;
+
+    swtp->recvCallback = NULL;
+    swtp->disconnectCallback = NULL;
+    swtp->clockCallback = NULL;
+    swtp->sendCallback = NULL;
+    swtp->frameCallback = NULL;
+    swtp->mtuCallback = NULL;
+    swtp->windowCallback = NULL;
+    swtp->userData = NULL;
+    swtp->sendWindow = NULL;
+    swtp->fecEncoder = NULL;
+    swtp->receiveRing = NULL;
+
+    if(swtp_initSendWindow(swtp, swtp->sendWindowSize) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    swtp->sendWindowStartIndex = 0;
+    swtp->sendWindowLimit = sendWindowLimit;
+
+    // The frames that are not read yet must not reference a buffer when the
+    // session is destroyed
+    memset(swtp->sendWindow, 0, sizeof(swtp_frame_t) * sendWindowLength);
+
+    if(swtp_readAll(fd, swtp->sendWindow, sizeof(swtp_frame_t) * sendWindowLength) != SWTP_SUCCESS) {
+        swtp_destroy(swtp);
+        return SWTP_ERROR;
+    }
+
+    for(uint32_t i = 0; i < sendWindowLength; i++) {
+        if(!swtp_isRestoredFrameValid(swtp, &swtp->sendWindow[i])) {
+            printf("Inconsistent session state.\n");
+            swtp_destroy(swtp);
+            return SWTP_ERROR;
+        }
+    }
+
+    if(hasFecEncoder) {
+        swtp->fecEncoder = malloc(sizeof(swtp_fecEncoder_t));
+
+        if(swtp->fecEncoder == NULL || swtp_readAll(fd, swtp->fecEncoder, sizeof(swtp_fecEncoder_t)) != SWTP_SUCCESS) {
+            swtp_destroy(swtp);
+            return SWTP_ERROR;
+        }
+
+        const swtp_fecEncoder_t *encoder = swtp->fecEncoder;
+
+        if(encoder->blockSize < SWTP_FEC_MIN_BLOCK_SIZE || encoder->blockSize > SWTP_FEC_MAX_BLOCK_SIZE || encoder->blockLength >= encoder->blockSize || encoder->parityLength > SWTP_MAX_PAYLOAD_SIZE || encoder->blockStartSequenceNumber > swtp_getSequenceNumberMask(swtp)) {
+            printf("Inconsistent session state.\n");
+            swtp_destroy(swtp);
+            return SWTP_ERROR;
+        }
+    }
+
+    if(hasReceiveRing) {
+        if(swtp_allocateReceiveRing(swtp) != SWTP_SUCCESS || swtp_readAll(fd, swtp->receiveRing, sizeof(swtp_receivedFrame_t) * SWTP_RECEIVE_RING_SIZE) != SWTP_SUCCESS) {
+            swtp_destroy(swtp);
+            return SWTP_ERROR;
+        }
+
+        for(unsigned int i = 0; i < SWTP_RECEIVE_RING_SIZE; i++) {
+            swtp_receivedFrame_t *receivedFrame = &swtp->receiveRing[i];
+
+            if(receivedFrame->valid && (receivedFrame->sequenceNumber % SWTP_RECEIVE_RING_SIZE != i || !swtp_isRestoredFrameValid(swtp, &receivedFrame->frame))) {
+                printf("Inconsistent session state.\n");
+                swtp_destroy(swtp);
+                return SWTP_ERROR;
+            }
+        }
+    }
+
+    swtp->connected = connected;
+    swtp->lastReceivedFrameTime = lastReceivedFrameTime;
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_enableSack(swtp_t *swtp) {
+    // The frames received out of order are kept until the missing ones arrive
+    if(swtp_allocateReceiveRing(swtp) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    swtp->sack = true;
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_generateKeyPair(uint8_t *secretKey, uint8_t *publicKey) {
+    if(getrandom(secretKey, SWTP_KEY_SIZE, 0) != SWTP_KEY_SIZE) {
+        return SWTP_ERROR;
+    }
+
+    x25519_getPublicKey(publicKey, secretKey);
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_enableEncryption(swtp_t *swtp, const uint8_t *secretKey, const uint8_t *peerPublicKey, const uint8_t *preSharedKey, bool client) {
+    static const uint8_t zero[HCHACHA20_INPUT_SIZE] = {0};
+    uint8_t publicKey[SWTP_KEY_SIZE];
+    uint8_t sharedSecret[SWTP_KEY_SIZE];
+    uint8_t key[CHACHA20POLY1305_KEY_SIZE];
+
+    // A low order public key gives a known shared secret
+    if(x25519(sharedSecret, secretKey, peerPublicKey) < 0) {
+        printf("Rejected the public key of the peer.\n");
+        return SWTP_ERROR;
+    }
+
+    x25519_getPublicKey(publicKey, secretKey);
+    hchacha20(sharedSecret, zero, key);
+
+    if(preSharedKey) {
+        for(int i = 0; i < CHACHA20POLY1305_KEY_SIZE; i++) {
+            key[i] ^= preSharedKey[i];
+        }
+
+        hchacha20(key, zero, key);
+    }
+
+    // The keys depend on both public keys, client first, 16 bytes at a time
+    const uint8_t *clientPublicKey = client ? publicKey : peerPublicKey;
+    const uint8_t *serverPublicKey = client ? peerPublicKey : publicKey;
+
+    hchacha20(key, clientPublicKey, key);
+    hchacha20(key, clientPublicKey + HCHACHA20_INPUT_SIZE, key);
+    hchacha20(key, serverPublicKey, key);
+    hchacha20(key, serverPublicKey + HCHACHA20_INPUT_SIZE, key);
+
+    hchacha20(key, (const uint8_t *)"client to server", client ? swtp->sendKey : swtp->receiveKey);
+    hchacha20(key, (const uint8_t *)"server to client", client ? swtp->receiveKey : swtp->sendKey);
+
+    memset(sharedSecret, 0, sizeof(sharedSecret));
+    memset(key, 0, sizeof(key));
+
+    swtp->sendNonce = (swtp->sendWindowStartSequenceNumber + swtp->sendWindowLength) & swtp_getSequenceNumberMask(swtp);
+    swtp->receiveNonce = swtp->expectedFrameNumber;
+    swtp->controlSendCounter = 0;
+    swtp->controlReceiveCounter = 0;
+    swtp->controlReplayBitmap = 0;
+    swtp->encrypted = true;
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Returns the nonce of a received data frame, which is the one of the nearest
+frame with its sequence number to the expected one.
+*/
+static inline uint64_t swtp_getReceiveNonce(const swtp_t *swtp, uint32_t sequenceNumber) {
+    uint32_t mask = swtp_getSequenceNumberMask(swtp);
+    uint32_t distance = swtp_getSequenceDistance(swtp, swtp->receiveNonce & mask, sequenceNumber);
+
+    if(distance > mask / 2) {
+        return swtp->receiveNonce - (mask + 1 - distance);
+    }
+
+    return swtp->receiveNonce + distance;
+}
+
+/*
+Checks the tag of a received data frame. A frame is authenticated before it
+changes the receive state, so that a forged or corrupted frame is neither
+acknowledged nor delivered, as if it had never arrived.
+*/
+static bool swtp_isFrameAuthentic(const swtp_t *swtp, const swtp_frame_t *frame, uint32_t sequenceNumber) {
+    size_t headerSize = swtp_getHeaderSize(swtp);
+
+    if(!swtp->encrypted) {
+        return true;
+    }
+
+    if(frame->size < headerSize + SWTP_TAG_SIZE) {
+        return false;
+    }
+
+    return chacha20poly1305_verify(swtp->receiveKey, swtp_getReceiveNonce(swtp, sequenceNumber), swtp_getPayload(swtp, frame), frame->size - headerSize - SWTP_TAG_SIZE) == 0;
+}
+
+/*
+Returns true if a control frame is authenticated in an encrypted session. A
+PARITY frame only rebuilds data frames, which are checked themselves, and the
+application checks the REBIND, COOKIE and JOIN frames with the session token or
+the cookie.
+*/
+static inline bool swtp_isControlFrameSigned(const uint8_t *header) {
+    unsigned int controlFrameType = (header[0] >> 4) & 0x07;
+
+    if(controlFrameType == 0) {
+        return false;
+    }
+
+    if(controlFrameType == 3) {
+        return header[1] == SWTP_EXT_SACK || header[1] == SWTP_EXT_PROBE || header[1] == SWTP_EXT_WINDOW;
+    }
+
+    return true;
+}
+
+/*
+Appends the counter and the tag of a control frame of an encrypted session,
+and returns the size of the frame with them. The buffer must have room for
+SWTP_CONTROL_TRAILER_SIZE more bytes.
+*/
+static size_t swtp_signControlFrame(swtp_t *swtp, void *frame, size_t size) {
+    if(!swtp->encrypted) {
+        return size;
+    }
+
+    // Control frames are sent from several threads, and a nonce must never be
+    // used twice
+    uint64_t counter = __atomic_fetch_add(&swtp->controlSendCounter, 1, __ATOMIC_RELAXED);
+    uint8_t *trailer = (uint8_t *)frame + size;
+
+    for(int i = 0; i < SWTP_CONTROL_COUNTER_SIZE; i++) {
+        trailer[i] = counter >> (8 * i);
+    }
+
+    chacha20poly1305_sign(swtp->sendKey, SWTP_CONTROL_NONCE_FLAG | counter, frame, size + SWTP_CONTROL_COUNTER_SIZE);
+
+    return size + SWTP_CONTROL_TRAILER_SIZE;
+}
+
+/*
+Checks the counter and the tag of a received control frame of an encrypted
+session, and copies the frame without them. A control frame that was forged or
+replayed is dropped before it changes anything, so that only the peer can
+acknowledge or reject frames, change the window, or tear the session down.
+*/
+static bool swtp_openControlFrame(swtp_t *swtp, const swtp_frame_t *frame, swtp_frame_t *openedFrame) {
+    if(frame->size < SWTP_HEADER_SIZE + SWTP_CONTROL_TRAILER_SIZE) {
+        return false;
+    }
+
+    size_t size = frame->size - SWTP_CONTROL_TRAILER_SIZE;
+    const uint8_t *trailer = (const uint8_t *)&frame->frame + size;
+    uint64_t counter = 0;
+
+    for(int i = 0; i < SWTP_CONTROL_COUNTER_SIZE; i++) {
+        counter |= (uint64_t)trailer[i] << (8 * i);
+    }
+
+    if(counter & SWTP_CONTROL_NONCE_FLAG) {
+        return false;
+    }
+
+    // Bit i of the bitmap stands for the counter i before the highest one
+    if(counter < swtp->controlReceiveCounter) {
+        uint64_t age = swtp->controlReceiveCounter - 1 - counter;
+
+        if(age >= SWTP_CONTROL_REPLAY_WINDOW || (swtp->controlReplayBitmap >> age) & 1) {
+            return false;
+        }
+    }
+
+    if(chacha20poly1305_verify(swtp->receiveKey, SWTP_CONTROL_NONCE_FLAG | counter, (const uint8_t *)&frame->frame, size + SWTP_CONTROL_COUNTER_SIZE) < 0) {
+        return false;
+    }
+
+    if(counter >= swtp->controlReceiveCounter) {
+        uint64_t shift = counter + 1 - swtp->controlReceiveCounter;
+
+        swtp->controlReplayBitmap = shift < SWTP_CONTROL_REPLAY_WINDOW ? swtp->controlReplayBitmap << shift : 0;
+        swtp->controlReplayBitmap |= 1;
+        swtp->controlReceiveCounter = counter + 1;
+    } else {
+        swtp->controlReplayBitmap |= (uint64_t)1 << (swtp->controlReceiveCounter - 1 - counter);
+    }
+
+    memcpy(&openedFrame->frame, &frame->frame, size);
+    openedFrame->size = size;
+    openedFrame->buffer = NULL;
+
+    return true;
+}
+
+/*
+Returns the frame size that carries packets of the default MTU, which is used
+until path MTU discovery confirms or finds another one.
+*/
+static inline unsigned int swtp_getDefaultFrameSize(const swtp_t *swtp) {
+    return SWTP_DEFAULT_MTU + swtp_getHeaderSize(swtp) + SWTLLP_HEADER_SIZE + (swtp->fecEncoder ? SWTP_FEC_PARITY_HEADER_SIZE : 0) + (swtp->encrypted ? SWTP_TAG_SIZE : 0);
+}
+
+unsigned int swtp_getMtu(const swtp_t *swtp) {
+    if(!swtp->pmtuDiscovery) {
+        return SWTP_DEFAULT_MTU;
+    }
+
+    // Parity frames are larger than the data frames they protect
+    unsigned int mtu = swtp->maxFrameSize - swtp_getHeaderSize(swtp) - SWTLLP_HEADER_SIZE - (swtp->fecEncoder ? SWTP_FEC_PARITY_HEADER_SIZE : 0) - (swtp->encrypted ? SWTP_TAG_SIZE : 0);
+
+    return mtu < MAXIMUM_MTU ? mtu : MAXIMUM_MTU;
+}
+
+/*
+Starts the path MTU discovery of a path over, from the default frame size.
+*/
+static void swtp_resetPathMtu(const swtp_t *swtp, swtp_path_t *path) {
+    path->maxFrameSize = swtp_getDefaultFrameSize(swtp);
+    path->maxFrameSizeConfirmed = false;
+    path->probeSize = 0;
+    path->probeCount = 0;
+    path->probeLimit = SWTP_MAX_FRAME_SIZE;
+    path->pmtuValidationTime = 0;
+}
+
+/*
+Limits the frames to the smallest frame size of the paths, and tells the
+application when the MTU changed.
+*/
+static void swtp_updateMaxFrameSize(swtp_t *swtp) {
+    unsigned int maxFrameSize = SWTP_MAX_FRAME_SIZE;
+
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        if(swtp->paths[i].maxFrameSize < maxFrameSize) {
+            maxFrameSize = swtp->paths[i].maxFrameSize;
+        }
+    }
+
+    if(maxFrameSize == swtp->maxFrameSize) {
+        return;
+    }
+
+    unsigned int mtu = swtp_getMtu(swtp);
+
+    swtp->maxFrameSize = maxFrameSize;
+
+    printf("Frames are now limited to %u bytes (MTU %u).\n", maxFrameSize, swtp_getMtu(swtp));
+
+    if(swtp->mtuCallback && swtp_getMtu(swtp) != mtu) {
+        swtp->mtuCallback(swtp, swtp_getMtu(swtp));
+    }
+}
+
+void swtp_enablePmtuDiscovery(swtp_t *swtp) {
+    mtx_lock(&swtp->sendWindowMutex);
+
+    swtp->pmtuDiscovery = true;
+    swtp->maxFrameSize = swtp_getDefaultFrameSize(swtp);
+
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        swtp_resetPathMtu(swtp, &swtp->paths[i]);
+    }
+
+    mtx_unlock(&swtp->sendWindowMutex);
+}
+
+int swtp_enableFec(swtp_t *swtp, unsigned int blockSize, bool adaptive) {
+    if(blockSize < SWTP_FEC_MIN_BLOCK_SIZE || blockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        return SWTP_ERROR;
+    }
+
+    // The send window mutex is created with the send window
+    if(swtp->sendWindow == NULL) {
+        return SWTP_ERROR;
+    }
+
+    swtp_fecEncoder_t *fecEncoder = calloc(1, sizeof(swtp_fecEncoder_t));
+
+    if(fecEncoder == NULL) {
+        return SWTP_ERROR;
+    }
+
+    fecEncoder->blockSize = blockSize;
+    fecEncoder->adaptive = adaptive;
+
+    mtx_lock(&swtp->sendWindowMutex);
+    free(swtp->fecEncoder);
+    swtp->fecEncoder = fecEncoder;
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return SWTP_SUCCESS;
+}
+
+static inline void swtp_xor(uint8_t *destination, const uint8_t *source, size_t size) {
+    // This loop is simple enough to be vectorized by the compiler.
+    for(size_t i = 0; i < size; i++) {
+        destination[i] ^= source[i];
+    }
+}
+
+static inline void swtp_fecAdaptBlockSize(swtp_fecEncoder_t *fecEncoder) {
+    unsigned int sampleLossRate = fecEncoder->sampleRetransmitCount * 10000 / fecEncoder->sampleFrameCount;
+
+    if(sampleLossRate > 10000) {
+        sampleLossRate = 10000;
+    }
+
+    fecEncoder->lossRate = (fecEncoder->lossRate * 3 + sampleLossRate) / 4;
+    fecEncoder->sampleFrameCount = 0;
+    fecEncoder->sampleRetransmitCount = 0;
+
+    if(!fecEncoder->adaptive) {
+        return;
+    }
+
+    // A parity frame repairs one frame per block, so the block should contain
+    // about two frames for each lost one.
+    unsigned int blockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+
+    if(fecEncoder->lossRate > 0) {
+        blockSize = 10000 / (2 * fecEncoder->lossRate);
+    }
+
+    if(blockSize < SWTP_FEC_MIN_BLOCK_SIZE) {
+        blockSize = SWTP_FEC_MIN_BLOCK_SIZE;
+    } else if(blockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        blockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+    }
+
+    if(blockSize != fecEncoder->blockSize) {
+        printf("FEC block size changed from %u to %u (loss rate=%u/10000).\n", fecEncoder->blockSize, blockSize, fecEncoder->lossRate);
+        fecEncoder->blockSize = blockSize;
+    }
+}
+
+/*
+Sends the parity frame of the current FEC block, even if the block is not
+complete. The send window mutex must be held.
+*/
+static int swtp_fecSendParity(swtp_t *swtp) {
+    swtp_fecEncoder_t *fecEncoder = swtp->fecEncoder;
+    bool partial = fecEncoder->blockLength < fecEncoder->blockSize;
+
+    // Build the parity frame
+    swtp_frame_t parityFrame;
+    size_t headerSize = swtp_buildControlHeader(swtp, parityFrame.frame.header, 0xb0000000 | SWTP_EXT_PARITY << 16, fecEncoder->blockStartSequenceNumber);
+    uint8_t *payload = swtp_getPayload(swtp, &parityFrame);
+    uint16_t sizeParity = htons(fecEncoder->sizeParity);
+
+    payload[0] = fecEncoder->blockLength | (partial ? SWTP_FEC_PARTIAL_BLOCK : 0);
+    memcpy(payload + 1, &sizeParity, 2);
+    memcpy(payload + SWTP_FEC_PARITY_HEADER_SIZE, fecEncoder->parity, fecEncoder->parityLength);
+    parityFrame.size = headerSize + SWTP_FEC_PARITY_HEADER_SIZE + fecEncoder->parityLength;
+
+    printf("< PARITY %u (%u frames%s)\n", fecEncoder->blockStartSequenceNumber, fecEncoder->blockLength, partial ? ", partial" : "");
+
+    fecEncoder->blockLength = 0;
+    swtp->stats.sentParityFrames++;
+
+    if(fecEncoder->sampleFrameCount >= SWTP_FEC_LOSS_SAMPLE_SIZE) {
+        swtp_fecAdaptBlockSize(fecEncoder);
+    }
+
+    if(swtp_send(swtp, &parityFrame.frame, parityFrame.size) < 0) {
+        perror("Failed to send parity frame");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Adds a data frame that was just sent to the current FEC block, and sends the
+parity frame if the block is complete. The send window mutex must be held.
+*/
+static int swtp_fecAddFrame(swtp_t *swtp, const swtp_frame_t *frame, uint32_t sequenceNumber) {
+    swtp_fecEncoder_t *fecEncoder = swtp->fecEncoder;
+    size_t payloadSize = frame->size - swtp_getHeaderSize(swtp);
+
+    if(fecEncoder->blockLength == 0) {
+        fecEncoder->blockStartSequenceNumber = sequenceNumber;
+        fecEncoder->parityLength = 0;
+        fecEncoder->sizeParity = 0;
+        memset(fecEncoder->parity, 0, sizeof(fecEncoder->parity));
+    }
+
+    if(frame->buffer) {
+        size_t headerSize = swtp_getSharedHeaderSize(swtp) - swtp_getHeaderSize(swtp);
+
+        swtp_xor(fecEncoder->parity, swtp_getPayload(swtp, frame), headerSize);
+        swtp_xor(fecEncoder->parity + headerSize, frame->buffer->data + TUN_HEADER_SIZE, payloadSize - headerSize);
+    } else {
+        swtp_xor(fecEncoder->parity, swtp_getPayload(swtp, frame), payloadSize);
+    }
+
+    fecEncoder->sizeParity ^= payloadSize;
+
+    if(payloadSize > fecEncoder->parityLength) {
+        fecEncoder->parityLength = payloadSize;
+    }
+
+    fecEncoder->blockLength++;
+    fecEncoder->blockTime = frame->lastSendAttemptTime;
+    fecEncoder->sampleFrameCount++;
+
+    if(fecEncoder->blockLength < fecEncoder->blockSize) {
+        return SWTP_SUCCESS;
+    }
+
+    return swtp_fecSendParity(swtp);
+}
+
+/*
+Counts retransmitted frames for the FEC loss rate measurement. The send window
+mutex must be held.
+*/
+static inline void swtp_fecCountRetransmission(swtp_t *swtp) {
+    if(swtp->fecEncoder) {
+        swtp->fecEncoder->sampleRetransmitCount++;
+    }
+}
+
+/*
+Adds the change of a 16-bit word to an Internet checksum, without computing it
+again (RFC 1624). The word, the checksum and the result are in network byte
+order.
+*/
+static inline uint16_t swtllp_updateChecksum(uint16_t checksum, uint16_t oldValue, uint16_t newValue) {
+    uint32_t sum = (uint16_t)~ntohs(checksum) + (uint16_t)~ntohs(oldValue) + ntohs(newValue);
+
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum);
+}
+
+/*
+Lowers the MSS option of a TCP SYN segment to the given value. The checksum
+covers 16-bit words from the start of the segment, so an option at an odd
+offset is counted with its bytes swapped.
+*/
+static void swtllp_clampTcpMss(swtp_t *swtp, uint8_t *segment, size_t size, uint16_t mss) {
+    if(size < 20 || !(segment[13] & 0x02)) {
+        // Not a SYN segment
+        return;
+    }
+
+    size_t headerSize = (segment[12] >> 4) * 4;
+
+    if(headerSize < 20 || headerSize > size) {
+        return;
+    }
+
+    for(size_t i = 20; i < headerSize;) {
+        uint8_t kind = segment[i];
+
+        if(kind == 0) {
+            // End of the option list
+            break;
+        } else if(kind == 1) {
+            // No-operation
+            i++;
+            continue;
+        }
+
+        if(i + 1 >= headerSize || segment[i + 1] < 2 || i + segment[i + 1] > headerSize) {
+            // Ignore malformed options
+            break;
+        }
+
+        if(kind == 2 && segment[i + 1] == 4) {
+            uint16_t oldMss;
+            uint16_t newMss = htons(mss);
+
+            memcpy(&oldMss, segment + i + 2, 2);
+
+            if(ntohs(oldMss) > mss) {
+                uint16_t checksum;
+
+                memcpy(&checksum, segment + 16, 2);
+
+                if((i + 2) % 2) {
+                    checksum = swtllp_updateChecksum(checksum, __builtin_bswap16(oldMss), __builtin_bswap16(newMss));
+                } else {
+                    checksum = swtllp_updateChecksum(checksum, oldMss, newMss);
+                }
+
+                memcpy(segment + 16, &checksum, 2);
+                memcpy(segment + i + 2, &newMss, 2);
+                swtp->stats.clampedSegments++;
+            }
+
+            break;
+        }
+
+        i += segment[i + 1];
+    }
+}
+
+/*
+Finds the TCP segment of an IPv4 or IPv6 packet and clamps its MSS option to
+the MTU of the session. Fragments after the first one and IPv6 packets with
+extension headers other than hop-by-hop, routing and destination options are
+left untouched.
+*/
+static void swtllp_clampMss(swtp_t *swtp, uint8_t *packet, size_t size, uint8_t protocol) {
+    unsigned int mtu = swtp_getMtu(swtp);
+
+    if(protocol == SWTLLP_IPV4) {
+        if(size < 20 || (packet[0] >> 4) != 4 || packet[9] != IPPROTO_TCP) {
+            return;
+        }
+
+        size_t headerSize = (packet[0] & 0x0f) * 4;
+        uint16_t fragmentOffset = ntohs(*(const uint16_t *)(packet + 6)) & 0x1fff;
+
+        if(headerSize < 20 || headerSize > size || fragmentOffset != 0) {
+            return;
+        }
+
+        swtllp_clampTcpMss(swtp, packet + headerSize, size - headerSize, mtu - SWTLLP_IPV4_TCP_HEADER_SIZE);
+    } else if(protocol == SWTLLP_IPV6) {
+        if(size < 40 || (packet[0] >> 4) != 6) {
+            return;
+        }
+
+        uint8_t nextHeader = packet[6];
+        size_t offset = 40;
+
+        while(nextHeader == IPPROTO_HOPOPTS || nextHeader == IPPROTO_ROUTING || nextHeader == IPPROTO_DSTOPTS) {
+            if(offset + 8 > size) {
+                return;
+            }
+
+            nextHeader = packet[offset];
+            offset += (packet[offset + 1] + 1) * 8;
+        }
+
+        if(nextHeader != IPPROTO_TCP || offset > size) {
+            return;
+        }
+
+        swtllp_clampTcpMss(swtp, packet + offset, size - offset, mtu - SWTLLP_IPV6_TCP_HEADER_SIZE);
+    }
+}
+
+/*
+Writes the SWTLLP header of a packet read from a TUN device, from the protocol
+in its TUN header.
+*/
+static int swtllp_setHeader(uint8_t *payload, const void *inputBuffer) {
+    uint16_t etherType = ntohs(*(uint16_t *)((uint8_t *)inputBuffer + 2));
+
+    if(etherType == ETHERTYPE_IPV4) {
+        payload[0] = SWTLLP_IPV4;
+    } else if(etherType == ETHERTYPE_IPV6) {
+        payload[0] = SWTLLP_IPV6;
+    } else {
+        printf("swtllp_encapsulate(): unknown ethertype value 0x%04x\n", etherType);
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Returns true if swtllp_clampMss() may change a packet: if it is a TCP segment,
+or an IPv6 packet whose extension headers may hide one.
+*/
+static bool swtllp_mayClampMss(const uint8_t *packet, size_t size, uint8_t protocol) {
+    if(protocol == SWTLLP_IPV4) {
+        return size >= 20 && packet[9] == IPPROTO_TCP;
+    }
+
+    if(protocol == SWTLLP_IPV6) {
+        return size >= 40 && (packet[6] == IPPROTO_TCP || packet[6] == IPPROTO_HOPOPTS || packet[6] == IPPROTO_ROUTING || packet[6] == IPPROTO_DSTOPTS);
+    }
+
+    return false;
+}
+
+int swtllp_encapsulate(swtp_t *swtp, swtp_frame_t *outputFrame, const void *inputBuffer, size_t bufferSize) {
+    uint8_t *payload = swtp_getPayload(swtp, outputFrame);
+
+    if(swtllp_setHeader(payload, inputBuffer) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    memcpy(payload + SWTLLP_HEADER_SIZE, (const uint8_t *)inputBuffer + TUN_HEADER_SIZE, bufferSize - TUN_HEADER_SIZE);
+    swtllp_clampMss(swtp, payload + SWTLLP_HEADER_SIZE, bufferSize - TUN_HEADER_SIZE, payload[0]);
+    outputFrame->size = swtp_getHeaderSize(swtp) + SWTLLP_HEADER_SIZE + bufferSize - TUN_HEADER_SIZE;
+    outputFrame->buffer = NULL;
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Encapsulates a shared packet like swtllp_encapsulate(), but only writes the
+SWTLLP header in the frame, which references the buffer of the packet.
+*/
+static int swtllp_encapsulateShared(swtp_t *swtp, swtp_frame_t *outputFrame, pktbuf_t *buffer) {
+    if(swtllp_setHeader(swtp_getPayload(swtp, outputFrame), buffer->data) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    outputFrame->size = swtp_getSharedHeaderSize(swtp) + buffer->size - TUN_HEADER_SIZE;
+    outputFrame->buffer = pktbuf_acquire(buffer);
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Encapsulates a shared packet like swtllp_encapsulate(), for an encrypted session:
+the packet is encrypted on its way from the shared buffer to the frame, which
+saves copying it first. The packet must not need its MSS clamped.
+*/
+static int swtllp_encapsulateSealed(swtp_t *swtp, swtp_frame_t *outputFrame, const pktbuf_t *buffer) {
+    uint8_t header[SWTLLP_HEADER_SIZE];
+    size_t packetSize = buffer->size - TUN_HEADER_SIZE;
+
+    if(swtllp_setHeader(header, buffer->data) != SWTP_SUCCESS) {
+        return SWTP_ERROR;
+    }
+
+    chacha20poly1305_sealGather(swtp->sendKey, swtp->sendNonce++, header, SWTLLP_HEADER_SIZE, buffer->data + TUN_HEADER_SIZE, packetSize, swtp_getPayload(swtp, outputFrame));
+    outputFrame->size = swtp_getHeaderSize(swtp) + SWTLLP_HEADER_SIZE + packetSize + SWTP_TAG_SIZE;
+    outputFrame->buffer = NULL;
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Forwards a packet, which follows the TUN header of the buffer, to the callback.
+*/
+static inline void swtllp_setEtherTypeAndForward(swtp_t *swtp, uint8_t *buffer, size_t packetSize, uint16_t etherType, uint8_t protocol) {
+    memset(buffer, 0, 2);
+    *(uint16_t *)(buffer + 2) = htons(etherType);
+
+    // The segments of the peer must also fit in the frames of this end
+    swtllp_clampMss(swtp, buffer + 4, packetSize, protocol);
+
+    // Call the callback
+    if(swtp->recvCallback) {
+        swtp->recvCallback(swtp, buffer, packetSize + TUN_HEADER_SIZE);
+    }
+}
+
+int swtllp_unwrap(swtp_t *swtp, const swtp_frame_t *frame) {
+    uint8_t buffer[SWTP_MAX_PAYLOAD_SIZE + TUN_HEADER_SIZE];
+    size_t tagSize = swtp->encrypted ? SWTP_TAG_SIZE : 0;
+
+    uint64_t nonce = 0;
+
+    swtp->stats.deliveredDataFrames++;
+
+    // The frames are delivered in sequence
+    if(swtp->encrypted) {
+        nonce = swtp_getReceiveNonce(swtp, swtp_getSendSequenceNumber(swtp, frame));
+        swtp->receiveNonce = nonce + 1;
+    }
+
+    if(frame->size <= swtp_getHeaderSize(swtp) + SWTLLP_HEADER_SIZE + tagSize) {
+        // Ignore truncated frame
+        return SWTP_SUCCESS;
+    }
+
+    // The SWTLLP header is copied right before the packet, where the TUN
+    // header is then written
+    uint8_t *payload = buffer + TUN_HEADER_SIZE - SWTLLP_HEADER_SIZE;
+    size_t payloadSize = frame->size - swtp_getHeaderSize(swtp) - tagSize;
+
+    // The tag was checked when the frame was received
+    if(swtp->encrypted) {
+        chacha20poly1305_decrypt(swtp->receiveKey, nonce, swtp_getPayload(swtp, frame), payload, payloadSize);
+    } else {
+        memcpy(payload, swtp_getPayload(swtp, frame), payloadSize);
+    }
+
+    uint8_t protocol = payload[0];
+
+    switch(protocol) {
+        case SWTLLP_IPV4:
+            swtllp_setEtherTypeAndForward(swtp, buffer, payloadSize - SWTLLP_HEADER_SIZE, ETHERTYPE_IPV4, protocol);
+            break;
+
+        case SWTLLP_IPV6:
+            swtllp_setEtherTypeAndForward(swtp, buffer, payloadSize - SWTLLP_HEADER_SIZE, ETHERTYPE_IPV6, protocol);
+            break;
+
+        default:
+            // Ignore unknown SWTLLP header value
+            break;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Returns the bytes that a data frame counts for in the byte window of the peer:
+its packet, without the SWTLLP header and the tag, plus the overhead size of the
+peer.
+*/
+static inline uint32_t swtp_getFrameCharge(const swtp_t *swtp, const swtp_frame_t *frame) {
+    return frame->size - swtp_getHeaderSize(swtp) - SWTLLP_HEADER_SIZE - (swtp->encrypted ? SWTP_TAG_SIZE : 0) + swtp->peerOverheadSize;
+}
+
+/*
+Returns the number of frames as large as the MTU that fit in the send window,
+in frames and in bytes. The send window mutex must be held.
+*/
+static unsigned int swtp_getAvailableSlots(const swtp_t *swtp) {
+    if(swtp->sendWindowLength >= swtp->sendWindowLimit) {
+        return 0;
+    }
+
+    unsigned int availableSlots = swtp->sendWindowLimit - swtp->sendWindowLength;
+
+    if(swtp->peerByteWindowSize > 0) {
+        uint32_t availableBytes = swtp->sendWindowBytes < swtp->peerByteWindowSize ? swtp->peerByteWindowSize - swtp->sendWindowBytes : 0;
+        unsigned int byteSlots = availableBytes / (swtp_getMtu(swtp) + swtp->peerOverheadSize);
+
+        if(byteSlots < availableSlots) {
+            availableSlots = byteSlots;
+        }
+    }
+
+    return availableSlots;
+}
+
+/*
+Sends a packet in a new data frame. The packet is copied in the frame, unless
+it comes from a shared buffer that the frame can reference.
+*/
+static int swtp_sendPacket(swtp_t *swtp, const void *buffer, size_t size, pktbuf_t *sharedBuffer) {
+    if(!swtp->connected) {
+        return SWTP_ERROR;
+    }
+
+    // Check the frame size
+    if(size > swtp_getMtu(swtp) + TUN_HEADER_SIZE) {
+        printf("Maximum payload size exceeded. (%lu > %u)\n", size, swtp_getMtu(swtp) + TUN_HEADER_SIZE);
+        return SWTP_ERROR;
+    }
+
+    // TODO: Wait for a slot to be available and acquire lock
+    mtx_lock(&swtp->sendWindowMutex);
+
+    // A frame always fits in an empty window, so that a byte window smaller
+    // than a frame does not stall the session
+    bool byteWindowFull = swtp->peerByteWindowSize > 0 && swtp->sendWindowLength > 0 && swtp->sendWindowBytes + size - TUN_HEADER_SIZE + swtp->peerOverheadSize > swtp->peerByteWindowSize;
+
+    if(swtp->sendWindowLength >= swtp->sendWindowLimit || byteWindowFull) {
+        swtp->stats.droppedDataFrames++;
+        mtx_unlock(&swtp->sendWindowMutex);
+        printf("Lost frame due to window saturation.\n");
+        return SWTP_SUCCESS;
+    }
+
+    // Compute sequence numbers
+    uint32_t sendSequenceNumber = (swtp->sendWindowStartSequenceNumber + swtp->sendWindowLength) & swtp_getSequenceNumberMask(swtp);
+    uint32_t sendWindowIndex = (swtp->sendWindowStartIndex + swtp->sendWindowLength) % swtp->sendWindowSize;
+
+    // A shared packet is referenced by the frame, or encrypted into it
+    bool sealed = sharedBuffer && swtp->encrypted;
+    int result;
+
+    if(sealed) {
+        result = swtllp_encapsulateSealed(swtp, &swtp->sendWindow[sendWindowIndex], sharedBuffer);
+    } else if(sharedBuffer) {
+        result = swtllp_encapsulateShared(swtp, &swtp->sendWindow[sendWindowIndex], sharedBuffer);
+    } else {
+        result = swtllp_encapsulate(swtp, &swtp->sendWindow[sendWindowIndex], buffer, size);
+    }
+
+    if(result == SWTP_ERROR) {
+        mtx_unlock(&swtp->sendWindowMutex);
+        printf("SWTLLP encapsulation failed.\n");
+        return SWTP_ERROR;
+    }
+
+    // The slot is only taken once it holds a valid frame
+    swtp->sendWindowLength++;
+    
+    // The payload is encrypted in its slot, after the MSS clamping, so that
+    // the retransmissions and the parity frames carry the ciphertext
+    if(swtp->encrypted && !sealed) {
+        swtp_frame_t *frame = &swtp->sendWindow[sendWindowIndex];
+
+        chacha20poly1305_seal(swtp->sendKey, swtp->sendNonce++, swtp_getPayload(swtp, frame), frame->size - swtp_getHeaderSize(swtp));
+        frame->size += SWTP_TAG_SIZE;
+    }
+
+    // Set the sequence numbers in the buffer
+    swtp_setSequenceNumbers(swtp, &swtp->sendWindow[sendWindowIndex], sendSequenceNumber, swtp->expectedFrameNumber);
+    swtp->sendWindowBytes += swtp_getFrameCharge(swtp, &swtp->sendWindow[sendWindowIndex]);
+
+    swtp->sendWindow[sendWindowIndex].lastSendAttemptTime = swtp_getTime(swtp);
+
+    // Spread the frames over the paths
+    unsigned int path = swtp_selectPath(swtp);
+
+    swtp->sendWindow[sendWindowIndex].path = path;
+    swtp->sendWindow[sendWindowIndex].retransmitted = false;
+    swtp->sendWindow[sendWindowIndex].sacked = false;
+
+    if(swtp->pathCount > 1 && ++swtp->paths[path].sentFrameCount >= SWTP_PATH_LOSS_SAMPLE_SIZE) {
+        swtp->paths[path].sentFrameCount /= 2;
+        swtp->paths[path].lostFrameCount /= 2;
+    }
+
+    printf("< DATA %u\n", sendSequenceNumber);
+
+    // Send the data frame
+    if(swtp_sendFrameOnPath(swtp, path, &swtp->sendWindow[sendWindowIndex]) < 0) {
+        mtx_unlock(&swtp->sendWindowMutex);
+        perror("Failed to send data frame");
+        return SWTP_ERROR;
+    }
+
+    swtp->stats.sentDataFrames++;
+
+    if(swtp->fecEncoder) {
+        if(swtp_fecAddFrame(swtp, &swtp->sendWindow[sendWindowIndex], sendSequenceNumber) != SWTP_SUCCESS) {
+            mtx_unlock(&swtp->sendWindowMutex);
+            return SWTP_ERROR;
+        }
+    }
+
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_sendDataFrame(swtp_t *swtp, const void *buffer, size_t size) {
+    return swtp_sendPacket(swtp, buffer, size, NULL);
+}
+
+int swtp_sendSharedDataFrame(swtp_t *swtp, pktbuf_t *buffer) {
+    // The payload of this session differs from the shared packet when it is
+    // clamped, so it needs its own copy. An encrypted session reads the shared
+    // packet, and only keeps its own ciphertext.
+    bool shared = buffer->size > TUN_HEADER_SIZE;
+
+    if(shared) {
+        uint8_t protocol;
+
+        shared = swtllp_setHeader(&protocol, buffer->data) == SWTP_SUCCESS && !swtllp_mayClampMss(buffer->data + TUN_HEADER_SIZE, buffer->size - TUN_HEADER_SIZE, protocol);
+    }
+
+    return swtp_sendPacket(swtp, buffer->data, buffer->size, shared ? buffer : NULL);
+}
+
+unsigned int swtp_getSendWindowAvailableSlots(swtp_t *swtp) {
+    mtx_lock(&swtp->sendWindowMutex);
+    unsigned int availableSlots = swtp_getAvailableSlots(swtp);
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return availableSlots;
+}
+
+/*
+Moves the frames in flight to a new send window of the given number of slots.
+The send window mutex must be held.
+*/
+static int swtp_reallocateSendWindow(swtp_t *swtp, uint32_t size) {
+    swtp_frame_t *sendWindow = calloc(size, sizeof(swtp_frame_t));
+
+    if(sendWindow == NULL) {
+        return SWTP_ERROR;
+    }
+
+    for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+        sendWindow[i] = swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize];
+    }
+
+    free(swtp->sendWindow);
+
+    swtp->sendWindow = sendWindow;
+    swtp->sendWindowSize = size;
+    swtp->sendWindowStartIndex = 0;
+
+    return SWTP_SUCCESS;
+}
+
+void swtp_setPeerWindow(swtp_t *swtp, uint32_t windowSize, unsigned int overheadSize, uint32_t byteWindowSize) {
+    mtx_lock(&swtp->sendWindowMutex);
+
+    swtp->peerWindowSize = windowSize < swtp_getMaxWindowSize(swtp) ? windowSize : swtp_getMaxWindowSize(swtp);
+    swtp->peerByteWindowSize = byteWindowSize < SWTP_MAX_SABM_BYTE_WINDOW_SIZE ? byteWindowSize : 0;
+    swtp->peerOverheadSize = overheadSize;
+
+    if(swtp->peerWindowSize > 0 && swtp->sendWindowLimit > swtp->peerWindowSize) {
+        swtp->sendWindowLimit = swtp->peerWindowSize;
+    }
+
+    // The frames in flight count with the new overhead size
+    swtp->sendWindowBytes = 0;
+
+    for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+        swtp->sendWindowBytes += swtp_getFrameCharge(swtp, &swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize]);
+    }
+
+    mtx_unlock(&swtp->sendWindowMutex);
+}
+
+int swtp_setSendWindowSize(swtp_t *swtp, uint32_t size) {
+    if(swtp->peerWindowSize > 0 && size > swtp->peerWindowSize) {
+        size = swtp->peerWindowSize;
+    }
+
+    if(size > swtp_getMaxWindowSize(swtp)) {
+        size = swtp_getMaxWindowSize(swtp);
+    }
+
+    if(size == 0) {
+        return SWTP_ERROR;
+    }
+
+    mtx_lock(&swtp->sendWindowMutex);
+
+    uint32_t slotCount = size > swtp->sendWindowLength ? size : swtp->sendWindowLength;
+
+    if(slotCount != swtp->sendWindowSize && swtp_reallocateSendWindow(swtp, slotCount) != SWTP_SUCCESS) {
+        mtx_unlock(&swtp->sendWindowMutex);
+        return SWTP_ERROR;
+    }
+
+    swtp->sendWindowLimit = size;
+
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Sends a WINDOW frame with the given parameter and receive window.
+*/
+static int swtp_sendWindowFrame(swtp_t *swtp, uint16_t parameter, uint32_t windowSize, uint32_t byteWindowSize) {
+    swtp_frame_t windowFrame;
+    uint16_t networkParameter = htons(parameter);
+    uint32_t networkWindowSize = htonl(windowSize);
+    uint32_t networkByteWindowSize = htonl(byteWindowSize);
+
+    windowFrame.frame.header[0] = 0xb0;
+    windowFrame.frame.header[1] = SWTP_EXT_WINDOW;
+    memcpy(windowFrame.frame.header + 2, &networkParameter, 2);
+    memcpy(windowFrame.frame.payload, &networkWindowSize, 4);
+    memcpy(windowFrame.frame.payload + 4, &networkByteWindowSize, 4);
+    windowFrame.size = swtp_signControlFrame(swtp, &windowFrame.frame, SWTP_HEADER_SIZE + SWTP_WINDOW_PAYLOAD_SIZE);
+
+    printf(parameter & SWTP_WINDOW_ACKNOWLEDGEMENT ? "< WINDOW %u acknowledged\n" : "< WINDOW %u\n", windowSize);
+
+    if(swtp_send(swtp, &windowFrame.frame, windowFrame.size) < 0) {
+        perror("Failed to send WINDOW");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_setReceiveWindow(swtp_t *swtp, uint32_t windowSize, uint32_t byteWindowSize) {
+    swtp->receiveWindowSize = windowSize;
+    swtp->receiveByteWindowSize = byteWindowSize;
+
+    // Before the session is established, the window goes in the SABM frame
+    if(!swtp->connected) {
+        return SWTP_SUCCESS;
+    }
+
+    mtx_lock(&swtp->sendWindowMutex);
+
+    swtp->receiveWindowUpdate = (swtp->receiveWindowUpdate + 1) & ~SWTP_WINDOW_ACKNOWLEDGEMENT;
+    swtp->receiveWindowPending = true;
+    swtp->receiveWindowTime = swtp_getTime(swtp);
+
+    int result = swtp_sendWindowFrame(swtp, swtp->receiveWindowUpdate, windowSize, byteWindowSize);
+
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return result;
+}
+
+bool swtp_isSentFrameNumberValid(const swtp_t *swtp, uint32_t seq) {
+    // Check that the sequence number is between the send window bounds
+    if(seq > swtp_getSequenceNumberMask(swtp)) {
+        return false;
+    }
+
+    return swtp_getSequenceDistance(swtp, swtp->sendWindowStartSequenceNumber, seq) < swtp->sendWindowLength;
+}
+
+swtp_frame_t *swtp_getSentFrame(const swtp_t *swtp, uint32_t seq) {
+    if(swtp_isSentFrameNumberValid(swtp, seq)) {
+        return &swtp->sendWindow[(swtp_getSequenceDistance(swtp, swtp->sendWindowStartSequenceNumber, seq) + swtp->sendWindowStartIndex) % swtp->sendWindowSize];
+    } else {
+        return NULL;
+    }
+}
+
+static inline int swtp_sendRR(swtp_t *swtp) {
+    uint8_t rr[SWTP_EXTENDED_HEADER_SIZE + SWTP_CONTROL_TRAILER_SIZE];
+    size_t size = swtp_buildControlHeader(swtp, rr, 0xe0000000, swtp->expectedFrameNumber);
+
+    size = swtp_signControlFrame(swtp, rr, size);
+
+    printf("< RR %u\n", swtp->expectedFrameNumber);
+
+    if(swtp_send(swtp, rr, size) < 0) {
+        perror("Failed to send RR");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+static inline int swtp_sendREJ(swtp_t *swtp) {
+    uint8_t rejBuffer[SWTP_EXTENDED_HEADER_SIZE + SWTP_CONTROL_TRAILER_SIZE];
+    size_t size = swtp_buildControlHeader(swtp, rejBuffer, 0xd0000000, swtp->expectedFrameNumber);
+
+    size = swtp_signControlFrame(swtp, rejBuffer, size);
+
+    printf("< REJ %u\n", swtp->expectedFrameNumber);
+
+    swtp->stats.sentRejects++;
+
+    if(swtp_send(swtp, rejBuffer, size) < 0) {
+        perror("Failed to send REJ");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+static int swtp_sendRebind(swtp_t *swtp) {
+    swtp_frame_t rebindFrame;
+
+    rebindFrame.frame.header[0] = 0xb0;
+    rebindFrame.frame.header[1] = SWTP_EXT_REBIND;
+    memset(rebindFrame.frame.header + 2, 0, 2);
+
+    uint32_t sessionId = htonl(swtp->sessionId);
+    memcpy(rebindFrame.frame.payload, &sessionId, 4);
+    memcpy(rebindFrame.frame.payload + 4, swtp->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+    rebindFrame.size = SWTP_HEADER_SIZE + SWTP_SESSION_SIZE;
+
+    printf("< REBIND %u\n", swtp->sessionId);
+
+    if(swtp_send(swtp, &rebindFrame.frame, rebindFrame.size) < 0) {
+        perror("Failed to send REBIND");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+static inline bool swtp_isFrameReceived(const swtp_t *swtp, uint32_t sequenceNumber) {
+    const swtp_receivedFrame_t *receivedFrame = &swtp->receiveRing[sequenceNumber % SWTP_RECEIVE_RING_SIZE];
+
+    return receivedFrame->valid && receivedFrame->sequenceNumber == sequenceNumber;
+}
+
+static inline void swtp_storeReceivedFrame(swtp_t *swtp, const swtp_frame_t *frame, uint32_t sequenceNumber) {
+    swtp_receivedFrame_t *receivedFrame = &swtp->receiveRing[sequenceNumber % SWTP_RECEIVE_RING_SIZE];
+
+    receivedFrame->valid = true;
+    receivedFrame->sequenceNumber = sequenceNumber;
+    receivedFrame->frame.size = frame->size;
+    memcpy(&receivedFrame->frame.frame, &frame->frame, frame->size);
+}
+
+/*
+Passes the frames stored in the receive ring to SWTLLP, in order, starting with
+the expected frame.
+*/
+static inline void swtp_deliverReceivedFrames(swtp_t *swtp) {
+    while(swtp_isFrameReceived(swtp, swtp->expectedFrameNumber)) {
+        swtllp_unwrap(swtp, &swtp->receiveRing[swtp->expectedFrameNumber % SWTP_RECEIVE_RING_SIZE].frame);
+
+        swtp->expectedFrameNumber = (swtp->expectedFrameNumber + 1) & swtp_getSequenceNumberMask(swtp);
+    }
+}
+
+/*
+Acknowledges the received frames with a SACK frame, whose bitmap tells which
+frames were received after the missing one, so that the peer only retransmits
+the missing frames. If no frame was received out of order, a RR frame is sent
+instead, unless duplicate is true, which means that the frame that was just
+received was not the expected one and that the peer must count a duplicate
+acknowledgement.
+*/
+static int swtp_sendSACK(swtp_t *swtp, bool duplicate) {
+    swtp_frame_t sackFrame;
+    size_t headerSize = swtp_buildControlHeader(swtp, sackFrame.frame.header, 0xb0000000 | SWTP_EXT_SACK << 16, swtp->expectedFrameNumber);
+    uint8_t *bitmap = swtp_getPayload(swtp, &sackFrame);
+    size_t bitmapSize = 0;
+
+    // Bit i, starting with the most significant bit of the first byte, is set
+    // if the frame i + 1 frames after the expected one was received
+    memset(bitmap, 0, SWTP_SACK_BITMAP_SIZE);
+
+    for(unsigned int i = 0; i < SWTP_SACK_BITMAP_SIZE * 8; i++) {
+        if(swtp_isFrameReceived(swtp, (swtp->expectedFrameNumber + 1 + i) & swtp_getSequenceNumberMask(swtp))) {
+            bitmap[i / 8] |= 0x80 >> (i % 8);
+            bitmapSize = i / 8 + 1;
+        }
+    }
+
+    if(bitmapSize == 0 && !duplicate) {
+        return swtp_sendRR(swtp);
+    }
+
+    sackFrame.size = swtp_signControlFrame(swtp, &sackFrame.frame, headerSize + bitmapSize);
+    swtp->stats.sentSacks++;
+
+    printf("< SACK %u\n", swtp->expectedFrameNumber);
+
+    if(swtp_send(swtp, &sackFrame.frame, sackFrame.size) < 0) {
+        perror("Failed to send SACK");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Reads a SACK frame. The frames before its sequence number are acknowledged,
+and those of its bitmap are marked as received. A missing frame is then
+retransmitted once enough frames after it were received, or, for the first
+frame of the window, once the peer acknowledged it again and again, so that
+several frames lost in the same window are all retransmitted within one RTT.
+The frame must also have had the time to arrive (see swtp_getLossDelay).
+*/
+static int swtp_onSackFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
+    size_t headerSize = swtp_getHeaderSize(swtp);
+
+    if(frame->size < headerSize || frame->size > headerSize + SWTP_SACK_BITMAP_SIZE) {
+        // Ignore malformed SACK frame
+        return SWTP_SUCCESS;
+    }
+
+    uint32_t acknowledgedSequenceNumber = swtp_getReceiveSequenceNumber(swtp, frame);
+    const uint8_t *bitmap = swtp_getPayload(swtp, frame);
+    unsigned int bitCount = (frame->size - headerSize) * 8;
+
+    printf("> SACK %u\n", acknowledgedSequenceNumber);
+
+    mtx_lock(&swtp->sendWindowMutex);
+
+    // SACK frames reordered by the network acknowledge older frames, and are
+    // not duplicates
+    if(acknowledgedSequenceNumber == swtp->sendWindowStartSequenceNumber) {
+        swtp->duplicateAcknowledgementCount++;
+    } else {
+        swtp_acknowledgeSentFrame(swtp, acknowledgedSequenceNumber);
+
+        if(acknowledgedSequenceNumber == swtp->sendWindowStartSequenceNumber) {
+            swtp->duplicateAcknowledgementCount = 0;
+        }
+    }
+
+    for(unsigned int i = 0; i < bitCount; i++) {
+        if(bitmap[i / 8] & (0x80 >> (i % 8))) {
+            swtp_frame_t *sackedFrame = swtp_getSentFrame(swtp, (acknowledgedSequenceNumber + 1 + i) & swtp_getSequenceNumberMask(swtp));
+
+            if(sackedFrame) {
+                sackedFrame->sacked = true;
+            }
+        }
+    }
+
+    // The frames acknowledged selectively are all within a bitmap of the
+    // start of the window
+    uint32_t span = swtp->sendWindowLength < SWTP_SACK_BITMAP_SIZE * 8 + 1 ? swtp->sendWindowLength : SWTP_SACK_BITMAP_SIZE * 8 + 1;
+    unsigned int sackedFrameCount = 0;
+
+    for(uint32_t i = 0; i < span; i++) {
+        if(swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize].sacked) {
+            sackedFrameCount++;
+        }
+    }
+
+    swtp_time_t currentTime = swtp_getTime(swtp);
+
+    // Retransmit the missing frames, until the last frame received
+    for(uint32_t i = 0; i < span && (sackedFrameCount > 0 || i == 0); i++) {
+        swtp_frame_t *sentFrame = &swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize];
+
+        if(sentFrame->sacked) {
+            sackedFrameCount--;
+            continue;
+        }
+
+        bool missing = sackedFrameCount >= SWTP_FAST_RETRANSMIT_THRESHOLD || (i == 0 && swtp->duplicateAcknowledgementCount >= SWTP_FAST_RETRANSMIT_THRESHOLD);
+
+        if(!missing || currentTime - sentFrame->lastSendAttemptTime < swtp_getLossDelay(swtp, sentFrame)) {
+            continue;
+        }
+
+        unsigned int path = swtp_prepareRetransmission(swtp, sentFrame, true);
+
+        sentFrame->lastSendAttemptTime = currentTime;
+        swtp_setReceiveSequenceNumber(swtp, sentFrame, swtp->expectedFrameNumber);
+        swtp_fecCountRetransmission(swtp);
+        swtp->stats.retransmittedDataFrames++;
+        swtp->stats.fastRetransmittedDataFrames++;
+
+        printf("< DATA %u (retransmit due to SACK)\n", swtp_getSendSequenceNumber(swtp, sentFrame));
+
+        if(swtp_sendFrameOnPath(swtp, path, sentFrame) < 0) {
+            mtx_unlock(&swtp->sendWindowMutex);
+            perror("Failed to send data frame after SACK");
+            return SWTP_ERROR;
+        }
+    }
+
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    return SWTP_SUCCESS;
+}
+
+static int swtp_onParityFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
+    size_t headerSize = swtp_getHeaderSize(swtp);
+
+    if(frame->size < headerSize + SWTP_FEC_PARITY_HEADER_SIZE) {
+        // Ignore malformed parity frame
+        return SWTP_SUCCESS;
+    }
+
+    const uint8_t *payload = swtp_getPayload(swtp, frame);
+    uint32_t blockStartSequenceNumber = swtp_getReceiveSequenceNumber(swtp, frame);
+    bool partial = payload[0] & SWTP_FEC_PARTIAL_BLOCK;
+    unsigned int blockSize = payload[0] & ~SWTP_FEC_PARTIAL_BLOCK;
+    size_t parityLength = frame->size - headerSize - SWTP_FEC_PARITY_HEADER_SIZE;
+
+    printf("> PARITY %u (%u frames%s)\n", blockStartSequenceNumber, blockSize, partial ? ", partial" : "");
+
+    if(blockSize == 0 || blockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        return SWTP_SUCCESS;
+    }
+
+    // A block cut short by an idle sender does not tell the size of the next
+    // ones
+    if(!partial || swtp->peerFecBlockSize == 0) {
+        swtp->peerFecBlockSize = blockSize;
+    }
+
+    // Start keeping the received frames, so that the next blocks can be
+    // repaired.
+    if(swtp->receiveRing == NULL) {
+        return swtp_allocateReceiveRing(swtp);
+    }
+
+    // Only the block that contains the expected frame can be repaired
+    if(swtp_getSequenceDistance(swtp, blockStartSequenceNumber, swtp->expectedFrameNumber) >= blockSize) {
+        return SWTP_SUCCESS;
+    }
+
+    unsigned int missingFrameCount = 0;
+    uint32_t missingFrameSequenceNumber = 0;
+
+    for(unsigned int i = 0; i < blockSize; i++) {
+        uint32_t sequenceNumber = (blockStartSequenceNumber + i) & swtp_getSequenceNumberMask(swtp);
+
+        if(!swtp_isFrameReceived(swtp, sequenceNumber)) {
+            missingFrameCount++;
+            missingFrameSequenceNumber = sequenceNumber;
+        }
+    }
+
+    if(missingFrameCount == 0) {
+        return SWTP_SUCCESS;
+    } else if(missingFrameCount > 1) {
+        printf("Cannot repair block %u (%u frames missing).\n", blockStartSequenceNumber, missingFrameCount);
+        return swtp_sendREJ(swtp);
+    } else if(swtp_getSequenceDistance(swtp, swtp->expectedFrameNumber, missingFrameSequenceNumber) >= blockSize) {
+        // The missing frame was delivered before the receive ring was created
+        return SWTP_SUCCESS;
+    }
+
+    // Rebuild the missing frame from the parity and the other frames
+    swtp_frame_t repairedFrame;
+    uint8_t *repairedPayload = swtp_getPayload(swtp, &repairedFrame);
+    uint16_t payloadSize = ntohs(*(uint16_t *)(payload + 1));
+
+    memcpy(repairedPayload, payload + SWTP_FEC_PARITY_HEADER_SIZE, parityLength);
+
+    for(unsigned int i = 0; i < blockSize; i++) {
+        uint32_t sequenceNumber = (blockStartSequenceNumber + i) & swtp_getSequenceNumberMask(swtp);
+
+        if(sequenceNumber != missingFrameSequenceNumber) {
+            const swtp_frame_t *receivedFrame = &swtp->receiveRing[sequenceNumber % SWTP_RECEIVE_RING_SIZE].frame;
+            size_t receivedPayloadSize = receivedFrame->size - headerSize;
+
+            if(receivedPayloadSize > parityLength) {
+                // Ignore inconsistent parity frame
+                return SWTP_SUCCESS;
+            }
+
+            swtp_xor(repairedPayload, swtp_getPayload(swtp, receivedFrame), receivedPayloadSize);
+            payloadSize ^= receivedPayloadSize;
+        }
+    }
+
+    if(payloadSize > parityLength || payloadSize <= SWTLLP_HEADER_SIZE) {
+        // Ignore inconsistent parity frame
+        return SWTP_SUCCESS;
+    }
+
+    swtp_setSequenceNumbers(swtp, &repairedFrame, missingFrameSequenceNumber, 0);
+    repairedFrame.size = payloadSize + headerSize;
+
+    if(!swtp_isFrameAuthentic(swtp, &repairedFrame, missingFrameSequenceNumber)) {
+        // Ignore forged parity frame
+        return SWTP_SUCCESS;
+    }
+
+    printf("Repaired DATA %u\n", missingFrameSequenceNumber);
+
+    swtp->stats.repairedDataFrames++;
+
+    swtp_storeReceivedFrame(swtp, &repairedFrame, missingFrameSequenceNumber);
+    swtp_deliverReceivedFrames(swtp);
+
+    return swtp_sendRR(swtp);
+}
+
+void swtp_buildSABM(swtp_frame_t *frame, const swtp_sabm_t *sabm) {
+    // Larger windows are only carried by the EXTENDED option
+    uint32_t header = htonl(0x80000000 | (sabm->windowSize < SWTP_MAX_WINDOW_SIZE ? sabm->windowSize : SWTP_MAX_WINDOW_SIZE));
+    uint32_t byteWindowSize = sabm->byteWindowSize > 0 ? sabm->byteWindowSize - 1 : 0;
+    uint8_t *payload = frame->frame.payload;
+
+    if(byteWindowSize > 0xffffff) {
+        byteWindowSize = 0xffffff;
+    }
+
+    memcpy(frame->frame.header, &header, SWTP_HEADER_SIZE);
+
+    // The sizes are not zero-based
+    payload[0] = sabm->overheadSize > 0 ? sabm->overheadSize - 1 : 0;
+    payload[1] = byteWindowSize >> 16;
+    payload[2] = byteWindowSize >> 8;
+    payload[3] = byteWindowSize;
+    payload += SWTP_SABM_PAYLOAD_SIZE;
+
+    if(sabm->hasSession) {
+        uint32_t sessionId = htonl(sabm->sessionId);
+
+        // The expected frame number of an extended session is 4 bytes long
+        size_t expectedFrameNumberSize = sabm->extended ? 4 : 2;
+
+        payload[0] = sabm->resume ? SWTP_SABM_OPTION_RESUME : SWTP_SABM_OPTION_SESSION;
+        payload[1] = sabm->resume ? SWTP_SESSION_SIZE + expectedFrameNumberSize : SWTP_SESSION_SIZE;
+        memcpy(payload + 2, &sessionId, 4);
+        memcpy(payload + 6, sabm->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+        payload += 2 + SWTP_SESSION_SIZE;
+
+        if(sabm->resume && sabm->extended) {
+            uint32_t expectedFrameNumber = htonl(sabm->expectedFrameNumber);
+
+            memcpy(payload, &expectedFrameNumber, 4);
+            payload += 4;
+        } else if(sabm->resume) {
+            uint16_t expectedFrameNumber = htons(sabm->expectedFrameNumber);
+
+            memcpy(payload, &expectedFrameNumber, 2);
+            payload += 2;
+        }
+    }
+
+    if(sabm->hasCookie) {
+        payload[0] = SWTP_SABM_OPTION_COOKIE;
+        payload[1] = SWTP_COOKIE_SIZE;
+        memcpy(payload + 2, sabm->cookie, SWTP_COOKIE_SIZE);
+        payload += 2 + SWTP_COOKIE_SIZE;
+    }
+
+    if(sabm->extended) {
+        uint32_t windowSize = htonl(sabm->windowSize);
+
+        payload[0] = SWTP_SABM_OPTION_EXTENDED;
+        payload[1] = 4;
+        memcpy(payload + 2, &windowSize, 4);
+        payload += 2 + 4;
+    }
+
+    if(sabm->sack) {
+        payload[0] = SWTP_SABM_OPTION_SACK;
+        payload[1] = 0;
+        payload += 2;
+    }
+
+    if(sabm->pmtu) {
+        payload[0] = SWTP_SABM_OPTION_PMTU;
+        payload[1] = 0;
+        payload += 2;
+    }
+
+    if(sabm->hasKey) {
+        payload[0] = SWTP_SABM_OPTION_KEY;
+        payload[1] = SWTP_KEY_SIZE;
+        memcpy(payload + 2, sabm->publicKey, SWTP_KEY_SIZE);
+        payload += 2 + SWTP_KEY_SIZE;
+    }
+
+    frame->size = payload - (uint8_t *)&frame->frame;
+}
+
+int swtp_parseSABM(const swtp_frame_t *frame, swtp_sabm_t *sabm) {
+    if(frame->size < SWTP_HEADER_SIZE) {
+        return SWTP_ERROR;
+    }
+
+    uint32_t header = ntohl(*(const uint32_t *)frame->frame.header);
+
+    if((header & 0xffff8000) != 0x80000000) {
+        return SWTP_ERROR;
+    }
+
+    memset(sabm, 0, sizeof(swtp_sabm_t));
+    sabm->windowSize = header & 0x7fff;
+
+    // Larger windows would make old sequence numbers look new
+    if(sabm->windowSize > SWTP_MAX_WINDOW_SIZE) {
+        sabm->windowSize = SWTP_MAX_WINDOW_SIZE;
+    }
+
+    // SABM frames without payload are still accepted
+    if(frame->size < SWTP_HEADER_SIZE + SWTP_SABM_PAYLOAD_SIZE) {
+        return SWTP_SUCCESS;
+    }
+
+    const uint8_t *payload = frame->frame.payload;
+    const uint8_t *payloadEnd = (const uint8_t *)&frame->frame + frame->size;
+    uint32_t extendedWindowSize = 0;
+
+    sabm->overheadSize = payload[0] + 1;
+    sabm->byteWindowSize = ((payload[1] << 16) | (payload[2] << 8) | payload[3]) + 1;
+    payload += SWTP_SABM_PAYLOAD_SIZE;
+
+    while(payloadEnd - payload >= 2) {
+        uint8_t optionType = payload[0];
+        uint8_t optionLength = payload[1];
+
+        if(payloadEnd - payload - 2 < optionLength) {
+            return SWTP_ERROR;
+        }
+
+        if(
+            (optionType == SWTP_SABM_OPTION_SESSION && optionLength == SWTP_SESSION_SIZE)
+            || (optionType == SWTP_SABM_OPTION_RESUME && optionLength == SWTP_SESSION_SIZE + 2)
+            || (optionType == SWTP_SABM_OPTION_RESUME && optionLength == SWTP_SESSION_SIZE + 4)
+        ) {
+            sabm->hasSession = true;
+            sabm->sessionId = ntohl(*(const uint32_t *)(payload + 2));
+            memcpy(sabm->sessionToken, payload + 6, SWTP_SESSION_TOKEN_SIZE);
+
+            if(optionType == SWTP_SABM_OPTION_RESUME && optionLength == SWTP_SESSION_SIZE + 4) {
+                sabm->resume = true;
+                sabm->expectedFrameNumber = ntohl(*(const uint32_t *)(payload + 2 + SWTP_SESSION_SIZE)) & SWTP_MAX_EXTENDED_SEQUENCE_NUMBER;
+            } else if(optionType == SWTP_SABM_OPTION_RESUME) {
+                sabm->resume = true;
+                sabm->expectedFrameNumber = ntohs(*(const uint16_t *)(payload + 2 + SWTP_SESSION_SIZE)) & SWTP_MAX_SEQUENCE_NUMBER;
+            }
+        } else if(optionType == SWTP_SABM_OPTION_COOKIE && optionLength == SWTP_COOKIE_SIZE) {
+            sabm->hasCookie = true;
+            memcpy(sabm->cookie, payload + 2, SWTP_COOKIE_SIZE);
+        } else if(optionType == SWTP_SABM_OPTION_EXTENDED && optionLength == 4) {
+            sabm->extended = true;
+            extendedWindowSize = ntohl(*(const uint32_t *)(payload + 2));
+        } else if(optionType == SWTP_SABM_OPTION_SACK && optionLength == 0) {
+            sabm->sack = true;
+        } else if(optionType == SWTP_SABM_OPTION_PMTU && optionLength == 0) {
+            sabm->pmtu = true;
+        } else if(optionType == SWTP_SABM_OPTION_KEY && optionLength == SWTP_KEY_SIZE) {
+            sabm->hasKey = true;
+            memcpy(sabm->publicKey, payload + 2, SWTP_KEY_SIZE);
+        }
+
+        payload += 2 + optionLength;
+    }
+
+    if(sabm->extended && extendedWindowSize > 0) {
+        sabm->windowSize = extendedWindowSize < SWTP_MAX_EXTENDED_WINDOW_SIZE ? extendedWindowSize : SWTP_MAX_EXTENDED_WINDOW_SIZE;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+void swtp_buildCookie(swtp_frame_t *frame, const uint8_t *cookie) {
+    frame->frame.header[0] = 0xb0;
+    frame->frame.header[1] = SWTP_EXT_COOKIE;
+    memset(frame->frame.header + 2, 0, 2);
+    memcpy(frame->frame.payload, cookie, SWTP_COOKIE_SIZE);
+    frame->size = SWTP_HEADER_SIZE + SWTP_COOKIE_SIZE;
+}
+
+int swtp_parseCookie(const swtp_frame_t *frame, uint8_t *cookie) {
+    if(
+        frame->size != SWTP_HEADER_SIZE + SWTP_COOKIE_SIZE
+        || frame->frame.header[0] != 0xb0
+        || frame->frame.header[1] != SWTP_EXT_COOKIE
+    ) {
+        return SWTP_ERROR;
+    }
+
+    memcpy(cookie, frame->frame.payload, SWTP_COOKIE_SIZE);
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_createSession(swtp_t *swtp) {
+    uint8_t randomBytes[SWTP_SESSION_SIZE];
+
+    if(getrandom(randomBytes, sizeof(randomBytes), 0) != sizeof(randomBytes)) {
+        return SWTP_ERROR;
+    }
+
+    memcpy(&swtp->sessionId, randomBytes, 4);
+    memcpy(swtp->sessionToken, randomBytes + 4, SWTP_SESSION_TOKEN_SIZE);
+    swtp->hasSession = true;
+
+    return SWTP_SUCCESS;
+}
+
+int swtp_parseRebind(const swtp_frame_t *frame, uint32_t *sessionId, uint8_t *sessionToken) {
+    if(
+        frame->size != SWTP_HEADER_SIZE + SWTP_SESSION_SIZE
+        || frame->frame.header[0] != 0xb0
+        || frame->frame.header[1] != SWTP_EXT_REBIND
+    ) {
+        return SWTP_ERROR;
+    }
+
+    *sessionId = ntohl(*(const uint32_t *)frame->frame.payload);
+    memcpy(sessionToken, frame->frame.payload + 4, SWTP_SESSION_TOKEN_SIZE);
+
+    return SWTP_SUCCESS;
+}
+
+bool swtp_checkSessionToken(const swtp_t *swtp, const uint8_t *sessionToken) {
+    uint8_t difference = 0;
+
+    // Do not leak the position of the first wrong byte
+    for(int i = 0; i < SWTP_SESSION_TOKEN_SIZE; i++) {
+        difference |= swtp->sessionToken[i] ^ sessionToken[i];
+    }
+
+    return swtp->hasSession && difference == 0;
+}
+
+int swtp_rebind(swtp_t *swtp, const struct sockaddr *socketAddress) {
+    mtx_lock(&swtp->sendWindowMutex);
+
+    memcpy(&swtp->socketAddress, socketAddress, sizeof(struct sockaddr));
+
+    // The extra paths must join the session again
+    swtp->pathCount = 1;
+    memset(swtp->paths, 0, sizeof(swtp->paths));
+
+    // The new address may be on a network with another path MTU
+    if(swtp->pmtuDiscovery) {
+        swtp_resetPathMtu(swtp, &swtp->paths[0]);
+        swtp_updateMaxFrameSize(swtp);
+    }
+
+    // The frames sent since the peer moved were lost
+    swtp_time_t currentTime = swtp_getTime(swtp);
+
+    for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+        swtp_frame_t *sentFrame = &swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize];
+
+        sentFrame->lastSendAttemptTime = currentTime;
+        sentFrame->path = 0;
+        sentFrame->retransmitted = true;
+        swtp_setReceiveSequenceNumber(swtp, sentFrame, swtp->expectedFrameNumber);
+
+        printf("< DATA %u (retransmit due to REBIND)\n", swtp_getSendSequenceNumber(swtp, sentFrame));
+
+        if(swtp_sendFrameOnPath(swtp, 0, sentFrame) < 0) {
+            mtx_unlock(&swtp->sendWindowMutex);
+            perror("Failed to send data frame after REBIND");
+            return SWTP_ERROR;
+        }
+
+        swtp->stats.retransmittedDataFrames++;
+    }
+
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    swtp->lastReceivedFrameTime = currentTime;
+
+    return swtp_sendRR(swtp);
+}
+
+int swtp_resume(swtp_t *swtp, const struct sockaddr *socketAddress, uint32_t peerExpectedFrameNumber) {
+    mtx_lock(&swtp->sendWindowMutex);
+    swtp_acknowledgeSentFrame(swtp, peerExpectedFrameNumber);
+    swtp->connected = true;
+    mtx_unlock(&swtp->sendWindowMutex);
+
+    printf("Resumed session %u\n", swtp->sessionId);
+
+    return swtp_rebind(swtp, socketAddress);
+}
+
+int swtp_disconnect(swtp_t *swtp) {
+    uint8_t disc[SWTP_EXTENDED_HEADER_SIZE + SWTP_CONTROL_TRAILER_SIZE];
+    size_t size = swtp_buildControlHeader(swtp, disc, 0x90000000, 0);
+
+    size = swtp_signControlFrame(swtp, disc, size);
+
+    printf("< DISC\n");
+
+    swtp->connected = false;
+
+    if(swtp_send(swtp, disc, size) < 0) {
+        perror("Failed to send DISC");
+        return SWTP_ERROR;
+    }
+
+    return SWTP_SUCCESS;
+}
+
+/*
+Updates the smoothed RTT of a path with a new sample, like TCP does.
+*/
+static inline void swtp_updatePathRtt(swtp_path_t *path, swtp_time_t rtt) {
+    // 0 means no sample
+    if(rtt < 1) {
+        rtt = 1;
+    }
+
+    if(path->smoothedRtt == 0) {
+        path->smoothedRtt = rtt;
+        path->rttVariation = rtt / 2;
+    } else {
+        swtp_time_t difference = path->smoothedRtt > rtt ? path->smoothedRtt - rtt : rtt - path->smoothedRtt;
+
+        path->rttVariation = (3 * path->rttVariation + difference) / 4;
+        path->smoothedRtt = (7 * path->smoothedRtt + rtt) / 8;
+    }
+}
+
+/*
+Returns the time a gap in the received frames may be caused by reordering
+between the paths, in milliseconds: the difference between the RTTs of the
+slowest and the fastest paths, plus their variation.
+*/
+static swtp_time_t swtp_getReorderDelay(const swtp_t *swtp) {
+    swtp_time_t minimumRtt = 0;
+    swtp_time_t maximumRtt = 0;
+    swtp_time_t maximumVariation = 0;
+
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        const swtp_path_t *path = &swtp->paths[i];
+
+        if(path->smoothedRtt == 0) {
+            // The delay of the path is unknown yet
+            return SWTP_DEFAULT_PATH_RTT;
+        }
+
+        if(minimumRtt == 0 || path->smoothedRtt < minimumRtt) {
+            minimumRtt = path->smoothedRtt;
+        }
+
+        if(path->smoothedRtt > maximumRtt) {
+            maximumRtt = path->smoothedRtt;
+        }
+
+        if(path->rttVariation > maximumVariation) {
+            maximumVariation = path->rttVariation;
+        }
+    }
+
+    swtp_time_t reorderDelay = maximumRtt - minimumRtt + 2 * maximumVariation;
+
+    if(reorderDelay < SWTP_MIN_REORDER_DELAY) {
+        return SWTP_MIN_REORDER_DELAY;
+    } else if(reorderDelay > SWTP_MAX_REORDER_DELAY) {
+        return SWTP_MAX_REORDER_DELAY;
+    }
+
+    return reorderDelay;
+}
+
+/*
+Returns true if a missing frame should be rejected now. With a single path, a
+gap means that the frame was lost. With several paths, the frame may still be
+on its way on a slower path, so it is only rejected after the reorder delay,
+and then at most once per reorder delay.
+*/
+static bool swtp_isGapExpired(swtp_t *swtp) {
+    if(swtp->pathCount <= 1) {
+        return true;
+    }
+
+    swtp_time_t currentTime = swtp_getTime(swtp);
+
+    if(swtp->gapStartTime == 0) {
+        swtp->gapStartTime = currentTime;
+        return false;
+    } else if(currentTime - swtp->gapStartTime < swtp_getReorderDelay(swtp)) {
+        return false;
+    }
+
+    swtp->gapStartTime = currentTime;
+
+    return true;
+}
+
+int swtp_addPath(swtp_t *swtp, int socket, const struct sockaddr *socketAddress) {
+    int path = swtp_findPath(swtp, socketAddress);
+
+    if(path >= 0) {
+        if(path > 0) {
+            swtp->paths[path].socket = socket;
+        }
+
+        return path;
+    } else if(swtp->pathCount >= SWTP_MAX_PATHS) {
+        return -1;
+    }
+
+    // The frames sent on different paths arrive out of order
+    if(swtp_allocateReceiveRing(swtp) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    path = swtp->pathCount;
+    memset(&swtp->paths[path], 0, sizeof(swtp_path_t));
+    swtp->paths[path].socket = socket;
+    memcpy(&swtp->paths[path].socketAddress, socketAddress, sizeof(struct sockaddr));
+
+    if(swtp->pmtuDiscovery) {
+        swtp_resetPathMtu(swtp, &swtp->paths[path]);
+    }
+
+    // Restart the round robin with the new path
+    for(unsigned int i = 0; i < swtp->pathCount; i++) {
+        swtp->paths[i].currentWeight = 0;
+    }
+
+    swtp->pathCount++;
+
+    if(swtp->pmtuDiscovery) {
+        swtp_updateMaxFrameSize(swtp);
+    }
+
+    return path;
 }
 
-int swtp_initSendWindow(swtp_t *swtp, uint_least16_t sendWindowSize) {
-    swtp->sendWindow = malloc(sizeof(swtp_frame_t) * sendWindowSize);
+int swtp_findPath(const swtp_t *swtp, const struct sockaddr *socketAddress) {
+    if(memcmp(&swtp->socketAddress, socketAddress, sizeof(struct sockaddr_in)) == 0) {
+        return 0;
+    }
 
-    if(swtp->sendWindow == NULL) {
-        return SWTP_ERROR;
+    for(unsigned int i = 1; i < swtp->pathCount; i++) {
+        if(memcmp(&swtp->paths[i].socketAddress, socketAddress, sizeof(struct sockaddr_in)) == 0) {
+            return i;
+        }
     }
 
-    swtp->sendWindowSize = sendWindowSize;
+    return -1;
+}
 
-    if(mtx_init(&swtp->sendWindowMutex, mtx_plain)) {
-        free(swtp->sendWindow);
+void swtp_buildJoin(swtp_frame_t *frame, const swtp_t *swtp, bool accepted) {
+    uint32_t sessionId = htonl(swtp->sessionId);
+
+    frame->frame.header[0] = 0xb0;
+    frame->frame.header[1] = SWTP_EXT_JOIN;
+    frame->frame.header[2] = 0;
+    frame->frame.header[3] = accepted ? 1 : 0;
+
+    memcpy(frame->frame.payload, &sessionId, 4);
+    memcpy(frame->frame.payload + 4, swtp->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+    frame->size = SWTP_HEADER_SIZE + SWTP_SESSION_SIZE;
+}
+
+int swtp_parseJoin(const swtp_frame_t *frame, uint32_t *sessionId, uint8_t *sessionToken, bool *accepted) {
+    if(
+        frame->size != SWTP_HEADER_SIZE + SWTP_SESSION_SIZE
+        || frame->frame.header[0] != 0xb0
+        || frame->frame.header[1] != SWTP_EXT_JOIN
+    ) {
         return SWTP_ERROR;
     }
 
-    swtp->connected = true;
+    *sessionId = ntohl(*(const uint32_t *)frame->frame.payload);
+    memcpy(sessionToken, frame->frame.payload + 4, SWTP_SESSION_TOKEN_SIZE);
+    *accepted = frame->frame.header[3] & 1;
 
     return SWTP_SUCCESS;
 }
 
-void swtp_destroy(swtp_t *swtp) {
-    if(swtp->sendWindow) {
-        mtx_destroy(&swtp->sendWindowMutex);
-        free(swtp->sendWindow);
+void swtp_acknowledgeSentFrame(swtp_t *swtp, uint32_t sequenceNumber) {
+    // An old acknowledgement is far beyond the end of the window
+    uint32_t acknowledgedFrameCount = swtp_getSequenceDistance(swtp, swtp->sendWindowStartSequenceNumber, sequenceNumber);
+
+    if(acknowledgedFrameCount > swtp->sendWindowLength) {
+        // Ignore wrong acknowledgement
+        printf("Ignored wrong acknowledgement\n");
+        return;
+    } else if(acknowledgedFrameCount == 0) {
+        printf("Acknowledgement for 0 frames.\n");
+        return;
+    }
+
+    printf("Acknowledged %u frames.\n", acknowledgedFrameCount);
+
+    // The last acknowledged frame gives an RTT sample for its path, unless it
+    // was retransmitted, in which case the acknowledgement may be for either
+    // transmission, or acknowledged selectively before, in which case it waited
+    // for a missing frame. The samples also give the retransmission delay of a
+    // single path.
+    swtp_frame_t *lastFrame = &swtp->sendWindow[(swtp->sendWindowStartIndex + acknowledgedFrameCount - 1) % swtp->sendWindowSize];
+
+    if(!lastFrame->retransmitted && !lastFrame->sacked && lastFrame->path < swtp->pathCount) {
+        swtp_updatePathRtt(&swtp->paths[lastFrame->path], swtp_getTime(swtp) - lastFrame->lastSendAttemptTime);
+    }
+
+    for(uint32_t i = 0; i < acknowledgedFrameCount; i++) {
+        swtp_frame_t *acknowledgedFrame = &swtp->sendWindow[(swtp->sendWindowStartIndex + i) % swtp->sendWindowSize];
+
+        swtp->sendWindowBytes -= swtp_getFrameCharge(swtp, acknowledgedFrame);
+        pktbuf_release(acknowledgedFrame->buffer);
+        acknowledgedFrame->buffer = NULL;
     }
+
+    swtp->sendWindowLength -= acknowledgedFrameCount;
+    swtp->sendWindowStartIndex += acknowledgedFrameCount;
+    swtp->sendWindowStartIndex %= swtp->sendWindowSize;
+    swtp->sendWindowStartSequenceNumber = (swtp->sendWindowStartSequenceNumber + acknowledgedFrameCount) & swtp_getSequenceNumberMask(swtp);
 }
 
-int swtllp_encapsulate(swtp_frame_t *outputFrame, const void *inputBuffer, size_t bufferSize) {
-    uint16_t etherType = ntohs(*(uint16_t *)((uint8_t *)inputBuffer + 2));
+/*
+Sets the path MTU discovery mode of the socket of a path, and returns the mode it
+had, or -1 if it could not be set. A probe is sent in IP_PMTUDISC_PROBE mode,
+with the Don't Fragment flag and regardless of the path MTU known to the kernel.
+*/
+static int swtp_setProbeMode(swtp_t *swtp, unsigned int path, int mode) {
+    int socket = path == 0 ? swtp->socket : swtp->paths[path].socket;
+    int previousMode;
+    socklen_t size = sizeof(previousMode);
+
+    if(swtp->sendCallback) {
+        return -1;
+    }
 
-    if(etherType == ETHERTYPE_IPV4) {
-        outputFrame->frame.payload[0] = SWTLLP_IPV4;
-    } else if(etherType == ETHERTYPE_IPV6) {
-        outputFrame->frame.payload[0] = SWTLLP_IPV6;
-    } else {
-        printf("swtllp_encapsulate(): unknown ethertype value 0x%04x\n", etherType);
-        return SWTP_ERROR;
+    if(getsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &previousMode, &size) < 0 || setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0) {
+        perror("Failed to set the path MTU discovery mode");
+        return -1;
+    }
+
+    return previousMode;
+}
+
+/*
+Sends a PROBE frame of the given size on a path. The parameter of the frame is
+its size, and its payload contains the path, followed by padding.
+*/
+static int swtp_sendProbe(swtp_t *swtp, unsigned int path, unsigned int size) {
+    swtp_frame_t probeFrame;
+    uint16_t probeSize = htons(size);
+
+    // The trailer of an encrypted session takes the end of the padding, so
+    // that the probe keeps its size
+    size_t trailerSize = swtp->encrypted ? SWTP_CONTROL_TRAILER_SIZE : 0;
+
+    probeFrame.frame.header[0] = 0xb0;
+    probeFrame.frame.header[1] = SWTP_EXT_PROBE;
+    memcpy(probeFrame.frame.header + 2, &probeSize, 2);
+    memset(probeFrame.frame.payload, 0, size - SWTP_HEADER_SIZE - trailerSize);
+    probeFrame.frame.payload[0] = path;
+    probeFrame.size = swtp_signControlFrame(swtp, &probeFrame.frame, size - trailerSize);
+
+    printf("< PROBE %u on path %u\n", size, path);
+
+    // The socket may be shared with other sessions, whose frames keep the mode
+    // the socket had
+    int previousMode = swtp_setProbeMode(swtp, path, IP_PMTUDISC_PROBE);
+    ssize_t result = swtp_sendOnPath(swtp, path, &probeFrame.frame, probeFrame.size);
+    int error = errno;
+
+    if(previousMode >= 0) {
+        swtp_setProbeMode(swtp, path, previousMode);
     }
 
-    memcpy(outputFrame->frame.payload + SWTLLP_HEADER_SIZE, (const uint8_t *)inputBuffer + TUN_HEADER_SIZE, bufferSize - TUN_HEADER_SIZE);
-    outputFrame->size = bufferSize + SWTLLP_HEADER_SIZE;
+    // A probe larger than the MTU of the interface is lost like any other
+    if(result < 0 && error != EMSGSIZE) {
+        errno = error;
+        perror("Failed to send PROBE");
+        return SWTP_ERROR;
+    }
 
     return SWTP_SUCCESS;
 }
 
-static inline void swtllp_setEtherTypeAndForward(swtp_t *swtp, const swtp_frame_t *frame, uint8_t *buffer, uint16_t etherType) {
-    memset(buffer, 0, 2);
-    *(uint16_t *)(buffer + 2) = htons(etherType);
-    memcpy(buffer + 4, frame->frame.payload + SWTLLP_HEADER_SIZE, frame->size - SWTLLP_HEADER_SIZE - SWTP_HEADER_SIZE);
+/*
+Sends the next probe of the path MTU discovery of a path: first a probe of the
+current frame size, which confirms it, and then a binary search between the
+largest size that went through and the smallest one that did not. Once the
+search is complete, it starts over after SWTP_PMTU_VALIDATION_INTERVAL.
+*/
+static int swtp_sendNextProbe(swtp_t *swtp, unsigned int pathIndex, swtp_time_t currentTime) {
+    swtp_path_t *path = &swtp->paths[pathIndex];
+
+    if(path->pmtuValidationTime > 0) {
+        if(currentTime - path->pmtuValidationTime < SWTP_PMTU_VALIDATION_INTERVAL) {
+            return SWTP_SUCCESS;
+        }
 
-    // Call the callback
-    if(swtp->recvCallback) {
-        swtp->recvCallback(swtp, buffer, frame->size - SWTP_HEADER_SIZE - SWTLLP_HEADER_SIZE + TUN_HEADER_SIZE);
+        // The path may have changed since the last search
+        path->pmtuValidationTime = 0;
+        path->maxFrameSizeConfirmed = false;
+        path->probeLimit = SWTP_MAX_FRAME_SIZE;
     }
+
+    if(!path->maxFrameSizeConfirmed) {
+        path->probeSize = path->maxFrameSize;
+    } else if(path->probeLimit >= path->maxFrameSize + SWTP_PMTU_SEARCH_GRANULARITY) {
+        path->probeSize = (path->maxFrameSize + path->probeLimit + 1) / 2;
+    } else {
+        printf("Path %u carries frames of %u bytes.\n", pathIndex, path->maxFrameSize);
+        path->pmtuValidationTime = currentTime;
+        return SWTP_SUCCESS;
+    }
+
+    path->probeCount = 1;
+    path->probeTime = currentTime;
+
+    return swtp_sendProbe(swtp, pathIndex, path->probeSize);
 }
 
-int swtllp_unwrap(swtp_t *swtp, const swtp_frame_t *frame) {
-    uint8_t buffer[MAXIMUM_MTU + TUN_HEADER_SIZE];
-    
-    switch(frame->frame.payload[0]) {
-        case SWTLLP_IPV4:
-            swtllp_setEtherTypeAndForward(swtp, frame, buffer, ETHERTYPE_IPV4);
-            break;
+/*
+Runs the path MTU discovery of a path from the timer. A probe that was not
+acknowledged within the retransmission delay of the path is sent again, and
+after SWTP_PMTU_MAX_PROBES attempts, its size is considered too large. If the
+current frame size does not go through anymore, the path falls back to the base
+frame size. A probe only counts as lost if the peer sent other frames since, so
+that an outage is not mistaken for a smaller path MTU.
+*/
+static int swtp_runPmtuDiscovery(swtp_t *swtp, unsigned int pathIndex, swtp_time_t currentTime) {
+    swtp_path_t *path = &swtp->paths[pathIndex];
+
+    if(path->probeSize == 0) {
+        return swtp_sendNextProbe(swtp, pathIndex, currentTime);
+    }
 
-        case SWTLLP_IPV6:
-            swtllp_setEtherTypeAndForward(swtp, frame, buffer, ETHERTYPE_IPV6);
-            break;
+    swtp_time_t probeTimeout = path->smoothedRtt > 0 ? path->smoothedRtt + 4 * path->rttVariation : SWTP_DEFAULT_PATH_RTT;
 
-        default:
-            // Ignore unknown SWTLLP header value
-            break;
+    if(currentTime - path->probeTime < probeTimeout || swtp->lastReceivedFrameTime <= path->probeTime) {
+        return SWTP_SUCCESS;
     }
 
-    return SWTP_SUCCESS;
-}
+    if(path->probeCount < SWTP_PMTU_MAX_PROBES) {
+        path->probeCount++;
+        path->probeTime = currentTime;
 
-int swtp_sendDataFrame(swtp_t *swtp, const void *buffer, size_t size) {
-    if(!swtp->connected) {
-        return SWTP_ERROR;
+        return swtp_sendProbe(swtp, pathIndex, path->probeSize);
     }
 
-    // Check the frame size
-    if(size > MAXIMUM_MTU + TUN_HEADER_SIZE) {
-        printf("Maximum payload size exceeded. (%lu > %d)\n", size, MAXIMUM_MTU + TUN_HEADER_SIZE);
-        return SWTP_ERROR;
+    printf("PROBE %u on path %u was lost.\n", path->probeSize, pathIndex);
+
+    if(path->probeSize <= path->maxFrameSize) {
+        path->maxFrameSize = SWTP_BASE_FRAME_SIZE;
+        path->maxFrameSizeConfirmed = true;
+        swtp_updateMaxFrameSize(swtp);
     }
 
-    // TODO: Wait for a slot to be available and acquire lock
-    mtx_lock(&swtp->sendWindowMutex);
+    path->probeLimit = path->probeSize - 1;
+    path->probeSize = 0;
 
-    if(swtp->sendWindowLength >= swtp->sendWindowSize) {
-        mtx_unlock(&swtp->sendWindowMutex);
-        printf("Lost frame due to window saturation.\n");
+    return swtp_sendNextProbe(swtp, pathIndex, currentTime);
+}
+
+/*
+Reads a PROBE frame. A probe, whose size is its parameter, is acknowledged with
+the same frame without its padding. An acknowledgement raises the frame size of
+the path, and the next probe is sent right away.
+*/
+static int swtp_onProbeFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
+    if(frame->size < SWTP_HEADER_SIZE + 1) {
+        // Ignore malformed PROBE frame
         return SWTP_SUCCESS;
     }
 
-    // Compute sequence numbers
-    uint_least16_t sendSequenceNumber = htons((swtp->sendWindowStartSequenceNumber + swtp->sendWindowLength) & 0x7fff);
-    uint_least16_t receiveSequenceNumber = htons(swtp->expectedFrameNumber);
-    uint_least16_t sendWindowIndex = (swtp->sendWindowStartIndex + swtp->sendWindowLength) % swtp->sendWindowSize;
+    unsigned int probeSize = ntohs(*(const uint16_t *)(frame->frame.header + 2));
+    unsigned int pathIndex = frame->frame.payload[0];
 
-    // Reserve a slot in the send window
-    swtp->sendWindowLength++;
+    // The trailer of an encrypted session was already removed
+    size_t receivedSize = frame->size + (swtp->encrypted ? SWTP_CONTROL_TRAILER_SIZE : 0);
 
-    if(swtllp_encapsulate(&swtp->sendWindow[sendWindowIndex], buffer, size) == SWTP_ERROR) {
-        mtx_unlock(&swtp->sendWindowMutex);
-        printf("SWTLLP encapsulation failed.\n");
-        return SWTP_ERROR;
+    if(receivedSize == probeSize) {
+        swtp_frame_t acknowledgementFrame;
+
+        printf("> PROBE %u\n", probeSize);
+
+        memcpy(acknowledgementFrame.frame.header, frame->frame.header, SWTP_HEADER_SIZE);
+        acknowledgementFrame.frame.payload[0] = pathIndex;
+        acknowledgementFrame.size = swtp_signControlFrame(swtp, &acknowledgementFrame.frame, SWTP_HEADER_SIZE + 1);
+
+        if(swtp_send(swtp, &acknowledgementFrame.frame, acknowledgementFrame.size) < 0) {
+            perror("Failed to acknowledge PROBE");
+            return SWTP_ERROR;
+        }
+
+        return SWTP_SUCCESS;
     }
-    
-    // Set the sequence numbers in the buffer
-    memcpy(swtp->sendWindow[sendWindowIndex].frame.header, &sendSequenceNumber, 2);
-    memcpy(swtp->sendWindow[sendWindowIndex].frame.header + 2, &receiveSequenceNumber, 2);
 
-    swtp->sendWindow[sendWindowIndex].lastSendAttemptTime = time(NULL);
+    printf("> PROBE %u acknowledged on path %u\n", probeSize, pathIndex);
 
-    printf("< DATA %d\n", ntohs(sendSequenceNumber));
+    int result = SWTP_SUCCESS;
 
-    // Send the data frame
-    if(sendto(swtp->socket, &swtp->sendWindow[sendWindowIndex].frame, swtp->sendWindow[sendWindowIndex].size, 0, (struct sockaddr *)&swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
-        mtx_unlock(&swtp->sendWindowMutex);
-        perror("Failed to send data frame");
-        return SWTP_ERROR;
+    mtx_lock(&swtp->sendWindowMutex);
+
+    if(swtp->pmtuDiscovery && pathIndex < swtp->pathCount && probeSize > 0 && swtp->paths[pathIndex].probeSize == probeSize) {
+        swtp_path_t *path = &swtp->paths[pathIndex];
+
+        path->maxFrameSize = probeSize > path->maxFrameSize ? probeSize : path->maxFrameSize;
+        path->maxFrameSizeConfirmed = true;
+        path->probeSize = 0;
+        swtp_updateMaxFrameSize(swtp);
+
+        result = swtp_sendNextProbe(swtp, pathIndex, swtp_getTime(swtp));
     }
 
     mtx_unlock(&swtp->sendWindowMutex);
 
-    return SWTP_SUCCESS;
+    return result;
 }
 
-bool swtp_isSentFrameNumberValid(const swtp_t *swtp, uint_least16_t seq) {
-    // Check that the sequence number is between the send window bounds
-    if(seq > SWTP_MAX_SEQUENCE_NUMBER) {
-        return NULL;
+/*
+Reads a WINDOW frame. A new receive window of the peer limits the send window
+right away, and the application may then grow it. The frame is acknowledged
+even if it is older than the last one applied, as the acknowledgement of the
+last one may have been lost.
+*/
+static int swtp_onWindowFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
+    if(frame->size != SWTP_HEADER_SIZE + SWTP_WINDOW_PAYLOAD_SIZE) {
+        // Ignore malformed WINDOW frame
+        return SWTP_SUCCESS;
     }
 
-    uint_least16_t windowStart = swtp->sendWindowStartSequenceNumber % SWTP_SEQUENCE_NUMBER_COUNT;
-    uint_least16_t windowEnd = (windowStart + swtp->sendWindowLength) % SWTP_SEQUENCE_NUMBER_COUNT;
+    uint16_t parameter = ntohs(*(const uint16_t *)(frame->frame.header + 2));
+    uint16_t update = parameter & ~SWTP_WINDOW_ACKNOWLEDGEMENT;
+    uint32_t windowSize = ntohl(*(const uint32_t *)frame->frame.payload);
+    uint32_t byteWindowSize = ntohl(*(const uint32_t *)(frame->frame.payload + 4));
 
-    if(windowEnd < windowStart) {
-        return seq >= windowStart;
-    } else {
-        return (seq >= windowStart) && (seq < windowEnd);
+    mtx_lock(&swtp->sendWindowMutex);
+
+    if(parameter & SWTP_WINDOW_ACKNOWLEDGEMENT) {
+        printf("> WINDOW %u acknowledged\n", windowSize);
+
+        if(update == swtp->receiveWindowUpdate) {
+            swtp->receiveWindowPending = false;
+        }
+
+        mtx_unlock(&swtp->sendWindowMutex);
+
+        return SWTP_SUCCESS;
     }
-}
 
-swtp_frame_t *swtp_getSentFrame(const swtp_t *swtp, uint_least16_t seq) {
-    if(swtp_isSentFrameNumberValid(swtp, seq)) {
-        return &swtp->sendWindow[((seq - swtp->sendWindowStartSequenceNumber) + swtp->sendWindowStartIndex) % swtp->sendWindowSize];
-    } else {
-        return NULL;
+    printf("> WINDOW %u (%u bytes)\n", windowSize, byteWindowSize);
+
+    // Only the updates that are newer than the last one, with serial number
+    // arithmetic, are applied
+    uint16_t distance = (update - swtp->peerWindowUpdate) & ~SWTP_WINDOW_ACKNOWLEDGEMENT;
+    bool applied = windowSize > 0 && distance > 0 && distance < SWTP_WINDOW_ACKNOWLEDGEMENT / 2;
+
+    if(applied) {
+        swtp->peerWindowUpdate = update;
+        swtp->peerWindowSize = windowSize < swtp_getMaxWindowSize(swtp) ? windowSize : swtp_getMaxWindowSize(swtp);
+        swtp->peerByteWindowSize = byteWindowSize;
+
+        if(swtp->sendWindowLimit > swtp->peerWindowSize) {
+            swtp->sendWindowLimit = swtp->peerWindowSize;
+        }
     }
-}
 
-static inline int swtp_sendRR(swtp_t *swtp) {
-    uint32_t rr = htonl(0xe0000000 | swtp->expectedFrameNumber);
+    int result = swtp_sendWindowFrame(swtp, parameter | SWTP_WINDOW_ACKNOWLEDGEMENT, windowSize, byteWindowSize);
 
-    printf("< RR %d\n", swtp->expectedFrameNumber);
+    mtx_unlock(&swtp->sendWindowMutex);
 
-    if(sendto(swtp->socket, &rr, SWTP_HEADER_SIZE, 0, &swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
-        perror("Failed to send RR");
-        return SWTP_ERROR;
+    if(applied && swtp->windowCallback) {
+        swtp->windowCallback(swtp, swtp->peerWindowSize, swtp->peerByteWindowSize);
     }
 
-    return SWTP_SUCCESS;
+    return result;
 }
 
-static inline void swtp_acknowledgeSentFrame(swtp_t *swtp, uint_least16_t sequenceNumber) {
-    uint_least16_t acknowledgedFrameCount;
-
-    if(sequenceNumber < swtp->sendWindowStartSequenceNumber) {
-        acknowledgedFrameCount = SWTP_MAX_SEQUENCE_NUMBER - swtp->sendWindowStartSequenceNumber + sequenceNumber;
-    } else {
-        acknowledgedFrameCount = sequenceNumber - swtp->sendWindowStartSequenceNumber;
+int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
+    if(swtp->frameCallback) {
+        swtp->frameCallback(swtp, SWTP_DIRECTION_RECEIVED, &frame->frame, frame->size);
     }
 
-    if(acknowledgedFrameCount > swtp->sendWindowLength) {
-        // Ignore wrong acknowledgement
-        printf("Ignored wrong acknowledgement\n");
-        return;
-    } else if(acknowledgedFrameCount == 0) {
-        printf("Acknowledgement for 0 frames.\n");
-        return;
+    // An encrypted session only acts on the control frames of the peer, which
+    // are then handled without their trailer
+    swtp_frame_t openedFrame;
+
+    if(swtp->encrypted && (frame->frame.header[0] & 0x80) && swtp_isControlFrameSigned(frame->frame.header)) {
+        if(!swtp_openControlFrame(swtp, frame, &openedFrame)) {
+            swtp->stats.rejectedControlFrames++;
+            printf("Dropped a control frame with a wrong tag.\n");
+            return SWTP_SUCCESS;
+        }
+
+        frame = &openedFrame;
     }
 
-    printf("Acknowledged %d frames.\n", acknowledgedFrameCount);
+    unsigned int controlFrameType = (frame->frame.header[0] >> 4) & 0x07;
 
-    swtp->sendWindowLength -= acknowledgedFrameCount;
-    swtp->sendWindowStartIndex += acknowledgedFrameCount;
-    swtp->sendWindowStartIndex %= swtp->sendWindowSize;
-    swtp->sendWindowStartSequenceNumber += acknowledgedFrameCount;
-    swtp->sendWindowStartSequenceNumber %= SWTP_SEQUENCE_NUMBER_COUNT;
-}
+    // Ignore the frames that are too short to carry their sequence numbers.
+    // SABM, DISC and extended control frames are checked separately.
+    if(frame->size < swtp_getHeaderSize(swtp) && (!(frame->frame.header[0] & 0x80) || controlFrameType == 2 || controlFrameType >= 4)) {
+        printf("Ignored truncated frame\n");
+        return SWTP_SUCCESS;
+    }
 
-int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
     // Determine the frame type
     if(frame->frame.header[0] & 0x80) {
         // Control frame
-        switch((frame->frame.header[0] >> 4) & 0x07) {
+        switch(controlFrameType) {
             case 0: // SABM
                 printf("> SABM\n");
                 // TODO: What to do when receiving a SABM if the connection was already established?
@@ -234,7 +2764,7 @@ int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
 
                 // Read acknowledgements
                 mtx_lock(&swtp->sendWindowMutex);
-                swtp_acknowledgeSentFrame(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                swtp_acknowledgeSentFrame(swtp, swtp_getReceiveSequenceNumber(swtp, frame));
                 mtx_unlock(&swtp->sendWindowMutex);
 
                 // Send RR
@@ -242,71 +2772,136 @@ int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
                     printf("Failed to send RR in response to TEST.\n");
                     return SWTP_ERROR;
                 }
+                break;
+
+            case 3: // Extended control frame
+                switch(frame->frame.header[1]) {
+                    case SWTP_EXT_PARITY:
+                        if(swtp_onParityFrameReceived(swtp, frame) != SWTP_SUCCESS) {
+                            return SWTP_ERROR;
+                        }
+                        break;
+
+                    case SWTP_EXT_REBIND:
+                        // The application rebinds the session when the address
+                        // of the peer changed
+                        printf("> REBIND\n");
+                        break;
+
+                    case SWTP_EXT_JOIN:
+                        // The application adds the paths
+                        printf("> JOIN\n");
+                        break;
+
+                    case SWTP_EXT_SACK:
+                        if(swtp_onSackFrameReceived(swtp, frame) != SWTP_SUCCESS) {
+                            return SWTP_ERROR;
+                        }
+                        break;
+
+                    case SWTP_EXT_PROBE:
+                        if(swtp_onProbeFrameReceived(swtp, frame) != SWTP_SUCCESS) {
+                            return SWTP_ERROR;
+                        }
+                        break;
+
+                    case SWTP_EXT_WINDOW:
+                        if(swtp_onWindowFrameReceived(swtp, frame) != SWTP_SUCCESS) {
+                            return SWTP_ERROR;
+                        }
+                        break;
 
-            case 3: // Unknown, ignore
+                    default: // Unknown, ignore
+                        break;
+                }
                 break;
             
             case 4: // SREJ
-                printf("> SREJ %d\n", ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                {
+                    uint32_t rejectedFrameSequenceNumber = swtp_getReceiveSequenceNumber(swtp, frame);
 
-                if(swtp_isSentFrameNumberValid(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)))) {
-                    swtp_frame_t *rejectedFrame = swtp_getSentFrame(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                    printf("> SREJ %u\n", rejectedFrameSequenceNumber);
 
-                    rejectedFrame->lastSendAttemptTime = time(NULL);
-                    
-                    // Update expected sequence number
-                    uint_least16_t receiveSequenceNumber = htons(swtp->expectedFrameNumber);
-                    memcpy(rejectedFrame->frame.header + 2, &receiveSequenceNumber, 2);
-                    
-                    printf("< DATA %d (retransmit due to SREJ)\n", ntohs(*(uint16_t *)(rejectedFrame->frame.header + 2)));
+                    // The timer retransmits from the same slots, so the frame
+                    // is only touched with the send window locked
+                    mtx_lock(&swtp->sendWindowMutex);
 
-                    if(sendto(swtp->socket, (const void *)&rejectedFrame->frame, rejectedFrame->size, 0, (struct sockaddr *)&swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
-                        perror("Failed to send data frame after SREJ");
-                        return SWTP_ERROR;
+                    if(swtp_isSentFrameNumberValid(swtp, rejectedFrameSequenceNumber)) {
+                        swtp_frame_t *rejectedFrame = swtp_getSentFrame(swtp, rejectedFrameSequenceNumber);
+
+                        rejectedFrame->lastSendAttemptTime = swtp_getTime(swtp);
+
+                        swtp_fecCountRetransmission(swtp);
+                        swtp->stats.retransmittedDataFrames++;
+                        unsigned int path = swtp_prepareRetransmission(swtp, rejectedFrame, true);
+
+                        // Update expected sequence number
+                        swtp_setReceiveSequenceNumber(swtp, rejectedFrame, swtp->expectedFrameNumber);
+
+                        printf("< DATA %u (retransmit due to SREJ)\n", swtp_getSendSequenceNumber(swtp, rejectedFrame));
+
+                        if(swtp_sendFrameOnPath(swtp, path, rejectedFrame) < 0) {
+                            mtx_unlock(&swtp->sendWindowMutex);
+                            perror("Failed to send data frame after SREJ");
+                            return SWTP_ERROR;
+                        }
                     }
+
+                    mtx_unlock(&swtp->sendWindowMutex);
                 }
                 break;
 
             case 5: // REJ
                 {
-                    printf("> REJ %d\n", ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                    uint32_t rejectedFrameSequenceNumber = swtp_getReceiveSequenceNumber(swtp, frame);
+
+                    printf("> REJ %u\n", rejectedFrameSequenceNumber);
+
+                    mtx_lock(&swtp->sendWindowMutex);
+                    swtp_fecCountRetransmission(swtp);
 
-                    uint_least16_t rejectedFrameSequenceNumber = ntohs(*(uint16_t *)(frame->frame.header + 2));
+                    // Retransmit frames from the lost one. Only the first one
+                    // is known to be lost.
+                    bool lost = true;
 
-                    // Retransmit frames from the lost one
                     while(swtp_isSentFrameNumberValid(swtp, rejectedFrameSequenceNumber)) {
                         swtp_frame_t *rejectedFrame = swtp_getSentFrame(swtp, rejectedFrameSequenceNumber);
+                        unsigned int path = swtp_prepareRetransmission(swtp, rejectedFrame, lost);
 
-                        rejectedFrame->lastSendAttemptTime = time(NULL);
+                        rejectedFrame->lastSendAttemptTime = swtp_getTime(swtp);
+                        lost = false;
                     
                         // Update expected sequence number
-                        uint_least16_t receiveSequenceNumber = htons(swtp->expectedFrameNumber);
-                        memcpy(rejectedFrame->frame.header + 2, &receiveSequenceNumber, 2);
+                        swtp_setReceiveSequenceNumber(swtp, rejectedFrame, swtp->expectedFrameNumber);
 
-                        printf("< DATA %d (retransmit due to REJ)\n", ntohs(*(uint16_t *)rejectedFrame->frame.header));
+                        printf("< DATA %u (retransmit due to REJ)\n", swtp_getSendSequenceNumber(swtp, rejectedFrame));
                         
-                        if(sendto(swtp->socket, (const void *)&rejectedFrame->frame, rejectedFrame->size, 0, (struct sockaddr *)&swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
+                        if(swtp_sendFrameOnPath(swtp, path, rejectedFrame) < 0) {
+                            mtx_unlock(&swtp->sendWindowMutex);
                             perror("Failed to send data frame after REJ");
                             return SWTP_ERROR;
                         }
 
-                        rejectedFrameSequenceNumber++;
-                        rejectedFrameSequenceNumber &= 0x7fff;
+                        swtp->stats.retransmittedDataFrames++;
+
+                        rejectedFrameSequenceNumber = (rejectedFrameSequenceNumber + 1) & swtp_getSequenceNumberMask(swtp);
                     }
+
+                    mtx_unlock(&swtp->sendWindowMutex);
                 }
                 break;
 
             case 6: // RR
-                printf("> RR %d\n", ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                printf("> RR %u\n", swtp_getReceiveSequenceNumber(swtp, frame));
                 mtx_lock(&swtp->sendWindowMutex);
-                swtp_acknowledgeSentFrame(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                swtp_acknowledgeSentFrame(swtp, swtp_getReceiveSequenceNumber(swtp, frame));
                 mtx_unlock(&swtp->sendWindowMutex);
                 break;
 
             case 7: // RNR
-                printf("> RNR %d\n", ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                printf("> RNR %u\n", swtp_getReceiveSequenceNumber(swtp, frame));
                 mtx_lock(&swtp->sendWindowMutex);
-                swtp_acknowledgeSentFrame(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)));
+                swtp_acknowledgeSentFrame(swtp, swtp_getReceiveSequenceNumber(swtp, frame));
                 mtx_unlock(&swtp->sendWindowMutex);
                 // TODO: set a flag to stop sending
                 break;
@@ -314,36 +2909,61 @@ int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
     } else {
         // Data frame
         // TODO: acquire lock
-        uint_least16_t frameSequenceNumber = ntohs(*(uint16_t *)frame->frame.header) & 0x7fff;
-
-        printf("> DATA %d\n", frameSequenceNumber);
+        uint32_t frameSequenceNumber = swtp_getSendSequenceNumber(swtp, frame);
 
-        // Make sure that the frame has the expected sequence number
-        if(frameSequenceNumber != swtp->expectedFrameNumber) {
-            // Compute the amount of missed frames
-            uint_least16_t missedFrameCount;
-
-            if(frameSequenceNumber < swtp->expectedFrameNumber) {
-                missedFrameCount = SWTP_MAX_SEQUENCE_NUMBER - swtp->expectedFrameNumber + frameSequenceNumber + 1;
-            } else {
-                missedFrameCount = frameSequenceNumber - swtp->expectedFrameNumber;
-            }
+        printf("> DATA %u\n", frameSequenceNumber);
 
-            // Ignore multiple (or bad) retransmissions
-            if(missedFrameCount <= swtp->sendWindowSize) {
-                uint32_t rejBuffer = htonl(0xd0000000 | swtp->expectedFrameNumber);
+        // A frame with a wrong tag is lost: it must not move the receive
+        // window, nor acknowledge the frames of this end
+        if(!swtp_isFrameAuthentic(swtp, frame, frameSequenceNumber)) {
+            swtp->stats.rejectedDataFrames++;
+            printf("Dropped a data frame with a wrong tag.\n");
+            return SWTP_SUCCESS;
+        }
 
-                printf("< REJ %d\n", swtp->expectedFrameNumber);
+        swtp->stats.receivedDataFrames++;
 
-                if(sendto(swtp->socket, &rejBuffer, SWTP_HEADER_SIZE, 0, &swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
+        // Make sure that the frame has the expected sequence number
+        if(frameSequenceNumber != swtp->expectedFrameNumber) {
+            // Compute the amount of missed frames. A frame that was already
+            // received gives a count larger than any window.
+            uint32_t missedFrameCount = swtp_getSequenceDistance(swtp, swtp->expectedFrameNumber, frameSequenceNumber);
+
+            if(swtp->receiveRing && missedFrameCount < SWTP_RECEIVE_RING_SIZE - SWTP_FEC_MAX_BLOCK_SIZE) {
+                // Keep the frame until the missing ones are repaired
+                swtp_storeReceivedFrame(swtp, frame, frameSequenceNumber);
+
+                // If the gap is larger than a FEC block, then the parity frame
+                // that could have repaired it was lost. With several paths,
+                // the missing frame may also arrive later.
+                if(missedFrameCount >= swtp->peerFecBlockSize && swtp_isGapExpired(swtp)) {
+                    if((swtp->sack ? swtp_sendSACK(swtp, true) : swtp_sendREJ(swtp)) != SWTP_SUCCESS) {
+                        // TODO: release lock
+                        return SWTP_ERROR;
+                    }
+                }
+            } else if(missedFrameCount <= swtp->sendWindowSize) {
+                // Ignore multiple (or bad) retransmissions
+                if((swtp->sack ? swtp_sendSACK(swtp, true) : swtp_sendREJ(swtp)) != SWTP_SUCCESS) {
                     // TODO: release lock
-                    perror("Failed to send REJ");
                     return SWTP_ERROR;
                 }
             }
+        } else if(swtp->receiveRing) {
+            // Keep the frame for FEC, and pass it to SWTLLP with the following
+            // frames that were received out of order
+            swtp->gapStartTime = 0;
+            swtp_storeReceivedFrame(swtp, frame, frameSequenceNumber);
+            swtp_deliverReceivedFrames(swtp);
+
+            // Acknowledge the frames, and those still received out of order
+            if(swtp->sack) {
+                swtp_sendSACK(swtp, false);
+            } else {
+                swtp_sendRR(swtp);
+            }
         } else {
-            swtp->expectedFrameNumber++;
-            swtp->expectedFrameNumber %= SWTP_SEQUENCE_NUMBER_COUNT;
+            swtp->expectedFrameNumber = (swtp->expectedFrameNumber + 1) & swtp_getSequenceNumberMask(swtp);
 
             // Acknowledge the frame
             swtp_sendRR(swtp);
@@ -354,13 +2974,13 @@ int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame) {
 
         // Read acknowledgements
         mtx_lock(&swtp->sendWindowMutex);
-        swtp_acknowledgeSentFrame(swtp, ntohs(*(uint16_t *)(frame->frame.header + 2)));
+        swtp_acknowledgeSentFrame(swtp, swtp_getReceiveSequenceNumber(swtp, frame));
         mtx_unlock(&swtp->sendWindowMutex);
 
         // TODO: release lock
     }
 
-    swtp->lastReceivedFrameTime = time(NULL);
+    swtp->lastReceivedFrameTime = swtp_getTime(swtp);
 
     return SWTP_SUCCESS;
 }
@@ -370,80 +2990,143 @@ int swtp_onTimerTick(swtp_t *swtp) {
         return SWTP_ERROR;
     }
 
-    time_t currentTime = time(NULL);
+    swtp_time_t currentTime = swtp_getTime(swtp);
 
     mtx_lock(&swtp->sendWindowMutex);
 
-    time_t timeSinceLastPacketReceived = currentTime - swtp->lastReceivedFrameTime;
+    swtp_time_t timeSinceLastPacketReceived = currentTime - swtp->lastReceivedFrameTime;
+    swtp_time_t keepaliveInterval = swtp_getKeepaliveInterval(swtp);
 
-    if(timeSinceLastPacketReceived >= SWTP_PING_TIMEOUT) {
-        if((timeSinceLastPacketReceived % SWTP_TIMEOUT) == 0) {
-            if(timeSinceLastPacketReceived - SWTP_PING_TIMEOUT >= SWTP_MAXRETRY * SWTP_TIMEOUT) {
-                swtp->connected = false;
+    // Any frame received since the last TEST proves that the peer is alive. The
+    // answer may come within the same millisecond.
+    if(swtp->lastKeepaliveTime <= swtp->lastReceivedFrameTime) {
+        swtp->keepaliveProbesSent = 0;
+    }
 
-                // Break connection due to timeout
-                if(swtp->disconnectCallback) {
-                    swtp->disconnectCallback(swtp, SWTP_DISCONNECTREASON_TIMEOUT);
-                }
+    // With an adaptive schedule, the frames in flight must be acknowledged
+    // within a retransmission delay, so their silence is suspicious much sooner
+    // than an idle one
+    swtp_time_t silenceTimeout = swtp->keepaliveAdaptive && swtp->sendWindowLength > 0 ? keepaliveInterval : swtp->keepaliveIdleTime;
 
-                mtx_unlock(&swtp->sendWindowMutex);
+    if(timeSinceLastPacketReceived >= silenceTimeout && currentTime - swtp->lastKeepaliveTime >= keepaliveInterval) {
+        if(swtp->keepaliveProbesSent >= swtp->keepaliveProbes) {
+            swtp->connected = false;
 
-                return SWTP_SUCCESS;
-            } else {
-                // Send TEST
-                uint32_t rr = htonl(0xa0000000 | swtp->expectedFrameNumber);
+            // Break connection due to timeout
+            if(swtp->disconnectCallback) {
+                swtp->disconnectCallback(swtp, SWTP_DISCONNECTREASON_TIMEOUT);
+            }
 
-                printf("< TEST %d\n", swtp->expectedFrameNumber);
+            mtx_unlock(&swtp->sendWindowMutex);
 
-                if(sendto(swtp->socket, &rr, SWTP_HEADER_SIZE, 0, &swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
-                    perror("Failed to send TEST");
+            return SWTP_SUCCESS;
+        }
 
-                    mtx_unlock(&swtp->sendWindowMutex);
+        // If the peer stopped answering, our address may have changed
+        if(swtp->roaming && swtp->hasSession) {
+            // The peer forgets the extra paths when it rebinds the session
+            swtp->pathCount = 1;
 
-                    return SWTP_ERROR;
-                }
+            if(swtp_sendRebind(swtp) != SWTP_SUCCESS) {
+                mtx_unlock(&swtp->sendWindowMutex);
+                return SWTP_ERROR;
             }
         }
-    }
-    
-    printf("Clock tick at %ld. Send Window: (", currentTime);
 
-    bool first = true;
+        // Send TEST
+        uint8_t test[SWTP_EXTENDED_HEADER_SIZE + SWTP_CONTROL_TRAILER_SIZE];
+        size_t size = swtp_buildControlHeader(swtp, test, 0xa0000000, swtp->expectedFrameNumber);
 
-    for(int i = 0; i < swtp->sendWindowLength; i++) {
-        uint_least16_t sendWindowIndex = (swtp->sendWindowStartIndex + i) % swtp->sendWindowSize;
+        size = swtp_signControlFrame(swtp, test, size);
 
-        printf(first ? "%d (%ld)" : ", %d (%ld)", ntohs(*(uint16_t *)(swtp->sendWindow[sendWindowIndex].frame.header)), swtp->sendWindow[sendWindowIndex].lastSendAttemptTime);
-        first = false;
-    }
+        printf("< TEST %u\n", swtp->expectedFrameNumber);
+
+        if(swtp_send(swtp, test, size) < 0) {
+            perror("Failed to send TEST");
+
+            mtx_unlock(&swtp->sendWindowMutex);
 
-    printf(")\n");
+            return SWTP_ERROR;
+        }
+
+        swtp->keepaliveProbesSent++;
+        swtp->lastKeepaliveTime = currentTime;
+    }
+    
+    // The timer ticks too often to log every tick, or the whole window of a
+    // large session
+    if(swtp->sendWindowLength > 0 && currentTime - swtp->lastTickLogTime >= 1000) {
+        const swtp_frame_t *firstFrame = &swtp->sendWindow[swtp->sendWindowStartIndex];
+        const swtp_frame_t *lastFrame = &swtp->sendWindow[(swtp->sendWindowStartIndex + swtp->sendWindowLength - 1) % swtp->sendWindowSize];
+
+        printf("Clock tick at %ld. Send window: %u frames, %u to %u\n", currentTime, swtp->sendWindowLength, swtp_getSendSequenceNumber(swtp, firstFrame), swtp_getSendSequenceNumber(swtp, lastFrame));
+        swtp->lastTickLogTime = currentTime;
+    }
 
     // If there are frames in the send window
-    for(int i = 0; i < swtp->sendWindowLength; i++) {
-        uint_least16_t sendWindowIndex = (swtp->sendWindowStartIndex + i) % swtp->sendWindowSize;
-        time_t timeSinceLastAttempt = currentTime - swtp->sendWindow[sendWindowIndex].lastSendAttemptTime;
+    for(uint32_t i = 0; i < swtp->sendWindowLength; i++) {
+        uint32_t sendWindowIndex = (swtp->sendWindowStartIndex + i) % swtp->sendWindowSize;
+        swtp_time_t timeSinceLastAttempt = currentTime - swtp->sendWindow[sendWindowIndex].lastSendAttemptTime;
+
+        // The peer already received the frame, and only needs the missing ones
+        if(swtp->sendWindow[sendWindowIndex].sacked) {
+            continue;
+        }
 
         // If the frame timed out
-        if(timeSinceLastAttempt >= SWTP_TIMEOUT) {
+        if(timeSinceLastAttempt >= SWTP_TIMEOUT * 1000) {
             // Retransmit the frame
+            unsigned int path = swtp_prepareRetransmission(swtp, &swtp->sendWindow[sendWindowIndex], true);
+
             swtp->sendWindow[sendWindowIndex].lastSendAttemptTime = currentTime;
-            
-            printf("< DATA %d (retransmit due to timeout)\n", ntohs(*(uint16_t *)(swtp->sendWindow[sendWindowIndex].frame.header)));
+            swtp_fecCountRetransmission(swtp);
+            swtp->stats.retransmittedDataFrames++;
+
+            printf("< DATA %u (retransmit due to timeout)\n", swtp_getSendSequenceNumber(swtp, &swtp->sendWindow[sendWindowIndex]));
 
-            if(sendto(swtp->socket, (const void *)&swtp->sendWindow[sendWindowIndex].frame, swtp->sendWindow[sendWindowIndex].size, 0, (struct sockaddr *)&swtp->socketAddress, sizeof(struct sockaddr_in)) < 0) {
+            if(swtp_sendFrameOnPath(swtp, path, &swtp->sendWindow[sendWindowIndex]) < 0) {
                 mtx_unlock(&swtp->sendWindowMutex);
                 perror("Failed to send data frame after timeout");
                 return SWTP_ERROR;
             }
-        } else {
+        } else if(!swtp->sendWindow[sendWindowIndex].retransmitted) {
             // We know it's useless to go further because the current frame is
             // older than the next frame. So if this frame did not time out,
-            // the next frames in the send window also won't.
+            // the next frames in the send window also won't. A frame that was
+            // retransmitted alone, after a SACK frame, may be more recent than
+            // the next frames.
             break;
         }
     }
 
+    // The last frames of a burst would wait for the parity frame of their
+    // block, and a loss among them for the retransmission timeout
+    if(swtp->fecEncoder && swtp->fecEncoder->blockLength > 0 && currentTime - swtp->fecEncoder->blockTime >= SWTP_TIMER_INTERVAL) {
+        if(swtp_fecSendParity(swtp) != SWTP_SUCCESS) {
+            mtx_unlock(&swtp->sendWindowMutex);
+            return SWTP_ERROR;
+        }
+    }
+
+    // The WINDOW frame or its acknowledgement may have been lost
+    if(swtp->receiveWindowPending && currentTime - swtp->receiveWindowTime >= keepaliveInterval) {
+        swtp->receiveWindowTime = currentTime;
+
+        if(swtp_sendWindowFrame(swtp, swtp->receiveWindowUpdate, swtp->receiveWindowSize, swtp->receiveByteWindowSize) != SWTP_SUCCESS) {
+            mtx_unlock(&swtp->sendWindowMutex);
+            return SWTP_ERROR;
+        }
+    }
+
+    if(swtp->pmtuDiscovery) {
+        for(unsigned int i = 0; i < swtp->pathCount; i++) {
+            if(swtp_runPmtuDiscovery(swtp, i, currentTime) != SWTP_SUCCESS) {
+                mtx_unlock(&swtp->sendWindowMutex);
+                return SWTP_ERROR;
+            }
+        }
+    }
+
     mtx_unlock(&swtp->sendWindowMutex);
 
     return SWTP_SUCCESS;
@@ -6,29 +6,185 @@
 #include <stdint.h>
 #include <threads.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <libswtp/chacha20poly1305.h>
+#include <libswtp/x25519.h>
+#include <libpktbuf/pktbuf.h>
 
 #define SWTP_PORT 5228
 #define SWTP_MAX_FRAME_SIZE 1500
 #define SWTP_HEADER_SIZE 4
 #define SWTP_MAX_PAYLOAD_SIZE (SWTP_MAX_FRAME_SIZE - SWTP_HEADER_SIZE)
-#define SWTP_PING_TIMEOUT 5
 #define SWTP_TIMEOUT 1
-#define SWTP_MAXRETRY 3
 #define SWTP_SUCCESS 0
 #define SWTP_ERROR -1
 #define SWTP_MAX_SEQUENCE_NUMBER 32767
 #define SWTP_SEQUENCE_NUMBER_COUNT 32768
 #define SWTP_MAX_WINDOW_SIZE 16384
 
+// In extended mode, the frames that carry a sequence number have a second
+// 32-bit word in their header, and sequence numbers are 31-bit wide. The window
+// stays far below half of the sequence number space, so that serial number
+// arithmetic can tell old frames from new ones.
+#define SWTP_EXTENDED_HEADER_SIZE 8
+#define SWTP_MAX_EXTENDED_SEQUENCE_NUMBER 0x7fffffff
+#define SWTP_MAX_EXTENDED_WINDOW_SIZE 1048576
+
+// Control frame type 3 is used for extended control frames. The second byte of
+// the header contains the extended frame type.
+#define SWTP_EXT_PARITY 0x01
+#define SWTP_EXT_REBIND 0x02
+#define SWTP_EXT_COOKIE 0x03
+#define SWTP_EXT_JOIN 0x04
+#define SWTP_EXT_SACK 0x05
+#define SWTP_EXT_PROBE 0x06
+#define SWTP_EXT_WINDOW 0x07
+
+#define SWTP_DIRECTION_RECEIVED 0
+#define SWTP_DIRECTION_SENT 1
+
+#define SWTP_FEC_MIN_BLOCK_SIZE 4
+#define SWTP_FEC_MAX_BLOCK_SIZE 32
+#define SWTP_FEC_PARITY_HEADER_SIZE 3
+
+// Set in the block size of a parity frame sent for a block that was not
+// complete when the sender became idle.
+#define SWTP_FEC_PARTIAL_BLOCK 0x80
+#define SWTP_FEC_LOSS_SAMPLE_SIZE 256
+
+// Contains the number of received frames kept to repair them with FEC or to
+// reorder them when they arrive on several paths.
+#define SWTP_RECEIVE_RING_SIZE 256
+
+#define SWTP_MAX_PATHS 8
+
+// Contains the RTT assumed for a path that has no RTT sample yet, in
+// milliseconds.
+#define SWTP_DEFAULT_PATH_RTT 100
+
+// Contains the number of frames sent on a path after which its loss counters
+// are halved, so that the loss rate follows the recent losses.
+#define SWTP_PATH_LOSS_SAMPLE_SIZE 256
+
+// Contains the bounds of the time a gap in the received frames waits for a
+// frame sent on a slower path before it is rejected, in milliseconds.
+#define SWTP_MIN_REORDER_DELAY 10
+#define SWTP_MAX_REORDER_DELAY 500
+
+// Contains the size of the bitmap of a SACK frame, in bytes. It covers the
+// frames that the receive ring can keep after the expected one.
+#define SWTP_SACK_BITMAP_SIZE (SWTP_RECEIVE_RING_SIZE / 8)
+
+// Contains the number of frames received after a missing frame, or of
+// duplicate acknowledgements, after which the missing frame is retransmitted.
+#define SWTP_FAST_RETRANSMIT_THRESHOLD 3
+
+// Contains the minimum time before a frame that was retransmitted may be
+// retransmitted again, in milliseconds.
+#define SWTP_MIN_RETRANSMIT_DELAY 10
+
+// Contains the period at which swtp_onTimerTick() must be called, in
+// milliseconds.
+#define SWTP_TIMER_INTERVAL 50
+
+// The peer is probed with TEST frames once it was silent for the keepalive
+// idle time, every keepalive interval, and is considered dead after
+// SWTP_DEFAULT_KEEPALIVE_PROBES unanswered probes: about 8 seconds by default,
+// which rides out short outages. An adaptive schedule (see swtp_setKeepalive())
+// probes at the pace of the retransmissions instead, from the minimum. The
+// times are in milliseconds.
+#define SWTP_DEFAULT_KEEPALIVE_IDLE_TIME 5000
+#define SWTP_DEFAULT_KEEPALIVE_INTERVAL 1000
+#define SWTP_DEFAULT_KEEPALIVE_PROBES 3
+#define SWTP_MIN_KEEPALIVE_INTERVAL 100
+
+// Path MTU discovery searches the largest frame that goes through each path
+// with padded PROBE frames, between the base frame size, which any path is
+// assumed to carry, and the maximum frame size. A probe is sent again up to
+// SWTP_PMTU_MAX_PROBES times before its size is considered too large, the
+// search stops once it is within SWTP_PMTU_SEARCH_GRANULARITY bytes of the
+// result, and it starts over every SWTP_PMTU_VALIDATION_INTERVAL milliseconds.
+#define SWTP_BASE_FRAME_SIZE 1200
+#define SWTP_PMTU_MAX_PROBES 3
+#define SWTP_PMTU_SEARCH_GRANULARITY 4
+#define SWTP_PMTU_VALIDATION_INTERVAL 60000
+
 #define ETHERTYPE_IPV4 0x0800
 #define ETHERTYPE_IPV6 0x86dd
 #define SWTLLP_SWTCP 0x00
 #define SWTLLP_IPV4 0x01
 #define SWTLLP_IPV6 0x02
-#define MAXIMUM_MTU 1400
 #define TUN_HEADER_SIZE 4
 #define SWTLLP_HEADER_SIZE 1
 
+// Contains the MTU of a session before, or without, path MTU discovery, and the
+// largest MTU that a session can reach, with extended headers and FEC.
+#define SWTP_DEFAULT_MTU 1400
+#define MAXIMUM_MTU (SWTP_MAX_FRAME_SIZE - SWTP_EXTENDED_HEADER_SIZE - SWTLLP_HEADER_SIZE - SWTP_FEC_PARITY_HEADER_SIZE)
+
+// IPv4 + UDP + SWTP + SWTLLP + IPv4 headers
+#define SWTP_OVERHEAD_SIZE (20 + 8 + SWTP_HEADER_SIZE + SWTLLP_HEADER_SIZE + 20)
+
+// The MSS option of the TCP SYN segments that go through the tunnel is lowered
+// to the MTU of the session minus the IP and TCP headers, so that the TCP
+// connections never send a segment that does not fit in a frame.
+#define SWTLLP_IPV4_TCP_HEADER_SIZE (20 + 20)
+#define SWTLLP_IPV6_TCP_HEADER_SIZE (40 + 20)
+
+// The SABM payload starts with the overhead size (1 byte) and the window size
+// in bytes (3 bytes), followed by options. Each option is made of a type (1
+// byte), a length (1 byte) and a value.
+#define SWTP_SABM_PAYLOAD_SIZE 4
+#define SWTP_SABM_OPTION_SESSION 0x01
+#define SWTP_SABM_OPTION_RESUME 0x02
+#define SWTP_SABM_OPTION_COOKIE 0x03
+#define SWTP_SABM_OPTION_EXTENDED 0x04
+#define SWTP_SABM_OPTION_SACK 0x05
+#define SWTP_SABM_OPTION_PMTU 0x06
+#define SWTP_SABM_OPTION_KEY 0x07
+
+// The window size in bytes of a SABM frame saturates at 16777216 bytes, which
+// does not limit the sender.
+#define SWTP_MAX_SABM_BYTE_WINDOW_SIZE 16777216
+
+// A WINDOW frame announces a new receive window: its parameter is the number of
+// the update, with SWTP_WINDOW_ACKNOWLEDGEMENT in the acknowledgement of the
+// peer, and its payload the window size in frames and in bytes (4 bytes each).
+#define SWTP_WINDOW_PAYLOAD_SIZE 8
+#define SWTP_WINDOW_ACKNOWLEDGEMENT 0x8000
+
+#define SWTP_SESSION_TOKEN_SIZE 8
+#define SWTP_SESSION_SIZE (4 + SWTP_SESSION_TOKEN_SIZE)
+
+#define SWTP_COOKIE_SIZE 8
+
+// Version of the session state written by swtp_save(), to increase whenever
+// swtp_t or the frames it contains change.
+#define SWTP_STATE_VERSION 8
+
+// When both ends offer a key, the payloads of the data frames are encrypted
+// with ChaCha20-Poly1305, under keys derived from an X25519 key exchange and an
+// optional pre-shared key. Each payload is followed by a tag.
+#define SWTP_KEY_SIZE X25519_KEY_SIZE
+#define SWTP_PRE_SHARED_KEY_SIZE CHACHA20POLY1305_KEY_SIZE
+#define SWTP_TAG_SIZE CHACHA20POLY1305_TAG_SIZE
+
+// The control frames of an encrypted session are followed by a 64-bit counter
+// and a tag over the whole frame, except the PARITY frames and those that the
+// application checks itself (REBIND, COOKIE, JOIN). The nonce of a control frame
+// is its counter with the highest bit set, which keeps it apart from the nonces
+// of the data frames. A counter is accepted once, and only within the last
+// SWTP_CONTROL_REPLAY_WINDOW counters received.
+#define SWTP_CONTROL_COUNTER_SIZE 8
+#define SWTP_CONTROL_TRAILER_SIZE (SWTP_CONTROL_COUNTER_SIZE + SWTP_TAG_SIZE)
+#define SWTP_CONTROL_NONCE_FLAG 0x8000000000000000
+#define SWTP_CONTROL_REPLAY_WINDOW 64
+
+// Time in milliseconds, from an arbitrary origin
+typedef int64_t swtp_time_t;
+
 enum {
     SWTP_DISCONNECTREASON_TIMEOUT,
     SWTP_DISCONNECTREASON_DISC
@@ -43,46 +199,563 @@ typedef struct {
         // The SWTP header
         uint8_t header[SWTP_HEADER_SIZE];
 
-        // The payload carried by the SWTP frame (if any)
+        // The payload carried by the SWTP frame (if any). In extended mode, it
+        // starts with the second word of the header.
         uint8_t payload[SWTP_MAX_PAYLOAD_SIZE];
     } __attribute__((packed)) frame;
 
     // The time of the last time an attempt to send this frame was made.
-    time_t lastSendAttemptTime;
+    swtp_time_t lastSendAttemptTime;
+
+    // The path the frame was last sent on, and whether it was sent more than
+    // once, in which case its acknowledgement does not give an RTT sample.
+    uint8_t path;
+    bool retransmitted;
+
+    // True if the peer acknowledged this frame in a SACK frame, so that it is
+    // not retransmitted.
+    bool sacked;
+
+    // Contains the packet of a data frame that shares it with other sessions.
+    // The frame then only holds the headers, and its packet is sent from the
+    // buffer. NULL if the packet was copied in the frame.
+    pktbuf_t *buffer;
 } swtp_frame_t;
 
+typedef struct {
+    // The number of data frames covered by each parity frame. 0 means that FEC
+    // is disabled.
+    unsigned int blockSize;
+
+    // If true, the block size follows the measured loss rate.
+    bool adaptive;
+
+    // The sequence number of the first frame of the current block
+    uint32_t blockStartSequenceNumber;
+
+    // The number of data frames already added to the current block
+    unsigned int blockLength;
+
+    // The time at which the last frame was added to the current block
+    swtp_time_t blockTime;
+
+    // The size of the longest payload in the current block
+    size_t parityLength;
+
+    // The XOR of the payload sizes of the current block
+    uint16_t sizeParity;
+
+    // The XOR of the payloads of the current block
+    uint8_t parity[SWTP_MAX_PAYLOAD_SIZE];
+
+    // Loss measurement, in frames, since the last block size adaptation
+    unsigned int sampleFrameCount;
+    unsigned int sampleRetransmitCount;
+
+    // Smoothed loss rate, in 1/10000
+    unsigned int lossRate;
+} swtp_fecEncoder_t;
+
+typedef struct {
+    // True if this slot contains a frame
+    bool valid;
+
+    // The sequence number of the frame stored in this slot
+    uint32_t sequenceNumber;
+
+    swtp_frame_t frame;
+} swtp_receivedFrame_t;
+
+typedef struct {
+    // Data frames sent for the first time
+    uint64_t sentDataFrames;
+
+    // Data frames sent again after a REJ, a SREJ or a timeout
+    uint64_t retransmittedDataFrames;
+
+    // Data frames dropped because the send window was full
+    uint64_t droppedDataFrames;
+
+    // Data frames retransmitted because SACK frames reported them missing
+    uint64_t fastRetransmittedDataFrames;
+
+    uint64_t sentParityFrames;
+    uint64_t sentRejects;
+    uint64_t sentSacks;
+
+    // Data frames received, including duplicates and out of order frames
+    uint64_t receivedDataFrames;
+
+    // Data frames passed to SWTLLP
+    uint64_t deliveredDataFrames;
+
+    // Data frames rebuilt from a parity frame
+    uint64_t repairedDataFrames;
+
+    // TCP SYN segments whose MSS option was lowered, in both directions
+    uint64_t clampedSegments;
+
+    // Encrypted data frames dropped because their tag was wrong
+    uint64_t rejectedDataFrames;
+
+    // Control frames of an encrypted session dropped because their tag was
+    // wrong or their counter was replayed
+    uint64_t rejectedControlFrames;
+} swtp_stats_t;
+
+typedef struct {
+    // The socket and the address of the peer. Those of the primary path are
+    // the socket and the address of the SWTP structure.
+    int socket;
+    struct sockaddr socketAddress;
+
+    // Smoothed RTT and RTT variation, in milliseconds. 0 means no sample.
+    swtp_time_t smoothedRtt;
+    swtp_time_t rttVariation;
+
+    // Data frames sent on this path, and those of them that were
+    // retransmitted, since the counters were last halved
+    unsigned int sentFrameCount;
+    unsigned int lostFrameCount;
+
+    // Smooth weighted round robin state
+    int64_t currentWeight;
+
+    // Path MTU discovery state: the largest frame known to go through the
+    // path, whether it was confirmed by a probe, the size of the probe in
+    // flight (0 if none), the largest size that may still go through, and the
+    // time at which the last search completed (0 while searching).
+    unsigned int maxFrameSize;
+    bool maxFrameSizeConfirmed;
+    unsigned int probeSize;
+    unsigned int probeCount;
+    unsigned int probeLimit;
+    swtp_time_t probeTime;
+    swtp_time_t pmtuValidationTime;
+} swtp_path_t;
+
+typedef struct {
+    // Contains the window size, in frames.
+    uint32_t windowSize;
+
+    // Contains the overhead size and the window size in bytes. Both are 0 if
+    // the SABM frame had no payload.
+    unsigned int overheadSize;
+    uint32_t byteWindowSize;
+
+    // In a SABM request, indicates that the client can roam. In a SABM
+    // response, contains the session assigned by the server.
+    bool hasSession;
+    uint32_t sessionId;
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+
+    // In a SABM request, asks the server to resume the session. In a SABM
+    // response, indicates that the session was resumed. Both carry the
+    // expected frame number of the sender, so that the peer knows which
+    // frames to retransmit.
+    bool resume;
+    uint32_t expectedFrameNumber;
+
+    // Contains the cookie that the server sent in response to a previous SABM
+    // request, which proves that the client can receive frames at its address.
+    bool hasCookie;
+    uint8_t cookie[SWTP_COOKIE_SIZE];
+
+    // In a SABM request, asks for extended sequence numbers. In a SABM
+    // response, indicates that the session uses them. The window size is then
+    // carried by the option, as it does not fit in the header.
+    bool extended;
+
+    // Indicates that the sender understands SACK frames.
+    bool sack;
+
+    // Indicates that the sender answers PROBE frames.
+    bool pmtu;
+
+    // Contains the ephemeral X25519 public key of the sender, which asks for
+    // encryption.
+    bool hasKey;
+    uint8_t publicKey[SWTP_KEY_SIZE];
+} swtp_sabm_t;
+
 struct swtp_s;
 typedef struct swtp_s swtp_t;
 
 typedef void (*swtp_recvCallback_t)(swtp_t *swtp, const void *buffer, size_t size);
 typedef void (*swtp_disconnectCallback_t)(swtp_t *swtp, int reason);
 
+// Returns the current time. The default clock is CLOCK_MONOTONIC.
+typedef swtp_time_t (*swtp_clockCallback_t)(const swtp_t *swtp);
+
+// Sends a frame to the peer, and returns a negative value if it failed. The
+// default transmit path is sendto() on the socket of the SWTP structure.
+typedef ssize_t (*swtp_sendCallback_t)(swtp_t *swtp, const void *buffer, size_t size);
+
+// Observes every frame sent or received (SWTP_DIRECTION_*), before it is
+// processed. Used to capture sessions.
+typedef void (*swtp_frameCallback_t)(swtp_t *swtp, int direction, const void *frame, size_t size);
+
+// Called when path MTU discovery changed the largest packet that the session
+// can carry.
+typedef void (*swtp_mtuCallback_t)(swtp_t *swtp, unsigned int mtu);
+
+// Called when the peer announced a new receive window, in frames and in bytes
+// (0 if unlimited). The send window was already reduced to it if needed, and
+// the application may grow it with swtp_setSendWindowSize().
+typedef void (*swtp_windowCallback_t)(swtp_t *swtp, uint32_t windowSize, uint32_t byteWindowSize);
+
 struct swtp_s {
     int socket;
     struct sockaddr socketAddress;
     swtp_recvCallback_t recvCallback;
     swtp_disconnectCallback_t disconnectCallback;
+    swtp_clockCallback_t clockCallback;
+    swtp_sendCallback_t sendCallback;
+    swtp_frameCallback_t frameCallback;
+    swtp_mtuCallback_t mtuCallback;
+    swtp_windowCallback_t windowCallback;
+
+    // Application data, never used by SWTP
+    void *userData;
 
     mtx_t sendWindowMutex;
 
     swtp_frame_t *sendWindow;
-    uint_least16_t sendWindowSize;
-    uint_least16_t sendWindowStartIndex;
-    uint_least16_t sendWindowStartSequenceNumber;
-    uint_least16_t sendWindowLength;
+    uint32_t sendWindowSize;
+    uint32_t sendWindowStartIndex;
+    uint32_t sendWindowStartSequenceNumber;
+    uint32_t sendWindowLength;
+
+    // Contains the number of frames that may be in flight, at most the number
+    // of slots of the send window, and the bytes in flight, each frame counting
+    // as its packet plus the overhead size of the peer.
+    uint32_t sendWindowLimit;
+    uint32_t sendWindowBytes;
+
+    // Contains the receive window of the peer, in frames and in bytes (0 if
+    // unlimited), its overhead size, and the number of the last WINDOW frame
+    // applied.
+    uint32_t peerWindowSize;
+    uint32_t peerByteWindowSize;
+    unsigned int peerOverheadSize;
+    uint16_t peerWindowUpdate;
+
+    // Contains the receive window announced to the peer, and the number of the
+    // last WINDOW frame. The frame is sent again until the peer acknowledges
+    // it.
+    uint32_t receiveWindowSize;
+    uint32_t receiveByteWindowSize;
+    uint16_t receiveWindowUpdate;
+    bool receiveWindowPending;
+    swtp_time_t receiveWindowTime;
+
+    uint32_t expectedFrameNumber;
+
+    // If true, the session uses extended headers and 31-bit sequence numbers.
+    // It must be set before the send window is initialized.
+    bool extended;
+
+    swtp_fecEncoder_t *fecEncoder;
+
+    // Recently received frames, indexed by sequence number. It is only
+    // allocated once the peer starts sending parity frames.
+    swtp_receivedFrame_t *receiveRing;
+
+    // The block size announced by the last parity frame received
+    unsigned int peerFecBlockSize;
+
+    // If true, the peer understands SACK frames, so that the frames received
+    // out of order are kept and acknowledged selectively instead of rejected.
+    bool sack;
+
+    // Contains the number of SACK frames received in a row that did not
+    // acknowledge any new frame in sequence.
+    unsigned int duplicateAcknowledgementCount;
+
+    // If true, the largest frame of each path is discovered with PROBE frames,
+    // and the frames are limited to the smallest of them.
+    bool pmtuDiscovery;
+    unsigned int maxFrameSize;
+
+    // If true, the payloads of the data frames are encrypted, with a key for
+    // each direction. The nonce of a frame is its sequence number extended to
+    // 64 bits: the send nonce is the one of the next frame sent, and the
+    // receive nonce the one of the expected frame, from which the nonces of
+    // the frames received are estimated.
+    bool encrypted;
+    uint8_t sendKey[CHACHA20POLY1305_KEY_SIZE];
+    uint8_t receiveKey[CHACHA20POLY1305_KEY_SIZE];
+    uint64_t sendNonce;
+    uint64_t receiveNonce;
+
+    // Counters of the control frames of an encrypted session: the counter of
+    // the next one sent, the one after the highest one received, and the
+    // bitmap of the last ones received, whose lowest bit is the highest one.
+    uint64_t controlSendCounter;
+    uint64_t controlReceiveCounter;
+    uint64_t controlReplayBitmap;
+
+    swtp_time_t lastReceivedFrameTime;
+
+    // Keepalive schedule, set by swtp_setKeepalive(), and the TEST frames sent
+    // since the last frame received.
+    swtp_time_t keepaliveIdleTime;
+    swtp_time_t keepaliveInterval;
+    unsigned int keepaliveProbes;
+    bool keepaliveAdaptive;
+    unsigned int keepaliveProbesSent;
+    swtp_time_t lastKeepaliveTime;
+
+    // Time the send window was last logged by the timer.
+    swtp_time_t lastTickLogTime;
+
+    // Identifies the session independently of the address of the peer. The
+    // token proves that a REBIND frame comes from the owner of the session.
+    bool hasSession;
+    uint32_t sessionId;
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+
+    // If true, this end sends REBIND frames when the peer stops answering, so
+    // that the peer learns its new address after roaming.
+    bool roaming;
 
-    uint_least16_t expectedFrameNumber;
+    // Contains the paths to the peer. The first one is the primary path, the
+    // others were added with JOIN frames. Data frames are spread over the
+    // paths, the better ones getting more frames.
+    swtp_path_t paths[SWTP_MAX_PATHS];
+    unsigned int pathCount;
 
-    time_t lastReceivedFrameTime;
+    // Contains the time the receiver started waiting for a missing frame while
+    // the following ones arrived on other paths. 0 means no gap.
+    swtp_time_t gapStartTime;
+
+    swtp_stats_t stats;
 
     bool connected;
 };
 
 void swtp_init(swtp_t *swtp, int socket, const struct sockaddr *socketAddress);
-int swtp_initSendWindow(swtp_t *swtp, uint_least16_t sendWindowSize);
+
+/*
+Allocates the send window once the connection is established. The clock and
+send callbacks, if any, must be set before calling this function.
+*/
+int swtp_initSendWindow(swtp_t *swtp, uint32_t sendWindowSize);
 void swtp_destroy(swtp_t *swtp);
+
+/*
+Sets the receive window of the peer, from its SABM frame, once the send window
+is initialized. The overhead size and the byte window are 0 if the SABM frame
+had no payload. The send window is reduced to the window of the peer if needed.
+*/
+void swtp_setPeerWindow(swtp_t *swtp, uint32_t windowSize, unsigned int overheadSize, uint32_t byteWindowSize);
+
+/*
+Resizes the send window, within the receive window of the peer, without
+interrupting the session. The frames in flight are kept, so the window only
+shrinks to their number, and the rest of its memory is released by a later
+call.
+*/
+int swtp_setSendWindowSize(swtp_t *swtp, uint32_t size);
+
+/*
+Sets the receive window announced to the peer, in frames and in bytes (0 if
+unlimited). Once the session is established, the peer is told with a WINDOW
+frame, which is sent again until it is acknowledged.
+*/
+int swtp_setReceiveWindow(swtp_t *swtp, uint32_t windowSize, uint32_t byteWindowSize);
+
+/*
+Writes the state of a session to a file descriptor, including the frames of its
+send window and of its receive ring, so that another process of the same host
+restores it with swtp_restore(). The times are CLOCK_MONOTONIC times, which
+only make sense on the same host. The state is only readable by a build with
+the same SWTP_STATE_VERSION and the same layout.
+*/
+int swtp_save(const swtp_t *swtp, int fd);
+
+/*
+Reads a session written by swtp_save(). The callbacks and the user data are
+cleared, and the sockets are those of the process that saved the session, so
+the caller must set them again.
+*/
+int swtp_restore(swtp_t *swtp, int fd);
 int swtp_sendDataFrame(swtp_t *swtp, const void *buffer, size_t size);
-swtp_frame_t *swtp_getSentFrame(const swtp_t *swtp, uint_least16_t seq);
+
+/*
+Sends a packet like swtp_sendDataFrame(), from a buffer shared with other
+sessions. The send window keeps a reference to the buffer instead of a copy of
+the packet. An encrypted session encrypts the packet straight from the buffer,
+and only keeps its ciphertext. A TCP segment whose MSS may be clamped is copied.
+*/
+int swtp_sendSharedDataFrame(swtp_t *swtp, pktbuf_t *buffer);
+bool swtp_isSentFrameNumberValid(const swtp_t *swtp, uint32_t seq);
+swtp_frame_t *swtp_getSentFrame(const swtp_t *swtp, uint32_t seq);
+swtp_time_t swtp_getTime(const swtp_t *swtp);
+
+/*
+Returns the size of the header of the frames that carry a sequence number,
+which depends on whether the session uses extended sequence numbers.
+*/
+size_t swtp_getHeaderSize(const swtp_t *swtp);
+
+/*
+Returns the send sequence number of a data frame.
+*/
+uint32_t swtp_getSendSequenceNumber(const swtp_t *swtp, const swtp_frame_t *frame);
+
+/*
+Returns the receive sequence number of a data frame, or the sequence number
+carried by a control frame.
+*/
+uint32_t swtp_getReceiveSequenceNumber(const swtp_t *swtp, const swtp_frame_t *frame);
+
+/*
+Removes the frames acknowledged by the given receive sequence number from the
+send window. The send window mutex must be held.
+*/
+void swtp_acknowledgeSentFrame(swtp_t *swtp, uint32_t sequenceNumber);
+
+int swtllp_encapsulate(swtp_t *swtp, swtp_frame_t *outputFrame, const void *inputBuffer, size_t bufferSize);
+int swtllp_unwrap(swtp_t *swtp, const swtp_frame_t *frame);
+
+/*
+Returns the number of data frames that can be sent before the send window is
+full, in frames or in bytes, counting the frames as large as the MTU.
+*/
+unsigned int swtp_getSendWindowAvailableSlots(swtp_t *swtp);
+
+/*
+Enables forward error correction on the frames sent to the peer: a parity frame
+is sent after every blockSize data frames, which allows the peer to rebuild one
+lost frame per block without waiting for a retransmission. If adaptive is true,
+blockSize is only the initial value and the block size then follows the loss
+rate measured from retransmissions.
+*/
+int swtp_enableFec(swtp_t *swtp, unsigned int blockSize, bool adaptive);
+
+/*
+Tells SWTP that the peer understands SACK frames. The frames received out of
+order are then kept, and reported to the peer in SACK frames, so that it only
+retransmits the missing ones.
+*/
+int swtp_enableSack(swtp_t *swtp);
+
+/*
+Tells SWTP that the peer answers PROBE frames. The largest frame of each path is
+then searched from the timer, and the packets are limited to the MTU that the
+smallest one allows. It must be called after FEC is enabled. A probe is sent
+with the socket of its path switched to IP_PMTUDISC_PROBE, which is restored
+right after, so the timer must not run while another thread sends on a socket
+shared with other sessions.
+*/
+void swtp_enablePmtuDiscovery(swtp_t *swtp);
+
+/*
+Generates an ephemeral X25519 key pair, whose public key is offered in a SABM
+frame.
+*/
+int swtp_generateKeyPair(uint8_t *secretKey, uint8_t *publicKey);
+
+/*
+Derives the keys of the session from the secret key of this end, the public key
+of the peer and the pre-shared key, if not NULL, and encrypts the data frames
+from then on. The client and the server derive the same keys in opposite
+directions. It must be called after the send window is initialized, and before
+path MTU discovery is enabled.
+*/
+int swtp_enableEncryption(swtp_t *swtp, const uint8_t *secretKey, const uint8_t *peerPublicKey, const uint8_t *preSharedKey, bool client);
+
+/*
+Returns the largest packet that the session can carry, without the TUN header.
+*/
+unsigned int swtp_getMtu(const swtp_t *swtp);
+
+/*
+Builds a SABM frame from the given parameters. The session is only included if
+hasSession is true.
+*/
+void swtp_buildSABM(swtp_frame_t *frame, const swtp_sabm_t *sabm);
+
+/*
+Reads a SABM frame. Unknown options are ignored. Returns SWTP_ERROR if the frame
+is not a valid SABM frame.
+*/
+int swtp_parseSABM(const swtp_frame_t *frame, swtp_sabm_t *sabm);
+
+/*
+Builds a COOKIE frame, sent by the server in response to a SABM request that
+did not contain a valid cookie.
+*/
+void swtp_buildCookie(swtp_frame_t *frame, const uint8_t *cookie);
+
+/*
+Reads a COOKIE frame. Returns SWTP_ERROR if the frame is not a valid COOKIE
+frame.
+*/
+int swtp_parseCookie(const swtp_frame_t *frame, uint8_t *cookie);
+
+/*
+Assigns a new random session identifier and token to the given structure.
+*/
+int swtp_createSession(swtp_t *swtp);
+
+/*
+Reads the session of a REBIND frame. Returns SWTP_ERROR if the frame is not a
+valid REBIND frame.
+*/
+int swtp_parseRebind(const swtp_frame_t *frame, uint32_t *sessionId, uint8_t *sessionToken);
+
+/*
+Returns true if the given token is the token of the session, in constant time.
+*/
+bool swtp_checkSessionToken(const swtp_t *swtp, const uint8_t *sessionToken);
+
+/*
+Adds a path to the peer, through the given socket and address. The frames that
+arrive out of order are then kept, as the paths have different delays. Returns
+the index of the path, or -1 if there are too many paths.
+*/
+int swtp_addPath(swtp_t *swtp, int socket, const struct sockaddr *socketAddress);
+
+/*
+Returns the index of the path with the given peer address, or -1 if there is
+none.
+*/
+int swtp_findPath(const swtp_t *swtp, const struct sockaddr *socketAddress);
+
+/*
+Builds a JOIN frame, which asks the peer to add the path it is received from
+to the session, or which confirms it if accepted is true.
+*/
+void swtp_buildJoin(swtp_frame_t *frame, const swtp_t *swtp, bool accepted);
+
+/*
+Reads the session of a JOIN frame. Returns SWTP_ERROR if the frame is not a
+valid JOIN frame.
+*/
+int swtp_parseJoin(const swtp_frame_t *frame, uint32_t *sessionId, uint8_t *sessionToken, bool *accepted);
+
+/*
+Moves the session to a new peer address, after the peer proved with a REBIND
+frame that it owns the session. The extra paths are removed, as their
+addresses probably changed too. The frames that were not acknowledged yet are
+retransmitted to the new address right away.
+*/
+int swtp_rebind(swtp_t *swtp, const struct sockaddr *socketAddress);
+
+/*
+Resumes a session after a reconnection, keeping the sequence numbers and the
+frames of the send window. The frames that the peer did not receive are
+retransmitted right away.
+*/
+int swtp_resume(swtp_t *swtp, const struct sockaddr *socketAddress, uint32_t peerExpectedFrameNumber);
+
+/*
+Closes the connection: sends a DISC frame, after which the peer forgets the
+session. The structure must then be destroyed, as nothing is answered anymore.
+*/
+int swtp_disconnect(swtp_t *swtp);
 
 /*
 This function must be called by the application code whenever a SWTP packet is
@@ -92,8 +765,19 @@ int swtp_onFrameReceived(swtp_t *swtp, const swtp_frame_t *frame);
 
 /*
 This function is responsible for checking the timeouts, therefore it must be
-called periodically, between once and twice per second.
+called periodically, every SWTP_TIMER_INTERVAL milliseconds.
 */
 int swtp_onTimerTick(swtp_t *swtp);
 
+/*
+Sets the keepalive schedule of the session, in milliseconds: the time the peer
+may stay silent, the time between two TEST frames, and the number of unanswered
+TEST frames after which the peer is considered dead. Any frame received from the
+peer proves that it is alive. If adaptive is true, the interval is only a
+maximum: the TEST frames follow the retransmission delay of the primary path,
+and the first one is sent after a single interval while frames wait for an
+acknowledgement, so that a dead peer is detected within a few RTTs.
+*/
+void swtp_setKeepalive(swtp_t *swtp, swtp_time_t idleTime, swtp_time_t interval, unsigned int probes, bool adaptive);
+
 #endif
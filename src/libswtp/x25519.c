@@ -0,0 +1,195 @@
+#include <libswtp/x25519.h>
+
+#include <string.h>
+
+// Field elements of GF(2^255 - 19) are made of 16 limbs of 16 bits, stored in
+// 64-bit integers so that products do not overflow (from TweetNaCl). Every
+// operation takes the same time whatever the values.
+typedef int64_t x25519_element_t[16];
+
+static const x25519_element_t x25519_a24 = {0xdb41, 1};
+
+static void x25519_carry(x25519_element_t element) {
+    for(int i = 0; i < 16; i++) {
+        element[i] += (int64_t)1 << 16;
+
+        int64_t carry = element[i] >> 16;
+
+        // The carry of the last limb wraps around multiplied by 38, as 2^256
+        // is 38 modulo p
+        if(i < 15) {
+            element[i + 1] += carry - 1;
+        } else {
+            element[0] += 38 * (carry - 1);
+        }
+
+        element[i] -= carry * ((int64_t)1 << 16);
+    }
+}
+
+/*
+Swaps two elements if swap is 1, in constant time.
+*/
+static void x25519_swap(x25519_element_t a, x25519_element_t b, int64_t swap) {
+    int64_t mask = ~(swap - 1);
+
+    for(int i = 0; i < 16; i++) {
+        int64_t t = mask & (a[i] ^ b[i]);
+
+        a[i] ^= t;
+        b[i] ^= t;
+    }
+}
+
+static void x25519_pack(uint8_t *output, const x25519_element_t element) {
+    x25519_element_t m;
+    x25519_element_t t;
+
+    memcpy(t, element, sizeof(t));
+    x25519_carry(t);
+    x25519_carry(t);
+    x25519_carry(t);
+
+    // Subtracts p twice if the element is not below it
+    for(int j = 0; j < 2; j++) {
+        m[0] = t[0] - 0xffed;
+
+        for(int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+
+        int64_t borrow = (m[15] >> 16) & 1;
+
+        m[14] &= 0xffff;
+        x25519_swap(t, m, 1 - borrow);
+    }
+
+    for(int i = 0; i < 16; i++) {
+        output[2 * i] = t[i] & 0xff;
+        output[2 * i + 1] = t[i] >> 8;
+    }
+}
+
+static void x25519_unpack(x25519_element_t element, const uint8_t *input) {
+    for(int i = 0; i < 16; i++) {
+        element[i] = input[2 * i] + ((int64_t)input[2 * i + 1] << 8);
+    }
+
+    element[15] &= 0x7fff;
+}
+
+static void x25519_add(x25519_element_t output, const x25519_element_t a, const x25519_element_t b) {
+    for(int i = 0; i < 16; i++) {
+        output[i] = a[i] + b[i];
+    }
+}
+
+static void x25519_subtract(x25519_element_t output, const x25519_element_t a, const x25519_element_t b) {
+    for(int i = 0; i < 16; i++) {
+        output[i] = a[i] - b[i];
+    }
+}
+
+static void x25519_multiply(x25519_element_t output, const x25519_element_t a, const x25519_element_t b) {
+    int64_t product[31] = {0};
+
+    for(int i = 0; i < 16; i++) {
+        for(int j = 0; j < 16; j++) {
+            product[i + j] += a[i] * b[j];
+        }
+    }
+
+    for(int i = 0; i < 15; i++) {
+        product[i] += 38 * product[i + 16];
+    }
+
+    memcpy(output, product, sizeof(x25519_element_t));
+    x25519_carry(output);
+    x25519_carry(output);
+}
+
+/*
+Computes the inverse of an element, as its power p - 2.
+*/
+static void x25519_invert(x25519_element_t output, const x25519_element_t input) {
+    x25519_element_t c;
+
+    memcpy(c, input, sizeof(c));
+
+    for(int i = 253; i >= 0; i--) {
+        x25519_multiply(c, c, c);
+
+        if(i != 2 && i != 4) {
+            x25519_multiply(c, c, input);
+        }
+    }
+
+    memcpy(output, c, sizeof(c));
+}
+
+int x25519(uint8_t *output, const uint8_t *scalar, const uint8_t *point) {
+    uint8_t clampedScalar[X25519_KEY_SIZE];
+    x25519_element_t x;
+    x25519_element_t a = {1};
+    x25519_element_t b;
+    x25519_element_t c = {0};
+    x25519_element_t d = {1};
+    x25519_element_t e;
+    x25519_element_t f;
+
+    memcpy(clampedScalar, scalar, X25519_KEY_SIZE);
+    clampedScalar[0] &= 248;
+    clampedScalar[31] = (clampedScalar[31] & 127) | 64;
+
+    x25519_unpack(x, point);
+    memcpy(b, x, sizeof(b));
+
+    // Montgomery ladder
+    for(int i = 254; i >= 0; i--) {
+        int64_t bit = (clampedScalar[i >> 3] >> (i & 7)) & 1;
+
+        x25519_swap(a, b, bit);
+        x25519_swap(c, d, bit);
+        x25519_add(e, a, c);
+        x25519_subtract(a, a, c);
+        x25519_add(c, b, d);
+        x25519_subtract(b, b, d);
+        x25519_multiply(d, e, e);
+        x25519_multiply(f, a, a);
+        x25519_multiply(a, c, a);
+        x25519_multiply(c, b, e);
+        x25519_add(e, a, c);
+        x25519_subtract(a, a, c);
+        x25519_multiply(b, a, a);
+        x25519_subtract(c, d, f);
+        x25519_multiply(a, c, x25519_a24);
+        x25519_add(a, a, d);
+        x25519_multiply(c, c, a);
+        x25519_multiply(a, d, f);
+        x25519_multiply(d, b, x);
+        x25519_multiply(b, e, e);
+        x25519_swap(a, b, bit);
+        x25519_swap(c, d, bit);
+    }
+
+    x25519_invert(c, c);
+    x25519_multiply(a, a, c);
+    x25519_pack(output, a);
+
+    uint8_t zero = 0;
+
+    for(int i = 0; i < X25519_KEY_SIZE; i++) {
+        zero |= output[i];
+    }
+
+    return zero ? 0 : -1;
+}
+
+void x25519_getPublicKey(uint8_t *publicKey, const uint8_t *secretKey) {
+    static const uint8_t basePoint[X25519_KEY_SIZE] = {9};
+
+    x25519(publicKey, secretKey, basePoint);
+}
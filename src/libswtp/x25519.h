@@ -0,0 +1,20 @@
+#ifndef __LIBSWTP_X25519_H_INCLUDED__
+#define __LIBSWTP_X25519_H_INCLUDED__
+
+#include <stdint.h>
+
+#define X25519_KEY_SIZE 32
+
+/*
+Computes the X25519 function (RFC 7748): the product of a point by a scalar
+on Curve25519. Returns -1 if the result is zero, which means that the point was
+of low order, and that the shared secret is not secret.
+*/
+int x25519(uint8_t *output, const uint8_t *scalar, const uint8_t *point);
+
+/*
+Computes the public key of a secret key.
+*/
+void x25519_getPublicKey(uint8_t *publicKey, const uint8_t *secretKey);
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
@@ -38,3 +39,24 @@ int libtun_open(char *deviceName) {
 int libtun_close(int fd) {
     return close(fd);
 }
+
+int libtun_setMtu(const char *deviceName, int mtu) {
+    struct ifreq ifr;
+
+    // The MTU of an interface is set through any socket
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if(fd < 0) {
+        return fd;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, deviceName, IFNAMSIZ - 1);
+    ifr.ifr_mtu = mtu;
+
+    int err = ioctl(fd, SIOCSIFMTU, &ifr);
+
+    close(fd);
+
+    return err;
+}
@@ -3,5 +3,6 @@
 
 extern int libtun_open(char *deviceName);
 extern int libtun_close(int fd);
+extern int libtun_setMtu(const char *deviceName, int mtu);
 
 #endif
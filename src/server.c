@@ -10,8 +10,19 @@
 #include <threads.h>
 #include <string.h>
 #include <libswtp/swtp.h>
+#include <libswtp/siphash.h>
+#include <libcapture/capture.h>
+#include <libsched/sched.h>
+#include <libring/ring.h>
+#include <libcluster/cluster.h>
+#include <libcpu/cpu.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <net/if.h>
 #include <signal.h>
+#include <poll.h>
 
 // Contains the client list
 swtp_t **clientList;
@@ -22,8 +33,44 @@ int clientListSize;
 // Contains the current number of clients
 int clientCount = 0;
 
-// Contains the server socket
-int serverSocket;
+// Contains, for each client that lost its connection, the time after which it
+// is removed from the client list. 0 means that the client is connected.
+swtp_time_t *clientExpiryTime;
+
+// Contains, for each slot of the client list, true if it is kept for a client
+// whose session is being migrated to another node of the cluster, so that the
+// session can be put back if the other node does not take it.
+bool *clientReserved;
+
+// Contains, for each client, the SABM frame that created its session, without
+// its cookie, and the public key that the server answered with, so that a
+// retransmitted SABM frame gets the same answer. The clients restored from
+// another server have none.
+typedef struct {
+    bool valid;
+    swtp_sabm_t request;
+    bool hasKey;
+    uint8_t publicKey[SWTP_KEY_SIZE];
+} client_sabm_t;
+
+client_sabm_t *clientSabm;
+
+// Contains the time during which the session of a client that timed out can be
+// resumed, in seconds.
+int sessionGracePeriod = 60;
+
+// Contains the server sockets, one per port. A client can spread its frames
+// over several ports, as hotspots often limit the rate of each UDP flow.
+int serverSockets[SWTP_MAX_PATHS];
+int serverSocketCount = 0;
+
+// Contains the ports of the server sockets.
+uint16_t serverPorts[SWTP_MAX_PATHS] = {SWTP_PORT};
+int serverPortCount = 1;
+
+// Contains the lifetime of the SABM cookies, in seconds. A cookie is valid
+// during the period it was created in and the next one.
+#define COOKIE_PERIOD 16
 
 // Contains the tun device
 int tunDevice;
@@ -31,6 +78,11 @@ int tunDevice;
 // Contains the tun device name
 char tunDeviceName[16];
 
+// If true, the server has no TUN device: it sends the packets of each client
+// back to it, as if a host behind the TUN device had answered them. This lets
+// bin/swtpload measure the server without root privileges on its side.
+bool echo = false;
+
 // Contains the maximum size of the receive window of the server.
 int receiveWindowSize;
 
@@ -38,15 +90,318 @@ int receiveWindowSize;
 // means unspecified.
 int sendWindowMaxSize = 0;
 
+// Contains the FEC block size used for the frames sent to the clients. 0 means
+// that FEC is disabled.
+unsigned int fecBlockSize = 0;
+
+// If true, the FEC block size follows the loss rate of each client.
+bool fecAdaptive = false;
+
+// Contains the keepalive schedule of the sessions, in milliseconds, and the
+// number of unanswered TEST frames after which a client is disconnected. The
+// schedule is only adaptive if set with --keepalive.
+swtp_time_t keepaliveIdleTime = SWTP_DEFAULT_KEEPALIVE_IDLE_TIME;
+swtp_time_t keepaliveInterval = SWTP_DEFAULT_KEEPALIVE_INTERVAL;
+unsigned int keepaliveProbes = SWTP_DEFAULT_KEEPALIVE_PROBES;
+bool keepaliveAdaptive = false;
+
+// If true, a client must echo a cookie sent by the server before anything is
+// allocated for it.
+bool sabmCookies = true;
+
+// Contains the secret key of the SABM cookies.
+uint8_t cookieKey[SIPHASH_KEY_SIZE];
+
+// If true, the data frames of the clients that offer a key are encrypted.
+bool encryption = true;
+
+// Contains the pre-shared key mixed in the keys of the sessions. If set, the
+// clients that do not offer a key are refused.
+bool hasPreSharedKey = false;
+uint8_t preSharedKey[SWTP_PRE_SHARED_KEY_SIZE];
+
+// Contains the maximum number of new sessions per second.
+int admissionRate = 100;
+
+// Contains the number of sessions that can be created right now, in
+// thousandths, and the time it was last updated.
+int64_t admissionTokens;
+swtp_time_t lastAdmissionTime;
+
+// Contains the number of sessions created, and of the clients refused because
+// too many were connecting or the client list was full, since the start.
+uint64_t acceptedSessionCount = 0;
+uint64_t refusedClientCount = 0;
+
+// Contains the number of timer ticks, the time they took, and the longest one
+// since the last stats command of the control socket, in microseconds.
+uint64_t timerTickCount = 0;
+uint64_t timerTickTime = 0;
+uint64_t maxTimerTickTime = 0;
+
+// Contains the maximum memory used by the send windows of the clients, and
+// the memory they currently use, in bytes.
+size_t windowMemoryLimit = 256 * 1024 * 1024;
+size_t windowMemory = 0;
+
+// Contains the path of the capture file. NULL means that capture is disabled.
+const char *capturePath = NULL;
+
+// Contains the number of records of the capture ring.
+uint64_t captureRecordCount = CAPTURE_DEFAULT_RECORD_COUNT;
+
+// Contains the number of payload bytes captured for each frame.
+uint32_t captureSnapLength = 0;
+
+capture_t capture;
+
+// Contains the number of sessions recorded in the capture file, which numbers
+// them, as the slots of the client list are reused.
+uint32_t captureSessionCount = 0;
+
+// Contains the egress scheduler, which has one flow per client, indexed like
+// the client list.
+sched_t scheduler;
+
+// Contains the number of packets queued for each client.
+unsigned int egressQueueSize = SCHED_DEFAULT_QUEUE_SIZE;
+
+// Contains the maximum memory used by the packets queued for all the clients,
+// in bytes. Each queued packet takes a slot of sizeof(sched_packet_t) bytes.
+size_t queueMemoryLimit = SCHED_DEFAULT_QUEUE_MEMORY;
+
+// Contains the number of bytes a client of weight 1 may send per round.
+unsigned int drrQuantum = SCHED_DEFAULT_QUANTUM;
+
+// Contains the weight and the rate limit of the new clients. The rate is in
+// kbit/s, 0 means unlimited.
+unsigned int defaultWeight = 1;
+uint64_t defaultRate = 0;
+
+// Contains the maximum time the egress thread sleeps while a client cannot
+// send, in milliseconds.
+#define EGRESS_WAIT_TIMEOUT 100
+
+// Contains the fraction of the send window of a client kept for interactive
+// packets.
+#define INTERACTIVE_WINDOW_FRACTION 8
+
+// Contains the path of the control socket. NULL means that it is disabled.
+const char *controlSocketPath = NULL;
+
+// Contains the path of the control socket of the server to take over at
+// startup. NULL means that the server starts on its own.
+const char *takeOverPath = NULL;
+
+// A server hands its TUN device, its sockets and its sessions over to another
+// process when it receives the handover command on its control socket. The
+// descriptors are passed with this header, followed by a handover_client_t
+// and the state of each session, a handover_client_t whose index is -1, and
+// the routes. The other process then answers "OK".
+#define HANDOVER_VERSION 1
+
+// Contains the time the server that hands over waits for the other process to
+// restore the sessions, in seconds.
+#define HANDOVER_TIMEOUT 10
+
+typedef struct {
+    uint32_t version;
+    int32_t serverSocketCount;
+
+    // Contains the descriptors of the server sockets in the process that
+    // hands over, which the sessions refer to, and their ports.
+    int32_t serverSockets[SWTP_MAX_PATHS];
+    uint16_t serverPorts[SWTP_MAX_PATHS];
+
+    char tunDeviceName[16];
+
+    // The cookies sent before the handover stay valid
+    uint8_t cookieKey[SIPHASH_KEY_SIZE];
+
+    int32_t routeCount;
+} handover_header_t;
+
+typedef struct {
+    int32_t clientIndex;
+    int64_t expiryTime;
+
+    // Contains the scheduling parameters of the client.
+    uint32_t weight;
+    uint64_t rate;
+    uint64_t burst;
+} handover_client_t;
+
+typedef struct {
+    handover_client_t client;
+    swtp_t *swtp;
+} handover_session_t;
+
+// A node migrates sessions to another node of the cluster in two steps, so
+// that a lost answer leaves them neither on both nodes nor on none. It sends a
+// migration_request_t of type MIGRATION_SESSIONS followed by the sessions in
+// the handover format, which the other node keeps aside and answers "OK". It
+// then sends a request of type MIGRATION_COMMIT with the same identifier, on a
+// new connection if the answer to the first one was lost. The other node adds
+// and claims the sessions on the first commit, and answers "OK" to every
+// commit of a migration it added, and "NO" to the others. A migration whose
+// connection closes before its commit is dropped, so "NO" means that the
+// sessions are still only on the node that sent them.
+#define MIGRATION_SESSIONS 0
+#define MIGRATION_COMMIT 1
+
+// Contains the number of times a node tries to commit a migration before it
+// gives the sessions up.
+#define MIGRATION_COMMIT_ATTEMPTS 3
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t id;
+} migration_request_t;
+
+// Contains the last migrations received from the other nodes, so that a
+// repeated commit gets the same answer. The sessions of a pending migration
+// are kept aside until it is committed or dropped.
+#define MIGRATION_HISTORY_SIZE 64
+
+#define MIGRATION_EMPTY 0
+#define MIGRATION_PENDING 1
+#define MIGRATION_COMMITTED 2
+#define MIGRATION_DROPPED 3
+
+typedef struct {
+    uint64_t id;
+    int state;
+    handover_header_t header;
+    handover_session_t *sessions;
+    int sessionCount;
+} migration_t;
+
+migration_t migrations[MIGRATION_HISTORY_SIZE];
+
+// Contains the index of the entry of the history that the next migration
+// replaces.
+int nextMigration = 0;
+
+// Contains the port of the UDP and TCP sockets through which the nodes of a
+// cluster steer the datagrams to the node that owns their session, and migrate
+// sessions. 0 means that the server is alone. The nodes share the server ports
+// with SO_REUSEPORT, so each one receives the datagrams of some clients.
+uint16_t clusterPort = 0;
+
+// Contains the other nodes of the cluster.
+struct sockaddr_in clusterPeers[CLUSTER_MAX_PEERS];
+int clusterPeerCount = 0;
+
+cluster_t cluster;
+thrd_t clusterThread;
+
+// True once the sessions were migrated to the other nodes with the drain
+// command. The new clients are then given to the other nodes.
+bool draining = false;
+
+// Contains the inner addresses of the clients, learned from the source address
+// of the packets they send, so that the packets read from the TUN device are
+// queued for the client they are addressed to. IPv4 addresses are stored as
+// IPv4-mapped IPv6 addresses. This is an open addressing hash table.
+#define ROUTE_TABLE_SIZE 4096
+
+typedef struct {
+    uint8_t address[16];
+
+    // -1 means that the entry is empty
+    int clientIndex;
+} route_t;
+
+route_t routeTable[ROUTE_TABLE_SIZE];
+int routeCount = 0;
+
+// If true, the main thread receives the datagrams, reads the TUN device and
+// writes to it through io_uring, instead of a blocking system call for each
+// packet. The server falls back to poll() if io_uring is not available.
+bool ioUring = false;
+
+// Contains the CPUs the threads of the server run on. The receiver is the main
+// thread, which also reads the TUN device with io_uring.
+#define THREAD_RECEIVER 0
+#define THREAD_READER 1
+#define THREAD_TIMER 2
+#define THREAD_EGRESS 3
+#define THREAD_CONTROL 4
+#define THREAD_CLUSTER 5
+
+const char *const threadNames[] = {"receiver", "reader", "timer", "egress", "control", "cluster"};
+cpu_affinity_t affinity;
+
+// Contains the time the kernel busy polls the server sockets, and the time the
+// main thread spins before it blocks, in microseconds. 0 disables both.
+uint32_t busyPollTime = 0;
+
+// Contains the number of entries of the submission queue, the number of
+// buffers provided for the datagrams and the packets read from the TUN device,
+// and the number of packets being written to the TUN device at a time.
+#define IO_RING_ENTRIES 256
+#define IO_RING_DATAGRAM_BUFFERS 1024
+#define IO_RING_TUN_BUFFERS 256
+#define IO_RING_TUN_WRITE_SLOTS 256
+
+// Contains the size of a datagram buffer, in which the kernel writes a
+// struct io_uring_recvmsg_out, the address of the client and the frame.
+#define IO_RING_DATAGRAM_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + SWTP_MAX_FRAME_SIZE)
+#define IO_RING_TUN_BUFFER_SIZE (SWTP_MAX_PAYLOAD_SIZE + TUN_HEADER_SIZE)
+
+// The user data of a request is its type, and the index of its socket or of
+// its write slot.
+#define IO_RING_DATAGRAM 1
+#define IO_RING_TUN_READ 2
+#define IO_RING_TUN_WRITE 3
+
+ring_t ioRing;
+ring_bufferGroup_t datagramBuffers;
+ring_bufferGroup_t tunBuffers;
+
+// Describes the layout of the datagram buffers to the kernel.
+struct msghdr datagramMessage;
+
+// False if the kernel does not support multishot reads, in which case the TUN
+// device is read one packet per request.
+bool tunMultishotRead = true;
+
+// Contains the registered buffer of the packets written to the TUN device,
+// and the indexes of its free slots.
+uint8_t *tunWriteBuffer;
+int tunWriteFreeSlots[IO_RING_TUN_WRITE_SLOTS];
+int tunWriteFreeSlotCount;
+
 int parseCommandLineParameters(int argc, const char **argv);
-int createServerSocket();
+int parseFecParameter(const char *value);
+int parseKeepaliveParameter(const char *value);
+int parsePortList(const char *value, uint16_t *ports, int *portCount);
+int readPreSharedKey(const char *path, uint8_t *key);
+int createServerSocket(uint16_t port);
 void mainServerLoop();
+int initIoRing();
+void destroyIoRing();
+int ioRingServerLoop();
 int tunReaderMainLoop(void *arg);
 int timerThreadMainLoop(void *arg);
+int egressThreadMainLoop(void *arg);
+int controlThreadMainLoop(void *arg);
+void removeClient(int clientIndex);
+swtp_t *detachClient(int clientIndex);
+void handOver(int fd);
+int takeOver(const char *path);
+void drainSessions(int fd);
+handover_client_t getHandoverClient(int clientIndex);
+int sendSession(int fd, const handover_client_t *client, const swtp_t *swtp);
+int clusterThreadMainLoop(void *arg);
+int migrationThreadMain(void *arg);
 
 mtx_t clientListMutex;
 thrd_t tunDeviceReaderThread;
 thrd_t timerThread;
+thrd_t egressThread;
+thrd_t controlThread;
 
 int main(int argc, const char **argv) {
     if(parseCommandLineParameters(argc, argv)) {
@@ -54,36 +409,108 @@ int main(int argc, const char **argv) {
         return EXIT_FAILURE;
     }
 
+    // The main thread is pinned before it allocates the client list and the
+    // buffers of io_uring, so that they are local to it. The other threads
+    // pin themselves when they start.
+    if(cpu_pinThread(&affinity, THREAD_RECEIVER)) {
+        perror("Failed to pin the receiver thread");
+        return EXIT_FAILURE;
+    }
+
     clientList = malloc(sizeof(swtp_t *) * clientListSize);
+    clientExpiryTime = calloc(clientListSize, sizeof(swtp_time_t));
+    clientSabm = calloc(clientListSize, sizeof(client_sabm_t));
+    clientReserved = calloc(clientListSize, sizeof(bool));
 
-    if(!clientList) {
+    if(!clientList || !clientExpiryTime || !clientSabm || !clientReserved) {
         perror("Failed to allocate memory for the client list");
         return EXIT_FAILURE;
     }
 
-    tunDevice = libtun_open(tunDeviceName);
+    // A server that takes over gets the TUN device and the sockets of the
+    // other one
+    if(!takeOverPath && !echo) {
+        tunDevice = libtun_open(tunDeviceName);
 
-    if(tunDevice < 0) {
-        perror("Failed to open TUN device");
-        return 1;
+        if(tunDevice < 0) {
+            perror("Failed to open TUN device");
+            return 1;
+        }
     }
 
-    serverSocket = createServerSocket();
+    if(capturePath) {
+        if(capture_create(&capture, capturePath, captureRecordCount, captureSnapLength)) {
+            perror("Failed to create the capture file");
+            return EXIT_FAILURE;
+        }
+    }
 
-    if(serverSocket < 0) {
-        perror("Failed to create server socket");
-        return 1;
+    if(getrandom(cookieKey, sizeof(cookieKey), 0) != sizeof(cookieKey)) {
+        perror("Failed to generate the cookie key");
+        return EXIT_FAILURE;
+    }
+
+    for(int i = 0; i < serverPortCount && !takeOverPath; i++) {
+        serverSockets[i] = createServerSocket(serverPorts[i]);
+
+        if(serverSockets[i] < 0) {
+            perror("Failed to create server socket");
+            return 1;
+        }
+
+        serverSocketCount++;
     }
 
     memset(clientList, 0, sizeof(swtp_t *) * clientListSize);
     clientCount = 0;
 
-    if(mtx_init(&clientListMutex, mtx_plain) == thrd_error) {
+    for(int i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        routeTable[i].clientIndex = -1;
+    }
+
+    // The queues of the clients share a pool, which holds at least one full
+    // queue
+    size_t queuePacketCount = queueMemoryLimit / sizeof(sched_packet_t);
+
+    if(queuePacketCount < egressQueueSize) {
+        queuePacketCount = egressQueueSize;
+    }
+
+    if(sched_init(&scheduler, clientListSize, drrQuantum, queuePacketCount)) {
+        perror("Failed to create the egress scheduler");
+        return EXIT_FAILURE;
+    }
+
+    if(takeOverPath && takeOver(takeOverPath)) {
+        printf("Failed to take the server over.\n");
+        return EXIT_FAILURE;
+    }
+
+    for(int i = 0; i < serverSocketCount && busyPollTime > 0; i++) {
+        if(cpu_enableBusyPoll(serverSockets[i], busyPollTime)) {
+            perror("Failed to enable busy polling");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(clusterPort != 0 && cluster_init(&cluster, clusterPort, clusterPeers, clusterPeerCount)) {
+        perror("Failed to create the cluster sockets");
+        return EXIT_FAILURE;
+    }
+
+    // The SWTP callbacks lock the client list again
+    if(mtx_init(&clientListMutex, mtx_plain | mtx_recursive) == thrd_error) {
         perror("Failed to create mutex");
         return 1;
     }
 
-    if(thrd_create(&tunDeviceReaderThread, tunReaderMainLoop, NULL) == thrd_error) {
+    if(ioUring && initIoRing() < 0) {
+        perror("Failed to set io_uring up, falling back to poll()");
+        ioUring = false;
+    }
+
+    // With io_uring, the main thread reads the TUN device
+    if(!ioUring && !echo && thrd_create(&tunDeviceReaderThread, tunReaderMainLoop, NULL) == thrd_error) {
         perror("Failed to create tun reader thread");
         return 1;
     }
@@ -93,11 +520,46 @@ int main(int argc, const char **argv) {
         return EXIT_FAILURE;
     }
 
+    if(thrd_create(&egressThread, egressThreadMainLoop, NULL)) {
+        perror("Failed to create egress thread");
+        return EXIT_FAILURE;
+    }
+
+    if(controlSocketPath) {
+        if(thrd_create(&controlThread, controlThreadMainLoop, NULL)) {
+            perror("Failed to create control thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(clusterPort != 0) {
+        if(thrd_create(&clusterThread, clusterThreadMainLoop, NULL)) {
+            perror("Failed to create cluster thread");
+            return EXIT_FAILURE;
+        }
+    }
+
     printf("Ready.\n");
 
+    if(ioUring) {
+        // Only returns if the kernel does not support a request
+        ioRingServerLoop();
+        destroyIoRing();
+        ioUring = false;
+
+        printf("Falling back to poll().\n");
+
+        if(thrd_create(&tunDeviceReaderThread, tunReaderMainLoop, NULL) == thrd_error) {
+            perror("Failed to create tun reader thread");
+            return 1;
+        }
+    }
+
     mainServerLoop();
 
-    close(serverSocket);
+    for(int i = 0; i < serverSocketCount; i++) {
+        close(serverSockets[i]);
+    }
     
     return 0;
 }
@@ -106,6 +568,27 @@ int parseCommandLineParameters(int argc, const char **argv) {
     bool flag_maxClients = false;
     bool flag_receiveWindowSize = false;
     bool flag_maxSendWindowSize = false;
+    bool flag_fec = false;
+    bool flag_keepalive = false;
+    bool flag_capture = false;
+    bool flag_captureRecords = false;
+    bool flag_capturePayload = false;
+    bool flag_sessionGracePeriod = false;
+    bool flag_admissionRate = false;
+    bool flag_maxWindowMemory = false;
+    bool flag_egressQueue = false;
+    bool flag_maxQueueMemory = false;
+    bool flag_drrQuantum = false;
+    bool flag_defaultWeight = false;
+    bool flag_defaultRate = false;
+    bool flag_controlSocket = false;
+    bool flag_ports = false;
+    bool flag_psk = false;
+    bool flag_takeOver = false;
+    bool flag_cluster = false;
+    bool flag_clusterPeers = false;
+    bool flag_affinity = false;
+    bool flag_busyPoll = false;
     
     bool flag_maxClients_set = false;
     bool flag_windowSize_set = false;
@@ -133,8 +616,8 @@ int parseCommandLineParameters(int argc, const char **argv) {
                 return 1;
             }
 
-            if(receiveWindowSize <= 0 || receiveWindowSize > SWTP_MAX_WINDOW_SIZE) {
-                printf("Invalid value for --max-recv-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_WINDOW_SIZE);
+            if(receiveWindowSize <= 0 || receiveWindowSize > SWTP_MAX_EXTENDED_WINDOW_SIZE) {
+                printf("Invalid value for --max-recv-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_EXTENDED_WINDOW_SIZE);
                 return 1;
             }
 
@@ -147,8 +630,147 @@ int parseCommandLineParameters(int argc, const char **argv) {
                 return 1;
             }
 
-            if(sendWindowMaxSize <= 0 || sendWindowMaxSize > SWTP_MAX_WINDOW_SIZE) {
-                printf("Invalid value for --max-send-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_WINDOW_SIZE);
+            if(sendWindowMaxSize <= 0 || sendWindowMaxSize > SWTP_MAX_EXTENDED_WINDOW_SIZE) {
+                printf("Invalid value for --max-send-window-size. Expected an integer between 1 and %d included.\n", SWTP_MAX_EXTENDED_WINDOW_SIZE);
+                return 1;
+            }
+        } else if(flag_fec) {
+            flag_fec = false;
+
+            if(parseFecParameter(argv[i])) {
+                return 1;
+            }
+        } else if(flag_keepalive) {
+            flag_keepalive = false;
+
+            if(parseKeepaliveParameter(argv[i])) {
+                return 1;
+            }
+        } else if(flag_admissionRate) {
+            flag_admissionRate = false;
+
+            if(sscanf(argv[i], "%d", &admissionRate) != 1 || admissionRate <= 0) {
+                printf("Invalid value for --admission-rate. Expected a strictly positive number of sessions per second.\n");
+                return 1;
+            }
+        } else if(flag_maxWindowMemory) {
+            flag_maxWindowMemory = false;
+
+            if(sscanf(argv[i], "%zu", &windowMemoryLimit) != 1 || windowMemoryLimit == 0) {
+                printf("Invalid value for --max-window-memory. Expected a strictly positive number of megabytes.\n");
+                return 1;
+            }
+
+            windowMemoryLimit *= 1024 * 1024;
+        } else if(flag_egressQueue) {
+            flag_egressQueue = false;
+
+            if(sscanf(argv[i], "%u", &egressQueueSize) != 1 || egressQueueSize == 0) {
+                printf("Invalid value for --egress-queue. Expected a strictly positive number of packets.\n");
+                return 1;
+            }
+        } else if(flag_maxQueueMemory) {
+            flag_maxQueueMemory = false;
+
+            if(sscanf(argv[i], "%zu", &queueMemoryLimit) != 1 || queueMemoryLimit == 0) {
+                printf("Invalid value for --max-queue-memory. Expected a strictly positive number of megabytes.\n");
+                return 1;
+            }
+
+            queueMemoryLimit *= 1024 * 1024;
+        } else if(flag_drrQuantum) {
+            flag_drrQuantum = false;
+
+            if(sscanf(argv[i], "%u", &drrQuantum) != 1 || drrQuantum == 0) {
+                printf("Invalid value for --drr-quantum. Expected a strictly positive number of bytes.\n");
+                return 1;
+            }
+        } else if(flag_defaultWeight) {
+            flag_defaultWeight = false;
+
+            if(sscanf(argv[i], "%u", &defaultWeight) != 1 || defaultWeight == 0) {
+                printf("Invalid value for --default-weight. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_defaultRate) {
+            flag_defaultRate = false;
+
+            if(sscanf(argv[i], "%lu", &defaultRate) != 1) {
+                printf("Invalid value for --default-rate. Expected a rate in kbit/s, or 0 for unlimited.\n");
+                return 1;
+            }
+        } else if(flag_controlSocket) {
+            flag_controlSocket = false;
+            controlSocketPath = argv[i];
+        } else if(flag_ports) {
+            flag_ports = false;
+
+            if(parsePortList(argv[i], serverPorts, &serverPortCount)) {
+                printf("Invalid value for --ports. Expected up to %d comma-separated ports.\n", SWTP_MAX_PATHS);
+                return 1;
+            }
+        } else if(flag_sessionGracePeriod) {
+            flag_sessionGracePeriod = false;
+
+            if(sscanf(argv[i], "%d", &sessionGracePeriod) != 1 || sessionGracePeriod < 0) {
+                printf("Invalid value for --session-grace-period. Expected a positive number of seconds.\n");
+                return 1;
+            }
+        } else if(flag_takeOver) {
+            flag_takeOver = false;
+            takeOverPath = argv[i];
+        } else if(flag_cluster) {
+            flag_cluster = false;
+
+            if(sscanf(argv[i], "%hu", &clusterPort) != 1 || clusterPort == 0) {
+                printf("Invalid value for --cluster. Expected a port.\n");
+                return 1;
+            }
+        } else if(flag_clusterPeers) {
+            flag_clusterPeers = false;
+
+            if(cluster_parsePeers(argv[i], clusterPeers, &clusterPeerCount)) {
+                printf("Invalid value for --cluster-peers. Expected up to %d comma-separated addresses and ports.\n", CLUSTER_MAX_PEERS);
+                return 1;
+            }
+        } else if(flag_affinity) {
+            flag_affinity = false;
+
+            if(cpu_parseAffinity(&affinity, threadNames, sizeof(threadNames) / sizeof(threadNames[0]), argv[i])) {
+                printf("Invalid value for --affinity. Expected <thread>=<cpus> pairs separated by commas, the threads being receiver, reader, timer, egress, control and cluster.\n");
+                return 1;
+            }
+        } else if(flag_busyPoll) {
+            flag_busyPoll = false;
+
+            if(sscanf(argv[i], "%u", &busyPollTime) != 1 || busyPollTime > CPU_MAX_BUSY_POLL_TIME) {
+                printf("Invalid value for --busy-poll. Expected an integer between 0 and %d included.\n", CPU_MAX_BUSY_POLL_TIME);
+                return 1;
+            }
+        } else if(flag_psk) {
+            flag_psk = false;
+
+            if(readPreSharedKey(argv[i], preSharedKey)) {
+                printf("Invalid value for --psk. Expected a file containing %d hexadecimal bytes.\n", SWTP_PRE_SHARED_KEY_SIZE);
+                return 1;
+            }
+
+            hasPreSharedKey = true;
+        } else if(flag_capture) {
+            flag_capture = false;
+            capturePath = argv[i];
+        } else if(flag_captureRecords) {
+            flag_captureRecords = false;
+
+            if(sscanf(argv[i], "%lu", &captureRecordCount) != 1 || captureRecordCount == 0) {
+                printf("Invalid value for --capture-records. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(flag_capturePayload) {
+            flag_capturePayload = false;
+
+            if(sscanf(argv[i], "%u", &captureSnapLength) != 1 || captureSnapLength > SWTP_MAX_PAYLOAD_SIZE) {
+                printf("Invalid value for --capture-payload. Expected an integer between 0 and %d included.\n", SWTP_MAX_PAYLOAD_SIZE);
                 return 1;
             }
         } else if(strcmp(argv[i], "--max-clients") == 0) {
@@ -157,6 +779,56 @@ int parseCommandLineParameters(int argc, const char **argv) {
             flag_receiveWindowSize = true;
         } else if(strcmp(argv[i], "--max-send-window-size") == 0) {
             flag_maxSendWindowSize = true;
+        } else if(strcmp(argv[i], "--fec") == 0) {
+            flag_fec = true;
+        } else if(strcmp(argv[i], "--keepalive") == 0) {
+            flag_keepalive = true;
+        } else if(strcmp(argv[i], "--no-sabm-cookies") == 0) {
+            sabmCookies = false;
+        } else if(strcmp(argv[i], "--io-uring") == 0) {
+            ioUring = true;
+        } else if(strcmp(argv[i], "--echo") == 0) {
+            echo = true;
+        } else if(strcmp(argv[i], "--affinity") == 0) {
+            flag_affinity = true;
+        } else if(strcmp(argv[i], "--busy-poll") == 0) {
+            flag_busyPoll = true;
+        } else if(strcmp(argv[i], "--no-encryption") == 0) {
+            encryption = false;
+        } else if(strcmp(argv[i], "--psk") == 0) {
+            flag_psk = true;
+        } else if(strcmp(argv[i], "--take-over") == 0) {
+            flag_takeOver = true;
+        } else if(strcmp(argv[i], "--cluster") == 0) {
+            flag_cluster = true;
+        } else if(strcmp(argv[i], "--cluster-peers") == 0) {
+            flag_clusterPeers = true;
+        } else if(strcmp(argv[i], "--admission-rate") == 0) {
+            flag_admissionRate = true;
+        } else if(strcmp(argv[i], "--max-window-memory") == 0) {
+            flag_maxWindowMemory = true;
+        } else if(strcmp(argv[i], "--session-grace-period") == 0) {
+            flag_sessionGracePeriod = true;
+        } else if(strcmp(argv[i], "--egress-queue") == 0) {
+            flag_egressQueue = true;
+        } else if(strcmp(argv[i], "--max-queue-memory") == 0) {
+            flag_maxQueueMemory = true;
+        } else if(strcmp(argv[i], "--drr-quantum") == 0) {
+            flag_drrQuantum = true;
+        } else if(strcmp(argv[i], "--default-weight") == 0) {
+            flag_defaultWeight = true;
+        } else if(strcmp(argv[i], "--default-rate") == 0) {
+            flag_defaultRate = true;
+        } else if(strcmp(argv[i], "--control-socket") == 0) {
+            flag_controlSocket = true;
+        } else if(strcmp(argv[i], "--ports") == 0) {
+            flag_ports = true;
+        } else if(strcmp(argv[i], "--capture") == 0) {
+            flag_capture = true;
+        } else if(strcmp(argv[i], "--capture-records") == 0) {
+            flag_captureRecords = true;
+        } else if(strcmp(argv[i], "--capture-payload") == 0) {
+            flag_capturePayload = true;
         } else {
             printf("Unknown argument \"%s\".", argv[i]);
             return 1;
@@ -172,128 +844,2064 @@ int parseCommandLineParameters(int argc, const char **argv) {
     } else if(flag_maxSendWindowSize) {
         printf("--max-send-window-size expected an integer value.\n");
         return 1;
+    } else if(flag_fec) {
+        printf("--fec expected a block size or \"auto\".\n");
+        return 1;
+    } else if(flag_keepalive) {
+        printf("--keepalive expected an idle time, and optionally an interval and a number of probes.\n");
+        return 1;
+    } else if(flag_admissionRate) {
+        printf("--admission-rate expected an integer value.\n");
+        return 1;
+    } else if(flag_maxWindowMemory) {
+        printf("--max-window-memory expected an integer value.\n");
+        return 1;
+    } else if(flag_sessionGracePeriod) {
+        printf("--session-grace-period expected an integer value.\n");
+        return 1;
+    } else if(flag_egressQueue) {
+        printf("--egress-queue expected an integer value.\n");
+        return 1;
+    } else if(flag_maxQueueMemory) {
+        printf("--max-queue-memory expected an integer value.\n");
+        return 1;
+    } else if(flag_drrQuantum) {
+        printf("--drr-quantum expected an integer value.\n");
+        return 1;
+    } else if(flag_defaultWeight) {
+        printf("--default-weight expected an integer value.\n");
+        return 1;
+    } else if(flag_defaultRate) {
+        printf("--default-rate expected an integer value.\n");
+        return 1;
+    } else if(flag_controlSocket) {
+        printf("--control-socket expected a file path.\n");
+        return 1;
+    } else if(flag_ports) {
+        printf("--ports expected a list of ports.\n");
+        return 1;
+    } else if(flag_psk) {
+        printf("--psk expected a file path.\n");
+        return 1;
+    } else if(flag_takeOver) {
+        printf("--take-over expected a file path.\n");
+        return 1;
+    } else if(flag_cluster) {
+        printf("--cluster expected a port.\n");
+        return 1;
+    } else if(flag_clusterPeers) {
+        printf("--cluster-peers expected a list of addresses and ports.\n");
+        return 1;
+    } else if(flag_affinity) {
+        printf("--affinity expected a list of threads and CPUs.\n");
+        return 1;
+    } else if(flag_busyPoll) {
+        printf("--busy-poll expected an integer value.\n");
+        return 1;
+    } else if(flag_capture) {
+        printf("--capture expected a file path.\n");
+        return 1;
+    } else if(flag_captureRecords) {
+        printf("--capture-records expected an integer value.\n");
+        return 1;
+    } else if(flag_capturePayload) {
+        printf("--capture-payload expected an integer value.\n");
+        return 1;
     } else if(!flag_maxClients_set) {
         printf("--max-clients was not set.\n");
         return 1;
     } else if(!flag_windowSize_set) {
         printf("--max-recv-window-size was not set.\n");
         return 1;
+    } else if(hasPreSharedKey && !encryption) {
+        printf("--psk cannot be used with --no-encryption.\n");
+        return 1;
+    } else if((clusterPort != 0) != (clusterPeerCount > 0)) {
+        printf("--cluster and --cluster-peers must be used together.\n");
+        return 1;
+    } else if(echo && (ioUring || takeOverPath)) {
+        printf("--echo cannot be used with --io-uring or --take-over, which need a TUN device.\n");
+        return 1;
     }
 
     return 0;
 }
 
-int timerThreadMainLoop(void *arg) {
-    UNUSED_PARAMETER(arg);
+/*
+    Reads a pre-shared key, written in hexadecimal in a file.
+*/
+int readPreSharedKey(const char *path, uint8_t *key) {
+    FILE *file = fopen(path, "r");
 
-    while(true) {
-        for(int i = 0; i < clientListSize; i++) {
-            if(clientList[i]) {
-                if(swtp_onTimerTick(clientList[i]) != SWTP_SUCCESS) {
-                    // TODO: what to do when an error occurs?
-                }
-            }
+    if(!file) {
+        perror("Failed to open the pre-shared key file");
+        return 1;
+    }
+
+    int result = 0;
+
+    for(int i = 0; i < SWTP_PRE_SHARED_KEY_SIZE && !result; i++) {
+        if(fscanf(file, " %2hhx", &key[i]) != 1) {
+            result = 1;
         }
-        
-        sleep(1);
     }
 
+    fclose(file);
+
+    return result;
+}
+
+/*
+    Parses a comma-separated list of UDP ports, such as "5228,4500,10000".
+*/
+int parsePortList(const char *value, uint16_t *ports, int *portCount) {
+    int count = 0;
+
+    while(*value) {
+        char *end;
+        unsigned long port = strtoul(value, &end, 10);
+
+        if(end == value || port == 0 || port > UINT16_MAX || count >= SWTP_MAX_PATHS || (*end != ',' && *end != '\0')) {
+            return 1;
+        }
+
+        ports[count++] = port;
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    if(count == 0) {
+        return 1;
+    }
+
+    *portCount = count;
+
     return 0;
 }
 
-int tunReaderMainLoop(void *arg) {
+int parseFecParameter(const char *value) {
+    if(strcmp(value, "auto") == 0) {
+        fecBlockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+        fecAdaptive = true;
+        return 0;
+    }
+
+    if(sscanf(value, "%u", &fecBlockSize) != 1) {
+        printf("Failed to parse argument value to --fec.\n");
+        return 1;
+    }
+
+    if(fecBlockSize < SWTP_FEC_MIN_BLOCK_SIZE || fecBlockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+        printf("Invalid value for --fec. Expected \"auto\" or an integer between %d and %d included.\n", SWTP_FEC_MIN_BLOCK_SIZE, SWTP_FEC_MAX_BLOCK_SIZE);
+        return 1;
+    }
+
+    fecAdaptive = false;
+
+    return 0;
+}
+
+/*
+    Parses the keepalive schedule, such as "5000,1000,3": the idle time and the
+    maximum interval between two TEST frames in milliseconds, and the number of
+    unanswered TEST frames after which the peer is considered dead. The last
+    two values are optional. A schedule given on the command line is adaptive,
+    so that dead peers are detected within a few RTTs.
+*/
+int parseKeepaliveParameter(const char *value) {
+    int64_t idleTime;
+    int64_t interval = keepaliveInterval;
+    unsigned int probes = keepaliveProbes;
+
+    if(sscanf(value, "%ld,%ld,%u", &idleTime, &interval, &probes) < 1) {
+        printf("Failed to parse argument value to --keepalive.\n");
+        return 1;
+    }
+
+    if(idleTime < SWTP_MIN_KEEPALIVE_INTERVAL || interval < SWTP_MIN_KEEPALIVE_INTERVAL || probes == 0) {
+        printf("Invalid value for --keepalive. Expected times of at least %d milliseconds and a strictly positive number of probes.\n", SWTP_MIN_KEEPALIVE_INTERVAL);
+        return 1;
+    }
+
+    keepaliveIdleTime = idleTime;
+    keepaliveInterval = interval;
+    keepaliveProbes = probes;
+    keepaliveAdaptive = true;
+
+    return 0;
+}
+
+int timerThreadMainLoop(void *arg) {
     UNUSED_PARAMETER(arg);
-    
-    uint8_t buffer[SWTP_MAX_PAYLOAD_SIZE];
+
+    if(cpu_pinThread(&affinity, THREAD_TIMER)) {
+        perror("Failed to pin the timer thread");
+    }
 
     while(true) {
-        ssize_t packetSize = read(tunDevice, buffer, SWTP_MAX_PAYLOAD_SIZE);
-        
-        if(packetSize < 0) {
-            break;
-        }
+        struct timespec startTime;
+        struct timespec endTime;
 
         mtx_lock(&clientListMutex);
 
+        // The time waiting for the lock is not part of the cost of the tick
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+        // The PROBE frames briefly change the mode of the server sockets,
+        // which is safe as every frame is sent with the client list locked
         for(int i = 0; i < clientListSize; i++) {
             if(clientList[i]) {
-                swtp_sendDataFrame(clientList[i], buffer, packetSize);
+                if(clientExpiryTime[i] != 0) {
+                    // The client was disconnected, and did not resume its
+                    // session in time
+                    if(swtp_getTime(clientList[i]) >= clientExpiryTime[i]) {
+                        removeClient(i);
+                    }
+                } else if(swtp_onTimerTick(clientList[i]) != SWTP_SUCCESS) {
+                    // TODO: what to do when an error occurs?
+                }
             }
         }
 
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+        uint64_t tickTime = (endTime.tv_sec - startTime.tv_sec) * 1000000 + (endTime.tv_nsec - startTime.tv_nsec) / 1000;
+
+        timerTickCount++;
+        timerTickTime += tickTime;
+
+        if(tickTime > maxTimerTickTime) {
+            maxTimerTickTime = tickTime;
+        }
+
         mtx_unlock(&clientListMutex);
+        
+        thrd_sleep(&(struct timespec){.tv_nsec = SWTP_TIMER_INTERVAL * 1000000}, NULL);
     }
 
     return 0;
 }
 
-int createServerSocket() {
-    int sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+/*
+    Reads the source or the destination address of a packet of the TUN device.
+    Returns -1 if the packet is neither an IPv4 nor an IPv6 packet.
+*/
+int getPacketAddress(const uint8_t *packet, size_t size, bool destination, uint8_t *address) {
+    // The TUN header contains the protocol of the packet
+    uint16_t protocol = (packet[2] << 8) | packet[3];
+
+    if(protocol == 0x0800 && size >= TUN_HEADER_SIZE + 20) {
+        memset(address, 0, 10);
+        memset(address + 10, 0xff, 2);
+        memcpy(address + 12, packet + TUN_HEADER_SIZE + (destination ? 16 : 12), 4);
+        return 0;
+    } else if(protocol == 0x86dd && size >= TUN_HEADER_SIZE + 40) {
+        memcpy(address, packet + TUN_HEADER_SIZE + (destination ? 24 : 8), 16);
+        return 0;
+    }
 
-    if(sock_fd < 0) {
-        return -1;
+    return -1;
+}
+
+/*
+    Returns the index of the entry of the given address in the route table, or
+    of the empty entry where it would be inserted.
+*/
+int findRoute(const uint8_t *address) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for(int i = 0; i < 16; i++) {
+        hash = (hash ^ address[i]) * 16777619u;
     }
 
-    struct sockaddr_in socketAddress;
-    memset(&socketAddress, 0, sizeof(socketAddress));
-    socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-    socketAddress.sin_family = AF_INET;
-    socketAddress.sin_port = htons(SWTP_PORT);
+    int index = hash % ROUTE_TABLE_SIZE;
 
-    bind(sock_fd, (const struct sockaddr *)&socketAddress, sizeof(socketAddress));
+    while(routeTable[index].clientIndex >= 0 && memcmp(routeTable[index].address, address, 16) != 0) {
+        index = (index + 1) % ROUTE_TABLE_SIZE;
+    }
 
-    return sock_fd;
+    return index;
 }
 
 /*
-    Searches for the client with the given socket address in the given client
-    list. If the client exists in the list, return its index. Else return -1.
+    Routes the given address to a client. An address that belongs to another
+    client keeps its route, so that a client cannot steal the traffic of
+    another one.
 */
-int findClientBySocketAddress(struct sockaddr_in *socketAddress, socklen_t socketAddressLength) {
-    for(int i = 0; i < clientListSize; i++) {
-        if(clientList[i]) {
-            if(memcmp(socketAddress, &clientList[i]->socketAddress, socketAddressLength) == 0) {
-                return i;
-            }
-        }
+void learnRoute(const uint8_t *address, int clientIndex) {
+    int index = findRoute(address);
+
+    // Keep the table sparse, so that the searches stay short
+    if(routeTable[index].clientIndex >= 0 || routeCount >= ROUTE_TABLE_SIZE * 3 / 4) {
+        return;
     }
 
-    return -1;
+    memcpy(routeTable[index].address, address, 16);
+    routeTable[index].clientIndex = clientIndex;
+    routeCount++;
 }
 
 /*
-    Searches for the client with the given pointer and returns its index in the
-    client table. If the client does not exist, this function returns -1.
+    Removes the routes of a client. The table is rebuilt, as removing entries
+    in place would break the probe sequences of the others.
 */
-int findClientByData(swtp_t *client) {
-    for(int i = 0; i < clientListSize; i++) {
-        if(clientList[i] == client) {
-            return i;
+void removeRoutes(int clientIndex) {
+    static route_t routes[ROUTE_TABLE_SIZE];
+    int count = 0;
+
+    for(int i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        if(routeTable[i].clientIndex >= 0 && routeTable[i].clientIndex != clientIndex) {
+            routes[count++] = routeTable[i];
         }
+
+        routeTable[i].clientIndex = -1;
     }
 
-    return -1;
+    routeCount = 0;
+
+    for(int i = 0; i < count; i++) {
+        learnRoute(routes[i].address, routes[i].clientIndex);
+    }
+}
+
+/*
+    Queues a packet read from the TUN device for the client it is addressed
+    to. The packets whose destination is unknown, such as broadcast packets,
+    are queued for every client. The egress thread sends them.
+*/
+void onTunPacketRead(const uint8_t *packet, size_t size) {
+    uint8_t address[16];
+
+    mtx_lock(&clientListMutex);
+
+    int clientIndex = -1;
+
+    if(getPacketAddress(packet, size, true, address) == 0) {
+        clientIndex = routeTable[findRoute(address)].clientIndex;
+    }
+
+    // A packet sent to every client is copied once, in a buffer that the
+    // queues and the send windows share. Encrypted sessions still encrypt it
+    // each, into their own send window.
+    pktbuf_t *buffer = clientIndex < 0 && clientCount > 1 ? pktbuf_create(packet, size) : NULL;
+
+    if(clientIndex >= 0) {
+        sched_enqueue(&scheduler, clientIndex, packet, size);
+    } else {
+        for(int i = 0; i < clientListSize; i++) {
+            if(clientList[i] && buffer) {
+                sched_enqueueBuffer(&scheduler, i, buffer);
+            } else if(clientList[i]) {
+                sched_enqueue(&scheduler, i, packet, size);
+            }
+        }
+    }
+
+    pktbuf_release(buffer);
+
+    mtx_unlock(&clientListMutex);
+}
+
+int tunReaderMainLoop(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_READER)) {
+        perror("Failed to pin the tun reader thread");
+    }
+    
+    uint8_t buffer[SWTP_MAX_PAYLOAD_SIZE];
+
+    while(true) {
+        ssize_t packetSize = read(tunDevice, buffer, SWTP_MAX_PAYLOAD_SIZE);
+        
+        if(packetSize < 0) {
+            break;
+        }
+
+        onTunPacketRead(buffer, packetSize);
+    }
+
+    return 0;
+}
+
+/*
+    Sends a queued packet to a client, if its send window has a free slot. The
+    last slots are kept for the interactive packets, so that they do not wait
+    for the bulk frames to be acknowledged. The packets of a disconnected
+    client stay queued until it resumes its session.
+*/
+int sendQueuedPacket(void *context, int clientIndex, int band, const void *packet, size_t size, pktbuf_t *buffer) {
+    UNUSED_PARAMETER(context);
+
+    swtp_t *swtp = clientList[clientIndex];
+
+    if(!swtp || clientExpiryTime[clientIndex] != 0) {
+        return SCHED_BLOCKED;
+    }
+
+    unsigned int reservedSlots = band == SCHED_BAND_INTERACTIVE ? 0 : swtp->sendWindowLimit / INTERACTIVE_WINDOW_FRACTION;
+
+    if(swtp_getSendWindowAvailableSlots(swtp) <= reservedSlots) {
+        return SCHED_BLOCKED;
+    }
+
+    if(buffer) {
+        swtp_sendSharedDataFrame(swtp, buffer);
+    } else {
+        swtp_sendDataFrame(swtp, packet, size);
+    }
+
+    return SCHED_SENT;
+}
+
+/*
+    Sends the queued packets with deficit round robin, so that a client that
+    downloads in bulk does not delay the packets of the other clients. The
+    thread is woken up when packets are queued and when a client acknowledges
+    frames.
+*/
+int egressThreadMainLoop(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_EGRESS)) {
+        perror("Failed to pin the egress thread");
+    }
+
+    while(true) {
+        mtx_lock(&clientListMutex);
+        sched_run(&scheduler, sendQueuedPacket, NULL);
+        mtx_unlock(&clientListMutex);
+
+        sched_wait(&scheduler, EGRESS_WAIT_TIMEOUT);
+    }
+
+    return 0;
+}
+
+/*
+    Sets the rate limit of a client, in kbit/s. The bucket holds 100 ms of
+    traffic.
+*/
+void setClientRate(int clientIndex, uint64_t rate) {
+    sched_setRate(&scheduler, clientIndex, rate * 1000 / 8, rate * 1000 / 8 / 10);
+}
+
+/*
+    Returns the memory of the server that is in RAM, in bytes, or 0 if it is
+    unknown.
+*/
+size_t getResidentMemory() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    size_t residentPages = 0;
+
+    if(!file) {
+        return 0;
+    }
+
+    if(fscanf(file, "%*u %zu", &residentPages) != 1) {
+        residentPages = 0;
+    }
+
+    fclose(file);
+
+    return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+    Runs a command of the control socket, and writes its response to the given
+    file descriptor.
+*/
+void runControlCommand(int fd, const char *command) {
+    char name[16];
+    int clientIndex;
+    uint64_t value;
+    int argumentCount = sscanf(command, "%15s %d %lu", name, &clientIndex, &value);
+
+    if(argumentCount < 1) {
+        return;
+    }
+
+    // The sessions are sent to the other nodes without the client list locked
+    if(strcmp(name, "drain") == 0) {
+        if(clusterPort == 0) {
+            dprintf(fd, "ERROR not in a cluster\n");
+        } else {
+            drainSessions(fd);
+        }
+
+        return;
+    }
+
+    mtx_lock(&clientListMutex);
+
+    if(strcmp(name, "list") == 0) {
+        for(int i = 0; i < clientListSize; i++) {
+            sched_flow_t flow;
+
+            if(!clientList[i]) {
+                continue;
+            }
+
+            const struct sockaddr_in *clientAddress = (const struct sockaddr_in *)&clientList[i]->socketAddress;
+
+            sched_getFlow(&scheduler, i, &flow);
+            dprintf(fd, "#%d %s:%d %s paths=%u window=%u/%u weight=%u rate=%lu queued=%u sent=%lu/%lu/%lu dropped=%lu\n", i, inet_ntoa(clientAddress->sin_addr), ntohs(clientAddress->sin_port), clientExpiryTime[i] ? "disconnected" : "connected", clientList[i]->pathCount, clientList[i]->sendWindowLimit, clientList[i]->receiveWindowSize, flow.weight, flow.rate * 8 / 1000, flow.queueLength, flow.bandSentPackets[SCHED_BAND_INTERACTIVE], flow.bandSentPackets[SCHED_BAND_DEFAULT], flow.bandSentPackets[SCHED_BAND_BULK], flow.droppedPackets);
+        }
+
+        dprintf(fd, "OK\n");
+    } else if(strcmp(name, "stats") == 0) {
+        int connectedClientCount = 0;
+
+        for(int i = 0; i < clientListSize; i++) {
+            connectedClientCount += clientList[i] && clientExpiryTime[i] == 0;
+        }
+
+        dprintf(fd, "clients=%d connected=%d accepted=%lu refused=%lu session_size=%zu window_memory=%zu queue_memory=%zu rss=%zu timer_ticks=%lu timer_time=%lu timer_max=%lu\n", clientCount, connectedClientCount, acceptedSessionCount, refusedClientCount, sizeof(swtp_t), windowMemory, sched_getQueueMemory(&scheduler), getResidentMemory(), timerTickCount, timerTickTime, maxTimerTickTime);
+        dprintf(fd, "OK\n");
+
+        maxTimerTickTime = 0;
+    } else if(strcmp(name, "handover") == 0) {
+        // Only returns if the other process failed
+        if(echo) {
+            dprintf(fd, "ERROR no TUN device to hand over\n");
+        } else {
+            handOver(fd);
+        }
+    } else if(strcmp(name, "weight") != 0 && strcmp(name, "rate") != 0 && strcmp(name, "window") != 0) {
+        dprintf(fd, "ERROR unknown command\n");
+    } else if(argumentCount < 3) {
+        dprintf(fd, "ERROR expected a client and a value\n");
+    } else if(clientIndex < 0 || clientIndex >= clientListSize || !clientList[clientIndex]) {
+        dprintf(fd, "ERROR no such client\n");
+    } else if(strcmp(name, "weight") == 0) {
+        if(value == 0 || value > UINT16_MAX) {
+            dprintf(fd, "ERROR expected a weight between 1 and %d\n", UINT16_MAX);
+        } else {
+            sched_setWeight(&scheduler, clientIndex, value);
+            dprintf(fd, "OK\n");
+        }
+    } else if(strcmp(name, "window") == 0) {
+        uint32_t maxWindowSize = clientList[clientIndex]->extended ? SWTP_MAX_EXTENDED_WINDOW_SIZE : SWTP_MAX_WINDOW_SIZE;
+
+        if(value == 0 || value > maxWindowSize) {
+            dprintf(fd, "ERROR expected a window size between 1 and %u\n", maxWindowSize);
+        } else if(swtp_setReceiveWindow(clientList[clientIndex], value, value * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU)) != SWTP_SUCCESS) {
+            dprintf(fd, "ERROR failed to send the window\n");
+        } else {
+            dprintf(fd, "OK\n");
+        }
+    } else {
+        setClientRate(clientIndex, value);
+        dprintf(fd, "OK\n");
+    }
+
+    mtx_unlock(&clientListMutex);
+}
+
+/*
+    Serves the control socket, a UNIX stream socket which accepts one command
+    per line:
+        list                        lists the clients and their queues, with
+                                    the packets sent from each priority band
+        stats                       shows the number of clients and sessions,
+                                    the memory of the server, of the send
+                                    windows and of the queues, and the time
+                                    spent in the timer ticks (see
+                                    bin/swtpload)
+        weight <client> <weight>    sets the scheduling weight of a client
+        rate <client> <kbit/s>      sets the rate limit of a client, 0 for none
+        window <client> <frames>    sets the receive window announced to a
+                                    client, which resizes its send window
+        handover                    hands the server over to the process that
+                                    sent the command (see takeOver())
+        drain                       migrates the sessions to the other nodes of
+                                    the cluster (see drainSessions())
+*/
+int controlThreadMainLoop(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_CONTROL)) {
+        perror("Failed to pin the control thread");
+    }
+
+    struct sockaddr_un socketAddress;
+    int controlSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(controlSocket < 0) {
+        perror("Failed to create the control socket");
+        return 1;
+    }
+
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sun_family = AF_UNIX;
+    strncpy(socketAddress.sun_path, controlSocketPath, sizeof(socketAddress.sun_path) - 1);
+    unlink(controlSocketPath);
+
+    if(bind(controlSocket, (const struct sockaddr *)&socketAddress, sizeof(socketAddress)) || listen(controlSocket, 4)) {
+        perror("Failed to bind the control socket");
+        close(controlSocket);
+        return 1;
+    }
+
+    while(true) {
+        int connection = accept(controlSocket, NULL, NULL);
+
+        if(connection < 0) {
+            continue;
+        }
+
+        FILE *input = fdopen(connection, "r");
+        char command[256];
+
+        if(!input) {
+            close(connection);
+            continue;
+        }
+
+        while(fgets(command, sizeof(command), input)) {
+            runControlCommand(connection, command);
+        }
+
+        fclose(input);
+    }
+
+    return 0;
+}
+
+int createServerSocket(uint16_t port) {
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(sock_fd < 0) {
+        return -1;
+    }
+
+    // The nodes of a cluster share the ports, and the kernel spreads the
+    // clients between them
+    int enable = 1;
+
+    if(clusterPort != 0 && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable))) {
+        close(sock_fd);
+        return -1;
+    }
+
+    struct sockaddr_in socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+
+    if(bind(sock_fd, (const struct sockaddr *)&socketAddress, sizeof(socketAddress))) {
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+/*
+    Searches for the client with the given socket address in the given client
+    list, on any of its paths. If the client exists in the list, return its
+    index. Else return -1.
+*/
+int findClientBySocketAddress(struct sockaddr_in *socketAddress, socklen_t socketAddressLength) {
+    UNUSED_PARAMETER(socketAddressLength);
+
+    for(int i = 0; i < clientListSize; i++) {
+        if(clientList[i]) {
+            if(swtp_findPath(clientList[i], (const struct sockaddr *)socketAddress) >= 0) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Searches for the client with the given session identifier. If the client
+    exists, return its index. Else return -1.
+*/
+int findClientBySessionId(uint32_t sessionId) {
+    for(int i = 0; i < clientListSize; i++) {
+        if(clientList[i] && clientList[i]->hasSession && clientList[i]->sessionId == sessionId) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Searches for the client with the given pointer and returns its index in the
+    client table. If the client does not exist, this function returns -1.
+*/
+int findClientByData(swtp_t *client) {
+    for(int i = 0; i < clientListSize; i++) {
+        if(clientList[i] == client) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Returns the index of a client in the client table, which is kept in the low
+    32 bits of its user data. The high bits contain its session in the capture
+    file.
+*/
+int getClientIndex(const swtp_t *swtp) {
+    return (uint32_t)(uintptr_t)swtp->userData;
+}
+
+/*
+    Queues a packet of a client for the same client, with its addresses and
+    its ports swapped, as if its destination had answered it. The checksums do
+    not change, as they are sums of 16-bit words.
+*/
+void echoPacket(int clientIndex, const uint8_t *packet, size_t size) {
+    uint8_t echoedPacket[SWTP_MAX_PAYLOAD_SIZE];
+    uint16_t protocol = (packet[2] << 8) | packet[3];
+    size_t addressOffset;
+    size_t addressSize;
+    size_t transportOffset;
+    uint8_t transportProtocol;
+
+    if(protocol == 0x0800 && size >= TUN_HEADER_SIZE + 20) {
+        addressOffset = TUN_HEADER_SIZE + 12;
+        addressSize = 4;
+        transportOffset = TUN_HEADER_SIZE + (packet[TUN_HEADER_SIZE] & 0x0f) * 4;
+        transportProtocol = packet[TUN_HEADER_SIZE + 9];
+    } else if(protocol == 0x86dd && size >= TUN_HEADER_SIZE + 40) {
+        addressOffset = TUN_HEADER_SIZE + 8;
+        addressSize = 16;
+        transportOffset = TUN_HEADER_SIZE + 40;
+        transportProtocol = packet[TUN_HEADER_SIZE + 6];
+    } else {
+        return;
+    }
+
+    if(size > sizeof(echoedPacket)) {
+        return;
+    }
+
+    memcpy(echoedPacket, packet, size);
+    memcpy(echoedPacket + addressOffset, packet + addressOffset + addressSize, addressSize);
+    memcpy(echoedPacket + addressOffset + addressSize, packet + addressOffset, addressSize);
+
+    if((transportProtocol == IPPROTO_TCP || transportProtocol == IPPROTO_UDP) && size >= transportOffset + 4) {
+        memcpy(echoedPacket + transportOffset, packet + transportOffset + 2, 2);
+        memcpy(echoedPacket + transportOffset + 2, packet + transportOffset, 2);
+    }
+
+    sched_enqueue(&scheduler, clientIndex, echoedPacket, size);
+}
+
+void onDataFrameReceived(swtp_t *swtp, const void *buffer, size_t size) {
+    uint8_t address[16];
+
+    // The client receives the packets addressed to the addresses it sends from
+    if(getPacketAddress(buffer, size, false, address) == 0) {
+        learnRoute(address, getClientIndex(swtp));
+    }
+
+    if(echo) {
+        echoPacket(getClientIndex(swtp), buffer, size);
+        return;
+    }
+
+    // The write is submitted with the next batch of requests of the ring. If
+    // no slot is free, the packet is written right away.
+    if(ioUring && tunWriteFreeSlotCount > 0 && size <= IO_RING_TUN_BUFFER_SIZE) {
+        struct io_uring_sqe *sqe = ring_getSqe(&ioRing);
+
+        if(sqe) {
+            int slot = tunWriteFreeSlots[--tunWriteFreeSlotCount];
+            uint8_t *packet = tunWriteBuffer + slot * IO_RING_TUN_BUFFER_SIZE;
+
+            memcpy(packet, buffer, size);
+            ring_prepareWriteFixed(sqe, serverSocketCount, packet, size, 0, (uint64_t)IO_RING_TUN_WRITE << 32 | slot);
+            return;
+        }
+    }
+
+    write(tunDevice, buffer, size);
+}
+
+/*
+    Stores the frames of a client in the capture file, in the session that was
+    recorded for it when it was added to the client table.
+*/
+void onFrameCaptured(swtp_t *swtp, int direction, const void *frame, size_t size) {
+    capture_recordFrame(&capture, (uintptr_t)swtp->userData >> 32, direction, frame, size);
+}
+
+/*
+    Stores the index of a client in the client table in its user data, and
+    records a new session for it in the capture file. The slots of the client
+    list are reused, so the sessions are numbered in the order they are
+    recorded.
+*/
+void setClientIndex(swtp_t *swtp, int clientIndex) {
+    uint64_t captureSession = 0;
+
+    if(capturePath) {
+        captureSession = captureSessionCount++;
+        swtp->frameCallback = onFrameCaptured;
+        capture_recordSession(&capture, captureSession, swtp->sendWindowSize, swtp->extended);
+    }
+
+    swtp->userData = (void *)(uintptr_t)(captureSession << 32 | (uint32_t)clientIndex);
+}
+
+void removeClient(int clientIndex) {
+    swtp_t *swtp = detachClient(clientIndex);
+
+    swtp_destroy(swtp);
+    free(swtp);
+}
+
+/*
+    Takes a client out of the client list, with its queue and its routes, and
+    returns its session, which is left untouched.
+*/
+swtp_t *detachClient(int clientIndex) {
+    swtp_t *swtp = clientList[clientIndex];
+
+    windowMemory -= swtp->sendWindowSize * sizeof(swtp_frame_t);
+
+    sched_removeFlow(&scheduler, clientIndex);
+    removeRoutes(clientIndex);
+
+    clientList[clientIndex] = NULL;
+    clientExpiryTime[clientIndex] = 0;
+    clientSabm[clientIndex].valid = false;
+    clientCount--;
+
+    return swtp;
+}
+
+/*
+    Resizes the send window of a client, and accounts for its memory. The
+    window only shrinks to the frames in flight.
+*/
+int resizeSendWindow(int clientIndex, uint32_t size) {
+    swtp_t *swtp = clientList[clientIndex];
+    uint32_t previousSize = swtp->sendWindowSize;
+
+    if(swtp_setSendWindowSize(swtp, size) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    windowMemory += ((size_t)swtp->sendWindowSize - previousSize) * sizeof(swtp_frame_t);
+
+    return 0;
+}
+
+/*
+    Follows the receive window that a client announced with a WINDOW frame. A
+    larger window is only given the memory that a new client would get.
+*/
+void onWindowChanged(swtp_t *swtp, uint32_t windowSize, uint32_t byteWindowSize) {
+    UNUSED_PARAMETER(byteWindowSize);
+
+    mtx_lock(&clientListMutex);
+
+    int clientIndex = findClientByData(swtp);
+    uint32_t size = windowSize;
+
+    if(sendWindowMaxSize > 0 && size > (uint32_t)sendWindowMaxSize) {
+        size = sendWindowMaxSize;
+    }
+
+    size_t maxWindowSize = swtp->sendWindowSize + (windowMemoryLimit - windowMemory) / (clientListSize - clientCount + 1) / sizeof(swtp_frame_t);
+
+    if(size > maxWindowSize) {
+        size = maxWindowSize;
+    }
+
+    if(size != swtp->sendWindowSize) {
+        printf("Resizing the send window of client #%d from %u to %u.\n", clientIndex, swtp->sendWindowSize, size);
+
+        if(resizeSendWindow(clientIndex, size)) {
+            perror("Failed to resize the send window");
+        }
+    }
+
+    mtx_unlock(&clientListMutex);
+}
+
+/*
+    Shrinks the send windows that are larger than the share of a new client, so
+    that the first clients do not keep the window memory to themselves.
+*/
+void reclaimWindowMemory() {
+    uint32_t share = windowMemoryLimit / (clientCount + 1) / sizeof(swtp_frame_t);
+
+    for(int i = 0; i < clientListSize; i++) {
+        if(clientList[i] && clientList[i]->sendWindowSize > share) {
+            printf("Reducing the send window of client #%d from %u to %u to save memory.\n", i, clientList[i]->sendWindowSize, share);
+
+            if(resizeSendWindow(i, share)) {
+                perror("Failed to resize the send window");
+            }
+        }
+    }
+}
+
+/*
+    The client is only removed by the timer thread, as this function is called
+    while SWTP still uses the structure. A client that timed out keeps its
+    session for the grace period, so that it can resume it.
+*/
+void onDisconnect(swtp_t *swtp, int reason) {
+    mtx_lock(&clientListMutex);
+    
+    int clientId = findClientByData(swtp);
+
+    clientExpiryTime[clientId] = swtp_getTime(swtp);
+
+    if(reason == SWTP_DISCONNECTREASON_TIMEOUT && swtp->hasSession) {
+        clientExpiryTime[clientId] += sessionGracePeriod * 1000;
+    }
+
+    // 0 means connected
+    if(clientExpiryTime[clientId] == 0) {
+        clientExpiryTime[clientId] = 1;
+    }
+
+    mtx_unlock(&clientListMutex);
+
+    printf("Client #%d disconnected (reason=%d)\n", clientId, reason);
+}
+
+int writeAll(int fd, const void *buffer, size_t size) {
+    const uint8_t *data = buffer;
+
+    while(size > 0) {
+        ssize_t writtenSize = write(fd, data, size);
+
+        if(writtenSize < 0 && errno == EINTR) {
+            continue;
+        } else if(writtenSize <= 0) {
+            return -1;
+        }
+
+        data += writtenSize;
+        size -= writtenSize;
+    }
+
+    return 0;
+}
+
+int readAll(int fd, void *buffer, size_t size) {
+    uint8_t *data = buffer;
+
+    while(size > 0) {
+        ssize_t readSize = read(fd, data, size);
+
+        if(readSize < 0 && errno == EINTR) {
+            continue;
+        } else if(readSize <= 0) {
+            return -1;
+        }
+
+        data += readSize;
+        size -= readSize;
+    }
+
+    return 0;
+}
+
+/*
+    Sends a buffer on a UNIX socket, with the given file descriptors attached
+    to it (SCM_RIGHTS).
+*/
+int sendDescriptors(int fd, const void *buffer, size_t size, const int *fds, int fdCount) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * (1 + SWTP_MAX_PATHS))];
+    } control;
+    struct iovec iovec = {(void *)buffer, size};
+    struct msghdr message;
+
+    memset(&control, 0, sizeof(control));
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iovec;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+    struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&message);
+
+    controlMessage->cmsg_level = SOL_SOCKET;
+    controlMessage->cmsg_type = SCM_RIGHTS;
+    controlMessage->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+    memcpy(CMSG_DATA(controlMessage), fds, sizeof(int) * fdCount);
+
+    ssize_t sentSize = sendmsg(fd, &message, 0);
+
+    if(sentSize < 0) {
+        return -1;
+    }
+
+    return writeAll(fd, (const uint8_t *)buffer + sentSize, size - sentSize);
+}
+
+/*
+    Receives a buffer sent by sendDescriptors(), and the file descriptors
+    attached to it. Returns the number of file descriptors, or -1.
+*/
+int receiveDescriptors(int fd, void *buffer, size_t size, int *fds, int maxFdCount) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * (1 + SWTP_MAX_PATHS))];
+    } control;
+    struct iovec iovec = {buffer, size};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iovec;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t receivedSize = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+
+    if(receivedSize <= 0) {
+        return -1;
+    }
+
+    int fdCount = 0;
+
+    for(struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&message); controlMessage; controlMessage = CMSG_NXTHDR(&message, controlMessage)) {
+        if(controlMessage->cmsg_level == SOL_SOCKET && controlMessage->cmsg_type == SCM_RIGHTS) {
+            int count = (controlMessage->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for(int i = 0; i < count; i++) {
+                int receivedFd;
+
+                memcpy(&receivedFd, CMSG_DATA(controlMessage) + i * sizeof(int), sizeof(int));
+
+                if(fdCount < maxFdCount) {
+                    fds[fdCount++] = receivedFd;
+                } else {
+                    close(receivedFd);
+                }
+            }
+        }
+    }
+
+    if(readAll(fd, (uint8_t *)buffer + receivedSize, size - receivedSize)) {
+        for(int i = 0; i < fdCount; i++) {
+            close(fds[i]);
+        }
+
+        return -1;
+    }
+
+    return fdCount;
+}
+
+/*
+    Hands the server over to the process connected to the control socket: the
+    TUN device and the server sockets are passed with SCM_RIGHTS, followed by
+    the sessions, with their windows and sequence numbers, their scheduling
+    parameters and the routes. Once the other process confirms that it restored
+    them, this process exits with the client list still locked, so that it does
+    not handle any frame the other process would not know about. The packets
+    still queued for the clients are lost. If the other process fails, this one
+    goes on serving. Must be called with the client list locked.
+*/
+void handOver(int fd) {
+    handover_header_t header;
+    int fds[1 + SWTP_MAX_PATHS];
+
+    memset(&header, 0, sizeof(header));
+    header.version = HANDOVER_VERSION;
+    header.serverSocketCount = serverSocketCount;
+    memcpy(header.tunDeviceName, tunDeviceName, sizeof(header.tunDeviceName));
+    memcpy(header.cookieKey, cookieKey, sizeof(header.cookieKey));
+    header.routeCount = routeCount;
+    fds[0] = tunDevice;
+
+    for(int i = 0; i < serverSocketCount; i++) {
+        header.serverSockets[i] = serverSockets[i];
+        header.serverPorts[i] = serverPorts[i];
+        fds[i + 1] = serverSockets[i];
+    }
+
+    printf("Handing %d sessions over...\n", clientCount);
+
+    if(sendDescriptors(fd, &header, sizeof(header), fds, serverSocketCount + 1)) {
+        perror("Failed to send the descriptors");
+        return;
+    }
+
+    for(int i = 0; i < clientListSize; i++) {
+        if(!clientList[i]) {
+            continue;
+        }
+
+        handover_client_t client = getHandoverClient(i);
+
+        if(sendSession(fd, &client, clientList[i])) {
+            perror("Failed to send a session");
+            return;
+        }
+    }
+
+    handover_client_t end = {-1, 0, 0, 0, 0};
+
+    if(writeAll(fd, &end, sizeof(end))) {
+        perror("Failed to send the sessions");
+        return;
+    }
+
+    for(int i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        if(routeTable[i].clientIndex >= 0 && writeAll(fd, &routeTable[i], sizeof(route_t))) {
+            perror("Failed to send the routes");
+            return;
+        }
+    }
+
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    char response[3];
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if(readAll(fd, response, sizeof(response)) || memcmp(response, "OK\n", sizeof(response)) != 0) {
+        printf("The other server failed to take over, going on.\n");
+        return;
+    }
+
+    printf("Handed the server over.\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+/*
+    Returns the server socket bound to the given port, or the first one if
+    there is none.
+*/
+int getServerSocket(uint16_t port) {
+    for(int i = 0; i < serverSocketCount; i++) {
+        if(serverPorts[i] == port) {
+            return serverSockets[i];
+        }
+    }
+
+    return serverSockets[0];
+}
+
+/*
+    Returns the port of the given server socket.
+*/
+uint16_t getServerPort(int serverSocket) {
+    for(int i = 0; i < serverSocketCount; i++) {
+        if(serverSockets[i] == serverSocket) {
+            return serverPorts[i];
+        }
+    }
+
+    return serverPorts[0];
+}
+
+/*
+    Returns the socket of this process that replaces a server socket of the
+    process that sent the sessions: the one bound to the same port.
+*/
+int getHandedOverSocket(const handover_header_t *header, int socket) {
+    for(int i = 0; i < header->serverSocketCount; i++) {
+        if(header->serverSockets[i] == socket) {
+            return getServerSocket(header->serverPorts[i]);
+        }
+    }
+
+    return serverSockets[0];
+}
+
+/*
+    Returns the scheduling parameters of a client, which are sent before its
+    session.
+*/
+handover_client_t getHandoverClient(int clientIndex) {
+    sched_flow_t flow;
+
+    sched_getFlow(&scheduler, clientIndex, &flow);
+
+    return (handover_client_t){clientIndex, clientExpiryTime[clientIndex], flow.weight, flow.rate, flow.burst};
+}
+
+/*
+    Writes the scheduling parameters and the state of a session.
+*/
+int sendSession(int fd, const handover_client_t *client, const swtp_t *swtp) {
+    if(writeAll(fd, client, sizeof(*client)) || swtp_save(swtp, fd) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Destroys sessions that were not added to the client list, and frees their
+    array.
+*/
+void freeSessions(handover_session_t *sessions, int count) {
+    for(int i = 0; i < count; i++) {
+        swtp_destroy(sessions[i].swtp);
+        free(sessions[i].swtp);
+    }
+
+    free(sessions);
+}
+
+/*
+    Reads the sessions written by sendSession(), until the end of the list,
+    into a new array. The client list is not touched, so that it does not have
+    to be locked while the other process sends them. Returns the number of
+    sessions, or -1 if any of them could not be read.
+*/
+int receiveSessions(int fd, handover_session_t **sessions) {
+    int count = 0;
+    int capacity = 0;
+
+    *sessions = NULL;
+
+    while(true) {
+        handover_client_t client;
+
+        if(readAll(fd, &client, sizeof(client))) {
+            perror("Failed to receive the sessions");
+            freeSessions(*sessions, count);
+            return -1;
+        }
+
+        if(client.clientIndex < 0) {
+            break;
+        }
+
+        if(count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            handover_session_t *newSessions = realloc(*sessions, sizeof(handover_session_t) * capacity);
+
+            if(!newSessions) {
+                perror("Failed to receive the sessions");
+                freeSessions(*sessions, count);
+                return -1;
+            }
+
+            *sessions = newSessions;
+        }
+
+        swtp_t *swtp = malloc(sizeof(swtp_t));
+
+        if(!swtp || swtp_restore(swtp, fd) != SWTP_SUCCESS) {
+            printf("Failed to restore the session of client #%d.\n", client.clientIndex);
+            free(swtp);
+            freeSessions(*sessions, count);
+            return -1;
+        }
+
+        (*sessions)[count].client = client;
+        (*sessions)[count].swtp = swtp;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+    Puts the sessions read by receiveSessions() in the client list. The
+    sessions keep their index when the server is handed over, and take a free
+    slot when they migrate from another node of the cluster, which is told to
+    the other nodes. Their sockets are mapped from those of the header, or kept
+    if it is NULL, for the sessions of this node whose migration failed. The
+    sessions that do not fit are destroyed. Must be called with the client list
+    locked once the threads are started. Returns the number of sessions added.
+*/
+int addSessions(handover_session_t *sessions, int count, const handover_header_t *header, bool migrate) {
+    int addedCount = 0;
+
+    for(int i = 0; i < count; i++) {
+        handover_client_t client = sessions[i].client;
+        swtp_t *swtp = sessions[i].swtp;
+        int clientIndex = client.clientIndex;
+
+        if(migrate) {
+            clientIndex = -1;
+
+            for(int j = 0; j < clientListSize && clientIndex < 0; j++) {
+                if(!clientList[j] && !clientReserved[j]) {
+                    clientIndex = j;
+                }
+            }
+
+            // The idle timer restarts on the clock of this node
+            swtp->lastReceivedFrameTime = swtp_getTime(swtp);
+
+            if(client.expiryTime != 0) {
+                client.expiryTime += swtp_getTime(swtp);
+            }
+
+            if(swtp->hasSession && findClientBySessionId(swtp->sessionId) >= 0) {
+                clientIndex = -1;
+            }
+        }
+
+        if(clientIndex < 0 || clientIndex >= clientListSize || clientList[clientIndex] || sched_addFlow(&scheduler, clientIndex, egressQueueSize, client.weight)) {
+            printf("Dropped the session of client #%d, which does not fit in the client list.\n", client.clientIndex);
+            swtp_destroy(swtp);
+            free(swtp);
+            continue;
+        }
+
+        if(client.rate > 0) {
+            sched_setRate(&scheduler, clientIndex, client.rate, client.burst);
+        }
+
+        // The primary path uses the socket of the structure
+        if(header) {
+            swtp->socket = getHandedOverSocket(header, swtp->socket);
+
+            for(unsigned int j = 1; j < swtp->pathCount; j++) {
+                swtp->paths[j].socket = getHandedOverSocket(header, swtp->paths[j].socket);
+            }
+        }
+
+        swtp->recvCallback = onDataFrameReceived;
+        swtp->disconnectCallback = onDisconnect;
+        swtp->windowCallback = onWindowChanged;
+        setClientIndex(swtp, clientIndex);
+
+        clientList[clientIndex] = swtp;
+        clientExpiryTime[clientIndex] = client.expiryTime;
+        clientCount++;
+        windowMemory += swtp->sendWindowSize * sizeof(swtp_frame_t);
+        addedCount++;
+
+        if(migrate) {
+            if(header) {
+                printf("Adopted client #%d of another node as #%d\n", client.clientIndex, clientIndex);
+            }
+
+            cluster_claim(&cluster, CLUSTER_ALL_PEERS, (const struct sockaddr_in *)&swtp->socketAddress, swtp->hasSession, swtp->sessionId);
+        }
+    }
+
+    return addedCount;
+}
+
+/*
+    Takes the server over from the one listening on the given control socket,
+    with the handover command: its TUN device, sockets and sessions are used
+    instead of new ones, and the clients only see a pause. Must be called
+    before the threads are started.
+*/
+int takeOver(const char *path) {
+    struct sockaddr_un socketAddress;
+    handover_header_t header;
+    int fds[1 + SWTP_MAX_PATHS];
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd < 0) {
+        perror("Failed to create the handover socket");
+        return -1;
+    }
+
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sun_family = AF_UNIX;
+    strncpy(socketAddress.sun_path, path, sizeof(socketAddress.sun_path) - 1);
+
+    if(connect(fd, (const struct sockaddr *)&socketAddress, sizeof(socketAddress)) || writeAll(fd, "handover\n", 9)) {
+        perror("Failed to connect to the control socket");
+        close(fd);
+        return -1;
+    }
+
+    int fdCount = receiveDescriptors(fd, &header, sizeof(header), fds, 1 + SWTP_MAX_PATHS);
+
+    if(fdCount < 0) {
+        perror("Failed to receive the descriptors");
+        close(fd);
+        return -1;
+    }
+
+    if(header.version != HANDOVER_VERSION || header.serverSocketCount < 1 || header.serverSocketCount > SWTP_MAX_PATHS || fdCount != header.serverSocketCount + 1) {
+        printf("Incompatible handover (version %u).\n", header.version);
+
+        for(int i = 0; i < fdCount; i++) {
+            close(fds[i]);
+        }
+
+        close(fd);
+        return -1;
+    }
+
+    tunDevice = fds[0];
+    memcpy(tunDeviceName, header.tunDeviceName, sizeof(tunDeviceName));
+    tunDeviceName[sizeof(tunDeviceName) - 1] = '\0';
+    memcpy(cookieKey, header.cookieKey, sizeof(cookieKey));
+
+    serverSocketCount = header.serverSocketCount;
+    serverPortCount = header.serverSocketCount;
+
+    for(int i = 0; i < serverSocketCount; i++) {
+        serverSockets[i] = fds[i + 1];
+        serverPorts[i] = header.serverPorts[i];
+    }
+
+    handover_session_t *sessions;
+    int sessionCount = receiveSessions(fd, &sessions);
+
+    if(sessionCount < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // The threads are not started yet, so the client list is not locked
+    addSessions(sessions, sessionCount, &header, false);
+    free(sessions);
+
+    for(int i = 0; i < header.routeCount; i++) {
+        route_t route;
+
+        if(readAll(fd, &route, sizeof(route))) {
+            perror("Failed to receive the routes");
+            close(fd);
+            return -1;
+        }
+
+        if(route.clientIndex < clientListSize && clientList[route.clientIndex]) {
+            learnRoute(route.address, route.clientIndex);
+        }
+    }
+
+    // The other server exits once it reads the answer
+    if(writeAll(fd, "OK\n", 3)) {
+        perror("Failed to confirm the handover");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    printf("Took %d sessions over from %s.\n", clientCount, path);
+
+    return 0;
+}
+
+/*
+    Sends the commit of a migration to a node of the cluster, on the given
+    connection or else on a new one. Returns 0 if the node added the sessions,
+    1 if it dropped them, or -1 if it did not answer.
+*/
+int sendCommit(int peer, int connection, uint64_t id) {
+    migration_request_t request;
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    char response[3];
+
+    if(connection < 0) {
+        connection = cluster_connect(&cluster, peer);
+
+        if(connection < 0) {
+            perror("Failed to connect to a node of the cluster");
+            return -1;
+        }
+
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.type = MIGRATION_COMMIT;
+    request.id = id;
+
+    int result = -1;
+
+    if(!writeAll(connection, &request, sizeof(request)) && !readAll(connection, response, sizeof(response))) {
+        result = memcmp(response, "OK\n", sizeof(response)) == 0 ? 0 : 1;
+    }
+
+    close(connection);
+
+    return result;
 }
 
-void onDataFrameReceived(swtp_t *swtp, const void *buffer, size_t size) {
-    UNUSED_PARAMETER(swtp);
-    write(tunDevice, buffer, size);
+/*
+    Sends sessions taken out of the client list to a node of the cluster, in the
+    format used to hand the server over, and commits them once the node has
+    them. The commit is sent again if the node does not answer it. Returns 0 if
+    the node added them, 1 if it did not, which leaves them to this node, or -1
+    if that is unknown because the node stopped answering.
+*/
+int migrateSessions(int peer, const handover_session_t *sessions, int count) {
+    migration_request_t request;
+    handover_header_t header;
+    handover_client_t end = {-1, 0, 0, 0, 0};
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+    char response[3];
+
+    memset(&request, 0, sizeof(request));
+    request.type = MIGRATION_SESSIONS;
+
+    if(getrandom(&request.id, sizeof(request.id), 0) != sizeof(request.id)) {
+        perror("Failed to generate a migration identifier");
+        return 1;
+    }
+
+    int connection = cluster_connect(&cluster, peer);
+
+    if(connection < 0) {
+        perror("Failed to connect to a node of the cluster");
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.version = HANDOVER_VERSION;
+    header.serverSocketCount = serverSocketCount;
+
+    for(int i = 0; i < serverSocketCount; i++) {
+        header.serverSockets[i] = serverSockets[i];
+        header.serverPorts[i] = serverPorts[i];
+    }
+
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    bool sent = !writeAll(connection, &request, sizeof(request)) && !writeAll(connection, &header, sizeof(header));
+
+    for(int i = 0; i < count && sent; i++) {
+        handover_client_t client = sessions[i].client;
+
+        // The expiry time is relative, as the clocks of the nodes differ
+        if(client.expiryTime != 0) {
+            client.expiryTime -= swtp_getTime(sessions[i].swtp);
+        }
+
+        sent = !sendSession(connection, &client, sessions[i].swtp);
+    }
+
+    // Until the commit, the node only keeps the sessions aside, and drops
+    // them when the connection closes
+    if(!sent || writeAll(connection, &end, sizeof(end)) || readAll(connection, response, sizeof(response)) || memcmp(response, "OK\n", sizeof(response)) != 0) {
+        close(connection);
+        return 1;
+    }
+
+    int result = sendCommit(peer, connection, request.id);
+
+    for(int attempt = 1; attempt < MIGRATION_COMMIT_ATTEMPTS && result < 0; attempt++) {
+        printf("Committing the migration to %s:%d again...\n", inet_ntoa(cluster.peers[peer].sin_addr), ntohs(cluster.peers[peer].sin_port));
+        thrd_sleep(&(struct timespec){.tv_sec = 1}, NULL);
+        result = sendCommit(peer, -1, request.id);
+    }
+
+    return result;
 }
 
-void onDisconnect(swtp_t *swtp, int reason) {
+/*
+    Migrates the sessions of this node to the other nodes of the cluster. Each
+    client goes to the node that its address hashes to, which then claims it,
+    and the datagrams this node still receives for it are forwarded there. The
+    sessions are taken out of the client list while they are sent, so that the
+    list is not locked while waiting for the other node, but their slots are
+    kept, and they are put back as they were if the node does not take them.
+    The sessions whose migration the node did not confirm either way are
+    dropped, as the node may serve them. The node then keeps forwarding the
+    datagrams of new clients to the other nodes, so that it can be stopped.
+*/
+void drainSessions(int fd) {
+    int migratedCount = 0;
+    int droppedCount = 0;
+
+    for(int peer = 0; peer < cluster.peerCount; peer++) {
+        int sessionCount = 0;
+
+        mtx_lock(&clientListMutex);
+
+        handover_session_t *sessions = malloc(sizeof(handover_session_t) * (clientCount > 0 ? clientCount : 1));
+
+        if(!sessions) {
+            mtx_unlock(&clientListMutex);
+            perror("Failed to migrate the sessions");
+            continue;
+        }
+
+        for(int i = 0; i < clientListSize; i++) {
+            if(clientList[i] && cluster_selectPeer(&cluster, (const struct sockaddr_in *)&clientList[i]->socketAddress) == peer) {
+                sessions[sessionCount].client = getHandoverClient(i);
+                sessions[sessionCount].swtp = detachClient(i);
+                clientReserved[i] = true;
+                sessionCount++;
+            }
+        }
+
+        mtx_unlock(&clientListMutex);
+
+        if(sessionCount == 0) {
+            free(sessions);
+            continue;
+        }
+
+        // The datagrams of the sessions are not handled until they are
+        // restored, by the other node or by this one
+        int result = migrateSessions(peer, sessions, sessionCount);
+
+        mtx_lock(&clientListMutex);
+
+        for(int i = 0; i < sessionCount; i++) {
+            clientReserved[sessions[i].client.clientIndex] = false;
+        }
+
+        if(result > 0) {
+            printf("Failed to migrate %d sessions to %s:%d.\n", sessionCount, inet_ntoa(cluster.peers[peer].sin_addr), ntohs(cluster.peers[peer].sin_port));
+            addSessions(sessions, sessionCount, NULL, false);
+            free(sessions);
+        } else if(result < 0) {
+            // If the other node took them, its claims tell this node
+            printf("Dropped %d sessions, as %s:%d did not confirm their migration.\n", sessionCount, inet_ntoa(cluster.peers[peer].sin_addr), ntohs(cluster.peers[peer].sin_port));
+            freeSessions(sessions, sessionCount);
+            droppedCount += sessionCount;
+        } else {
+            // The other node owns them now
+            for(int i = 0; i < sessionCount; i++) {
+                cluster_setAddressOwner(&cluster, (const struct sockaddr_in *)&sessions[i].swtp->socketAddress, peer);
+
+                if(sessions[i].swtp->hasSession) {
+                    cluster_setSessionOwner(&cluster, sessions[i].swtp->sessionId, peer);
+                }
+            }
+
+            freeSessions(sessions, sessionCount);
+
+            migratedCount += sessionCount;
+            printf("Migrated %d sessions to %s:%d.\n", sessionCount, inet_ntoa(cluster.peers[peer].sin_addr), ntohs(cluster.peers[peer].sin_port));
+        }
+
+        mtx_unlock(&clientListMutex);
+    }
+
     mtx_lock(&clientListMutex);
-    
-    int clientId = findClientByData(swtp);
 
-    clientCount--;
-    clientList[clientId] = NULL;
-    
-    swtp_destroy(swtp);
-    free(swtp);
+    draining = true;
+
+    if(droppedCount > 0) {
+        dprintf(fd, "ERROR %d sessions were not migrated, %d were dropped\n", clientCount, droppedCount);
+    } else if(clientCount > 0) {
+        dprintf(fd, "ERROR %d sessions were not migrated\n", clientCount);
+    } else {
+        dprintf(fd, "OK %d sessions migrated\n", migratedCount);
+    }
+
+    mtx_unlock(&clientListMutex);
+}
+
+/*
+    Returns the migration of the history with the given identifier, or NULL.
+    Must be called with the client list locked.
+*/
+migration_t *findMigration(uint64_t id) {
+    for(int i = 0; i < MIGRATION_HISTORY_SIZE; i++) {
+        if(migrations[i].state != MIGRATION_EMPTY && migrations[i].id == id) {
+            return &migrations[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Drops the sessions of a migration that was not committed. The answer to its
+    commit is then "NO". Must be called with the client list locked.
+*/
+void dropMigration(migration_t *migration) {
+    if(migration->state == MIGRATION_PENDING) {
+        freeSessions(migration->sessions, migration->sessionCount);
+        migration->sessions = NULL;
+        migration->state = MIGRATION_DROPPED;
+    }
+}
+
+/*
+    Keeps sessions migrated from another node aside until their commit, in the
+    entry of the history that the oldest migration used, which is dropped if it
+    is still pending. Must be called with the client list locked.
+*/
+void addMigration(uint64_t id, const handover_header_t *header, handover_session_t *sessions, int count) {
+    migration_t *migration = &migrations[nextMigration];
+
+    dropMigration(migration);
+
+    migration->id = id;
+    migration->state = MIGRATION_PENDING;
+    migration->header = *header;
+    migration->sessions = sessions;
+    migration->sessionCount = count;
+
+    nextMigration = (nextMigration + 1) % MIGRATION_HISTORY_SIZE;
+}
+
+/*
+    Adds the sessions of a pending migration to the client list, which claims
+    them, or drops them if they do not all fit. A migration is only committed or
+    dropped once, so the answer to its commit does not change when the other
+    node repeats it. Returns true if the sessions were added. Must be called
+    with the client list locked.
+*/
+bool commitMigration(uint64_t id) {
+    migration_t *migration = findMigration(id);
+
+    if(!migration) {
+        return false;
+    }
+
+    if(migration->state == MIGRATION_PENDING) {
+        int freeSlotCount = 0;
+
+        for(int i = 0; i < clientListSize; i++) {
+            if(!clientList[i] && !clientReserved[i]) {
+                freeSlotCount++;
+            }
+        }
+
+        if(freeSlotCount < migration->sessionCount) {
+            printf("Refused %d sessions from another node, as the client list is full.\n", migration->sessionCount);
+            dropMigration(migration);
+            return false;
+        }
+
+        addSessions(migration->sessions, migration->sessionCount, &migration->header, true);
+        free(migration->sessions);
+        migration->sessions = NULL;
+        migration->state = MIGRATION_COMMITTED;
+    }
+
+    return migration->state == MIGRATION_COMMITTED;
+}
+
+/*
+    Serves a connection from another node of the cluster: the sessions that it
+    migrates to this node with drainSessions(), and their commit. They are read
+    before the client list is locked, as the other node may be slow to send
+    them.
+*/
+void adoptSessions(int fd) {
+    migration_request_t request;
+    handover_header_t header;
+    handover_session_t *sessions;
+    struct timeval timeout = {HANDOVER_TIMEOUT, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if(readAll(fd, &request, sizeof(request))) {
+        return;
+    }
+
+    if(request.type == MIGRATION_SESSIONS) {
+        uint64_t id = request.id;
+
+        if(readAll(fd, &header, sizeof(header)) || header.version != HANDOVER_VERSION || header.serverSocketCount < 1 || header.serverSocketCount > SWTP_MAX_PATHS) {
+            printf("Refused sessions from another node.\n");
+            return;
+        }
+
+        int sessionCount = receiveSessions(fd, &sessions);
+
+        if(sessionCount < 0) {
+            return;
+        }
+
+        mtx_lock(&clientListMutex);
+        addMigration(id, &header, sessions, sessionCount);
+        mtx_unlock(&clientListMutex);
 
+        // The other node commits on this connection, unless it lost the
+        // answer, in which case the migration is dropped
+        if(writeAll(fd, "OK\n", 3) || readAll(fd, &request, sizeof(request)) || request.type != MIGRATION_COMMIT || request.id != id) {
+            mtx_lock(&clientListMutex);
+
+            migration_t *migration = findMigration(id);
+
+            if(migration) {
+                dropMigration(migration);
+            }
+
+            mtx_unlock(&clientListMutex);
+            return;
+        }
+    }
+
+    if(request.type != MIGRATION_COMMIT) {
+        return;
+    }
+
+    mtx_lock(&clientListMutex);
+    bool committed = commitMigration(request.id);
     mtx_unlock(&clientListMutex);
 
-    printf("Client #0 disconnected (reason=%d)\n", reason);
+    writeAll(fd, committed ? "OK\n" : "NO\n", 3);
+}
+
+/*
+    Moves the session of a REBIND frame to the address the frame was received
+    from, if the token of the session is correct. Returns the index of the
+    client, or -1 if the session was not found.
+*/
+int rebindClient(int serverSocket, const struct sockaddr *socketAddress, const swtp_frame_t *frame) {
+    uint32_t sessionId;
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+
+    if(swtp_parseRebind(frame, &sessionId, sessionToken) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    int clientIndex = findClientBySessionId(sessionId);
+
+    // A disconnected client must resume its session with a SABM frame instead
+    if(clientIndex < 0 || clientExpiryTime[clientIndex] != 0 || !swtp_checkSessionToken(clientList[clientIndex], sessionToken)) {
+        return -1;
+    }
+
+    printf("Rebound client #%d to %s\n", clientIndex, inet_ntoa((*(struct sockaddr_in *)socketAddress).sin_addr));
+
+    clientList[clientIndex]->socket = serverSocket;
+
+    if(swtp_rebind(clientList[clientIndex], socketAddress) != SWTP_SUCCESS) {
+        perror("Failed to retransmit frames after REBIND");
+    }
+
+    return clientIndex;
+}
+
+/*
+    Adds the path a JOIN frame was received from to its session, if the token
+    of the session is correct, and confirms it to the client. Returns the index
+    of the client, or -1 if the session was not found.
+*/
+int joinClient(int serverSocket, const struct sockaddr *socketAddress, const swtp_frame_t *frame) {
+    uint32_t sessionId;
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+    bool accepted;
+
+    if(swtp_parseJoin(frame, &sessionId, sessionToken, &accepted) != SWTP_SUCCESS || accepted) {
+        return -1;
+    }
+
+    int clientIndex = findClientBySessionId(sessionId);
+
+    if(clientIndex < 0 || clientExpiryTime[clientIndex] != 0 || !swtp_checkSessionToken(clientList[clientIndex], sessionToken)) {
+        return -1;
+    }
+
+    // The address may already be a path of another client, whose NAT mapping
+    // expired
+    int previousClientIndex = findClientBySocketAddress((struct sockaddr_in *)socketAddress, sizeof(struct sockaddr_in));
+
+    if(previousClientIndex >= 0 && previousClientIndex != clientIndex) {
+        return -1;
+    }
+
+    int path = swtp_addPath(clientList[clientIndex], serverSocket, socketAddress);
+
+    if(path < 0) {
+        printf("Refused a path for client #%d because it has too many paths.\n", clientIndex);
+        return -1;
+    }
+
+    if(previousClientIndex < 0) {
+        printf("Added path #%d from %s to client #%d\n", path, inet_ntoa((*(struct sockaddr_in *)socketAddress).sin_addr), clientIndex);
+    }
+
+    swtp_frame_t response;
+
+    swtp_buildJoin(&response, clientList[clientIndex], true);
+    sendto(serverSocket, &response.frame, response.size, 0, socketAddress, sizeof(struct sockaddr_in));
+
+    return clientIndex;
+}
+
+void computeCookie(const struct sockaddr_in *socketAddress, uint64_t period, uint8_t *cookie) {
+    uint8_t data[16];
+
+    memcpy(data, &socketAddress->sin_addr, 4);
+    memcpy(data + 4, &socketAddress->sin_port, 2);
+    memset(data + 6, 0, 2);
+    memcpy(data + 8, &period, 8);
+
+    uint64_t hash = siphash24(cookieKey, data, sizeof(data));
+    memcpy(cookie, &hash, SWTP_COOKIE_SIZE);
+}
+
+bool checkCookie(const struct sockaddr_in *socketAddress, const uint8_t *cookie) {
+    uint64_t period = time(NULL) / COOKIE_PERIOD;
+
+    for(int i = 0; i < 2; i++) {
+        uint8_t expectedCookie[SWTP_COOKIE_SIZE];
+        uint8_t difference = 0;
+
+        computeCookie(socketAddress, period - i, expectedCookie);
+
+        for(int j = 0; j < SWTP_COOKIE_SIZE; j++) {
+            difference |= expectedCookie[j] ^ cookie[j];
+        }
+
+        if(difference == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Decides whether a SABM frame may create a session, without storing anything
+    about the client. A client must first prove that it receives frames at its
+    address by echoing a cookie, which is a keyed hash of its address and of the
+    current period, like TCP SYN cookies. Then, the number of new sessions per
+    second is limited, so that a reconnection storm does not allocate all the
+    windows at once. Resumed sessions are admitted right away, as they do not
+    allocate anything.
+*/
+bool admitClient(int serverSocket, const struct sockaddr_in *socketAddress, const swtp_frame_t *frame) {
+    swtp_sabm_t sabm;
+
+    if(swtp_parseSABM(frame, &sabm) != SWTP_SUCCESS) {
+        return false;
+    }
+
+    if(sabm.resume) {
+        int clientIndex = findClientBySessionId(sabm.sessionId);
+
+        if(clientIndex >= 0 && swtp_checkSessionToken(clientList[clientIndex], sabm.sessionToken) && clientList[clientIndex]->extended == sabm.extended) {
+            return true;
+        }
+    }
+
+    if(sabmCookies && !(sabm.hasCookie && checkCookie(socketAddress, sabm.cookie))) {
+        swtp_frame_t cookieFrame;
+        uint8_t cookie[SWTP_COOKIE_SIZE];
+
+        computeCookie(socketAddress, time(NULL) / COOKIE_PERIOD, cookie);
+        swtp_buildCookie(&cookieFrame, cookie);
+        sendto(serverSocket, &cookieFrame.frame, cookieFrame.size, 0, (const struct sockaddr *)socketAddress, sizeof(struct sockaddr_in));
+
+        return false;
+    }
+
+    // Token bucket, which allows bursts of one second of sessions
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    swtp_time_t currentTime = (swtp_time_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    admissionTokens += (currentTime - lastAdmissionTime) * admissionRate;
+    lastAdmissionTime = currentTime;
+
+    if(admissionTokens > admissionRate * 1000) {
+        admissionTokens = admissionRate * 1000;
+    }
+
+    if(admissionTokens < 1000) {
+        printf("Refused a client because too many clients are connecting.\n");
+        refusedClientCount++;
+        return false;
+    }
+
+    admissionTokens -= 1000;
+
+    return true;
+}
+
+/*
+    Sends the SABM response to the given client request. The response only has
+    a payload if the request had one. The public key, if not NULL, is the one
+    of the server for a new encrypted session.
+*/
+void sendSABMResponse(int serverSocket, const swtp_t *swtp, const struct sockaddr *socketAddress, const swtp_sabm_t *request, bool resumed, const uint8_t *publicKey) {
+    swtp_frame_t response;
+    swtp_sabm_t responseSabm = {
+        .windowSize = swtp->receiveWindowSize,
+        .overheadSize = SWTP_OVERHEAD_SIZE,
+        .byteWindowSize = swtp->receiveByteWindowSize,
+        .hasSession = swtp->hasSession,
+        .sessionId = swtp->sessionId,
+        .resume = resumed,
+        .expectedFrameNumber = swtp->expectedFrameNumber,
+        .extended = swtp->extended,
+        .sack = true,
+        .pmtu = true
+    };
+
+    memcpy(responseSabm.sessionToken, swtp->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+
+    if(publicKey) {
+        responseSabm.hasKey = true;
+        memcpy(responseSabm.publicKey, publicKey, SWTP_KEY_SIZE);
+    }
+
+    swtp_buildSABM(&response, &responseSabm);
+
+    if(request->overheadSize == 0) {
+        response.size = SWTP_HEADER_SIZE;
+    }
+
+    sendto(serverSocket, &response.frame, response.size, 0, socketAddress, sizeof(struct sockaddr_in));
+}
+
+/*
+    Tells whether a SABM frame is a copy of the one that created the session of
+    a client. Only the cookie may differ, as the client may have been sent
+    several. A client that offers a key generates a new one when it starts
+    over, so the same key means the same request. Without a key, the client
+    may have started over with the same request, which is only taken as a
+    copy as long as the session did not receive any data frame.
+*/
+bool isRetransmittedSABM(int clientIndex, const swtp_sabm_t *sabm) {
+    if(!clientSabm[clientIndex].valid || clientExpiryTime[clientIndex] != 0) {
+        return false;
+    }
+
+    // The frames are compared with their padding, which swtp_parseSABM()
+    // clears
+    swtp_sabm_t request;
+
+    memcpy(&request, sabm, sizeof(swtp_sabm_t));
+    request.hasCookie = false;
+    memset(request.cookie, 0, SWTP_COOKIE_SIZE);
+
+    if(memcmp(&request, &clientSabm[clientIndex].request, sizeof(swtp_sabm_t)) != 0) {
+        return false;
+    }
+
+    return request.hasKey || clientList[clientIndex]->stats.receivedDataFrames == 0;
+}
+
+/*
+    Resumes the session of a client that reconnected, from its new address. The
+    frames the client did not receive are retransmitted right away.
+*/
+int resumeClient(int serverSocket, int clientIndex, const struct sockaddr *socketAddress, const swtp_sabm_t *sabm) {
+    swtp_t *swtp = clientList[clientIndex];
+
+    clientExpiryTime[clientIndex] = 0;
+    swtp->socket = serverSocket;
+    swtp_setPeerWindow(swtp, sabm->windowSize, sabm->overheadSize, sabm->byteWindowSize);
+    sendSABMResponse(serverSocket, swtp, socketAddress, sabm, true, NULL);
+
+    printf("Resumed the session of client #%d from %s\n", clientIndex, inet_ntoa((*(struct sockaddr_in *)socketAddress).sin_addr));
+
+    if(swtp_resume(swtp, socketAddress, sabm->expectedFrameNumber) != SWTP_SUCCESS) {
+        perror("Failed to retransmit frames after resuming a session");
+    }
+
+    // Send the packets queued while the client was disconnected
+    sched_kick(&scheduler);
+
+    return clientIndex;
 }
 
 /*
@@ -301,21 +2909,66 @@ void onDisconnect(swtp_t *swtp, int reason) {
     entry in the client table, and return its index in the table. If an error
     occurred, -1 will be returned.
 */
-int acceptClientSABM(const struct sockaddr *socketAddress, const swtp_frame_t *frame) {
-    // Check if there's enough space in the client table
-    if(clientCount >= clientListSize) {
+int acceptClientSABM(int serverSocket, const struct sockaddr *socketAddress, const swtp_frame_t *frame) {
+    swtp_sabm_t sabm;
+
+    if(swtp_parseSABM(frame, &sabm) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    // A client that reconnects after a connection loss resumes its session, as
+    // long as it keeps the same sequence numbers
+    if(sabm.resume) {
+        int clientIndex = findClientBySessionId(sabm.sessionId);
+
+        if(clientIndex >= 0 && swtp_checkSessionToken(clientList[clientIndex], sabm.sessionToken) && clientList[clientIndex]->extended == sabm.extended) {
+            return resumeClient(serverSocket, clientIndex, socketAddress, &sabm);
+        }
+    }
+
+    // The pre-shared key authenticates the clients
+    if(hasPreSharedKey && !sabm.hasKey) {
+        printf("Refused a client that does not support encryption.\n");
         return -1;
     }
 
-    // Find a free slot for the client
-    int freeSlot;
+    // The client resends its SABM frame until it gets an answer, so the
+    // answer may have been lost or delayed
+    int previousClientIndex = findClientBySocketAddress((struct sockaddr_in *)socketAddress, sizeof(struct sockaddr_in));
+
+    if(previousClientIndex >= 0 && isRetransmittedSABM(previousClientIndex, &sabm)) {
+        printf("Answered a retransmitted SABM of client #%d.\n", previousClientIndex);
+        sendSABMResponse(serverSocket, clientList[previousClientIndex], socketAddress, &sabm, false, clientSabm[previousClientIndex].hasKey ? clientSabm[previousClientIndex].publicKey : NULL);
+        return previousClientIndex;
+    }
+
+    // Else, the previous session of the client is over. The cookie checked by
+    // admitClient() proves that the SABM frame comes from that address.
+    if(previousClientIndex >= 0) {
+        removeClient(previousClientIndex);
+    }
+
+    // Find a free slot for the client, or else the slot of the disconnected
+    // client that expires first
+    int freeSlot = -1;
 
-    for(freeSlot = 0; freeSlot < clientListSize; freeSlot++) {
-        if(!clientList[freeSlot]) {
+    for(int i = 0; i < clientListSize; i++) {
+        if(!clientList[i] && !clientReserved[i]) {
+            freeSlot = i;
             break;
+        } else if(clientExpiryTime[i] != 0 && (freeSlot < 0 || clientExpiryTime[i] < clientExpiryTime[freeSlot])) {
+            freeSlot = i;
         }
     }
 
+    if(freeSlot < 0) {
+        printf("Refused a client because the client list was full.\n");
+        refusedClientCount++;
+        return -1;
+    } else if(clientList[freeSlot]) {
+        removeClient(freeSlot);
+    }
+
     // Allocate memory for the SWTP structure
     swtp_t *swtp = malloc(sizeof(swtp_t));
 
@@ -323,10 +2976,16 @@ int acceptClientSABM(const struct sockaddr *socketAddress, const swtp_frame_t *f
         return -1;
     }
 
-    // Initialize SWTP structure
+    // Initialize SWTP structure. Extended sequence numbers are used if the
+    // client asks for them.
     swtp_init(swtp, serverSocket, socketAddress);
+    swtp->extended = sabm.extended;
+    swtp_setKeepalive(swtp, keepaliveIdleTime, keepaliveInterval, keepaliveProbes, keepaliveAdaptive);
 
-    int sendWindowSize = ntohs(*((uint16_t *)(frame->frame.header + 2)));
+    // The receive window of the server goes in the SABM response
+    swtp_setReceiveWindow(swtp, receiveWindowSize, receiveWindowSize * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU));
+
+    int sendWindowSize = sabm.windowSize;
 
     if(sendWindowMaxSize > 0) {
         if(sendWindowSize > sendWindowMaxSize) {
@@ -335,81 +2994,622 @@ int acceptClientSABM(const struct sockaddr *socketAddress, const swtp_frame_t *f
         }
     }
 
-    if(swtp_initSendWindow(swtp, sendWindowSize) != SWTP_SUCCESS) {
+    // Share the remaining window memory between the free slots, so that the
+    // first clients cannot use all of it. Under memory pressure, the windows
+    // of the other clients shrink to their share.
+    size_t maxWindowSize = (windowMemoryLimit - windowMemory) / (clientListSize - clientCount) / sizeof(swtp_frame_t);
+
+    if((size_t)sendWindowSize > maxWindowSize) {
+        reclaimWindowMemory();
+        maxWindowSize = (windowMemoryLimit - windowMemory) / (clientListSize - clientCount) / sizeof(swtp_frame_t);
+    }
+
+    if((size_t)sendWindowSize > maxWindowSize) {
+        printf("Reducing client receive window size from %d to %zu to save memory.\n", sendWindowSize, maxWindowSize);
+        sendWindowSize = maxWindowSize;
+    }
+
+    if(sendWindowSize == 0 || swtp_initSendWindow(swtp, sendWindowSize) != SWTP_SUCCESS) {
+        free(swtp);
+        return -1;
+    }
+
+    windowMemory += sendWindowSize * sizeof(swtp_frame_t);
+
+    // The client announced its receive window and overhead in its SABM frame
+    swtp_setPeerWindow(swtp, sabm.windowSize, sabm.overheadSize, sabm.byteWindowSize);
+
+    if(fecBlockSize > 0) {
+        if(swtp_enableFec(swtp, fecBlockSize, fecAdaptive) != SWTP_SUCCESS) {
+            windowMemory -= sendWindowSize * sizeof(swtp_frame_t);
+            swtp_destroy(swtp);
+            free(swtp);
+            return -1;
+        }
+    }
+
+    // Clients that understand SACK frames get them instead of REJ frames
+    if(sabm.sack && swtp_enableSack(swtp) != SWTP_SUCCESS) {
+        windowMemory -= sendWindowSize * sizeof(swtp_frame_t);
+        swtp_destroy(swtp);
+        free(swtp);
+        return -1;
+    }
+
+    // Clients that offer a key get an encrypted tunnel
+    uint8_t publicKey[SWTP_KEY_SIZE];
+
+    if(sabm.hasKey && encryption) {
+        uint8_t secretKey[SWTP_KEY_SIZE];
+
+        if(
+            swtp_generateKeyPair(secretKey, publicKey) != SWTP_SUCCESS
+            || swtp_enableEncryption(swtp, secretKey, sabm.publicKey, hasPreSharedKey ? preSharedKey : NULL, false) != SWTP_SUCCESS
+        ) {
+            windowMemory -= sendWindowSize * sizeof(swtp_frame_t);
+            swtp_destroy(swtp);
+            free(swtp);
+            return -1;
+        }
+    }
+
+    // Clients that answer probe frames let the server search the path MTU
+    if(sabm.pmtu) {
+        swtp_enablePmtuDiscovery(swtp);
+    }
+
+    // A client that can roam gets a session, so that it can rebind it to its
+    // new address later
+    if(sabm.hasSession) {
+        do {
+            if(swtp_createSession(swtp) != SWTP_SUCCESS) {
+                windowMemory -= sendWindowSize * sizeof(swtp_frame_t);
+                swtp_destroy(swtp);
+                free(swtp);
+                return -1;
+            }
+        } while(findClientBySessionId(swtp->sessionId) >= 0);
+    }
+
+    if(sched_addFlow(&scheduler, freeSlot, egressQueueSize, defaultWeight)) {
+        windowMemory -= sendWindowSize * sizeof(swtp_frame_t);
+        swtp_destroy(swtp);
         free(swtp);
         return -1;
     }
 
-    swtp->lastReceivedFrameTime = time(NULL);
+    if(defaultRate > 0) {
+        setClientRate(freeSlot, defaultRate);
+    }
 
-    // Send SABM response
-    uint32_t response = htonl(0x80000000 | receiveWindowSize);
-    sendto(serverSocket, &response, 4, 0, socketAddress, sizeof(struct sockaddr_in));
+    sendSABMResponse(serverSocket, swtp, socketAddress, &sabm, false, sabm.hasKey && encryption ? publicKey : NULL);
 
     // Register the client in the client list
     clientList[freeSlot] = swtp;
     clientCount++;
+    acceptedSessionCount++;
 
-    printf("Accepted %s (recv window size=%d) as #%d\n", inet_ntoa((*(struct sockaddr_in *)socketAddress).sin_addr), swtp->sendWindowSize, freeSlot);
+    // Remember the answer, in case the client did not receive it
+    clientSabm[freeSlot].valid = true;
+    memcpy(&clientSabm[freeSlot].request, &sabm, sizeof(swtp_sabm_t));
+    clientSabm[freeSlot].request.hasCookie = false;
+    memset(clientSabm[freeSlot].request.cookie, 0, SWTP_COOKIE_SIZE);
+    clientSabm[freeSlot].hasKey = sabm.hasKey && encryption;
+
+    if(clientSabm[freeSlot].hasKey) {
+        memcpy(clientSabm[freeSlot].publicKey, publicKey, SWTP_KEY_SIZE);
+    }
+
+    printf("Accepted %s (recv window size=%u%s%s) as #%d\n", inet_ntoa((*(struct sockaddr_in *)socketAddress).sin_addr), swtp->sendWindowSize, swtp->extended ? ", extended" : "", swtp->encrypted ? ", encrypted" : "", freeSlot);
 
     // Register callbacks
     clientList[freeSlot]->recvCallback = onDataFrameReceived;
     clientList[freeSlot]->disconnectCallback = onDisconnect;
+    clientList[freeSlot]->windowCallback = onWindowChanged;
+    setClientIndex(swtp, freeSlot);
 
     return freeSlot;
 }
 
-void mainServerLoop() {
-    while(true) {
-        // Contains the address of the last client who sent a datagram.
-        struct sockaddr_in socketAddress;
+/*
+    Steers a datagram from an unknown address, in a cluster. The datagram is
+    forwarded to the node that owns its session or its address. If the owner
+    is unknown, the datagram is sent to every node, and the owner claims it.
+    The owner is asked to claim it again every few seconds, and forgotten if it
+    does not, as it may have stopped. Only once no node claimed it, this node
+    handles it, which makes it the owner of a new session. Returns true if this
+    node must not handle the datagram. The forwarder is the index of the node
+    that forwarded the datagram, -1 if it was received from the client.
+*/
+bool steerDatagram(int serverSocket, const struct sockaddr_in *socketAddress, const swtp_frame_t *frame, int forwarder, uint8_t forwardFlags) {
+    uint8_t sessionToken[SWTP_SESSION_TOKEN_SIZE];
+    bool sabm = (frame->frame.header[0] & 0xf0) == 0x80;
+    bool hasSession = false;
+    uint32_t sessionId = 0;
+    bool accepted;
+    bool stale = false;
+
+    if(sabm) {
+        swtp_sabm_t request;
+
+        if(swtp_parseSABM(frame, &request) == SWTP_SUCCESS && request.resume) {
+            hasSession = true;
+            sessionId = request.sessionId;
+        }
+    } else if(frame->frame.header[0] == 0xb0 && frame->frame.header[1] == SWTP_EXT_REBIND) {
+        hasSession = swtp_parseRebind(frame, &sessionId, sessionToken) == SWTP_SUCCESS;
+    } else if(frame->frame.header[0] == 0xb0 && frame->frame.header[1] == SWTP_EXT_JOIN) {
+        hasSession = swtp_parseJoin(frame, &sessionId, sessionToken, &accepted) == SWTP_SUCCESS;
+    }
 
-        // Contains the size of the socketAddress structure.
-        socklen_t socketAddressLength = sizeof(socketAddress);
-        
-        // Contains the datagram from the client.
-        swtp_frame_t buffer;
+    if(hasSession && findClientBySessionId(sessionId) >= 0) {
+        return false;
+    }
 
-        // Receive the datagram.
-        ssize_t packetSize = recvfrom(serverSocket, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0, (struct sockaddr *)&socketAddress, &socketAddressLength);
+    if(forwarder >= 0) {
+        // Only the owner answers a flooded datagram. A datagram forwarded to
+        // this node only is handled as if it was received from the client,
+        // unless its forwarder thinks that this node owns it while it does
+        // not.
+        if(forwardFlags & CLUSTER_FLAG_FLOOD) {
+            return true;
+        } else if(!sabm) {
+            cluster_release(&cluster, forwarder, socketAddress, hasSession, sessionId);
+            return true;
+        }
 
-        // If the packet has a negative size, then an error occurred.
-        if(packetSize < 0) {
-            perror("An error occurred in server main loop");
+        return false;
+    }
 
-            // Exit the loop
-            break;
+    int owner = CLUSTER_UNCLAIMED;
+
+    if(hasSession) {
+        owner = cluster_findSessionOwner(&cluster, sessionId, &stale);
+    } else if(!sabm) {
+        owner = cluster_findAddressOwner(&cluster, socketAddress, &stale);
+    }
+
+    if(owner == CLUSTER_UNKNOWN) {
+        cluster_forward(&cluster, CLUSTER_ALL_PEERS, getServerPort(serverSocket), socketAddress, &frame->frame, frame->size, CLUSTER_FLAG_FLOOD);
+
+        if(hasSession) {
+            cluster_setSessionOwner(&cluster, sessionId, CLUSTER_PENDING);
+        } else {
+            cluster_setAddressOwner(&cluster, socketAddress, CLUSTER_PENDING);
         }
 
-        buffer.size = packetSize;
+        return true;
+    } else if(owner == CLUSTER_PENDING) {
+        return true;
+    }
 
-        mtx_lock(&clientListMutex);
+    // A node that was drained gives its new clients to the other nodes
+    if(owner == CLUSTER_UNCLAIMED && sabm && draining) {
+        owner = cluster_selectPeer(&cluster, socketAddress);
+    }
 
-        // Search for the client
-        int clientIndex = findClientBySocketAddress(&socketAddress, socketAddressLength);
-
-        // If the client was not found
-        if(clientIndex == -1) {
-            // If there is no slot remaining
-            if(clientCount < clientListSize) {
-                // If the packet is a SABM packet
-                if((buffer.frame.header[0] & 0xf0) == 0x80) {
-                    // Accept the client
-                    if(acceptClientSABM((const struct sockaddr *)&socketAddress, &buffer) < 0) {
-                        perror("Failed to accept a client");
-                    }
-                } else {
-                    printf("Refused a client because the received packet was incorrect.\n");
-                }
-            } else {
-                printf("Refused a client because the client list was full.\n");
+    if(owner >= 0) {
+        cluster_forward(&cluster, owner, getServerPort(serverSocket), socketAddress, &frame->frame, frame->size, stale ? CLUSTER_FLAG_REFRESH : 0);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    Handles a datagram received on one of the server sockets, or forwarded by
+    another node of the cluster (see steerDatagram()).
+*/
+void handleDatagram(int serverSocket, struct sockaddr_in *socketAddress, socklen_t socketAddressLength, const swtp_frame_t *frame, int forwarder, uint8_t forwardFlags) {
+    mtx_lock(&clientListMutex);
+
+    // Search for the client
+    int clientIndex = findClientBySocketAddress(socketAddress, socketAddressLength);
+
+    if(clientIndex < 0 && clusterPort != 0 && steerDatagram(serverSocket, socketAddress, frame, forwarder, forwardFlags)) {
+        mtx_unlock(&clientListMutex);
+        return;
+    }
+
+    // If the packet is a SABM packet, the client connects or reconnects
+    if((frame->frame.header[0] & 0xf0) == 0x80) {
+        // Accept the client, once it was asked for a cookie
+        if(admitClient(serverSocket, socketAddress, frame)) {
+            if(acceptClientSABM(serverSocket, (const struct sockaddr *)socketAddress, frame) < 0) {
+                perror("Failed to accept a client");
+            }
+        }
+    } else if(frame->frame.header[0] == 0xb0 && frame->frame.header[1] == SWTP_EXT_JOIN) {
+        // The client adds a path to its session, or did not receive the
+        // confirmation
+        if(joinClient(serverSocket, (const struct sockaddr *)socketAddress, frame) < 0) {
+            printf("Refused a JOIN for an unknown session.\n");
+        }
+    } else if(clientIndex == -1) {
+        // If the client roamed to another address
+        if(frame->frame.header[0] == 0xb0 && frame->frame.header[1] == SWTP_EXT_REBIND) {
+            if(rebindClient(serverSocket, (const struct sockaddr *)socketAddress, frame) < 0) {
+                printf("Refused a REBIND for an unknown session.\n");
             }
         } else {
-            if(swtp_onFrameReceived(clientList[clientIndex], &buffer) != SWTP_SUCCESS) {
-                perror("SWTP failed to handle frame from client");
+            printf("Refused a client because the received packet was incorrect.\n");
+        }
+    } else {
+        if(swtp_onFrameReceived(clientList[clientIndex], frame) != SWTP_SUCCESS) {
+            perror("SWTP failed to handle frame from client");
+        }
+
+        // The frame may have acknowledged frames, which frees slots in the
+        // send window of the client
+        sched_kick(&scheduler);
+    }
+
+    // The node that asked for the owner of the datagram, or that forwarded
+    // the datagram of a new address, steers the next ones here
+    if(forwarder >= 0 && ((forwardFlags & (CLUSTER_FLAG_FLOOD | CLUSTER_FLAG_REFRESH)) || clientIndex < 0)) {
+        int ownerIndex = findClientBySocketAddress(socketAddress, socketAddressLength);
+
+        if(ownerIndex >= 0) {
+            cluster_claim(&cluster, forwarder, socketAddress, clientList[ownerIndex]->hasSession, clientList[ownerIndex]->sessionId);
+        }
+    }
+
+    mtx_unlock(&clientListMutex);
+}
+
+/*
+    Receives a datagram on one of the server sockets.
+*/
+void onDatagramReceived(int serverSocket) {
+    // Contains the address of the last client who sent a datagram.
+    struct sockaddr_in socketAddress;
+
+    // Contains the size of the socketAddress structure.
+    socklen_t socketAddressLength = sizeof(socketAddress);
+    
+    // Contains the datagram from the client.
+    swtp_frame_t buffer;
+
+    // Receive the datagram.
+    ssize_t packetSize = recvfrom(serverSocket, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0, (struct sockaddr *)&socketAddress, &socketAddressLength);
+
+    // If the packet has a negative size, then an error occurred.
+    if(packetSize < 0) {
+        perror("Failed to receive a datagram");
+        return;
+    }
+
+    buffer.size = packetSize;
+
+    handleDatagram(serverSocket, &socketAddress, socketAddressLength, &buffer, -1, 0);
+}
+
+/*
+    Serves the connection of another node of the cluster with adoptSessions(),
+    then closes it.
+*/
+int migrationThreadMain(void *arg) {
+    int fd = (int)(intptr_t)arg;
+
+    adoptSessions(fd);
+    close(fd);
+
+    return 0;
+}
+
+/*
+    Serves the sockets of the cluster: the datagrams forwarded by the other
+    nodes, their claims, and the sessions they migrate to this node. Each
+    migration is served on its own thread, so that a slow node does not stop
+    the datagrams forwarded by the others.
+*/
+int clusterThreadMainLoop(void *arg) {
+    UNUSED_PARAMETER(arg);
+
+    if(cpu_pinThread(&affinity, THREAD_CLUSTER)) {
+        perror("Failed to pin the cluster thread");
+    }
+
+    struct pollfd pollFds[2] = {{cluster.socket, POLLIN, 0}, {cluster.listenSocket, POLLIN, 0}};
+    cluster_message_t message;
+
+    while(true) {
+        if(poll(pollFds, 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("An error occurred in the cluster thread");
+            return 1;
+        }
+
+        if(pollFds[1].revents & POLLIN) {
+            int connection = cluster_accept(&cluster);
+
+            thrd_t migrationThread;
+
+            if(connection >= 0 && thrd_create(&migrationThread, migrationThreadMain, (void *)(intptr_t)connection) != thrd_success) {
+                perror("Failed to create migration thread");
+                close(connection);
+            } else if(connection >= 0) {
+                thrd_detach(migrationThread);
             }
         }
 
+        if(!(pollFds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        int peer;
+
+        // The claims change the owner tables
+        mtx_lock(&clientListMutex);
+        ssize_t size = cluster_receive(&cluster, &message, &peer);
         mtx_unlock(&clientListMutex);
+
+        if(size < 0 || size > SWTP_MAX_FRAME_SIZE || message.header.type != CLUSTER_MESSAGE_FORWARD) {
+            continue;
+        }
+
+        struct sockaddr_in socketAddress;
+        swtp_frame_t frame;
+
+        memset(&socketAddress, 0, sizeof(socketAddress));
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_addr.s_addr = message.header.clientAddress;
+        socketAddress.sin_port = message.header.clientPort;
+
+        memcpy(&frame.frame, message.payload, size);
+        frame.size = size;
+
+        handleDatagram(getServerSocket(ntohs(message.header.port)), &socketAddress, sizeof(socketAddress), &frame, peer, message.header.flags);
+    }
+
+    return 0;
+}
+
+void mainServerLoop() {
+    struct pollfd pollFds[SWTP_MAX_PATHS];
+    cpu_spinner_t spinner;
+
+    cpu_initSpinner(&spinner, busyPollTime);
+
+    for(int i = 0; i < serverSocketCount; i++) {
+        pollFds[i].fd = serverSockets[i];
+        pollFds[i].events = POLLIN;
+    }
+
+    while(true) {
+        if(cpu_poll(&spinner, pollFds, serverSocketCount, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("An error occurred in server main loop");
+            break;
+        }
+
+        for(int i = 0; i < serverSocketCount; i++) {
+            if(pollFds[i].revents & POLLIN) {
+                onDatagramReceived(serverSockets[i]);
+            }
+        }
+    }
+}
+
+/*
+    Creates the io_uring instance of the main thread. The server sockets and
+    the TUN device are registered, and so is the buffer of the packets written
+    to the TUN device.
+*/
+int initIoRing() {
+    int fds[SWTP_MAX_PATHS + 1];
+
+    if(ring_init(&ioRing, IO_RING_ENTRIES) < 0) {
+        return -1;
+    }
+
+    // The TUN device follows the server sockets
+    memcpy(fds, serverSockets, serverSocketCount * sizeof(int));
+    fds[serverSocketCount] = tunDevice;
+
+    if(ring_registerFiles(&ioRing, fds, serverSocketCount + 1) < 0) {
+        ring_destroy(&ioRing);
+        return -1;
+    }
+
+    tunWriteBuffer = malloc(IO_RING_TUN_WRITE_SLOTS * IO_RING_TUN_BUFFER_SIZE);
+
+    if(!tunWriteBuffer) {
+        ring_destroy(&ioRing);
+        return -1;
+    }
+
+    struct iovec tunWriteVector = {
+        .iov_base = tunWriteBuffer,
+        .iov_len = IO_RING_TUN_WRITE_SLOTS * IO_RING_TUN_BUFFER_SIZE
+    };
+
+    if(ring_registerBuffers(&ioRing, &tunWriteVector, 1) < 0) {
+        free(tunWriteBuffer);
+        ring_destroy(&ioRing);
+        return -1;
+    }
+
+    for(int i = 0; i < IO_RING_TUN_WRITE_SLOTS; i++) {
+        tunWriteFreeSlots[i] = i;
+    }
+
+    tunWriteFreeSlotCount = IO_RING_TUN_WRITE_SLOTS;
+
+    if(ring_createBufferGroup(&ioRing, &datagramBuffers, IO_RING_DATAGRAM, IO_RING_DATAGRAM_BUFFERS, IO_RING_DATAGRAM_BUFFER_SIZE) < 0) {
+        free(tunWriteBuffer);
+        ring_destroy(&ioRing);
+        return -1;
+    }
+
+    if(ring_createBufferGroup(&ioRing, &tunBuffers, IO_RING_TUN_READ, IO_RING_TUN_BUFFERS, IO_RING_TUN_BUFFER_SIZE) < 0) {
+        ring_destroyBufferGroup(&ioRing, &datagramBuffers);
+        free(tunWriteBuffer);
+        ring_destroy(&ioRing);
+        return -1;
+    }
+
+    // The datagram buffers start with the address of the client
+    memset(&datagramMessage, 0, sizeof(datagramMessage));
+    datagramMessage.msg_namelen = sizeof(struct sockaddr_in);
+
+    return 0;
+}
+
+void destroyIoRing() {
+    ring_destroyBufferGroup(&ioRing, &tunBuffers);
+    ring_destroyBufferGroup(&ioRing, &datagramBuffers);
+    ring_destroy(&ioRing);
+    free(tunWriteBuffer);
+}
+
+/*
+    Submits the reception of the datagrams of a server socket. A multishot
+    request keeps receiving until it runs out of buffers.
+*/
+int armDatagramReception(int socketIndex) {
+    struct io_uring_sqe *sqe = ring_getSqe(&ioRing);
+
+    if(!sqe) {
+        return -1;
+    }
+
+    ring_prepareRecvMsg(sqe, socketIndex, &datagramMessage, IO_RING_DATAGRAM, true, (uint64_t)IO_RING_DATAGRAM << 32 | socketIndex);
+
+    return 0;
+}
+
+int armTunRead() {
+    struct io_uring_sqe *sqe = ring_getSqe(&ioRing);
+
+    if(!sqe) {
+        return -1;
+    }
+
+    ring_prepareRead(sqe, serverSocketCount, IO_RING_TUN_READ, IO_RING_TUN_BUFFER_SIZE, tunMultishotRead, (uint64_t)IO_RING_TUN_READ << 32);
+
+    return 0;
+}
+
+/*
+    Handles a datagram received by a multishot request. Returns -1 if the
+    kernel does not support multishot receptions.
+*/
+int onRingDatagramReceived(int socketIndex, int result, unsigned int flags) {
+    if(result == -EINVAL) {
+        printf("The kernel does not support multishot receptions.\n");
+        return -1;
+    }
+
+    if(flags & IORING_CQE_F_BUFFER) {
+        uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+        const uint8_t *data = ring_getBuffer(&datagramBuffers, bufferId);
+        const struct io_uring_recvmsg_out *header = (const struct io_uring_recvmsg_out *)data;
+        struct sockaddr_in socketAddress;
+        socklen_t socketAddressLength = header->namelen < sizeof(socketAddress) ? header->namelen : sizeof(socketAddress);
+        swtp_frame_t buffer;
+
+        memset(&socketAddress, 0, sizeof(socketAddress));
+        memcpy(&socketAddress, data + sizeof(struct io_uring_recvmsg_out), socketAddressLength);
+
+        // A truncated datagram is cut to the maximum frame size, like with
+        // recvfrom()
+        buffer.size = header->payloadlen < SWTP_MAX_FRAME_SIZE ? header->payloadlen : SWTP_MAX_FRAME_SIZE;
+        memcpy(&buffer.frame, data + sizeof(struct io_uring_recvmsg_out) + datagramMessage.msg_namelen + datagramMessage.msg_controllen, buffer.size);
+        ring_recycleBuffer(&datagramBuffers, bufferId);
+
+        handleDatagram(serverSockets[socketIndex], &socketAddress, socketAddressLength, &buffer, -1, 0);
+    } else if(result < 0 && result != -ENOBUFS) {
+        errno = -result;
+        perror("Failed to receive a datagram");
+    }
+
+    if(!(flags & IORING_CQE_F_MORE)) {
+        return armDatagramReception(socketIndex);
+    }
+
+    return 0;
+}
+
+void onRingTunPacketRead(int result, unsigned int flags) {
+    if(flags & IORING_CQE_F_BUFFER) {
+        uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if(result > 0) {
+            onTunPacketRead(ring_getBuffer(&tunBuffers, bufferId), result);
+        }
+
+        ring_recycleBuffer(&tunBuffers, bufferId);
+    } else if(result == -EINVAL && tunMultishotRead) {
+        printf("The kernel does not support multishot reads, reading the TUN device one packet at a time.\n");
+        tunMultishotRead = false;
+    } else if(result < 0 && result != -ENOBUFS) {
+        errno = -result;
+        perror("Failed to read from the TUN device");
+    }
+
+    if(!(flags & IORING_CQE_F_MORE)) {
+        armTunRead();
+    }
+}
+
+/*
+    Receives the datagrams of the clients and the packets of the TUN device
+    through io_uring. Every completion available is handled before the next
+    system call, which submits the writes to the TUN device and the requests
+    to rearm, and waits for the next completions. Returns if the kernel does
+    not support a request, so that the server falls back to poll().
+*/
+int ioRingServerLoop() {
+    for(int i = 0; i < serverSocketCount; i++) {
+        if(armDatagramReception(i) < 0) {
+            return -1;
+        }
+    }
+
+    if(armTunRead() < 0) {
+        return -1;
+    }
+
+    while(true) {
+        if(ring_submit(&ioRing, 1) < 0) {
+            perror("An error occurred in server main loop");
+            return -1;
+        }
+
+        struct io_uring_cqe *cqe;
+
+        while((cqe = ring_peekCqe(&ioRing)) != NULL) {
+            uint64_t userData = cqe->user_data;
+            int result = cqe->res;
+            unsigned int flags = cqe->flags;
+
+            ring_consumeCqe(&ioRing);
+
+            switch(userData >> 32) {
+                case IO_RING_DATAGRAM:
+                    if(onRingDatagramReceived(userData & 0xffffffff, result, flags) < 0) {
+                        return -1;
+                    }
+
+                    break;
+
+                case IO_RING_TUN_READ:
+                    onRingTunPacketRead(result, flags);
+                    break;
+
+                case IO_RING_TUN_WRITE:
+                    // Like with write(), a packet that the TUN device refuses,
+                    // for example while it is down, is dropped silently
+                    tunWriteFreeSlots[tunWriteFreeSlotCount++] = userData & 0xffffffff;
+                    break;
+            }
+        }
     }
 }
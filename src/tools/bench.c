@@ -0,0 +1,522 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <common.h>
+#include <libswtp/swtp.h>
+#include <libcpu/cpu.h>
+
+#define BENCH_IPV4_HEADER_SIZE 20
+#define BENCH_UDP_HEADER_SIZE 8
+#define BENCH_MARKER_SIZE 12
+#define BENCH_MIN_PACKET_SIZE (BENCH_IPV4_HEADER_SIZE + BENCH_UDP_HEADER_SIZE + BENCH_MARKER_SIZE)
+#define BENCH_TICK_INTERVAL (SWTP_TIMER_INTERVAL * 1000000)
+#define BENCH_STALL_TIMEOUT 10000000000
+
+// Contains the size of the IP packets sent through the tunnel.
+int packetSize = 1000;
+
+// Contains the number of packets sent per second. 0 means as fast as the send
+// window allows.
+int packetRate = 0;
+
+// Contains the number of packets to send.
+int packetCount = 100000;
+
+// Contains the maximum duration of the benchmark, in seconds (0 = unlimited).
+int timeLimit = 0;
+
+// Contains the send window size of both endpoints.
+int windowSize = 1024;
+
+// Contains the FEC block size of the sending endpoint (0 = disabled).
+unsigned int fecBlockSize = 0;
+bool fecAdaptive = false;
+
+// If true, the receiving endpoint reports the frames received out of order in
+// SACK frames instead of rejecting the whole window.
+bool sack = true;
+
+// If true, the data frames are encrypted with keys exchanged like the client
+// and the server do.
+bool encryption = false;
+
+// Contains the UDP port of the sending endpoint. The receiving endpoint uses the
+// next port.
+int portBase = 40000;
+
+// If not 0, the sending endpoint sends its frames to this local port instead of
+// the receiving endpoint, and the receiving endpoint sends its frames to
+// viaUpstreamPort. This is used for running the benchmark through bin/impair.
+int viaPort = 0;
+int viaUpstreamPort = 0;
+
+// Contains the time the kernel busy polls the sockets, and the time the
+// benchmark spins before it blocks, in microseconds, like the --busy-poll
+// option of the client and the server.
+uint32_t busyPollTime = 0;
+
+// The sending (a) and receiving (b) endpoints
+swtp_t endpointA;
+swtp_t endpointB;
+
+// Contains the one-way latency of every delivered packet, in nanoseconds.
+uint64_t *latencies;
+
+uint64_t deliveredPackets = 0;
+uint64_t deliveredBytes = 0;
+uint64_t lastDeliveryTime;
+
+// Contains the longest time between two deliveries, in nanoseconds.
+uint64_t maxDeliveryGap = 0;
+
+// Contains the reason the first endpoint to disconnect gave, or -1 while both
+// are connected.
+int disconnectReason = -1;
+
+// Contains the output of the benchmark report, as stdout receives the protocol
+// trace.
+FILE *reportFile;
+
+int parseCommandLineParameters(int argc, const char **argv);
+int createEndpointSocket(int port);
+int runBenchmark();
+void printReport(uint32_t sentPackets, uint64_t elapsedTime);
+void onDisconnect(swtp_t *swtp, int reason);
+
+static inline uint64_t getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Keep the report on the original stdout, and discard the protocol trace
+    int reportFd = dup(STDOUT_FILENO);
+
+    if(reportFd < 0 || (reportFile = fdopen(reportFd, "w")) == NULL) {
+        perror("Failed to duplicate stdout");
+        return EXIT_FAILURE;
+    }
+
+    if(freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to discard the protocol trace");
+        return EXIT_FAILURE;
+    }
+
+    latencies = malloc(sizeof(uint64_t) * packetCount);
+
+    if(!latencies) {
+        perror("Failed to allocate memory for the latency samples");
+        return EXIT_FAILURE;
+    }
+
+    if(runBenchmark()) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *value = argv[++i];
+
+        if(strcmp(argv[i - 1], "--size") == 0) {
+            if(sscanf(value, "%d", &packetSize) != 1 || packetSize < BENCH_MIN_PACKET_SIZE || packetSize > SWTP_DEFAULT_MTU) {
+                printf("Invalid value for --size. Expected an integer between %d and %d included.\n", BENCH_MIN_PACKET_SIZE, SWTP_DEFAULT_MTU);
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--rate") == 0) {
+            if(sscanf(value, "%d", &packetRate) != 1 || packetRate < 0) {
+                printf("Invalid value for --rate. Expected a positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--count") == 0) {
+            if(sscanf(value, "%d", &packetCount) != 1 || packetCount <= 0) {
+                printf("Invalid value for --count. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--time-limit") == 0) {
+            if(sscanf(value, "%d", &timeLimit) != 1 || timeLimit < 0) {
+                printf("Invalid value for --time-limit. Expected a positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--window") == 0) {
+            if(sscanf(value, "%d", &windowSize) != 1 || windowSize <= 0 || windowSize > SWTP_MAX_EXTENDED_WINDOW_SIZE) {
+                printf("Invalid value for --window. Expected an integer between 1 and %d included.\n", SWTP_MAX_EXTENDED_WINDOW_SIZE);
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--fec") == 0) {
+            if(strcmp(value, "auto") == 0) {
+                fecBlockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+                fecAdaptive = true;
+            } else if(sscanf(value, "%u", &fecBlockSize) != 1 || fecBlockSize < SWTP_FEC_MIN_BLOCK_SIZE || fecBlockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+                printf("Invalid value for --fec. Expected \"auto\" or an integer between %d and %d included.\n", SWTP_FEC_MIN_BLOCK_SIZE, SWTP_FEC_MAX_BLOCK_SIZE);
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--sack") == 0) {
+            if(strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                printf("Invalid value for --sack. Expected 0 or 1.\n");
+                return 1;
+            }
+
+            sack = strcmp(value, "1") == 0;
+        } else if(strcmp(argv[i - 1], "--encryption") == 0) {
+            if(strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                printf("Invalid value for --encryption. Expected 0 or 1.\n");
+                return 1;
+            }
+
+            encryption = strcmp(value, "1") == 0;
+        } else if(strcmp(argv[i - 1], "--via") == 0) {
+            if(sscanf(value, "%d:%d", &viaPort, &viaUpstreamPort) != 2 || viaPort <= 0 || viaPort > 65535 || viaUpstreamPort <= 0 || viaUpstreamPort > 65535) {
+                printf("Invalid value for --via. Expected <proxy port>:<proxy upstream port>.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--busy-poll") == 0) {
+            if(sscanf(value, "%u", &busyPollTime) != 1 || busyPollTime > CPU_MAX_BUSY_POLL_TIME) {
+                printf("Invalid value for --busy-poll. Expected an integer between 0 and %d included.\n", CPU_MAX_BUSY_POLL_TIME);
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--port") == 0) {
+            if(sscanf(value, "%d", &portBase) != 1 || portBase <= 0 || portBase >= 65535) {
+                printf("Invalid value for --port. Expected an integer between 1 and 65534 included.\n");
+                return 1;
+            }
+        } else {
+            printf("Unknown argument \"%s\".\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int createEndpointSocket(int port) {
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(sock_fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+
+    if(bind(sock_fd, (const struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+
+    // The benchmark loop never blocks on a socket
+    if(fcntl(sock_fd, F_SETFL, O_NONBLOCK) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+
+    if(busyPollTime > 0 && cpu_enableBusyPoll(sock_fd, busyPollTime) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+void onPacketReceived(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(swtp);
+
+    uint64_t now = getTime();
+    const uint8_t *marker = (const uint8_t *)buffer + TUN_HEADER_SIZE + BENCH_IPV4_HEADER_SIZE + BENCH_UDP_HEADER_SIZE;
+    uint64_t sendTime;
+
+    memcpy(&sendTime, marker + 4, sizeof(sendTime));
+
+    if(deliveredPackets < (uint64_t)packetCount) {
+        latencies[deliveredPackets] = now - sendTime;
+    }
+
+    if(deliveredPackets > 0 && now - lastDeliveryTime > maxDeliveryGap) {
+        maxDeliveryGap = now - lastDeliveryTime;
+    }
+
+    deliveredPackets++;
+    deliveredBytes += size - TUN_HEADER_SIZE;
+    lastDeliveryTime = now;
+}
+
+void onDisconnect(swtp_t *swtp, int reason) {
+    UNUSED_PARAMETER(swtp);
+
+    if(disconnectReason < 0) {
+        disconnectReason = reason;
+    }
+}
+
+/*
+    Builds a TUN packet that contains an IPv4/UDP packet of the configured size.
+    The UDP payload starts with the packet number and the time it was sent at.
+*/
+void buildPacket(uint8_t *buffer, uint32_t packetNumber) {
+    uint8_t *ipHeader = buffer + TUN_HEADER_SIZE;
+    uint8_t *udpHeader = ipHeader + BENCH_IPV4_HEADER_SIZE;
+    uint8_t *marker = udpHeader + BENCH_UDP_HEADER_SIZE;
+    uint64_t sendTime = getTime();
+
+    memset(buffer, 0, TUN_HEADER_SIZE + packetSize);
+    *(uint16_t *)(buffer + 2) = htons(ETHERTYPE_IPV4);
+
+    ipHeader[0] = 0x45;
+    *(uint16_t *)(ipHeader + 2) = htons(packetSize);
+    ipHeader[8] = 64;
+    ipHeader[9] = IPPROTO_UDP;
+    *(uint32_t *)(ipHeader + 12) = htonl(0x0a000001);
+    *(uint32_t *)(ipHeader + 16) = htonl(0x0a000002);
+
+    *(uint16_t *)(udpHeader + 0) = htons(9);
+    *(uint16_t *)(udpHeader + 2) = htons(9);
+    *(uint16_t *)(udpHeader + 4) = htons(packetSize - BENCH_IPV4_HEADER_SIZE);
+
+    memcpy(marker, &packetNumber, 4);
+    memcpy(marker + 4, &sendTime, sizeof(sendTime));
+}
+
+/*
+    Passes all the datagrams waiting on the given socket to the given endpoint.
+    Returns the number of datagrams processed.
+*/
+int receiveFrames(int sock_fd, swtp_t *swtp) {
+    int frameCount = 0;
+    swtp_frame_t buffer;
+
+    while(true) {
+        ssize_t size = recv(sock_fd, &buffer.frame, SWTP_MAX_FRAME_SIZE, 0);
+
+        if(size < 0) {
+            break;
+        }
+
+        buffer.size = size;
+        swtp_onFrameReceived(swtp, &buffer);
+        frameCount++;
+    }
+
+    return frameCount;
+}
+
+int runBenchmark() {
+    int socketA = createEndpointSocket(portBase);
+    int socketB = createEndpointSocket(portBase + 1);
+
+    if(socketA < 0 || socketB < 0) {
+        perror("Failed to create endpoint sockets");
+        return 1;
+    }
+
+    struct sockaddr_in addressA;
+    struct sockaddr_in addressB;
+    memset(&addressA, 0, sizeof(addressA));
+    addressA.sin_family = AF_INET;
+    addressA.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addressA.sin_port = htons(portBase);
+    addressB = addressA;
+    addressB.sin_port = htons(portBase + 1);
+
+    if(viaPort > 0) {
+        addressB.sin_port = htons(viaPort);
+        addressA.sin_port = htons(viaUpstreamPort);
+    }
+
+    swtp_init(&endpointA, socketA, (const struct sockaddr *)&addressB);
+    swtp_init(&endpointB, socketB, (const struct sockaddr *)&addressA);
+
+    // Larger windows need extended sequence numbers
+    endpointA.extended = windowSize > SWTP_MAX_WINDOW_SIZE;
+    endpointB.extended = endpointA.extended;
+
+    if(swtp_initSendWindow(&endpointA, windowSize) != SWTP_SUCCESS || swtp_initSendWindow(&endpointB, windowSize) != SWTP_SUCCESS) {
+        perror("Failed to initialize the send windows");
+        return 1;
+    }
+
+    if(fecBlockSize > 0 && swtp_enableFec(&endpointA, fecBlockSize, fecAdaptive) != SWTP_SUCCESS) {
+        perror("Failed to enable FEC");
+        return 1;
+    }
+
+    if(sack && (swtp_enableSack(&endpointA) != SWTP_SUCCESS || swtp_enableSack(&endpointB) != SWTP_SUCCESS)) {
+        perror("Failed to enable SACK");
+        return 1;
+    }
+
+    if(encryption) {
+        uint8_t secretKeyA[SWTP_KEY_SIZE];
+        uint8_t publicKeyA[SWTP_KEY_SIZE];
+        uint8_t secretKeyB[SWTP_KEY_SIZE];
+        uint8_t publicKeyB[SWTP_KEY_SIZE];
+
+        if(
+            swtp_generateKeyPair(secretKeyA, publicKeyA) != SWTP_SUCCESS
+            || swtp_generateKeyPair(secretKeyB, publicKeyB) != SWTP_SUCCESS
+            || swtp_enableEncryption(&endpointA, secretKeyA, publicKeyB, NULL, true) != SWTP_SUCCESS
+            || swtp_enableEncryption(&endpointB, secretKeyB, publicKeyA, NULL, false) != SWTP_SUCCESS
+        ) {
+            fprintf(stderr, "Failed to enable encryption.\n");
+            return 1;
+        }
+    }
+
+    endpointA.disconnectCallback = onDisconnect;
+    endpointB.disconnectCallback = onDisconnect;
+    endpointB.recvCallback = onPacketReceived;
+
+    uint8_t packet[TUN_HEADER_SIZE + MAXIMUM_MTU];
+    uint64_t sendInterval = packetRate > 0 ? 1000000000 / packetRate : 0;
+    uint64_t startTime = getTime();
+    uint64_t nextSendTime = startTime;
+    uint64_t nextTickTime = startTime + BENCH_TICK_INTERVAL;
+    uint32_t sentPackets = 0;
+    cpu_spinner_t spinner;
+
+    cpu_initSpinner(&spinner, busyPollTime);
+    lastDeliveryTime = startTime;
+
+    while(deliveredPackets < (uint64_t)packetCount) {
+        uint64_t now = getTime();
+
+        // A keepalive timeout ends the run, but the packets delivered so far
+        // are still reported
+        if(disconnectReason >= 0) {
+            fprintf(reportFile, "Disconnected: %s.\n", disconnectReason == SWTP_DISCONNECTREASON_TIMEOUT ? "keepalive timeout" : "peer disconnected");
+            break;
+        }
+
+        if(sentPackets < (uint32_t)packetCount && now >= nextSendTime && swtp_getSendWindowAvailableSlots(&endpointA) > 0) {
+            buildPacket(packet, sentPackets);
+
+            if(swtp_sendDataFrame(&endpointA, packet, TUN_HEADER_SIZE + packetSize) != SWTP_SUCCESS) {
+                fprintf(reportFile, "Failed to send packet %u.\n", sentPackets);
+                return 1;
+            }
+
+            sentPackets++;
+            nextSendTime += sendInterval;
+        }
+
+        int frameCount = receiveFrames(socketB, &endpointB) + receiveFrames(socketA, &endpointA);
+
+        if(now >= nextTickTime) {
+            swtp_onTimerTick(&endpointA);
+            swtp_onTimerTick(&endpointB);
+            nextTickTime += BENCH_TICK_INTERVAL;
+        }
+
+        if(now > lastDeliveryTime && now - lastDeliveryTime > BENCH_STALL_TIMEOUT) {
+            fprintf(reportFile, "Stalled: no packet delivered for %d s.\n", (int)(BENCH_STALL_TIMEOUT / 1000000000));
+            break;
+        }
+
+        if(timeLimit > 0 && now - startTime > (uint64_t)timeLimit * 1000000000) {
+            fprintf(reportFile, "Time limit reached.\n");
+            break;
+        }
+
+        // Wait for the next event if there is nothing to do right now
+        bool canSend = sentPackets < (uint32_t)packetCount && swtp_getSendWindowAvailableSlots(&endpointA) > 0;
+
+        if(frameCount == 0 && !(canSend && now >= nextSendTime)) {
+            uint64_t wakeUpTime = nextTickTime;
+
+            if(canSend && nextSendTime < wakeUpTime) {
+                wakeUpTime = nextSendTime;
+            }
+
+            struct pollfd fds[2] = {
+                {.fd = socketA, .events = POLLIN},
+                {.fd = socketB, .events = POLLIN}
+            };
+
+            int timeout = wakeUpTime > now ? (int)((wakeUpTime - now) / 1000000) : 0;
+            cpu_poll(&spinner, fds, 2, timeout);
+        }
+    }
+
+    printReport(sentPackets, lastDeliveryTime - startTime);
+
+    swtp_destroy(&endpointA);
+    swtp_destroy(&endpointB);
+    close(socketA);
+    close(socketB);
+
+    return disconnectReason >= 0 ? 1 : 0;
+}
+
+int compareLatencies(const void *a, const void *b) {
+    uint64_t latencyA = *(const uint64_t *)a;
+    uint64_t latencyB = *(const uint64_t *)b;
+
+    return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+static inline double getLatencyPercentile(uint64_t sampleCount, double percentile) {
+    if(sampleCount == 0) {
+        return 0.0;
+    }
+
+    uint64_t index = (uint64_t)(percentile / 100.0 * (sampleCount - 1));
+
+    return latencies[index] / 1000.0;
+}
+
+void printReport(uint32_t sentPackets, uint64_t elapsedTime) {
+    uint64_t sampleCount = deliveredPackets < (uint64_t)packetCount ? deliveredPackets : (uint64_t)packetCount;
+    double seconds = elapsedTime / 1e9;
+
+    qsort(latencies, sampleCount, sizeof(uint64_t), compareLatencies);
+
+    fprintf(reportFile, "packet_size: %d\n", packetSize);
+    fprintf(reportFile, "packet_rate: %d\n", packetRate);
+    fprintf(reportFile, "window_size: %d\n", windowSize);
+    fprintf(reportFile, "extended: %s\n", endpointA.extended ? "true" : "false");
+    fprintf(reportFile, "fec_block_size: %u%s\n", fecBlockSize, fecAdaptive ? " (auto)" : "");
+    fprintf(reportFile, "sack: %s\n", sack ? "true" : "false");
+    fprintf(reportFile, "encryption: %s\n", encryption ? "true" : "false");
+    fprintf(reportFile, "busy_poll_us: %u\n", busyPollTime);
+    fprintf(reportFile, "sent_packets: %u\n", sentPackets);
+    fprintf(reportFile, "delivered_packets: %lu\n", deliveredPackets);
+    fprintf(reportFile, "elapsed_s: %.3f\n", seconds);
+    fprintf(reportFile, "frames_per_s: %.0f\n", seconds > 0 ? deliveredPackets / seconds : 0.0);
+    fprintf(reportFile, "goodput_mbit_s: %.2f\n", seconds > 0 ? deliveredBytes * 8 / seconds / 1e6 : 0.0);
+    fprintf(reportFile, "retransmissions: %lu\n", endpointA.stats.retransmittedDataFrames);
+    fprintf(reportFile, "fast_retransmissions: %lu\n", endpointA.stats.fastRetransmittedDataFrames);
+    fprintf(reportFile, "dropped_frames: %lu\n", endpointA.stats.droppedDataFrames);
+    fprintf(reportFile, "repaired_frames: %lu\n", endpointB.stats.repairedDataFrames);
+    fprintf(reportFile, "latency_p50_us: %.1f\n", getLatencyPercentile(sampleCount, 50.0));
+    fprintf(reportFile, "latency_p90_us: %.1f\n", getLatencyPercentile(sampleCount, 90.0));
+    fprintf(reportFile, "latency_p99_us: %.1f\n", getLatencyPercentile(sampleCount, 99.0));
+    fprintf(reportFile, "latency_p999_us: %.1f\n", getLatencyPercentile(sampleCount, 99.9));
+    fprintf(reportFile, "latency_max_us: %.1f\n", getLatencyPercentile(sampleCount, 100.0));
+    fprintf(reportFile, "max_delivery_gap_ms: %.1f\n", maxDeliveryGap / 1e6);
+    fflush(reportFile);
+}
@@ -0,0 +1,605 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <common.h>
+
+#define IMPAIR_MAX_DATAGRAM_SIZE 65536
+#define IMPAIR_DIRECTION_UP 0
+#define IMPAIR_DIRECTION_DOWN 1
+#define IMPAIR_DIRECTION_COUNT 2
+
+typedef struct {
+    // Fixed delay and uniform jitter, in nanoseconds
+    uint64_t delay;
+    uint64_t jitter;
+
+    // Probabilities, between 0 and 1
+    double loss;
+    double reorder;
+    double duplicate;
+
+    // Gilbert-Elliott model: probability to go from the good state to the bad
+    // state (p) and back (r), and loss probability in the bad state (h). The
+    // model is disabled when p is 0.
+    double gilbertP;
+    double gilbertR;
+    double gilbertH;
+
+    // Rate limit in bits per second (0 = unlimited) and the maximum time a
+    // datagram can wait in the rate limiter queue
+    uint64_t rate;
+    uint64_t queueLimit;
+
+    // Blackout: every datagram is dropped between blackoutStart and
+    // blackoutStart + blackoutDuration after the start of the proxy
+    uint64_t blackoutStart;
+    uint64_t blackoutDuration;
+} impair_profile_t;
+
+typedef struct {
+    impair_profile_t profile;
+
+    // The current Gilbert-Elliott state
+    bool badState;
+
+    // The time at which the rate limiter will be idle
+    uint64_t linkIdleTime;
+
+    uint64_t receivedDatagrams;
+    uint64_t forwardedDatagrams;
+    uint64_t lostDatagrams;
+    uint64_t duplicatedDatagrams;
+    uint64_t reorderedDatagrams;
+    uint64_t queueDrops;
+} impair_direction_t;
+
+typedef struct {
+    uint64_t releaseTime;
+    uint64_t order;
+    int direction;
+    size_t size;
+    uint8_t data[];
+} impair_datagram_t;
+
+// Contains the port the client sends its datagrams to.
+int listenPort = 0;
+
+// Contains the address datagrams from the client are forwarded to.
+struct sockaddr_in targetAddress;
+
+// Contains the local port used for forwarding datagrams to the target (0 =
+// chosen by the system).
+int upstreamPort = 0;
+
+// Contains the last address the client sent a datagram from.
+struct sockaddr_in clientAddress;
+bool clientKnown = false;
+
+impair_direction_t directions[IMPAIR_DIRECTION_COUNT];
+
+// Contains the datagrams waiting to be released, as a binary heap ordered by
+// release time.
+impair_datagram_t **pendingDatagrams;
+size_t pendingDatagramCount = 0;
+size_t pendingDatagramCapacity = 0;
+uint64_t datagramOrder = 0;
+
+uint64_t randomState = 0x853c49e6748fea9bULL;
+uint64_t startTime;
+volatile sig_atomic_t running = 1;
+
+int parseCommandLineParameters(int argc, const char **argv);
+int createSocket(int port);
+int runProxy();
+void printStatistics();
+
+static inline uint64_t getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*, so that a given seed always gives the same impairments
+static inline double getRandom() {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+
+    return ((randomState * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+void onSignal(int signal) {
+    UNUSED_PARAMETER(signal);
+    running = 0;
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    int result = runProxy();
+
+    printStatistics();
+
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+    Parses a value that applies to one or both directions. The value can be
+    prefixed with "up:" or "down:".
+*/
+static int parseDirections(const char **value, bool *up, bool *down) {
+    *up = true;
+    *down = true;
+
+    if(strncmp(*value, "up:", 3) == 0) {
+        *down = false;
+        *value += 3;
+    } else if(strncmp(*value, "down:", 5) == 0) {
+        *up = false;
+        *value += 5;
+    }
+
+    return 0;
+}
+
+static int parseProfileParameter(const char *name, const char *value) {
+    bool up;
+    bool down;
+    double numbers[3];
+    int count;
+
+    parseDirections(&value, &up, &down);
+
+    count = sscanf(value, "%lf,%lf,%lf", &numbers[0], &numbers[1], &numbers[2]);
+
+    if(count < 1) {
+        printf("Failed to parse argument value to %s.\n", name);
+        return 1;
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(numbers[i] < 0) {
+            printf("Invalid value for %s. Expected positive numbers.\n", name);
+            return 1;
+        }
+    }
+
+    for(int direction = 0; direction < IMPAIR_DIRECTION_COUNT; direction++) {
+        if((direction == IMPAIR_DIRECTION_UP && !up) || (direction == IMPAIR_DIRECTION_DOWN && !down)) {
+            continue;
+        }
+
+        impair_profile_t *profile = &directions[direction].profile;
+
+        if(strcmp(name, "--delay") == 0) {
+            profile->delay = numbers[0] * 1000000;
+        } else if(strcmp(name, "--jitter") == 0) {
+            profile->jitter = numbers[0] * 1000000;
+        } else if(strcmp(name, "--loss") == 0) {
+            profile->loss = numbers[0] / 100.0;
+        } else if(strcmp(name, "--reorder") == 0) {
+            profile->reorder = numbers[0] / 100.0;
+        } else if(strcmp(name, "--duplicate") == 0) {
+            profile->duplicate = numbers[0] / 100.0;
+        } else if(strcmp(name, "--rate") == 0) {
+            profile->rate = numbers[0] * 1000;
+        } else if(strcmp(name, "--queue-limit") == 0) {
+            profile->queueLimit = numbers[0] * 1000000;
+        } else if(strcmp(name, "--gilbert") == 0) {
+            if(count != 3) {
+                printf("Invalid value for --gilbert. Expected <p>,<r>,<h> in percent.\n");
+                return 1;
+            }
+
+            profile->gilbertP = numbers[0] / 100.0;
+            profile->gilbertR = numbers[1] / 100.0;
+            profile->gilbertH = numbers[2] / 100.0;
+        } else if(strcmp(name, "--blackout") == 0) {
+            if(count != 2) {
+                printf("Invalid value for --blackout. Expected <start>,<duration> in milliseconds.\n");
+                return 1;
+            }
+
+            profile->blackoutStart = numbers[0] * 1000000;
+            profile->blackoutDuration = numbers[1] * 1000000;
+        }
+    }
+
+    return 0;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    static const char *profileParameters[] = {
+        "--delay", "--jitter", "--loss", "--reorder", "--duplicate", "--rate",
+        "--queue-limit", "--gilbert", "--blackout"
+    };
+
+    bool flag_target_set = false;
+
+    for(int direction = 0; direction < IMPAIR_DIRECTION_COUNT; direction++) {
+        directions[direction].profile.queueLimit = 1000000000;
+    }
+
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *name = argv[i++];
+        const char *value = argv[i];
+        bool profileParameter = false;
+
+        for(size_t j = 0; j < sizeof(profileParameters) / sizeof(profileParameters[0]); j++) {
+            if(strcmp(name, profileParameters[j]) == 0) {
+                profileParameter = true;
+            }
+        }
+
+        if(profileParameter) {
+            if(parseProfileParameter(name, value)) {
+                return 1;
+            }
+        } else if(strcmp(name, "--listen") == 0) {
+            if(sscanf(value, "%d", &listenPort) != 1 || listenPort <= 0 || listenPort > 65535) {
+                printf("Invalid value for --listen. Expected an integer between 1 and 65535 included.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--upstream-port") == 0) {
+            if(sscanf(value, "%d", &upstreamPort) != 1 || upstreamPort < 0 || upstreamPort > 65535) {
+                printf("Invalid value for --upstream-port. Expected an integer between 0 and 65535 included.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--target") == 0) {
+            char host[64];
+            int port;
+
+            if(sscanf(value, "%63[^:]:%d", host, &port) != 2 || port <= 0 || port > 65535) {
+                printf("Invalid value for --target. Expected <IPv4 address>:<port>.\n");
+                return 1;
+            }
+
+            memset(&targetAddress, 0, sizeof(targetAddress));
+            targetAddress.sin_family = AF_INET;
+            targetAddress.sin_port = htons(port);
+
+            if(inet_pton(AF_INET, host, &targetAddress.sin_addr) != 1) {
+                printf("Invalid value for --target. Expected <IPv4 address>:<port>.\n");
+                return 1;
+            }
+
+            flag_target_set = true;
+        } else if(strcmp(name, "--seed") == 0) {
+            if(sscanf(value, "%lu", &randomState) != 1 || randomState == 0) {
+                printf("Invalid value for --seed. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else {
+            printf("Unknown argument \"%s\".\n", name);
+            return 1;
+        }
+    }
+
+    if(listenPort == 0) {
+        printf("--listen was not set.\n");
+        return 1;
+    } else if(!flag_target_set) {
+        printf("--target was not set.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int createSocket(int port) {
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(sock_fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in socketAddress;
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    socketAddress.sin_family = AF_INET;
+    socketAddress.sin_port = htons(port);
+
+    if(bind(sock_fd, (const struct sockaddr *)&socketAddress, sizeof(socketAddress)) < 0) {
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+static inline bool isDatagramBefore(const impair_datagram_t *a, const impair_datagram_t *b) {
+    if(a->releaseTime != b->releaseTime) {
+        return a->releaseTime < b->releaseTime;
+    }
+
+    return a->order < b->order;
+}
+
+int pushDatagram(impair_datagram_t *datagram) {
+    if(pendingDatagramCount == pendingDatagramCapacity) {
+        size_t capacity = pendingDatagramCapacity ? pendingDatagramCapacity * 2 : 1024;
+        impair_datagram_t **datagrams = realloc(pendingDatagrams, sizeof(impair_datagram_t *) * capacity);
+
+        if(!datagrams) {
+            return -1;
+        }
+
+        pendingDatagrams = datagrams;
+        pendingDatagramCapacity = capacity;
+    }
+
+    size_t index = pendingDatagramCount++;
+
+    while(index > 0 && isDatagramBefore(datagram, pendingDatagrams[(index - 1) / 2])) {
+        pendingDatagrams[index] = pendingDatagrams[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+
+    pendingDatagrams[index] = datagram;
+
+    return 0;
+}
+
+impair_datagram_t *popDatagram() {
+    impair_datagram_t *first = pendingDatagrams[0];
+    impair_datagram_t *last = pendingDatagrams[--pendingDatagramCount];
+    size_t index = 0;
+
+    while(true) {
+        size_t child = index * 2 + 1;
+
+        if(child >= pendingDatagramCount) {
+            break;
+        }
+
+        if(child + 1 < pendingDatagramCount && isDatagramBefore(pendingDatagrams[child + 1], pendingDatagrams[child])) {
+            child++;
+        }
+
+        if(!isDatagramBefore(pendingDatagrams[child], last)) {
+            break;
+        }
+
+        pendingDatagrams[index] = pendingDatagrams[child];
+        index = child;
+    }
+
+    if(pendingDatagramCount > 0) {
+        pendingDatagrams[index] = last;
+    }
+
+    return first;
+}
+
+static inline bool isDatagramLost(impair_direction_t *direction, uint64_t now) {
+    impair_profile_t *profile = &direction->profile;
+    uint64_t elapsedTime = now - startTime;
+
+    if(profile->blackoutDuration > 0 && elapsedTime >= profile->blackoutStart && elapsedTime < profile->blackoutStart + profile->blackoutDuration) {
+        return true;
+    }
+
+    if(profile->gilbertP > 0) {
+        if(direction->badState) {
+            if(getRandom() < profile->gilbertR) {
+                direction->badState = false;
+            }
+        } else if(getRandom() < profile->gilbertP) {
+            direction->badState = true;
+        }
+
+        if(direction->badState && getRandom() < profile->gilbertH) {
+            return true;
+        }
+    }
+
+    return getRandom() < profile->loss;
+}
+
+/*
+    Applies the impairments of the given direction to a received datagram, and
+    queues the copies that survive.
+*/
+int impairDatagram(int directionIndex, const uint8_t *data, size_t size, uint64_t now) {
+    impair_direction_t *direction = &directions[directionIndex];
+    impair_profile_t *profile = &direction->profile;
+
+    direction->receivedDatagrams++;
+
+    if(isDatagramLost(direction, now)) {
+        direction->lostDatagrams++;
+        return 0;
+    }
+
+    int copyCount = 1;
+
+    if(getRandom() < profile->duplicate) {
+        direction->duplicatedDatagrams++;
+        copyCount = 2;
+    }
+
+    for(int i = 0; i < copyCount; i++) {
+        uint64_t releaseTime = now;
+
+        // Like netem, a reordered datagram skips the delay and overtakes the
+        // datagrams that are already waiting.
+        if(getRandom() < profile->reorder) {
+            direction->reorderedDatagrams++;
+        } else {
+            releaseTime += profile->delay;
+
+            if(profile->jitter > 0) {
+                int64_t jitter = (int64_t)((getRandom() * 2.0 - 1.0) * profile->jitter);
+
+                if(jitter < 0 && (uint64_t)-jitter > profile->delay) {
+                    jitter = -(int64_t)profile->delay;
+                }
+
+                releaseTime += jitter;
+            }
+        }
+
+        if(profile->rate > 0) {
+            uint64_t transmissionTime = size * 8 * 1000000000ULL / profile->rate;
+
+            if(direction->linkIdleTime > releaseTime) {
+                if(direction->linkIdleTime - releaseTime > profile->queueLimit) {
+                    direction->queueDrops++;
+                    continue;
+                }
+
+                releaseTime = direction->linkIdleTime;
+            }
+
+            releaseTime += transmissionTime;
+            direction->linkIdleTime = releaseTime;
+        }
+
+        impair_datagram_t *datagram = malloc(sizeof(impair_datagram_t) + size);
+
+        if(!datagram) {
+            return -1;
+        }
+
+        datagram->releaseTime = releaseTime;
+        datagram->order = datagramOrder++;
+        datagram->direction = directionIndex;
+        datagram->size = size;
+        memcpy(datagram->data, data, size);
+
+        if(pushDatagram(datagram)) {
+            free(datagram);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int runProxy() {
+    int listenSocket = createSocket(listenPort);
+    int upstreamSocket = createSocket(upstreamPort);
+
+    if(listenSocket < 0 || upstreamSocket < 0) {
+        perror("Failed to create the proxy sockets");
+        return 1;
+    }
+
+    printf("Forwarding port %d to %s:%d.\n", listenPort, inet_ntoa(targetAddress.sin_addr), ntohs(targetAddress.sin_port));
+    fflush(stdout);
+
+    static uint8_t buffer[IMPAIR_MAX_DATAGRAM_SIZE];
+
+    startTime = getTime();
+
+    while(running) {
+        uint64_t now = getTime();
+
+        // Release the datagrams that are due
+        while(pendingDatagramCount > 0 && pendingDatagrams[0]->releaseTime <= now) {
+            impair_datagram_t *datagram = popDatagram();
+
+            if(datagram->direction == IMPAIR_DIRECTION_UP) {
+                sendto(upstreamSocket, datagram->data, datagram->size, 0, (const struct sockaddr *)&targetAddress, sizeof(targetAddress));
+            } else if(clientKnown) {
+                sendto(listenSocket, datagram->data, datagram->size, 0, (const struct sockaddr *)&clientAddress, sizeof(clientAddress));
+            }
+
+            directions[datagram->direction].forwardedDatagrams++;
+            free(datagram);
+        }
+
+        int timeout = -1;
+
+        if(pendingDatagramCount > 0) {
+            timeout = (pendingDatagrams[0]->releaseTime - now + 999999) / 1000000;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = listenSocket, .events = POLLIN},
+            {.fd = upstreamSocket, .events = POLLIN}
+        };
+
+        if(poll(fds, 2, timeout) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            perror("poll() failed");
+            return 1;
+        }
+
+        now = getTime();
+
+        if(fds[0].revents & POLLIN) {
+            struct sockaddr_in sourceAddress;
+            socklen_t sourceAddressLength = sizeof(sourceAddress);
+            ssize_t size = recvfrom(listenSocket, buffer, sizeof(buffer), 0, (struct sockaddr *)&sourceAddress, &sourceAddressLength);
+
+            if(size >= 0) {
+                clientAddress = sourceAddress;
+                clientKnown = true;
+
+                if(impairDatagram(IMPAIR_DIRECTION_UP, buffer, size, now)) {
+                    perror("Failed to queue datagram");
+                    return 1;
+                }
+            }
+        }
+
+        if(fds[1].revents & POLLIN) {
+            ssize_t size = recv(upstreamSocket, buffer, sizeof(buffer), 0);
+
+            if(size >= 0) {
+                if(impairDatagram(IMPAIR_DIRECTION_DOWN, buffer, size, now)) {
+                    perror("Failed to queue datagram");
+                    return 1;
+                }
+            }
+        }
+    }
+
+    close(listenSocket);
+    close(upstreamSocket);
+
+    return 0;
+}
+
+void printStatistics() {
+    static const char *directionNames[] = {"up", "down"};
+
+    for(int i = 0; i < IMPAIR_DIRECTION_COUNT; i++) {
+        printf(
+            "%s: received=%lu forwarded=%lu lost=%lu duplicated=%lu reordered=%lu queue_drops=%lu\n",
+            directionNames[i],
+            directions[i].receivedDatagrams,
+            directions[i].forwardedDatagrams,
+            directions[i].lostDatagrams,
+            directions[i].duplicatedDatagrams,
+            directions[i].reorderedDatagrams,
+            directions[i].queueDrops
+        );
+    }
+}
@@ -0,0 +1,905 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <common.h>
+#include <libswtp/swtp.h>
+
+#define LOAD_IPV4_HEADER_SIZE 20
+#define LOAD_UDP_HEADER_SIZE 8
+#define LOAD_MARKER_SIZE 12
+#define LOAD_TICK_INTERVAL (SWTP_TIMER_INTERVAL * 1000000)
+
+// Contains the sizes of the packets of the traffic mix, which follows the
+// simple IMIX: 7 small packets, 4 medium ones and 1 large one out of 12. The
+// small packets go to port 53, so that the server schedules them as
+// interactive packets.
+#define LOAD_SMALL_PACKET_SIZE 64
+#define LOAD_MEDIUM_PACKET_SIZE 576
+#define LOAD_LARGE_PACKET_SIZE SWTP_DEFAULT_MTU
+
+// Contains the time after which a session sends its SABM frame again, and the
+// time a step waits for its sessions to connect, in nanoseconds.
+#define LOAD_CONNECT_TIMEOUT 1000000000
+#define LOAD_RAMP_TIMEOUT 60000000000
+
+// Contains the number of descriptors the generator needs besides the sockets
+// of the sessions.
+#define LOAD_RESERVED_FDS 16
+
+#define LOAD_MAX_EVENTS 256
+
+#define LOAD_SESSION_IDLE 0
+#define LOAD_SESSION_CONNECTING 1
+#define LOAD_SESSION_CONNECTED 2
+
+typedef struct {
+    swtp_t swtp;
+    int socket;
+    int state;
+
+    // Contains the SABM request of a connecting session, and the secret key
+    // matching the public key it offers.
+    swtp_sabm_t sabm;
+    uint8_t secretKey[SWTP_KEY_SIZE];
+
+    // Contains the time the session sent its first SABM frame, and the time it
+    // sends it again if the server does not answer, in nanoseconds.
+    uint64_t connectTime;
+    uint64_t retryTime;
+
+    // True if SWTP reported that the connection was lost. The session
+    // connects again at the next timer tick.
+    bool lost;
+} load_session_t;
+
+typedef struct {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+} load_samples_t;
+
+typedef struct {
+    uint64_t connectedSessions;
+    uint64_t connectRetries;
+    uint64_t churnedSessions;
+    uint64_t lostSessions;
+    uint64_t sentPackets;
+    uint64_t blockedPackets;
+    uint64_t echoedPackets;
+    uint64_t misroutedPackets;
+} load_counters_t;
+
+// Contains the answer of the server to the stats command of its control socket.
+typedef struct {
+    bool valid;
+    int clients;
+    int connected;
+    uint64_t accepted;
+    uint64_t refused;
+    size_t sessionSize;
+    size_t windowMemory;
+    size_t queueMemory;
+    size_t residentMemory;
+    uint64_t timerTicks;
+    uint64_t timerTime;
+    uint64_t timerMax;
+} load_serverStats_t;
+
+char serverHostname[256] = "127.0.0.1";
+int serverPort = SWTP_PORT;
+struct sockaddr_in serverAddress;
+
+// Contains the number of sessions of the last step, and the number of steps
+// the sessions are opened in.
+int sessionCount = 1000;
+int stepCount = 4;
+
+// Contains the time the traffic runs at the end of each step, in seconds.
+int stepTime = 10;
+
+// Contains the number of sessions opened per second.
+int connectRate = 500;
+
+// Contains the number of packets each session sends per second.
+int packetRate = 10;
+
+// Contains the percentage of the sessions that are closed and opened again
+// each second while the traffic runs.
+double churnRate = 1;
+
+// Contains the receive window announced by the sessions, which is also their
+// largest send window.
+int windowSize = 64;
+
+// If true, the sessions offer a key, like the reference client.
+bool encryption = true;
+
+// Contains the path of the control socket of the server. NULL means that the
+// report does not contain the figures of the server.
+const char *controlSocketPath = NULL;
+
+uint64_t randomState = 0x853c49e6748fea9bULL;
+
+load_session_t *sessions;
+int epollFd;
+
+// Contains the number of sessions that were opened, which are the first ones of
+// the table, and the number of those that are connected.
+int openSessionCount = 0;
+int connectedSessionCount = 0;
+
+load_counters_t counters;
+load_samples_t connectTimes;
+load_samples_t roundTripTimes;
+
+// True while the round-trip times are recorded.
+bool measuring = false;
+
+// Contains the output of the report, as stdout receives the protocol trace.
+FILE *reportFile;
+
+int parseCommandLineParameters(int argc, const char **argv);
+int runLoad();
+
+static inline uint64_t getTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline uint64_t getCpuTime() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*, so that a given seed always picks the same sessions
+static inline double getRandom() {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+
+    return ((randomState * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+/*
+    Returns the time until the next event of a process that happens the given
+    number of times per second, in nanoseconds. The times are spread uniformly
+    between 0 and twice their mean, so that the sessions do not send in
+    lockstep.
+*/
+static inline uint64_t getRandomInterval(double rate) {
+    return (uint64_t)(getRandom() * 2 * 1000000000 / rate);
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    // The protocol trace of thousands of sessions is not readable anyway
+    int reportFd = dup(STDOUT_FILENO);
+
+    if(reportFd < 0 || (reportFile = fdopen(reportFd, "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to discard the protocol trace");
+        return EXIT_FAILURE;
+    }
+
+    if(runLoad()) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *value = argv[++i];
+
+        if(strcmp(argv[i - 1], "--hostname") == 0) {
+            if(strlen(value) >= sizeof(serverHostname)) {
+                printf("Invalid value for --hostname. Expected at most %zu characters.\n", sizeof(serverHostname) - 1);
+                return 1;
+            }
+
+            strcpy(serverHostname, value);
+        } else if(strcmp(argv[i - 1], "--port") == 0) {
+            if(sscanf(value, "%d", &serverPort) != 1 || serverPort <= 0 || serverPort > 65535) {
+                printf("Invalid value for --port. Expected an integer between 1 and 65535 included.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--sessions") == 0) {
+            if(sscanf(value, "%d", &sessionCount) != 1 || sessionCount <= 0) {
+                printf("Invalid value for --sessions. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--steps") == 0) {
+            if(sscanf(value, "%d", &stepCount) != 1 || stepCount <= 0) {
+                printf("Invalid value for --steps. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--step-time") == 0) {
+            if(sscanf(value, "%d", &stepTime) != 1 || stepTime <= 0) {
+                printf("Invalid value for --step-time. Expected a strictly positive number of seconds.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--connect-rate") == 0) {
+            if(sscanf(value, "%d", &connectRate) != 1 || connectRate <= 0) {
+                printf("Invalid value for --connect-rate. Expected a strictly positive number of sessions per second.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--rate") == 0) {
+            if(sscanf(value, "%d", &packetRate) != 1 || packetRate < 0) {
+                printf("Invalid value for --rate. Expected a positive number of packets per second.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--churn") == 0) {
+            if(sscanf(value, "%lf", &churnRate) != 1 || churnRate < 0 || churnRate > 100) {
+                printf("Invalid value for --churn. Expected a percentage of the sessions per second.\n");
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--window") == 0) {
+            if(sscanf(value, "%d", &windowSize) != 1 || windowSize <= 0 || windowSize > SWTP_MAX_WINDOW_SIZE) {
+                printf("Invalid value for --window. Expected an integer between 1 and %d included.\n", SWTP_MAX_WINDOW_SIZE);
+                return 1;
+            }
+        } else if(strcmp(argv[i - 1], "--encryption") == 0) {
+            if(strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                printf("Invalid value for --encryption. Expected 0 or 1.\n");
+                return 1;
+            }
+
+            encryption = strcmp(value, "1") == 0;
+        } else if(strcmp(argv[i - 1], "--control-socket") == 0) {
+            controlSocketPath = value;
+        } else if(strcmp(argv[i - 1], "--seed") == 0) {
+            if(sscanf(value, "%lu", &randomState) != 1 || randomState == 0) {
+                printf("Invalid value for --seed. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else {
+            printf("Unknown argument \"%s\".\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    if(sessionCount < stepCount) {
+        printf("--sessions must be at least --steps.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int addSample(load_samples_t *samples, uint64_t value) {
+    if(samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 4096;
+        uint64_t *values = realloc(samples->values, sizeof(uint64_t) * capacity);
+
+        if(!values) {
+            return -1;
+        }
+
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+
+    samples->values[samples->count++] = value;
+
+    return 0;
+}
+
+int compareSamples(const void *a, const void *b) {
+    uint64_t sampleA = *(const uint64_t *)a;
+    uint64_t sampleB = *(const uint64_t *)b;
+
+    return (sampleA > sampleB) - (sampleA < sampleB);
+}
+
+/*
+    Returns a percentile of sorted samples, in the unit of the samples.
+*/
+static inline uint64_t getPercentile(const load_samples_t *samples, double percentile) {
+    if(samples->count == 0) {
+        return 0;
+    }
+
+    return samples->values[(size_t)(percentile / 100.0 * (samples->count - 1))];
+}
+
+/*
+    Sends the stats command to the control socket of the server, and reads its
+    answer. The server then starts measuring its longest timer tick again.
+*/
+int readServerStats(load_serverStats_t *stats) {
+    struct sockaddr_un socketAddress;
+    int controlSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct timeval timeout = {2, 0};
+    char answer[512] = "";
+    size_t answerSize = 0;
+
+    stats->valid = false;
+
+    if(controlSocket < 0) {
+        return -1;
+    }
+
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    socketAddress.sun_family = AF_UNIX;
+    strncpy(socketAddress.sun_path, controlSocketPath, sizeof(socketAddress.sun_path) - 1);
+
+    if(
+        setsockopt(controlSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+        || connect(controlSocket, (const struct sockaddr *)&socketAddress, sizeof(socketAddress))
+        || write(controlSocket, "stats\n", 6) != 6
+    ) {
+        close(controlSocket);
+        return -1;
+    }
+
+    while(answerSize < sizeof(answer) - 1 && !strstr(answer, "OK\n")) {
+        ssize_t size = read(controlSocket, answer + answerSize, sizeof(answer) - 1 - answerSize);
+
+        if(size <= 0) {
+            break;
+        }
+
+        answerSize += size;
+        answer[answerSize] = '\0';
+    }
+
+    close(controlSocket);
+
+    if(sscanf(answer, "clients=%d connected=%d accepted=%lu refused=%lu session_size=%zu window_memory=%zu queue_memory=%zu rss=%zu timer_ticks=%lu timer_time=%lu timer_max=%lu", &stats->clients, &stats->connected, &stats->accepted, &stats->refused, &stats->sessionSize, &stats->windowMemory, &stats->queueMemory, &stats->residentMemory, &stats->timerTicks, &stats->timerTime, &stats->timerMax) != 11) {
+        return -1;
+    }
+
+    stats->valid = true;
+
+    return 0;
+}
+
+int resolveHostname(const char *hostname, in_addr_t *address) {
+    struct hostent *hostEntry = gethostbyname(hostname);
+
+    if(hostEntry == NULL) {
+        return -1;
+    }
+
+    memcpy(address, hostEntry->h_addr_list[0], sizeof(in_addr_t));
+
+    return 0;
+}
+
+/*
+    Lets the generator open a socket for every session, and returns -1 if the
+    hard limit of the process is too low.
+*/
+int raiseDescriptorLimit() {
+    struct rlimit limit;
+    rlim_t neededDescriptors = sessionCount + LOAD_RESERVED_FDS;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit)) {
+        return -1;
+    }
+
+    if(limit.rlim_cur >= neededDescriptors) {
+        return 0;
+    }
+
+    if(limit.rlim_max != RLIM_INFINITY && limit.rlim_max < neededDescriptors) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    limit.rlim_cur = neededDescriptors;
+
+    return setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+void sendSABM(load_session_t *session) {
+    swtp_frame_t request;
+
+    swtp_buildSABM(&request, &session->sabm);
+    sendto(session->socket, &request.frame, request.size, 0, (const struct sockaddr *)&serverAddress, sizeof(serverAddress));
+
+    session->retryTime = getTime() + LOAD_CONNECT_TIMEOUT;
+}
+
+/*
+    Opens a session from a new socket, and thus from a new port, like a new
+    client. The session is connected once the server answers its SABM frame.
+*/
+int openSession(int index) {
+    load_session_t *session = &sessions[index];
+
+    session->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+
+    if(session->socket < 0) {
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = index};
+
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, session->socket, &event)) {
+        close(session->socket);
+        return -1;
+    }
+
+    memset(&session->sabm, 0, sizeof(session->sabm));
+    session->sabm.windowSize = windowSize;
+    session->sabm.overheadSize = SWTP_OVERHEAD_SIZE;
+    session->sabm.byteWindowSize = windowSize * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU);
+    session->sabm.hasSession = true;
+    session->sabm.sack = true;
+
+    if(encryption) {
+        if(swtp_generateKeyPair(session->secretKey, session->sabm.publicKey) != SWTP_SUCCESS) {
+            close(session->socket);
+            return -1;
+        }
+
+        session->sabm.hasKey = true;
+    }
+
+    session->state = LOAD_SESSION_CONNECTING;
+    session->lost = false;
+    session->connectTime = getTime();
+
+    sendSABM(session);
+
+    return 0;
+}
+
+/*
+    Closes a session. A connected session sends a DISC frame first, so that the
+    server removes it right away.
+*/
+void closeSession(int index) {
+    load_session_t *session = &sessions[index];
+
+    if(session->state == LOAD_SESSION_CONNECTED) {
+        if(!session->lost) {
+            swtp_disconnect(&session->swtp);
+        }
+
+        swtp_destroy(&session->swtp);
+        connectedSessionCount--;
+    }
+
+    if(session->state != LOAD_SESSION_IDLE) {
+        close(session->socket);
+    }
+
+    session->state = LOAD_SESSION_IDLE;
+}
+
+void onPacketReceived(swtp_t *swtp, const void *buffer, size_t size) {
+    load_session_t *session = swtp->userData;
+    const uint8_t *marker = (const uint8_t *)buffer + TUN_HEADER_SIZE + LOAD_IPV4_HEADER_SIZE + LOAD_UDP_HEADER_SIZE;
+    uint32_t index;
+    uint64_t sendTime;
+
+    if(size < TUN_HEADER_SIZE + LOAD_IPV4_HEADER_SIZE + LOAD_UDP_HEADER_SIZE + LOAD_MARKER_SIZE) {
+        return;
+    }
+
+    memcpy(&index, marker, 4);
+    memcpy(&sendTime, marker + 4, sizeof(sendTime));
+
+    // The server must send the packet back to the session that sent it
+    if(index != (uint32_t)(session - sessions)) {
+        counters.misroutedPackets++;
+        return;
+    }
+
+    counters.echoedPackets++;
+
+    if(measuring && addSample(&roundTripTimes, getTime() - sendTime)) {
+        perror("Failed to record a round-trip time");
+    }
+}
+
+void onDisconnect(swtp_t *swtp, int reason) {
+    UNUSED_PARAMETER(reason);
+
+    load_session_t *session = swtp->userData;
+
+    // SWTP still uses the structure, so the session is closed later
+    session->lost = true;
+    counters.lostSessions++;
+}
+
+/*
+    Sets the session up like the reference client does, once the server has
+    accepted it.
+*/
+int onConnected(int index, const swtp_sabm_t *response) {
+    load_session_t *session = &sessions[index];
+    uint32_t sendWindowSize = response->windowSize < (uint32_t)windowSize ? response->windowSize : (uint32_t)windowSize;
+
+    swtp_init(&session->swtp, session->socket, (const struct sockaddr *)&serverAddress);
+    swtp_setReceiveWindow(&session->swtp, windowSize, windowSize * (SWTP_OVERHEAD_SIZE + MAXIMUM_MTU));
+    session->swtp.extended = response->extended;
+
+    if(swtp_initSendWindow(&session->swtp, sendWindowSize) != SWTP_SUCCESS) {
+        swtp_destroy(&session->swtp);
+        return -1;
+    }
+
+    swtp_setPeerWindow(&session->swtp, response->windowSize, response->overheadSize, response->byteWindowSize);
+
+    if(
+        (response->sack && swtp_enableSack(&session->swtp) != SWTP_SUCCESS)
+        || (response->hasKey && swtp_enableEncryption(&session->swtp, session->secretKey, response->publicKey, NULL, true) != SWTP_SUCCESS)
+    ) {
+        swtp_destroy(&session->swtp);
+        return -1;
+    }
+
+    if(response->hasSession) {
+        session->swtp.hasSession = true;
+        session->swtp.sessionId = response->sessionId;
+        memcpy(session->swtp.sessionToken, response->sessionToken, SWTP_SESSION_TOKEN_SIZE);
+    }
+
+    session->swtp.recvCallback = onPacketReceived;
+    session->swtp.disconnectCallback = onDisconnect;
+    session->swtp.userData = session;
+    session->state = LOAD_SESSION_CONNECTED;
+
+    connectedSessionCount++;
+    counters.connectedSessions++;
+
+    return addSample(&connectTimes, getTime() - session->connectTime);
+}
+
+/*
+    Handles the datagrams waiting on the socket of a session.
+*/
+void receiveFrames(int index) {
+    load_session_t *session = &sessions[index];
+    swtp_frame_t frame;
+
+    while(session->state != LOAD_SESSION_IDLE) {
+        ssize_t size = recv(session->socket, &frame.frame, SWTP_MAX_FRAME_SIZE, 0);
+        swtp_sabm_t response;
+
+        if(size < 0) {
+            break;
+        }
+
+        frame.size = size;
+
+        if(session->state == LOAD_SESSION_CONNECTED) {
+            swtp_onFrameReceived(&session->swtp, &frame);
+        } else if(swtp_parseCookie(&frame, session->sabm.cookie) == SWTP_SUCCESS) {
+            // The server asks for a proof that the session receives frames
+            // at its address
+            session->sabm.hasCookie = true;
+            sendSABM(session);
+        } else if(swtp_parseSABM(&frame, &response) == SWTP_SUCCESS && onConnected(index, &response)) {
+            perror("Failed to set a session up");
+            closeSession(index);
+        }
+    }
+}
+
+/*
+    Sends a packet of the traffic mix from a session. The UDP payload starts
+    with the index of the session and the time the packet was sent at, which
+    the server sends back.
+*/
+void sendPacket(int index) {
+    load_session_t *session = &sessions[index];
+    uint8_t packet[TUN_HEADER_SIZE + LOAD_LARGE_PACKET_SIZE];
+    double mix = getRandom() * 12;
+    int packetSize = mix < 7 ? LOAD_SMALL_PACKET_SIZE : mix < 11 ? LOAD_MEDIUM_PACKET_SIZE : LOAD_LARGE_PACKET_SIZE;
+    uint8_t *ipHeader = packet + TUN_HEADER_SIZE;
+    uint8_t *udpHeader = ipHeader + LOAD_IPV4_HEADER_SIZE;
+    uint8_t *marker = udpHeader + LOAD_UDP_HEADER_SIZE;
+    uint32_t sessionIndex = index;
+    uint64_t sendTime = getTime();
+
+    if(session->state != LOAD_SESSION_CONNECTED || session->lost) {
+        return;
+    }
+
+    if(swtp_getSendWindowAvailableSlots(&session->swtp) == 0) {
+        counters.blockedPackets++;
+        return;
+    }
+
+    memset(packet, 0, TUN_HEADER_SIZE + packetSize);
+    *(uint16_t *)(packet + 2) = htons(ETHERTYPE_IPV4);
+
+    // Each session sends from its own address of 10.128.0.0/9
+    ipHeader[0] = 0x45;
+    *(uint16_t *)(ipHeader + 2) = htons(packetSize);
+    ipHeader[8] = 64;
+    ipHeader[9] = IPPROTO_UDP;
+    *(uint32_t *)(ipHeader + 12) = htonl(0x0a800000 + index);
+    *(uint32_t *)(ipHeader + 16) = htonl(0x0a000001);
+
+    *(uint16_t *)(udpHeader + 0) = htons(40000);
+    *(uint16_t *)(udpHeader + 2) = htons(packetSize == LOAD_SMALL_PACKET_SIZE ? 53 : 443);
+    *(uint16_t *)(udpHeader + 4) = htons(packetSize - LOAD_IPV4_HEADER_SIZE);
+
+    memcpy(marker, &sessionIndex, 4);
+    memcpy(marker + 4, &sendTime, sizeof(sendTime));
+
+    if(swtp_sendDataFrame(&session->swtp, packet, TUN_HEADER_SIZE + packetSize) == SWTP_SUCCESS) {
+        counters.sentPackets++;
+    }
+}
+
+/*
+    Runs the timers of the sessions: the SWTP timers of the connected sessions,
+    the SABM retries of the connecting ones, and the reconnection of the lost
+    ones.
+*/
+void onTimerTick() {
+    uint64_t now = getTime();
+
+    for(int i = 0; i < openSessionCount; i++) {
+        load_session_t *session = &sessions[i];
+
+        if(session->lost) {
+            closeSession(i);
+
+            if(openSession(i)) {
+                perror("Failed to open a session again");
+            }
+        } else if(session->state == LOAD_SESSION_CONNECTED) {
+            swtp_onTimerTick(&session->swtp);
+        } else if(session->state == LOAD_SESSION_CONNECTING && now >= session->retryTime) {
+            counters.connectRetries++;
+            sendSABM(session);
+        }
+    }
+}
+
+/*
+    Runs the sessions until the end time. During a ramp, sessions are opened at
+    the connection rate until targetSessionCount of them are open, and the
+    function returns once they are all connected. Otherwise, sessions are
+    closed and opened again at the churn rate.
+*/
+int runSessions(uint64_t endTime, int targetSessionCount, bool ramp) {
+    struct epoll_event events[LOAD_MAX_EVENTS];
+    uint64_t now = getTime();
+    uint64_t nextConnectTime = now;
+    uint64_t nextPacketTime = now;
+    uint64_t nextChurnTime = now;
+    uint64_t nextTickTime = now + LOAD_TICK_INTERVAL;
+
+    while(now < endTime && !(ramp && openSessionCount == targetSessionCount && connectedSessionCount == targetSessionCount)) {
+        while(ramp && openSessionCount < targetSessionCount && now >= nextConnectTime) {
+            if(openSession(openSessionCount)) {
+                perror("Failed to open a session");
+                return -1;
+            }
+
+            openSessionCount++;
+            nextConnectTime += 1000000000 / connectRate;
+        }
+
+        // The sessions send independently of each other, so the packets of
+        // all of them are drawn from one process
+        double totalPacketRate = (double)openSessionCount * packetRate;
+
+        while(totalPacketRate > 0 && now >= nextPacketTime) {
+            sendPacket(getRandom() * openSessionCount);
+            nextPacketTime += getRandomInterval(totalPacketRate);
+        }
+
+        double totalChurnRate = openSessionCount * churnRate / 100;
+
+        while(!ramp && totalChurnRate > 0 && now >= nextChurnTime) {
+            int index = getRandom() * openSessionCount;
+
+            closeSession(index);
+
+            if(openSession(index)) {
+                perror("Failed to open a session again");
+                return -1;
+            }
+
+            counters.churnedSessions++;
+            nextChurnTime += getRandomInterval(totalChurnRate);
+        }
+
+        if(now >= nextTickTime) {
+            onTimerTick();
+            nextTickTime += LOAD_TICK_INTERVAL;
+        }
+
+        // Sleep until the next event, rounded up to the millisecond
+        uint64_t wakeUpTime = nextTickTime < endTime ? nextTickTime : endTime;
+
+        if(totalPacketRate > 0 && nextPacketTime < wakeUpTime) {
+            wakeUpTime = nextPacketTime;
+        }
+
+        if(ramp && openSessionCount < targetSessionCount && nextConnectTime < wakeUpTime) {
+            wakeUpTime = nextConnectTime;
+        }
+
+        if(!ramp && totalChurnRate > 0 && nextChurnTime < wakeUpTime) {
+            wakeUpTime = nextChurnTime;
+        }
+
+        int timeout = wakeUpTime > now ? (int)((wakeUpTime - now + 999999) / 1000000) : 0;
+        int eventCount = epoll_wait(epollFd, events, LOAD_MAX_EVENTS, timeout);
+
+        if(eventCount < 0 && errno != EINTR) {
+            perror("Failed to wait for frames");
+            return -1;
+        }
+
+        for(int i = 0; i < eventCount; i++) {
+            receiveFrames(events[i].data.u32);
+        }
+
+        now = getTime();
+    }
+
+    return 0;
+}
+
+void printStepReport(int step, uint64_t rampTime, uint64_t rampConnections, uint64_t holdTime, uint64_t cpuTime, const load_serverStats_t *baseline, const load_serverStats_t *start, const load_serverStats_t *end) {
+    qsort(connectTimes.values, connectTimes.count, sizeof(uint64_t), compareSamples);
+    qsort(roundTripTimes.values, roundTripTimes.count, sizeof(uint64_t), compareSamples);
+
+    fprintf(reportFile, "step: %d/%d\n", step, stepCount);
+    fprintf(reportFile, "sessions: %d\n", openSessionCount);
+    fprintf(reportFile, "connected_sessions: %d\n", connectedSessionCount);
+    fprintf(reportFile, "ramp_s: %.3f\n", rampTime / 1e9);
+    fprintf(reportFile, "accept_rate_per_s: %.1f\n", rampTime > 0 ? rampConnections / (rampTime / 1e9) : 0.0);
+    fprintf(reportFile, "connect_p50_ms: %.1f\n", getPercentile(&connectTimes, 50.0) / 1e6);
+    fprintf(reportFile, "connect_p99_ms: %.1f\n", getPercentile(&connectTimes, 99.0) / 1e6);
+    fprintf(reportFile, "connect_max_ms: %.1f\n", getPercentile(&connectTimes, 100.0) / 1e6);
+    fprintf(reportFile, "connect_retries: %lu\n", counters.connectRetries);
+    fprintf(reportFile, "churned_sessions: %lu\n", counters.churnedSessions);
+    fprintf(reportFile, "lost_sessions: %lu\n", counters.lostSessions);
+    fprintf(reportFile, "sent_packets: %lu\n", counters.sentPackets);
+    fprintf(reportFile, "blocked_packets: %lu\n", counters.blockedPackets);
+    fprintf(reportFile, "echoed_packets: %lu\n", counters.echoedPackets);
+    fprintf(reportFile, "misrouted_packets: %lu\n", counters.misroutedPackets);
+    fprintf(reportFile, "rtt_p50_us: %.1f\n", getPercentile(&roundTripTimes, 50.0) / 1e3);
+    fprintf(reportFile, "rtt_p90_us: %.1f\n", getPercentile(&roundTripTimes, 90.0) / 1e3);
+    fprintf(reportFile, "rtt_p99_us: %.1f\n", getPercentile(&roundTripTimes, 99.0) / 1e3);
+    fprintf(reportFile, "rtt_p999_us: %.1f\n", getPercentile(&roundTripTimes, 99.9) / 1e3);
+    fprintf(reportFile, "rtt_max_us: %.1f\n", getPercentile(&roundTripTimes, 100.0) / 1e3);
+    fprintf(reportFile, "generator_cpu_percent: %.1f\n", holdTime > 0 ? cpuTime * 100.0 / holdTime : 0.0);
+
+    // The memory of the server grows with its sessions from what it used
+    // before the first one
+    if(baseline->valid && start->valid && end->valid) {
+        uint64_t tickCount = end->timerTicks - start->timerTicks;
+        double tickTime = tickCount > 0 ? (double)(end->timerTime - start->timerTime) / tickCount : 0.0;
+
+        fprintf(reportFile, "server_clients: %d\n", end->clients);
+        fprintf(reportFile, "server_refused_clients: %lu\n", end->refused - start->refused);
+        fprintf(reportFile, "server_rss_mib: %.1f\n", end->residentMemory / 1048576.0);
+        fprintf(reportFile, "server_memory_per_session_kib: %.1f\n", end->clients > 0 ? ((double)end->residentMemory - baseline->residentMemory) / end->clients / 1024 : 0.0);
+        fprintf(reportFile, "server_window_memory_per_session_kib: %.1f\n", end->clients > 0 ? (double)end->windowMemory / end->clients / 1024 : 0.0);
+        fprintf(reportFile, "server_queue_memory_mib: %.1f\n", end->queueMemory / 1048576.0);
+        fprintf(reportFile, "server_session_size_bytes: %zu\n", end->sessionSize);
+        fprintf(reportFile, "server_timer_tick_us: %.1f\n", tickTime);
+        fprintf(reportFile, "server_timer_tick_max_us: %lu\n", end->timerMax);
+        fprintf(reportFile, "server_timer_ns_per_session: %.1f\n", end->clients > 0 ? tickTime * 1000 / end->clients : 0.0);
+        fprintf(reportFile, "server_timer_cpu_percent: %.1f\n", holdTime > 0 ? (end->timerTime - start->timerTime) * 1000 * 100.0 / holdTime : 0.0);
+    }
+
+    fprintf(reportFile, "\n");
+    fflush(reportFile);
+}
+
+int runLoad() {
+    load_serverStats_t baseline = {.valid = false};
+
+    if(raiseDescriptorLimit()) {
+        perror("Failed to allow a socket per session");
+        return 1;
+    }
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+
+    if(resolveHostname(serverHostname, &serverAddress.sin_addr.s_addr)) {
+        fprintf(stderr, "Failed to resolve %s.\n", serverHostname);
+        return 1;
+    }
+
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(serverPort);
+
+    sessions = calloc(sessionCount, sizeof(load_session_t));
+    epollFd = epoll_create1(0);
+
+    if(!sessions || epollFd < 0) {
+        perror("Failed to allocate the sessions");
+        return 1;
+    }
+
+    if(controlSocketPath && readServerStats(&baseline)) {
+        fprintf(stderr, "Failed to read the stats of the server from %s.\n", controlSocketPath);
+        return 1;
+    }
+
+    for(int step = 1; step <= stepCount; step++) {
+        load_serverStats_t start = {.valid = false};
+        load_serverStats_t end = {.valid = false};
+        int targetSessionCount = (int64_t)sessionCount * step / stepCount;
+        uint64_t rampStartTime = getTime();
+
+        memset(&counters, 0, sizeof(counters));
+        connectTimes.count = 0;
+        roundTripTimes.count = 0;
+
+        if(runSessions(rampStartTime + LOAD_RAMP_TIMEOUT, targetSessionCount, true)) {
+            return 1;
+        }
+
+        uint64_t holdStartTime = getTime();
+        uint64_t rampConnections = counters.connectedSessions;
+
+        if(connectedSessionCount < targetSessionCount) {
+            fprintf(reportFile, "Only %d of %d sessions connected within %d s.\n", connectedSessionCount, targetSessionCount, (int)(LOAD_RAMP_TIMEOUT / 1000000000));
+        }
+
+        if(controlSocketPath) {
+            readServerStats(&start);
+        }
+
+        uint64_t cpuStartTime = getCpuTime();
+
+        measuring = true;
+
+        if(runSessions(holdStartTime + (uint64_t)stepTime * 1000000000, targetSessionCount, false)) {
+            return 1;
+        }
+
+        measuring = false;
+
+        uint64_t cpuTime = getCpuTime() - cpuStartTime;
+        uint64_t holdTime = getTime() - holdStartTime;
+
+        if(controlSocketPath) {
+            readServerStats(&end);
+        }
+
+        printStepReport(step, holdStartTime - rampStartTime, rampConnections, holdTime, cpuTime, &baseline, &start, &end);
+    }
+
+    for(int i = 0; i < openSessionCount; i++) {
+        closeSession(i);
+    }
+
+    close(epollFd);
+    free(sessions);
+
+    return 0;
+}
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <common.h>
+#include <libswtp/swtp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICROBENCH_UNIT "cycles"
+#else
+#define MICROBENCH_UNIT "ns"
+#endif
+
+#define MICROBENCH_WINDOW_SIZE 1024
+#define MICROBENCH_BATCH_SIZE 1024
+#define MICROBENCH_WARMUP_RUNS 5
+
+typedef struct {
+    const char *name;
+
+    // Runs the benchmarked operation MICROBENCH_BATCH_SIZE times, and returns
+    // the elapsed time. Any setup must happen outside of the measurement.
+    uint64_t (*run)(int parameter);
+
+    int parameter;
+} microbench_t;
+
+// Contains the number of measured batches of each benchmark.
+int runCount = 201;
+
+// Contains the CPU the benchmarks are pinned to.
+int cpu = 0;
+
+// Contains the path of the results file (NULL = stdout).
+const char *outputPath = NULL;
+
+swtp_t sender;
+swtp_t receiver;
+
+swtp_frame_t frames[MICROBENCH_BATCH_SIZE];
+uint8_t packet[TUN_HEADER_SIZE + MAXIMUM_MTU];
+
+int parseCommandLineParameters(int argc, const char **argv);
+
+static inline uint64_t readCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    uint64_t counter = __rdtsc();
+    _mm_lfence();
+
+    return counter;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// The benchmarks neither wait for time nor send anything on the network
+swtp_time_t getFixedTime(const swtp_t *swtp) {
+    UNUSED_PARAMETER(swtp);
+    return 0;
+}
+
+ssize_t discardFrame(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(swtp);
+    UNUSED_PARAMETER(buffer);
+    return size;
+}
+
+void discardPacket(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(swtp);
+    UNUSED_PARAMETER(buffer);
+    UNUSED_PARAMETER(size);
+}
+
+void initEndpoint(swtp_t *swtp, uint32_t windowSize) {
+    struct sockaddr address;
+
+    memset(&address, 0, sizeof(address));
+    swtp_destroy(swtp);
+    swtp_init(swtp, -1, &address);
+    swtp->clockCallback = getFixedTime;
+    swtp->sendCallback = discardFrame;
+    swtp->recvCallback = discardPacket;
+
+    if(swtp_initSendWindow(swtp, windowSize) != SWTP_SUCCESS) {
+        perror("Failed to initialize the send window");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void buildPacket(int size) {
+    memset(packet, 0, sizeof(packet));
+    *(uint16_t *)(packet + 2) = htons(ETHERTYPE_IPV4);
+    packet[TUN_HEADER_SIZE] = 0x45;
+    *(uint16_t *)(packet + TUN_HEADER_SIZE + 2) = htons(size);
+}
+
+/*
+    Fills the send window of the sender with frames, starting with the given
+    sequence number.
+*/
+void fillSendWindow(uint_least16_t startSequenceNumber, uint_least16_t length) {
+    sender.sendWindowStartIndex = 0;
+    sender.sendWindowStartSequenceNumber = startSequenceNumber;
+    sender.sendWindowLength = length;
+
+    for(uint_least16_t i = 0; i < length; i++) {
+        uint16_t sequenceNumber = htons((startSequenceNumber + i) % SWTP_SEQUENCE_NUMBER_COUNT);
+
+        memcpy(sender.sendWindow[i].frame.header, &sequenceNumber, 2);
+        sender.sendWindow[i].size = SWTP_HEADER_SIZE + SWTLLP_HEADER_SIZE + 1000;
+        sender.sendWindow[i].buffer = NULL;
+    }
+}
+
+void buildControlFrame(swtp_frame_t *frame, uint32_t command) {
+    uint32_t header = htonl(command);
+
+    memcpy(frame->frame.header, &header, SWTP_HEADER_SIZE);
+    frame->size = SWTP_HEADER_SIZE;
+}
+
+uint64_t runSendDataFrame(int size) {
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    buildPacket(size);
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtp_sendDataFrame(&sender, packet, TUN_HEADER_SIZE + size);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runReceiveDataFrame(int size) {
+    initEndpoint(&receiver, MICROBENCH_WINDOW_SIZE);
+    buildPacket(size);
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtllp_encapsulate(&receiver, &frames[i], packet, TUN_HEADER_SIZE + size);
+        *(uint16_t *)frames[i].frame.header = htons(i);
+        *(uint16_t *)(frames[i].frame.header + 2) = 0;
+    }
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtp_onFrameReceived(&receiver, &frames[i]);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runReceiveRR(int parameter) {
+    UNUSED_PARAMETER(parameter);
+
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    fillSendWindow(0, MICROBENCH_WINDOW_SIZE);
+
+    // Each RR acknowledges one more frame
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        buildControlFrame(&frames[i], 0xe0000000 | (i + 1));
+    }
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtp_onFrameReceived(&sender, &frames[i]);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runReceiveREJ(int rejectedFrameCount) {
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    fillSendWindow(0, MICROBENCH_WINDOW_SIZE);
+
+    // Each REJ makes the sender retransmit the last frames of the window
+    buildControlFrame(&frames[0], 0xd0000000 | (MICROBENCH_WINDOW_SIZE - rejectedFrameCount));
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtp_onFrameReceived(&sender, &frames[0]);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runReceiveSREJ(int parameter) {
+    UNUSED_PARAMETER(parameter);
+
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    fillSendWindow(0, MICROBENCH_WINDOW_SIZE);
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        buildControlFrame(&frames[i], 0xc0000000 | i);
+    }
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtp_onFrameReceived(&sender, &frames[i]);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runAcknowledgeSentFrame(int startSequenceNumber) {
+    initEndpoint(&sender, SWTP_MAX_WINDOW_SIZE);
+
+    uint64_t elapsedTime = 0;
+
+    // Acknowledge the whole window at once, possibly across the sequence
+    // number wraparound
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        sender.sendWindowStartIndex = i;
+        sender.sendWindowStartSequenceNumber = startSequenceNumber;
+        sender.sendWindowLength = SWTP_MAX_WINDOW_SIZE;
+
+        uint64_t startTime = readCounter();
+        swtp_acknowledgeSentFrame(&sender, (startSequenceNumber + SWTP_MAX_WINDOW_SIZE - 1) % SWTP_SEQUENCE_NUMBER_COUNT);
+        elapsedTime += readCounter() - startTime;
+    }
+
+    return elapsedTime;
+}
+
+uint64_t runGetSentFrame(int startSequenceNumber) {
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    fillSendWindow(startSequenceNumber, MICROBENCH_WINDOW_SIZE);
+
+    uintptr_t checksum = 0;
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        checksum += (uintptr_t)swtp_getSentFrame(&sender, (startSequenceNumber + i) % SWTP_SEQUENCE_NUMBER_COUNT);
+    }
+
+    uint64_t elapsedTime = readCounter() - startTime;
+
+    // Keep the compiler from removing the loop
+    __asm__ volatile("" : : "r"(checksum));
+
+    return elapsedTime;
+}
+
+uint64_t runIsSentFrameNumberValid(int startSequenceNumber) {
+    initEndpoint(&sender, MICROBENCH_WINDOW_SIZE);
+    fillSendWindow(startSequenceNumber, MICROBENCH_WINDOW_SIZE);
+
+    int validCount = 0;
+    uint64_t startTime = readCounter();
+
+    // Half of the sequence numbers are in the window
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        validCount += swtp_isSentFrameNumberValid(&sender, (startSequenceNumber + i * 2) % SWTP_SEQUENCE_NUMBER_COUNT);
+    }
+
+    uint64_t elapsedTime = readCounter() - startTime;
+
+    __asm__ volatile("" : : "r"(validCount));
+
+    return elapsedTime;
+}
+
+uint64_t runEncapsulate(int size) {
+    buildPacket(size);
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtllp_encapsulate(&sender, &frames[i], packet, TUN_HEADER_SIZE + size);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runUnwrap(int size) {
+    initEndpoint(&receiver, MICROBENCH_WINDOW_SIZE);
+    buildPacket(size);
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtllp_encapsulate(&receiver, &frames[i], packet, TUN_HEADER_SIZE + size);
+    }
+
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        swtllp_unwrap(&receiver, &frames[i]);
+    }
+
+    return readCounter() - startTime;
+}
+
+static const uint8_t benchKey[CHACHA20POLY1305_KEY_SIZE] = {1};
+
+uint64_t runSeal(int size) {
+    uint64_t startTime = readCounter();
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        chacha20poly1305_seal(benchKey, i, frames[i].frame.payload, size);
+    }
+
+    return readCounter() - startTime;
+}
+
+uint64_t runSealBatch(int size) {
+    static chacha20poly1305_message_t messages[MICROBENCH_BATCH_SIZE];
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        messages[i].data = frames[i].frame.payload;
+        messages[i].size = size;
+        messages[i].nonce = i;
+    }
+
+    uint64_t startTime = readCounter();
+
+    chacha20poly1305_sealBatch(benchKey, messages, MICROBENCH_BATCH_SIZE);
+
+    return readCounter() - startTime;
+}
+
+uint64_t runOpen(int size) {
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        chacha20poly1305_seal(benchKey, i, frames[i].frame.payload, size);
+    }
+
+    uint64_t startTime = readCounter();
+    int failures = 0;
+
+    for(int i = 0; i < MICROBENCH_BATCH_SIZE; i++) {
+        failures += chacha20poly1305_open(benchKey, i, frames[i].frame.payload, frames[i].frame.payload, size) < 0;
+    }
+
+    uint64_t elapsedTime = readCounter() - startTime;
+
+    __asm__ volatile("" : : "r"(failures));
+
+    return elapsedTime;
+}
+
+static const microbench_t benchmarks[] = {
+    {"swtp_sendDataFrame/64", runSendDataFrame, 64},
+    {"swtp_sendDataFrame/1400", runSendDataFrame, 1400},
+    {"swtp_onFrameReceived/data/64", runReceiveDataFrame, 64},
+    {"swtp_onFrameReceived/data/1400", runReceiveDataFrame, 1400},
+    {"swtp_onFrameReceived/rr", runReceiveRR, 0},
+    {"swtp_onFrameReceived/rej/1", runReceiveREJ, 1},
+    {"swtp_onFrameReceived/rej/16", runReceiveREJ, 16},
+    {"swtp_onFrameReceived/srej", runReceiveSREJ, 0},
+    {"swtp_acknowledgeSentFrame/16383", runAcknowledgeSentFrame, 0},
+    {"swtp_acknowledgeSentFrame/16383/wrap", runAcknowledgeSentFrame, 30000},
+    {"swtp_getSentFrame", runGetSentFrame, 0},
+    {"swtp_getSentFrame/wrap", runGetSentFrame, SWTP_SEQUENCE_NUMBER_COUNT - MICROBENCH_WINDOW_SIZE / 2},
+    {"swtp_isSentFrameNumberValid", runIsSentFrameNumberValid, 0},
+    {"swtp_isSentFrameNumberValid/wrap", runIsSentFrameNumberValid, SWTP_SEQUENCE_NUMBER_COUNT - MICROBENCH_WINDOW_SIZE / 2},
+    {"swtllp_encapsulate/64", runEncapsulate, 64},
+    {"swtllp_encapsulate/576", runEncapsulate, 576},
+    {"swtllp_encapsulate/1400", runEncapsulate, 1400},
+    {"swtllp_unwrap/64", runUnwrap, 64},
+    {"swtllp_unwrap/576", runUnwrap, 576},
+    {"swtllp_unwrap/1400", runUnwrap, 1400},
+    {"chacha20poly1305_seal/64", runSeal, 64},
+    {"chacha20poly1305_seal/576", runSeal, 576},
+    {"chacha20poly1305_seal/1400", runSeal, 1400},
+    {"chacha20poly1305_sealBatch/64", runSealBatch, 64},
+    {"chacha20poly1305_sealBatch/576", runSealBatch, 576},
+    {"chacha20poly1305_sealBatch/1400", runSealBatch, 1400},
+    {"chacha20poly1305_open/64", runOpen, 64},
+    {"chacha20poly1305_open/576", runOpen, 576},
+    {"chacha20poly1305_open/1400", runOpen, 1400}
+};
+
+int compareCounters(const void *a, const void *b) {
+    uint64_t counterA = *(const uint64_t *)a;
+    uint64_t counterB = *(const uint64_t *)b;
+
+    return (counterA > counterB) - (counterA < counterB);
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *outputFile = stdout;
+
+    if(outputPath) {
+        outputFile = fopen(outputPath, "w");
+    } else {
+        int outputFd = dup(STDOUT_FILENO);
+        outputFile = outputFd < 0 ? NULL : fdopen(outputFd, "w");
+    }
+
+    if(!outputFile) {
+        perror("Failed to open the results file");
+        return EXIT_FAILURE;
+    }
+
+    // The protocol trace is part of the measured cost, but must not be shown
+    if(freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to discard the protocol trace");
+        return EXIT_FAILURE;
+    }
+
+    // Migrations between CPUs would make the cycle counts unstable
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+
+    if(sched_setaffinity(0, sizeof(cpuSet), &cpuSet)) {
+        perror("Failed to pin the benchmarks to a CPU");
+    }
+
+    uint64_t *results = malloc(sizeof(uint64_t) * runCount);
+
+    if(!results) {
+        perror("Failed to allocate memory for the results");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(outputFile, "# %-40s %12s %12s\n", "benchmark", MICROBENCH_UNIT "/op", "min");
+
+    for(size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        const microbench_t *benchmark = &benchmarks[i];
+
+        for(int run = 0; run < MICROBENCH_WARMUP_RUNS; run++) {
+            benchmark->run(benchmark->parameter);
+        }
+
+        for(int run = 0; run < runCount; run++) {
+            results[run] = benchmark->run(benchmark->parameter);
+        }
+
+        qsort(results, runCount, sizeof(uint64_t), compareCounters);
+
+        // The median is reported, as it is not affected by interrupts
+        fprintf(
+            outputFile,
+            "%-42s %12lu %12lu\n",
+            benchmark->name,
+            (results[runCount / 2] + MICROBENCH_BATCH_SIZE / 2) / MICROBENCH_BATCH_SIZE,
+            (results[0] + MICROBENCH_BATCH_SIZE / 2) / MICROBENCH_BATCH_SIZE
+        );
+    }
+
+    fclose(outputFile);
+    free(results);
+    swtp_destroy(&sender);
+    swtp_destroy(&receiver);
+
+    return EXIT_SUCCESS;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *name = argv[i++];
+        const char *value = argv[i];
+
+        if(strcmp(name, "--runs") == 0) {
+            if(sscanf(value, "%d", &runCount) != 1 || runCount <= 0) {
+                printf("Invalid value for --runs. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--cpu") == 0) {
+            if(sscanf(value, "%d", &cpu) != 1 || cpu < 0 || cpu >= CPU_SETSIZE) {
+                printf("Invalid value for --cpu. Expected a CPU number.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--output") == 0) {
+            outputPath = value;
+        } else {
+            printf("Unknown argument \"%s\".\n", name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,443 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <common.h>
+#include <libswtp/swtp.h>
+#include <libcapture/capture.h>
+
+#define REPLAY_TIMER_INTERVAL SWTP_TIMER_INTERVAL
+
+typedef struct {
+    uint32_t id;
+    swtp_t swtp;
+
+    // Contains the sequence number of the next new data frame sent by the
+    // captured endpoint. Retransmissions are left to the replayed endpoint.
+    uint32_t nextSequenceNumber;
+
+    // False until the sequence numbers are known, when the beginning of the
+    // session was overwritten in the capture ring.
+    bool receiveSynchronized;
+    bool sendSynchronized;
+
+    swtp_time_t nextTimerTick;
+} replay_session_t;
+
+// Contains the path of the capture file.
+const char *inputPath = NULL;
+
+// Contains the replay speed relative to the capture. 0 means as fast as
+// possible.
+double speed = 0;
+
+// Contains the only session to replay, or -1 to replay all of them.
+int64_t selectedSession = -1;
+
+// Contains the number of times the capture is replayed.
+int loopCount = 1;
+
+replay_session_t *sessions = NULL;
+int sessionCount = 0;
+
+// Contains the replayed time, which follows the capture timestamps.
+swtp_time_t currentTime = 0;
+
+uint64_t replayedFrames = 0;
+uint64_t replayedDataFrames = 0;
+uint64_t sentFrames = 0;
+uint64_t deliveredPackets = 0;
+
+int parseCommandLineParameters(int argc, const char **argv);
+int replayCapture(const capture_t *capture);
+void printReport(FILE *reportFile, double wallClockTime, double cpuTime, swtp_time_t duration);
+
+swtp_time_t getReplayTime(const swtp_t *swtp) {
+    UNUSED_PARAMETER(swtp);
+    return currentTime;
+}
+
+ssize_t countSentFrame(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(swtp);
+    UNUSED_PARAMETER(buffer);
+    sentFrames++;
+    return size;
+}
+
+void countDeliveredPacket(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(swtp);
+    UNUSED_PARAMETER(buffer);
+    UNUSED_PARAMETER(size);
+    deliveredPackets++;
+}
+
+void ignoreDisconnect(swtp_t *swtp, int reason) {
+    UNUSED_PARAMETER(swtp);
+    UNUSED_PARAMETER(reason);
+}
+
+static inline double getElapsedTime(clockid_t clock, const struct timespec *startTime) {
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return (now.tv_sec - startTime->tv_sec) + (now.tv_nsec - startTime->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    capture_t capture;
+
+    if(capture_open(&capture, inputPath)) {
+        perror("Failed to open the capture file");
+        return EXIT_FAILURE;
+    }
+
+    // The report is printed on the original stdout, the protocol trace is
+    // discarded
+    int reportFd = dup(STDOUT_FILENO);
+    FILE *reportFile;
+
+    if(reportFd < 0 || (reportFile = fdopen(reportFd, "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to discard the protocol trace");
+        return EXIT_FAILURE;
+    }
+
+    struct timespec wallClockStartTime;
+    struct timespec cpuStartTime;
+    swtp_time_t duration = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &wallClockStartTime);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStartTime);
+
+    for(int i = 0; i < loopCount; i++) {
+        if(replayCapture(&capture)) {
+            return EXIT_FAILURE;
+        }
+
+        duration += currentTime;
+    }
+
+    printReport(reportFile, getElapsedTime(CLOCK_MONOTONIC, &wallClockStartTime), getElapsedTime(CLOCK_PROCESS_CPUTIME_ID, &cpuStartTime), duration);
+    fflush(reportFile);
+
+    for(int i = 0; i < sessionCount; i++) {
+        swtp_destroy(&sessions[i].swtp);
+    }
+
+    free(sessions);
+    capture_close(&capture);
+
+    return EXIT_SUCCESS;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *name = argv[i++];
+        const char *value = argv[i];
+
+        if(strcmp(name, "--input") == 0) {
+            inputPath = value;
+        } else if(strcmp(name, "--speed") == 0) {
+            if(sscanf(value, "%lf", &speed) != 1 || speed < 0) {
+                printf("Invalid value for --speed. Expected a positive number, or 0 to replay as fast as possible.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--session") == 0) {
+            if(sscanf(value, "%ld", &selectedSession) != 1 || selectedSession < 0 || selectedSession > UINT32_MAX) {
+                printf("Invalid value for --session. Expected a session number.\n");
+                return 1;
+            }
+        } else if(strcmp(name, "--loops") == 0) {
+            if(sscanf(value, "%d", &loopCount) != 1 || loopCount <= 0) {
+                printf("Invalid value for --loops. Expected a strictly positive integer.\n");
+                return 1;
+            }
+        } else {
+            printf("Unknown argument \"%s\".\n", name);
+            return 1;
+        }
+    }
+
+    if(!inputPath) {
+        printf("--input was not set.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Starts the replay of a session. If the session already exists, it is
+    restarted, as the captured endpoint reconnected.
+*/
+replay_session_t *startSession(uint32_t id, uint32_t sendWindowSize, bool extended, bool synchronized) {
+    replay_session_t *session = NULL;
+
+    for(int i = 0; i < sessionCount; i++) {
+        if(sessions[i].id == id) {
+            session = &sessions[i];
+            swtp_destroy(&session->swtp);
+            break;
+        }
+    }
+
+    if(!session) {
+        replay_session_t *newSessions = realloc(sessions, sizeof(replay_session_t) * (sessionCount + 1));
+
+        if(!newSessions) {
+            perror("Failed to allocate memory for the sessions");
+            return NULL;
+        }
+
+        sessions = newSessions;
+        session = &sessions[sessionCount++];
+    }
+
+    struct sockaddr address;
+
+    memset(&address, 0, sizeof(address));
+    memset(session, 0, sizeof(replay_session_t));
+
+    session->id = id;
+    session->receiveSynchronized = synchronized;
+    session->sendSynchronized = synchronized;
+    session->nextTimerTick = currentTime + REPLAY_TIMER_INTERVAL;
+
+    swtp_init(&session->swtp, -1, &address);
+    session->swtp.clockCallback = getReplayTime;
+    session->swtp.sendCallback = countSentFrame;
+    session->swtp.recvCallback = countDeliveredPacket;
+    session->swtp.disconnectCallback = ignoreDisconnect;
+    session->swtp.extended = extended;
+
+    if(swtp_initSendWindow(&session->swtp, sendWindowSize) != SWTP_SUCCESS) {
+        perror("Failed to initialize the send window");
+        return NULL;
+    }
+
+    return session;
+}
+
+replay_session_t *findSession(uint32_t id) {
+    for(int i = 0; i < sessionCount; i++) {
+        if(sessions[i].id == id) {
+            return &sessions[i];
+        }
+    }
+
+    // The beginning of the session was not captured
+    return startSession(id, SWTP_MAX_WINDOW_SIZE, false, false);
+}
+
+/*
+    Rebuilds the frame of a record. The bytes of the payload that were not
+    captured are zeroes.
+*/
+void buildFrame(const replay_session_t *session, swtp_frame_t *frame, const capture_record_t *record) {
+    size_t size = record->size > SWTP_MAX_FRAME_SIZE ? SWTP_MAX_FRAME_SIZE : record->size;
+    size_t headerSize = swtp_getHeaderSize(&session->swtp);
+
+    memset(&frame->frame, 0, size);
+    memcpy(frame->frame.header, record->header, SWTP_HEADER_SIZE);
+    memcpy(frame->frame.payload, record->payload, record->payloadLength);
+    frame->size = size;
+
+    // Without the SWTLLP header, the frame would not be delivered
+    if(!(frame->frame.header[0] & 0x80) && (size_t)record->payloadLength + SWTP_HEADER_SIZE <= headerSize && size > headerSize) {
+        ((uint8_t *)&frame->frame)[headerSize] = SWTLLP_IPV4;
+    }
+}
+
+int replayReceivedFrame(replay_session_t *session, const capture_record_t *record) {
+    swtp_frame_t frame;
+
+    buildFrame(session, &frame, record);
+
+    if(!(frame.frame.header[0] & 0x80)) {
+        if(!session->receiveSynchronized) {
+            session->swtp.expectedFrameNumber = swtp_getSendSequenceNumber(&session->swtp, &frame);
+            session->receiveSynchronized = true;
+        }
+
+        replayedDataFrames++;
+    }
+
+    replayedFrames++;
+
+    // Errors are part of the captured behaviour
+    swtp_onFrameReceived(&session->swtp, &frame);
+
+    return 0;
+}
+
+int replaySentFrame(replay_session_t *session, const capture_record_t *record) {
+    // Control frames and retransmissions are generated by the replayed
+    // endpoint itself
+    size_t headerSize = swtp_getHeaderSize(&session->swtp);
+
+    if((record->header[0] & 0x80) || record->size <= headerSize + SWTLLP_HEADER_SIZE) {
+        return 0;
+    }
+
+    swtp_frame_t frame;
+
+    buildFrame(session, &frame, record);
+
+    uint32_t sequenceNumber = swtp_getSendSequenceNumber(&session->swtp, &frame);
+
+    if(!session->sendSynchronized) {
+        if(session->swtp.sendWindowLength == 0) {
+            session->swtp.sendWindowStartSequenceNumber = sequenceNumber;
+        }
+
+        session->nextSequenceNumber = sequenceNumber;
+        session->sendSynchronized = true;
+    }
+
+    if(sequenceNumber != session->nextSequenceNumber) {
+        return 0;
+    }
+
+    session->nextSequenceNumber = (sequenceNumber + 1) & (session->swtp.extended ? SWTP_MAX_EXTENDED_SEQUENCE_NUMBER : SWTP_MAX_SEQUENCE_NUMBER);
+
+    // Rebuild the packet read from the TUN device
+    const uint8_t *payload = (const uint8_t *)&frame.frame + headerSize;
+    uint8_t packet[TUN_HEADER_SIZE + MAXIMUM_MTU];
+    size_t packetSize = frame.size - headerSize - SWTLLP_HEADER_SIZE;
+
+    if(packetSize > MAXIMUM_MTU) {
+        return 0;
+    }
+
+    memset(packet, 0, 2);
+    *(uint16_t *)(packet + 2) = htons(payload[0] == SWTLLP_IPV6 ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4);
+    memcpy(packet + TUN_HEADER_SIZE, payload + SWTLLP_HEADER_SIZE, packetSize);
+
+    swtp_sendDataFrame(&session->swtp, packet, TUN_HEADER_SIZE + packetSize);
+
+    return 0;
+}
+
+/*
+    Feeds the records of the capture to the replayed sessions, in order. The
+    SWTP clock follows the capture timestamps, and the wall clock too unless
+    the speed is 0.
+*/
+int replayCapture(const capture_t *capture) {
+    uint64_t firstIndex;
+    uint64_t recordCount = capture_getRecordCount(capture, &firstIndex);
+
+    if(recordCount == 0) {
+        return 0;
+    }
+
+    uint64_t firstTimestamp = capture_getRecord(capture, firstIndex)->timestamp;
+    struct timespec startTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    currentTime = 0;
+
+    for(int i = 0; i < sessionCount; i++) {
+        sessions[i].nextTimerTick = REPLAY_TIMER_INTERVAL;
+    }
+
+    for(uint64_t i = 0; i < recordCount; i++) {
+        const capture_record_t *record = capture_getRecord(capture, firstIndex + i);
+
+        if(selectedSession >= 0 && record->session != selectedSession) {
+            continue;
+        }
+
+        currentTime = (record->timestamp - firstTimestamp) / 1000000;
+
+        if(speed > 0) {
+            double delay = currentTime / 1000.0 / speed - getElapsedTime(CLOCK_MONOTONIC, &startTime);
+
+            if(delay > 0) {
+                struct timespec sleepTime = {(time_t)delay, (long)((delay - (time_t)delay) * 1e9)};
+                nanosleep(&sleepTime, NULL);
+            }
+        }
+
+        // Run the timers that expired before this record
+        for(int j = 0; j < sessionCount; j++) {
+            while(sessions[j].nextTimerTick <= currentTime) {
+                swtp_onTimerTick(&sessions[j].swtp);
+                sessions[j].nextTimerTick += REPLAY_TIMER_INTERVAL;
+            }
+        }
+
+        if(record->direction == CAPTURE_DIRECTION_SESSION) {
+            // Older captures only have the size field
+            uint32_t sendWindowSize = *(const uint32_t *)record->header;
+
+            if(sendWindowSize == 0) {
+                sendWindowSize = record->size;
+            }
+
+            if(startSession(record->session, sendWindowSize, record->flags & CAPTURE_FLAG_EXTENDED, true) == NULL) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        replay_session_t *session = findSession(record->session);
+
+        if(session == NULL) {
+            return 1;
+        }
+
+        if(record->direction == CAPTURE_DIRECTION_RECEIVED) {
+            replayReceivedFrame(session, record);
+        } else if(record->direction == CAPTURE_DIRECTION_SENT) {
+            replaySentFrame(session, record);
+        }
+    }
+
+    return 0;
+}
+
+void printReport(FILE *reportFile, double wallClockTime, double cpuTime, swtp_time_t duration) {
+    swtp_stats_t stats;
+
+    memset(&stats, 0, sizeof(stats));
+
+    for(int i = 0; i < sessionCount; i++) {
+        stats.sentDataFrames += sessions[i].swtp.stats.sentDataFrames;
+        stats.retransmittedDataFrames += sessions[i].swtp.stats.retransmittedDataFrames;
+        stats.sentRejects += sessions[i].swtp.stats.sentRejects;
+        stats.repairedDataFrames += sessions[i].swtp.stats.repairedDataFrames;
+    }
+
+    fprintf(reportFile, "sessions: %d\n", sessionCount);
+    fprintf(reportFile, "captured_duration_ms: %ld\n", duration);
+    fprintf(reportFile, "replayed_frames: %lu\n", replayedFrames);
+    fprintf(reportFile, "replayed_data_frames: %lu\n", replayedDataFrames);
+    fprintf(reportFile, "delivered_packets: %lu\n", deliveredPackets);
+    fprintf(reportFile, "sent_frames: %lu\n", sentFrames);
+    fprintf(reportFile, "sent_data_frames: %lu\n", stats.sentDataFrames);
+    fprintf(reportFile, "retransmissions: %lu\n", stats.retransmittedDataFrames);
+    fprintf(reportFile, "rejects: %lu\n", stats.sentRejects);
+    fprintf(reportFile, "repaired: %lu\n", stats.repairedDataFrames);
+    fprintf(reportFile, "wall_clock_s: %.3f\n", wallClockTime);
+    fprintf(reportFile, "cpu_s: %.3f\n", cpuTime);
+
+    if(replayedFrames > 0) {
+        fprintf(reportFile, "cpu_ns_per_received_frame: %.0f\n", cpuTime * 1e9 / replayedFrames);
+    }
+}
@@ -0,0 +1,632 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <common.h>
+#include <libswtp/swtp.h>
+
+#define SIM_TICK_INTERVAL (SWTP_TIMER_INTERVAL * 1000)
+#define SIM_EVENT_SEND 0
+#define SIM_EVENT_DELIVER 1
+#define SIM_EVENT_TICK 2
+
+typedef struct {
+    // Propagation delay and uniform jitter, in microseconds
+    uint64_t delay;
+    uint64_t jitter;
+
+    // Loss probabilities, between 0 and 1 (see bin/impair for the Gilbert-
+    // Elliott parameters)
+    double loss;
+    double gilbertP;
+    double gilbertR;
+    double gilbertH;
+
+    // Bandwidth in bits per second (0 = unlimited)
+    uint64_t rate;
+} sim_linkModel_t;
+
+typedef struct {
+    bool badState;
+
+    // The time at which the link will have sent the frames queued on it
+    uint64_t idleTime;
+
+    uint64_t sentFrames;
+    uint64_t lostFrames;
+} sim_link_t;
+
+typedef struct {
+    // Endpoint 0 sends the packets, endpoint 1 receives them
+    swtp_t endpoints[2];
+
+    // links[i] carries the frames sent by endpoints[i]
+    sim_link_t links[2];
+
+    uint32_t sentPackets;
+    uint32_t deliveredPackets;
+
+    // True if a SEND event is pending for this session
+    bool sendScheduled;
+
+    bool disconnected;
+    bool complete;
+    uint64_t completionTime;
+} sim_session_t;
+
+typedef struct {
+    uint64_t time;
+    uint64_t order;
+    int type;
+    int endpoint;
+    sim_session_t *session;
+    swtp_frame_t *frame;
+} sim_event_t;
+
+// Simulation parameters
+int sessionCount = 100;
+int packetCount = 1000;
+int packetSize = 1000;
+int packetRate = 0;
+int windowSize = 64;
+unsigned int fecBlockSize = 0;
+bool fecAdaptive = false;
+bool sack = false;
+uint64_t timeLimit = 600000000;
+sim_linkModel_t linkModel = {.delay = 20000};
+
+sim_session_t *sessions;
+
+// Contains the pending events, as a binary heap ordered by time.
+sim_event_t *events;
+size_t eventCount = 0;
+size_t eventCapacity = 0;
+uint64_t eventOrder = 0;
+
+// Contains the current simulated time, in microseconds.
+uint64_t simulationTime = 0;
+
+uint64_t randomState = 0x853c49e6748fea9bULL;
+
+int parseCommandLineParameters(int argc, const char **argv);
+int runSimulation();
+void printReport(FILE *reportFile, double wallClockTime);
+
+// xorshift64*, so that a given seed always gives the same simulation
+static inline double getRandom() {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+
+    return ((randomState * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+int main(int argc, const char **argv) {
+    if(parseCommandLineParameters(argc, argv)) {
+        printf("Failed to parse command-line parameters.\n");
+        return EXIT_FAILURE;
+    }
+
+    // The protocol trace of thousands of sessions is not readable anyway
+    int reportFd = dup(STDOUT_FILENO);
+    FILE *reportFile;
+
+    if(reportFd < 0 || (reportFile = fdopen(reportFd, "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Failed to discard the protocol trace");
+        return EXIT_FAILURE;
+    }
+
+    struct timespec startTime;
+    struct timespec endTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    if(runSimulation()) {
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+    printReport(reportFile, (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9);
+    fflush(reportFile);
+
+    return EXIT_SUCCESS;
+}
+
+int parseCommandLineParameters(int argc, const char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("%s expected a value.\n", argv[i]);
+            return 1;
+        }
+
+        const char *name = argv[i++];
+        const char *value = argv[i];
+        double number;
+        int count = 1;
+
+        if(strcmp(name, "--fec") == 0) {
+            if(strcmp(value, "auto") == 0) {
+                fecBlockSize = SWTP_FEC_MAX_BLOCK_SIZE;
+                fecAdaptive = true;
+            } else if(sscanf(value, "%u", &fecBlockSize) != 1 || fecBlockSize < SWTP_FEC_MIN_BLOCK_SIZE || fecBlockSize > SWTP_FEC_MAX_BLOCK_SIZE) {
+                printf("Invalid value for --fec. Expected \"auto\" or an integer between %d and %d included.\n", SWTP_FEC_MIN_BLOCK_SIZE, SWTP_FEC_MAX_BLOCK_SIZE);
+                return 1;
+            }
+
+            continue;
+        } else if(strcmp(name, "--sack") == 0) {
+            if(strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                printf("Invalid value for --sack. Expected 0 or 1.\n");
+                return 1;
+            }
+
+            sack = strcmp(value, "1") == 0;
+            continue;
+        } else if(strcmp(name, "--gilbert") == 0) {
+            double p;
+            double r;
+            double h;
+
+            if(sscanf(value, "%lf,%lf,%lf", &p, &r, &h) != 3 || p < 0 || r < 0 || h < 0) {
+                printf("Invalid value for --gilbert. Expected <p>,<r>,<h> in percent.\n");
+                return 1;
+            }
+
+            linkModel.gilbertP = p / 100.0;
+            linkModel.gilbertR = r / 100.0;
+            linkModel.gilbertH = h / 100.0;
+            continue;
+        } else if(strcmp(name, "--seed") == 0) {
+            if(sscanf(value, "%lu", &randomState) != 1 || randomState == 0) {
+                printf("Invalid value for --seed. Expected a strictly positive integer.\n");
+                return 1;
+            }
+
+            continue;
+        }
+
+        if(sscanf(value, "%lf", &number) != 1 || number < 0) {
+            printf("Invalid value for %s. Expected a positive number.\n", name);
+            return 1;
+        }
+
+        if(strcmp(name, "--sessions") == 0) {
+            sessionCount = number;
+            count = sessionCount;
+        } else if(strcmp(name, "--packets") == 0) {
+            packetCount = number;
+            count = packetCount;
+        } else if(strcmp(name, "--size") == 0) {
+            packetSize = number;
+
+            if(packetSize < 40 || packetSize > SWTP_DEFAULT_MTU) {
+                printf("Invalid value for --size. Expected an integer between 40 and %d included.\n", SWTP_DEFAULT_MTU);
+                return 1;
+            }
+        } else if(strcmp(name, "--rate") == 0) {
+            packetRate = number;
+        } else if(strcmp(name, "--window") == 0) {
+            windowSize = number;
+
+            if(windowSize > SWTP_MAX_WINDOW_SIZE) {
+                count = 0;
+            } else {
+                count = windowSize;
+            }
+        } else if(strcmp(name, "--time-limit") == 0) {
+            timeLimit = number * 1000000;
+        } else if(strcmp(name, "--delay") == 0) {
+            linkModel.delay = number * 1000;
+        } else if(strcmp(name, "--jitter") == 0) {
+            linkModel.jitter = number * 1000;
+        } else if(strcmp(name, "--loss") == 0) {
+            linkModel.loss = number / 100.0;
+        } else if(strcmp(name, "--bandwidth") == 0) {
+            linkModel.rate = number * 1000;
+        } else {
+            printf("Unknown argument \"%s\".\n", name);
+            return 1;
+        }
+
+        if(count <= 0) {
+            printf("Invalid value for %s.\n", name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline bool isEventBefore(const sim_event_t *a, const sim_event_t *b) {
+    if(a->time != b->time) {
+        return a->time < b->time;
+    }
+
+    return a->order < b->order;
+}
+
+int scheduleEvent(uint64_t time, int type, sim_session_t *session, int endpoint, swtp_frame_t *frame) {
+    if(eventCount == eventCapacity) {
+        size_t capacity = eventCapacity ? eventCapacity * 2 : 4096;
+        sim_event_t *newEvents = realloc(events, sizeof(sim_event_t) * capacity);
+
+        if(!newEvents) {
+            return -1;
+        }
+
+        events = newEvents;
+        eventCapacity = capacity;
+    }
+
+    sim_event_t event = {
+        .time = time,
+        .order = eventOrder++,
+        .type = type,
+        .endpoint = endpoint,
+        .session = session,
+        .frame = frame
+    };
+
+    size_t index = eventCount++;
+
+    while(index > 0 && isEventBefore(&event, &events[(index - 1) / 2])) {
+        events[index] = events[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+
+    events[index] = event;
+
+    return 0;
+}
+
+sim_event_t popEvent() {
+    sim_event_t first = events[0];
+    sim_event_t last = events[--eventCount];
+    size_t index = 0;
+
+    while(true) {
+        size_t child = index * 2 + 1;
+
+        if(child >= eventCount) {
+            break;
+        }
+
+        if(child + 1 < eventCount && isEventBefore(&events[child + 1], &events[child])) {
+            child++;
+        }
+
+        if(!isEventBefore(&events[child], &last)) {
+            break;
+        }
+
+        events[index] = events[child];
+        index = child;
+    }
+
+    if(eventCount > 0) {
+        events[index] = last;
+    }
+
+    return first;
+}
+
+swtp_time_t getSimulationTime(const swtp_t *swtp) {
+    UNUSED_PARAMETER(swtp);
+
+    return simulationTime / 1000;
+}
+
+static inline bool isFrameLost(sim_link_t *link) {
+    if(linkModel.gilbertP > 0) {
+        if(link->badState) {
+            if(getRandom() < linkModel.gilbertR) {
+                link->badState = false;
+            }
+        } else if(getRandom() < linkModel.gilbertP) {
+            link->badState = true;
+        }
+
+        if(link->badState && getRandom() < linkModel.gilbertH) {
+            return true;
+        }
+    }
+
+    return getRandom() < linkModel.loss;
+}
+
+/*
+    Transmit path of the simulated endpoints: the frame goes through the link
+    model and is scheduled for delivery to the other endpoint.
+*/
+ssize_t sendFrame(swtp_t *swtp, const void *buffer, size_t size) {
+    sim_session_t *session = swtp->userData;
+    int endpoint = swtp == &session->endpoints[0] ? 0 : 1;
+    sim_link_t *link = &session->links[endpoint];
+    uint64_t departureTime = simulationTime;
+
+    link->sentFrames++;
+
+    if(linkModel.rate > 0) {
+        if(link->idleTime > departureTime) {
+            departureTime = link->idleTime;
+        }
+
+        departureTime += size * 8 * 1000000 / linkModel.rate;
+        link->idleTime = departureTime;
+    }
+
+    if(isFrameLost(link)) {
+        link->lostFrames++;
+        return size;
+    }
+
+    uint64_t arrivalTime = departureTime + linkModel.delay;
+
+    if(linkModel.jitter > 0) {
+        arrivalTime += (uint64_t)(getRandom() * linkModel.jitter);
+    }
+
+    swtp_frame_t *frame = malloc(sizeof(swtp_frame_t));
+
+    if(!frame) {
+        return -1;
+    }
+
+    memcpy(&frame->frame, buffer, size);
+    frame->size = size;
+
+    if(scheduleEvent(arrivalTime, SIM_EVENT_DELIVER, session, 1 - endpoint, frame)) {
+        free(frame);
+        return -1;
+    }
+
+    return size;
+}
+
+void onPacketReceived(swtp_t *swtp, const void *buffer, size_t size) {
+    UNUSED_PARAMETER(buffer);
+    UNUSED_PARAMETER(size);
+
+    sim_session_t *session = swtp->userData;
+
+    session->deliveredPackets++;
+
+    if(session->deliveredPackets == (uint32_t)packetCount) {
+        session->complete = true;
+        session->completionTime = simulationTime;
+    }
+}
+
+void onDisconnect(swtp_t *swtp, int reason) {
+    UNUSED_PARAMETER(reason);
+
+    sim_session_t *session = swtp->userData;
+
+    session->disconnected = true;
+}
+
+int initSession(sim_session_t *session) {
+    struct sockaddr address;
+
+    memset(&address, 0, sizeof(address));
+    memset(session, 0, sizeof(sim_session_t));
+
+    for(int i = 0; i < 2; i++) {
+        swtp_t *swtp = &session->endpoints[i];
+
+        swtp_init(swtp, -1, &address);
+        swtp->userData = session;
+        swtp->clockCallback = getSimulationTime;
+        swtp->sendCallback = sendFrame;
+        swtp->disconnectCallback = onDisconnect;
+
+        if(swtp_initSendWindow(swtp, windowSize) != SWTP_SUCCESS) {
+            return -1;
+        }
+
+        // The receiver acknowledges the frames received out of order with SACK
+        // frames, instead of rejecting them
+        if(sack && swtp_enableSack(swtp) != SWTP_SUCCESS) {
+            return -1;
+        }
+    }
+
+    if(fecBlockSize > 0 && swtp_enableFec(&session->endpoints[0], fecBlockSize, fecAdaptive) != SWTP_SUCCESS) {
+        return -1;
+    }
+
+    session->endpoints[1].recvCallback = onPacketReceived;
+
+    return 0;
+}
+
+int sendPackets(sim_session_t *session) {
+    uint8_t packet[TUN_HEADER_SIZE + MAXIMUM_MTU];
+
+    memset(packet, 0, sizeof(packet));
+    *(uint16_t *)(packet + 2) = htons(ETHERTYPE_IPV4);
+    packet[TUN_HEADER_SIZE] = 0x45;
+
+    session->sendScheduled = false;
+
+    while(session->sentPackets < (uint32_t)packetCount && swtp_getSendWindowAvailableSlots(&session->endpoints[0]) > 0) {
+        if(swtp_sendDataFrame(&session->endpoints[0], packet, TUN_HEADER_SIZE + packetSize) != SWTP_SUCCESS) {
+            return -1;
+        }
+
+        session->sentPackets++;
+
+        // Paced traffic: schedule the next packet
+        if(packetRate > 0) {
+            if(session->sentPackets < (uint32_t)packetCount) {
+                session->sendScheduled = true;
+                return scheduleEvent(simulationTime + 1000000 / packetRate, SIM_EVENT_SEND, session, 0, NULL);
+            }
+
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+int runSimulation() {
+    sessions = malloc(sizeof(sim_session_t) * sessionCount);
+
+    if(!sessions) {
+        perror("Failed to allocate memory for the sessions");
+        return 1;
+    }
+
+    for(int i = 0; i < sessionCount; i++) {
+        if(initSession(&sessions[i])) {
+            perror("Failed to initialize a session");
+            return 1;
+        }
+
+        // Spread the session starts and the timer ticks over one tick interval
+        uint64_t startTime = (uint64_t)i * SIM_TICK_INTERVAL / sessionCount;
+
+        sessions[i].sendScheduled = true;
+
+        if(scheduleEvent(startTime, SIM_EVENT_SEND, &sessions[i], 0, NULL) || scheduleEvent(startTime + SIM_TICK_INTERVAL, SIM_EVENT_TICK, &sessions[i], 0, NULL)) {
+            perror("Failed to schedule events");
+            return 1;
+        }
+    }
+
+    while(eventCount > 0) {
+        sim_event_t event = popEvent();
+        sim_session_t *session = event.session;
+
+        simulationTime = event.time;
+
+        if(simulationTime > timeLimit) {
+            free(event.frame);
+            break;
+        }
+
+        if(session->complete || session->disconnected) {
+            free(event.frame);
+            continue;
+        }
+
+        int result = 0;
+
+        switch(event.type) {
+            case SIM_EVENT_SEND:
+                result = sendPackets(session);
+                break;
+
+            case SIM_EVENT_DELIVER:
+                swtp_onFrameReceived(&session->endpoints[event.endpoint], event.frame);
+                free(event.frame);
+
+                // Acknowledgements may have freed send window slots
+                if(event.endpoint == 0 && packetRate == 0 && !session->sendScheduled) {
+                    result = sendPackets(session);
+                }
+                break;
+
+            case SIM_EVENT_TICK:
+                swtp_onTimerTick(&session->endpoints[0]);
+                swtp_onTimerTick(&session->endpoints[1]);
+                result = scheduleEvent(simulationTime + SIM_TICK_INTERVAL, SIM_EVENT_TICK, session, 0, NULL);
+                break;
+        }
+
+        if(result) {
+            perror("Simulation failed");
+            return 1;
+        }
+    }
+
+    while(eventCount > 0) {
+        free(popEvent().frame);
+    }
+
+    return 0;
+}
+
+int compareTimes(const void *a, const void *b) {
+    uint64_t timeA = *(const uint64_t *)a;
+    uint64_t timeB = *(const uint64_t *)b;
+
+    return (timeA > timeB) - (timeA < timeB);
+}
+
+void printReport(FILE *reportFile, double wallClockTime) {
+    uint64_t *completionTimes = malloc(sizeof(uint64_t) * sessionCount);
+    int completeSessions = 0;
+    int disconnectedSessions = 0;
+    uint64_t deliveredPackets = 0;
+    uint64_t retransmissions = 0;
+    uint64_t fastRetransmissions = 0;
+    uint64_t repairedFrames = 0;
+    uint64_t sentFrames = 0;
+    uint64_t lostFrames = 0;
+
+    for(int i = 0; i < sessionCount; i++) {
+        sim_session_t *session = &sessions[i];
+
+        if(session->complete && completionTimes) {
+            completionTimes[completeSessions] = session->completionTime;
+        }
+
+        completeSessions += session->complete;
+        disconnectedSessions += session->disconnected;
+        deliveredPackets += session->deliveredPackets;
+        retransmissions += session->endpoints[0].stats.retransmittedDataFrames;
+        fastRetransmissions += session->endpoints[0].stats.fastRetransmittedDataFrames;
+        repairedFrames += session->endpoints[1].stats.repairedDataFrames;
+        sentFrames += session->links[0].sentFrames + session->links[1].sentFrames;
+        lostFrames += session->links[0].lostFrames + session->links[1].lostFrames;
+    }
+
+    fprintf(reportFile, "sessions: %d\n", sessionCount);
+    fprintf(reportFile, "complete_sessions: %d\n", completeSessions);
+    fprintf(reportFile, "disconnected_sessions: %d\n", disconnectedSessions);
+    fprintf(reportFile, "delivered_packets: %lu\n", deliveredPackets);
+    fprintf(reportFile, "frames_on_wire: %lu\n", sentFrames);
+    fprintf(reportFile, "lost_frames: %lu\n", lostFrames);
+    fprintf(reportFile, "retransmissions: %lu\n", retransmissions);
+    fprintf(reportFile, "fast_retransmissions: %lu\n", fastRetransmissions);
+    fprintf(reportFile, "repaired_frames: %lu\n", repairedFrames);
+
+    if(completeSessions > 0 && completionTimes) {
+        qsort(completionTimes, completeSessions, sizeof(uint64_t), compareTimes);
+
+        double meanTime = 0;
+
+        for(int i = 0; i < completeSessions; i++) {
+            meanTime += completionTimes[i] / 1e6;
+        }
+
+        meanTime /= completeSessions;
+
+        fprintf(reportFile, "completion_mean_s: %.3f\n", meanTime);
+        fprintf(reportFile, "completion_p50_s: %.3f\n", completionTimes[(completeSessions - 1) / 2] / 1e6);
+        fprintf(reportFile, "completion_p99_s: %.3f\n", completionTimes[(int)((completeSessions - 1) * 0.99)] / 1e6);
+        fprintf(reportFile, "goodput_per_session_mbit_s: %.3f\n", (double)packetCount * packetSize * 8 / meanTime / 1e6);
+    }
+
+    // Each session runs in parallel with the others, so the speedup is
+    // computed from the sum of the session durations.
+    double sessionTime = 0;
+
+    for(int i = 0; i < sessionCount; i++) {
+        sessionTime += (sessions[i].complete ? sessions[i].completionTime : simulationTime) / 1e6;
+    }
+
+    fprintf(reportFile, "simulated_s: %.3f\n", simulationTime / 1e6);
+    fprintf(reportFile, "simulated_session_s: %.3f\n", sessionTime);
+    fprintf(reportFile, "wall_clock_s: %.3f\n", wallClockTime);
+    fprintf(reportFile, "speedup: %.1f\n", wallClockTime > 0 ? sessionTime / wallClockTime : 0.0);
+
+    free(completionTimes);
+}